@@ -0,0 +1,90 @@
+#!/bin/bash
+# Copyright (c) 2018 The Catocoin developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+# Measure initial block download throughput on regtest: PEERS source nodes
+# share one chain, and a fresh node syncs it from all of them at once.
+#
+# Usage: syncbench.sh [blocks] [peers] [catocoind args for the syncing node]
+#
+# Compare the sync modes with e.g.
+#   contrib/devtools/syncbench.sh 200 4 -headersfirst=1
+#   contrib/devtools/syncbench.sh 200 4 -headersfirst=0
+#
+# Regtest switches to proof-of-stake after block 200, so the source chain is
+# mined with setgenerate only up to there. For longer chains set SOURCE_DATADIR
+# to a data directory holding a regtest chain; its blocks are used instead.
+
+set -e
+
+BITCOIND=${BITCOIND:-src/catocoind}
+BITCOINCLI=${BITCOINCLI:-src/catocoin-cli}
+BLOCKS=${1:-200}
+PEERS=${2:-4}
+shift $(( $# < 2 ? $# : 2 ))
+
+DIR=$(mktemp -d)
+BASEPORT=$((20000 + $$ % 20000))
+SINK=$PEERS
+
+cli() {
+    local i=$1
+    shift
+    "$BITCOINCLI" -regtest -datadir="$DIR/node$i" -rpcport=$((BASEPORT + 2 * i + 1)) -rpcuser=bench -rpcpassword=bench "$@"
+}
+
+start_node() {
+    local i=$1
+    shift
+    mkdir -p "$DIR/node$i"
+    "$BITCOIND" -regtest -datadir="$DIR/node$i" -port=$((BASEPORT + 2 * i)) -rpcport=$((BASEPORT + 2 * i + 1)) \
+        -rpcuser=bench -rpcpassword=bench -server -daemon -listen -discover=0 -dnsseed=0 -listenonion=0 \
+        -litemode=1 -staking=0 -debug=net "$@"
+    until cli $i getblockcount > /dev/null 2>&1; do sleep 0.2; done
+}
+
+stop_node() {
+    cli $1 stop > /dev/null 2>&1 || true
+    while [ -f "$DIR/node$1/regtest/catocoind.pid" ]; do sleep 0.2; done
+}
+
+cleanup() {
+    for i in $(seq 0 $SINK); do
+        [ -d "$DIR/node$i" ] && stop_node $i
+    done
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+# Build the source chain once, then give every source node a copy of it
+mkdir -p "$DIR/node0"
+if [ -n "$SOURCE_DATADIR" ]; then
+    cp -r "$SOURCE_DATADIR/regtest" "$DIR/node0/"
+    rm -f "$DIR/node0/regtest/wallet.dat" "$DIR/node0/regtest/peers.dat"
+    start_node 0
+else
+    start_node 0
+    cli 0 setgenerate true "$BLOCKS" > /dev/null
+fi
+HEIGHT=$(cli 0 getblockcount)
+stop_node 0
+for i in $(seq 1 $((PEERS - 1))); do
+    mkdir -p "$DIR/node$i/regtest"
+    cp -r "$DIR/node0/regtest/blocks" "$DIR/node0/regtest/chainstate" "$DIR/node$i/regtest/"
+done
+
+CONNECT=""
+for i in $(seq 0 $((PEERS - 1))); do
+    start_node $i
+    CONNECT="$CONNECT -connect=127.0.0.1:$((BASEPORT + 2 * i))"
+done
+
+echo "Syncing $HEIGHT blocks from $PEERS peers ($*)"
+START=$(date +%s.%N)
+start_node $SINK $CONNECT "$@"
+until [ "$(cli $SINK getblockcount)" -ge "$HEIGHT" ]; do sleep 0.1; done
+END=$(date +%s.%N)
+
+awk -v blocks="$HEIGHT" -v start="$START" -v end="$END" \
+    'BEGIN { printf "Synced %d blocks in %.2f s (%.1f blocks/s)\n", blocks, end - start, blocks / (end - start) }'
@@ -258,6 +258,161 @@ struct zero_after_free_allocator : public std::allocator<T> {
     }
 };
 
+/**
+ * Pool of fixed-size chunks for node based containers.
+ *
+ * Chunks are carved out of larger blocks and recycled through one free list
+ * per size class, so inserting into a container that uses pool_allocator does
+ * not pay for a malloc call and its per-allocation overhead. Blocks start small
+ * and double in size up to MAX_BLOCK_SIZE, and are all handed back to the heap
+ * as soon as the last chunk is released (e.g. when the owning container is
+ * cleared). Requests larger than MAX_CHUNK_SIZE are not served by the pool.
+ *
+ * Not thread-safe: the pool is protected by whatever protects its container.
+ */
+class CNodePool
+{
+public:
+    static const size_t CHUNK_ALIGN = 8;
+    static const size_t MAX_CHUNK_SIZE = 512;
+    static const size_t MIN_BLOCK_SIZE = 4096;
+    static const size_t MAX_BLOCK_SIZE = 256 * 1024;
+
+    CNodePool() : nBlockUsed(0), nBlockSize(0), nNextBlockSize(MIN_BLOCK_SIZE), nChunksInUse(0), nBytesReserved(0)
+    {
+        memset(vFreeList, 0, sizeof(vFreeList));
+    }
+
+    ~CNodePool()
+    {
+        assert(nChunksInUse == 0);
+        Release();
+    }
+
+    void* Allocate(size_t nSize)
+    {
+        assert(nSize > 0 && nSize <= MAX_CHUNK_SIZE);
+        const size_t nClass = (nSize - 1) / CHUNK_ALIGN;
+        void* p = vFreeList[nClass];
+        if (p != NULL) {
+            vFreeList[nClass] = *static_cast<void**>(p);
+        } else {
+            const size_t nChunkSize = (nClass + 1) * CHUNK_ALIGN;
+            if (vBlocks.empty() || nBlockUsed + nChunkSize > nBlockSize) {
+                nBlockSize = nNextBlockSize;
+                vBlocks.push_back(static_cast<char*>(::operator new(nBlockSize)));
+                nBytesReserved += nBlockSize;
+                nBlockUsed = 0;
+                if (nNextBlockSize < MAX_BLOCK_SIZE)
+                    nNextBlockSize *= 2;
+            }
+            p = vBlocks.back() + nBlockUsed;
+            nBlockUsed += nChunkSize;
+        }
+        ++nChunksInUse;
+        return p;
+    }
+
+    void Deallocate(void* p, size_t nSize)
+    {
+        assert(nChunksInUse > 0);
+        const size_t nClass = (nSize - 1) / CHUNK_ALIGN;
+        *static_cast<void**>(p) = vFreeList[nClass];
+        vFreeList[nClass] = p;
+        if (--nChunksInUse == 0)
+            Release();
+    }
+
+    //! Bytes obtained from the heap, including chunks currently on a free list
+    size_t GetReservedBytes() const { return nBytesReserved; }
+    size_t GetBlockCount() const { return vBlocks.size(); }
+    size_t GetChunksInUse() const { return nChunksInUse; }
+
+private:
+    void* vFreeList[MAX_CHUNK_SIZE / CHUNK_ALIGN];
+    std::vector<char*> vBlocks;
+    size_t nBlockUsed;
+    size_t nBlockSize;
+    size_t nNextBlockSize;
+    size_t nChunksInUse;
+    size_t nBytesReserved;
+
+    void Release()
+    {
+        for (std::vector<char*>::iterator it = vBlocks.begin(); it != vBlocks.end(); ++it)
+            ::operator delete(*it);
+        std::vector<char*>().swap(vBlocks);
+        memset(vFreeList, 0, sizeof(vFreeList));
+        nBlockUsed = 0;
+        nBlockSize = 0;
+        nNextBlockSize = MIN_BLOCK_SIZE;
+        nBytesReserved = 0;
+    }
+
+    CNodePool(const CNodePool&);
+    CNodePool& operator=(const CNodePool&);
+};
+
+//
+// Allocator that serves single-object allocations (container nodes) from a
+// CNodePool. Array allocations (e.g. hash table buckets), oversized objects
+// and allocators without a pool fall back to the global heap.
+//
+template <typename T>
+struct pool_allocator {
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    CNodePool* pool;
+
+    pool_allocator() throw() : pool(NULL) {}
+    explicit pool_allocator(CNodePool* poolIn) throw() : pool(poolIn) {}
+    pool_allocator(const pool_allocator& a) throw() : pool(a.pool) {}
+    template <typename U>
+    pool_allocator(const pool_allocator<U>& a) throw() : pool(a.pool)
+    {
+    }
+    ~pool_allocator() throw() {}
+    template <typename _Other>
+    struct rebind {
+        typedef pool_allocator<_Other> other;
+    };
+
+    T* allocate(std::size_t n, const void* hint = 0)
+    {
+        if (pool != NULL && n == 1 && sizeof(T) <= CNodePool::MAX_CHUNK_SIZE)
+            return static_cast<T*>(pool->Allocate(sizeof(T)));
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (pool != NULL && n == 1 && sizeof(T) <= CNodePool::MAX_CHUNK_SIZE)
+            pool->Deallocate(p, sizeof(T));
+        else
+            ::operator delete(p);
+    }
+
+    size_type max_size() const throw() { return size_type(-1) / sizeof(T); }
+};
+
+template <typename T, typename U>
+bool operator==(const pool_allocator<T>& a, const pool_allocator<U>& b)
+{
+    return a.pool == b.pool;
+}
+
+template <typename T, typename U>
+bool operator!=(const pool_allocator<T>& a, const pool_allocator<U>& b)
+{
+    return a.pool != b.pool;
+}
+
 // This is exactly like std::string, but with a custom allocator.
 typedef std::basic_string<char, std::char_traits<char>, secure_allocator<char> > SecureString;
 
@@ -0,0 +1,306 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "banman.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "hash.h"
+#include "random.h"
+#include "streams.h"
+#include "util.h"
+
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+CBanManager banManager;
+
+std::string CBanEntry::BanReasonToString() const
+{
+    switch (banReason) {
+    case BanReasonNodeMisbehaving:
+        return "node misbehaving";
+    case BanReasonManuallyAdded:
+        return "manually added";
+    default:
+        return "unknown";
+    }
+}
+
+class CBanManager::CBanTrie
+{
+private:
+    struct CTrieNode {
+        //! Index of the child for a clear and a set next bit; 0 (the root) means none
+        uint32_t vChild[2];
+        //! Latest expiry of the bans with exactly this prefix, 0 if none
+        int64_t nBanUntil;
+
+        CTrieNode() : nBanUntil(0)
+        {
+            vChild[0] = vChild[1] = 0;
+        }
+    };
+
+    std::vector<CTrieNode> vNodes;
+    //! Subnets whose netmask is not a prefix, e.g. given as 255.0.255.0; matched one by one
+    std::vector<std::pair<CSubNet, int64_t> > vOther;
+
+    static int GetBit(const CNetAddr& addr, int n)
+    {
+        return (addr.GetByte(15 - (n >> 3)) >> (7 - (n & 7))) & 1;
+    }
+
+public:
+    CBanTrie() : vNodes(1) {}
+
+    void Insert(const CSubNet& subNet, int64_t nBanUntil)
+    {
+        int nPrefix = subNet.GetPrefixLength();
+        if (nPrefix < 0) {
+            vOther.push_back(std::make_pair(subNet, nBanUntil));
+            return;
+        }
+        uint32_t nNode = 0;
+        for (int n = 0; n < nPrefix; n++) {
+            int nBit = GetBit(subNet.GetNetwork(), n);
+            if (vNodes[nNode].vChild[nBit] == 0) {
+                vNodes[nNode].vChild[nBit] = vNodes.size();
+                vNodes.push_back(CTrieNode());
+            }
+            nNode = vNodes[nNode].vChild[nBit];
+        }
+        vNodes[nNode].nBanUntil = std::max(vNodes[nNode].nBanUntil, nBanUntil);
+    }
+
+    bool Match(const CNetAddr& addr, int64_t nNow) const
+    {
+        uint32_t nNode = 0;
+        for (int n = 0;; n++) {
+            if (nNow < vNodes[nNode].nBanUntil)
+                return true;
+            if (n == 128)
+                break;
+            nNode = vNodes[nNode].vChild[GetBit(addr, n)];
+            if (nNode == 0)
+                break;
+        }
+        for (unsigned int i = 0; i < vOther.size(); i++)
+            if (nNow < vOther[i].second && vOther[i].first.Match(addr))
+                return true;
+        return false;
+    }
+};
+
+CBanManager::CBanManager() : fDirty(false), ptrie(new CBanTrie())
+{
+}
+
+void CBanManager::Rebuild()
+{
+    AssertLockHeld(cs);
+    boost::shared_ptr<CBanTrie> ptrieNew(new CBanTrie());
+    for (banmap_t::const_iterator it = mapBanned.begin(); it != mapBanned.end(); ++it)
+        ptrieNew->Insert(it->first, it->second.nBanUntil);
+
+    LOCK(cs_trie);
+    ptrie = ptrieNew;
+}
+
+void CBanManager::Ban(const CSubNet& subNet, const CBanEntry& entry)
+{
+    if (!subNet.IsValid())
+        return;
+    LOCK(cs);
+    banmap_t::iterator it = mapBanned.find(subNet);
+    if (it != mapBanned.end() && it->second.nBanUntil >= entry.nBanUntil)
+        return;
+    mapBanned[subNet] = entry;
+    fDirty = true;
+    Rebuild();
+}
+
+bool CBanManager::Unban(const CSubNet& subNet)
+{
+    LOCK(cs);
+    if (!mapBanned.erase(subNet))
+        return false;
+    fDirty = true;
+    Rebuild();
+    return true;
+}
+
+void CBanManager::Clear()
+{
+    LOCK(cs);
+    mapBanned.clear();
+    fDirty = true;
+    Rebuild();
+}
+
+bool CBanManager::IsBanned(const CNetAddr& addr, int64_t nNow) const
+{
+    boost::shared_ptr<const CBanTrie> ptrieCurrent;
+    {
+        LOCK(cs_trie);
+        ptrieCurrent = ptrie;
+    }
+    return ptrieCurrent->Match(addr, nNow);
+}
+
+bool CBanManager::IsBanned(const CSubNet& subNet, int64_t nNow) const
+{
+    LOCK(cs);
+    banmap_t::const_iterator it = mapBanned.find(subNet);
+    return it != mapBanned.end() && nNow < it->second.nBanUntil;
+}
+
+void CBanManager::GetBanned(banmap_t& banMap) const
+{
+    LOCK(cs);
+    banMap = mapBanned;
+}
+
+void CBanManager::SetBanned(const banmap_t& banMap)
+{
+    LOCK(cs);
+    mapBanned = banMap;
+    fDirty = true;
+    Rebuild();
+}
+
+unsigned int CBanManager::SweepBanned(int64_t nNow)
+{
+    LOCK(cs);
+    unsigned int nSwept = 0;
+    banmap_t::iterator it = mapBanned.begin();
+    while (it != mapBanned.end()) {
+        if (nNow >= it->second.nBanUntil) {
+            LogPrint("net", "%s: Removed banned node ip/subnet from banlist.dat: %s\n", __func__, it->first.ToString());
+            mapBanned.erase(it++);
+            nSwept++;
+        } else
+            ++it;
+    }
+    if (nSwept) {
+        fDirty = true;
+        Rebuild();
+    }
+    return nSwept;
+}
+
+bool CBanManager::IsDirty() const
+{
+    LOCK(cs);
+    return fDirty;
+}
+
+void CBanManager::SetDirty(bool fDirtyIn)
+{
+    LOCK(cs);
+    fDirty = fDirtyIn;
+}
+
+//
+// CBanDB
+//
+
+CBanDB::CBanDB()
+{
+    pathBanlist = GetDataDir() / "banlist.dat";
+}
+
+bool CBanDB::Write(const banmap_t& banSet)
+{
+    // Generate random temporary filename
+    unsigned short randv = 0;
+    GetRandBytes((unsigned char*)&randv, sizeof(randv));
+    std::string tmpfn = strprintf("banlist.dat.%04x", randv);
+
+    // serialize banlist, checksum data up to that point, then append csum
+    CDataStream ssBanlist(SER_DISK, CLIENT_VERSION);
+    ssBanlist << FLATDATA(Params().MessageStart());
+    ssBanlist << banSet;
+    uint256 hash = Hash(ssBanlist.begin(), ssBanlist.end());
+    ssBanlist << hash;
+
+    // open temp output file, and associate with CAutoFile
+    boost::filesystem::path pathTmp = GetDataDir() / tmpfn;
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
+
+    // Write and commit header, data
+    try {
+        fileout << ssBanlist;
+    } catch (std::exception& e) {
+        fileout.fclose();
+        boost::filesystem::remove(pathTmp);
+        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    }
+    FileCommit(fileout.Get());
+    fileout.fclose();
+
+    // replace existing banlist.dat, if any, with new banlist.dat.XXXX
+    if (!RenameOver(pathTmp, pathBanlist)) {
+        boost::filesystem::remove(pathTmp);
+        return error("%s : Rename-into-place failed", __func__);
+    }
+
+    return true;
+}
+
+bool CBanDB::Read(banmap_t& banSet)
+{
+    // open input file, and associate with CAutoFile
+    FILE* file = fopen(pathBanlist.string().c_str(), "rb");
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s : Failed to open file %s", __func__, pathBanlist.string());
+
+    // use file size to size memory buffer
+    int fileSize = boost::filesystem::file_size(pathBanlist);
+    int dataSize = fileSize - sizeof(uint256);
+    // Don't try to resize to a negative number if file is small
+    if (dataSize < 0)
+        dataSize = 0;
+    std::vector<unsigned char> vchData;
+    vchData.resize(dataSize);
+    uint256 hashIn;
+
+    // read data and checksum from file
+    try {
+        filein.read((char*)&vchData[0], dataSize);
+        filein >> hashIn;
+    } catch (std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    filein.fclose();
+
+    CDataStream ssBanlist(vchData, SER_DISK, CLIENT_VERSION);
+
+    // verify stored checksum matches input data
+    uint256 hashTmp = Hash(ssBanlist.begin(), ssBanlist.end());
+    if (hashIn != hashTmp)
+        return error("%s : Checksum mismatch, data corrupted", __func__);
+
+    unsigned char pchMsgTmp[4];
+    try {
+        // de-serialize file header (network specific magic number) and ..
+        ssBanlist >> FLATDATA(pchMsgTmp);
+
+        // ... verify the network matches ours
+        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)))
+            return error("%s : Invalid network magic number", __func__);
+
+        // de-serialize ban data
+        ssBanlist >> banSet;
+    } catch (std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    return true;
+}
@@ -0,0 +1,141 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BANMAN_H
+#define BITCOIN_BANMAN_H
+
+#include "netbase.h"
+#include "serialize.h"
+#include "sync.h"
+
+#include <map>
+#include <stdint.h>
+#include <string>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
+
+/** Default for -bantime, in seconds */
+static const int64_t DEFAULT_MISBEHAVING_BANTIME = 60 * 60 * 24;
+
+enum BanReason {
+    BanReasonUnknown = 0,
+    BanReasonNodeMisbehaving = 1,
+    BanReasonManuallyAdded = 2
+};
+
+class CBanEntry
+{
+public:
+    static const int CURRENT_VERSION = 1;
+    int nVersion;
+    int64_t nCreateTime;
+    int64_t nBanUntil;
+    uint8_t banReason;
+
+    CBanEntry()
+    {
+        SetNull();
+    }
+
+    CBanEntry(int64_t nCreateTimeIn, int64_t nBanUntilIn, BanReason banReasonIn)
+    {
+        SetNull();
+        nCreateTime = nCreateTimeIn;
+        nBanUntil = nBanUntilIn;
+        banReason = banReasonIn;
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(this->nVersion);
+        nVersion = this->nVersion;
+        READWRITE(nCreateTime);
+        READWRITE(nBanUntil);
+        READWRITE(banReason);
+    }
+
+    void SetNull()
+    {
+        nVersion = CBanEntry::CURRENT_VERSION;
+        nCreateTime = 0;
+        nBanUntil = 0;
+        banReason = BanReasonUnknown;
+    }
+
+    std::string BanReasonToString() const;
+};
+
+typedef std::map<CSubNet, CBanEntry> banmap_t;
+
+/**
+ * Banned addresses and subnets. The map is the master copy; every change
+ * rebuilds an immutable binary trie over the 128-bit address space from it,
+ * with one level per bit of the subnet prefix. A lookup walks at most
+ * prefix-length nodes of the current trie, and only holds a lock for the
+ * time it takes to copy the pointer to it, so the socket thread checking
+ * every accepted connection never waits for bans being added or swept.
+ * Entries store their expiry, so lookups ignore expired bans even before
+ * SweepBanned removes them.
+ */
+class CBanManager
+{
+private:
+    class CBanTrie;
+
+    //! Guards mapBanned and fDirty
+    mutable CCriticalSection cs;
+    banmap_t mapBanned;
+    //! Whether mapBanned changed since it was last written to disk
+    bool fDirty;
+
+    //! Guards only the pointer; the trie it points to is never modified
+    mutable CCriticalSection cs_trie;
+    boost::shared_ptr<const CBanTrie> ptrie;
+
+    void Rebuild();
+
+public:
+    CBanManager();
+
+    //! Ban subNet, unless it is already banned for longer
+    void Ban(const CSubNet& subNet, const CBanEntry& entry);
+    //! Lift the ban of exactly subNet; false if it was not banned
+    bool Unban(const CSubNet& subNet);
+    void Clear();
+
+    //! Whether addr is in a subnet banned beyond nNow
+    bool IsBanned(const CNetAddr& addr, int64_t nNow) const;
+    //! Whether exactly subNet is banned beyond nNow
+    bool IsBanned(const CSubNet& subNet, int64_t nNow) const;
+
+    void GetBanned(banmap_t& banMap) const;
+    //! Replace every ban, e.g. with the ones loaded from banlist.dat
+    void SetBanned(const banmap_t& banMap);
+
+    //! Remove the bans that expired by nNow, returning how many there were
+    unsigned int SweepBanned(int64_t nNow);
+
+    bool IsDirty() const;
+    void SetDirty(bool fDirtyIn);
+};
+
+extern CBanManager banManager;
+
+/** Access to the banned subnets database (banlist.dat) */
+class CBanDB
+{
+private:
+    boost::filesystem::path pathBanlist;
+
+public:
+    CBanDB();
+    bool Write(const banmap_t& banSet);
+    bool Read(banmap_t& banSet);
+};
+
+#endif // BITCOIN_BANMAN_H
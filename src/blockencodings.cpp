@@ -0,0 +1,187 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+#include "version.h"
+
+#include <boost/unordered_map.hpp>
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) : nonce(GetRand(std::numeric_limits<uint64_t>::max())),
+                                                                             header(block.GetBlockHeader()),
+                                                                             vchBlockSig(block.vchBlockSig)
+{
+    FillShortTxIDSelector();
+
+    // The coinbase and the coinstake can't be in the receiver's mempool
+    size_t nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    nPrefilled = std::min(nPrefilled, block.vtx.size());
+    prefilledtxn.resize(nPrefilled);
+    for (size_t i = 0; i < nPrefilled; i++) {
+        prefilledtxn[i].index = 0;
+        prefilledtxn[i].tx = block.vtx[i];
+    }
+
+    shorttxids.resize(block.vtx.size() - nPrefilled);
+    for (size_t i = nPrefilled; i < block.vtx.size(); i++)
+        shorttxids[i - nPrefilled] = GetShortID(block.vtx[i].GetHash());
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << header << nonce;
+    CSHA256 hasher;
+    hasher.Write((unsigned char*)&(*stream.begin()), stream.end() - stream.begin());
+    uint256 shorttxidhash;
+    hasher.Finalize(shorttxidhash.begin());
+    shorttxidk0 = ReadLE64(shorttxidhash.begin());
+    shorttxidk1 = ReadLE64(shorttxidhash.begin() + 8);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffL;
+}
+
+
+PartiallyDownloadedBlock::ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<const CTransaction*>& vExtraTxn)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return READ_STATUS_INVALID;
+    static const unsigned int nMinTxSize = ::GetSerializeSize(CTransaction(), SER_NETWORK, PROTOCOL_VERSION);
+    if (cmpctblock.shorttxids.size() + cmpctblock.prefilledtxn.size() > MAX_BLOCK_SIZE_CURRENT / nMinTxSize)
+        return READ_STATUS_INVALID;
+
+    assert(header.IsNull() && txn_available.empty());
+    header = cmpctblock.header;
+    vchBlockSig = cmpctblock.vchBlockSig;
+    txn_available.resize(cmpctblock.BlockTxCount());
+
+    int32_t nLastPrefilledIndex = -1;
+    for (size_t i = 0; i < cmpctblock.prefilledtxn.size(); i++) {
+        if (cmpctblock.prefilledtxn[i].tx.IsNull())
+            return READ_STATUS_INVALID;
+
+        nLastPrefilledIndex += cmpctblock.prefilledtxn[i].index + 1;
+        if (nLastPrefilledIndex > std::numeric_limits<uint16_t>::max())
+            return READ_STATUS_INVALID;
+        // Each prefilled transaction must leave room for the short IDs that come after it
+        if ((uint32_t)nLastPrefilledIndex > cmpctblock.shorttxids.size() + i)
+            return READ_STATUS_INVALID;
+        txn_available[nLastPrefilledIndex] = cmpctblock.prefilledtxn[i].tx;
+    }
+    prefilled_count = cmpctblock.prefilledtxn.size();
+
+    // Map the short IDs to their positions in the block. The IDs of a well-formed
+    // compact block are uniformly distributed, so badly clustered buckets or
+    // duplicates mean we can't rebuild it cheaply; fetch the whole block then.
+    boost::unordered_map<uint64_t, uint16_t> mapShortIDs(cmpctblock.shorttxids.size());
+    uint16_t nIndexOffset = 0;
+    for (size_t i = 0; i < cmpctblock.shorttxids.size(); i++) {
+        while (!txn_available[i + nIndexOffset].IsNull())
+            nIndexOffset++;
+        mapShortIDs[cmpctblock.shorttxids[i]] = i + nIndexOffset;
+        if (mapShortIDs.bucket_size(mapShortIDs.bucket(cmpctblock.shorttxids[i])) > 12)
+            return READ_STATUS_FAILED;
+    }
+    if (mapShortIDs.size() != cmpctblock.shorttxids.size())
+        return READ_STATUS_FAILED;
+
+    std::vector<bool> vHave(txn_available.size());
+    {
+        LOCK(pool->cs);
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = pool->mapTx.begin(); it != pool->mapTx.end(); ++it) {
+            boost::unordered_map<uint64_t, uint16_t>::iterator itID = mapShortIDs.find(cmpctblock.GetShortID(it->first));
+            if (itID != mapShortIDs.end()) {
+                if (!vHave[itID->second]) {
+                    txn_available[itID->second] = it->second.GetTx();
+                    vHave[itID->second] = true;
+                    mempool_count++;
+                } else if (!txn_available[itID->second].IsNull()) {
+                    // Two mempool transactions match the same short ID; ask for the right one
+                    txn_available[itID->second] = CTransaction();
+                    mempool_count--;
+                }
+            }
+            if (mempool_count == mapShortIDs.size())
+                break;
+        }
+    }
+
+    for (size_t i = 0; i < vExtraTxn.size() && mempool_count < mapShortIDs.size(); i++) {
+        boost::unordered_map<uint64_t, uint16_t>::iterator itID = mapShortIDs.find(cmpctblock.GetShortID(vExtraTxn[i]->GetHash()));
+        if (itID == mapShortIDs.end())
+            continue;
+        if (!vHave[itID->second]) {
+            txn_available[itID->second] = *vExtraTxn[i];
+            vHave[itID->second] = true;
+            mempool_count++;
+        } else if (!txn_available[itID->second].IsNull() && txn_available[itID->second].GetHash() != vExtraTxn[i]->GetHash()) {
+            txn_available[itID->second] = CTransaction();
+            mempool_count--;
+        }
+    }
+
+    LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s using a cmpctblock of size %lu\n",
+        cmpctblock.header.GetHash().ToString(), ::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION));
+
+    return READ_STATUS_OK;
+}
+
+bool PartiallyDownloadedBlock::IsTxAvailable(size_t index) const
+{
+    assert(!header.IsNull());
+    assert(index < txn_available.size());
+    return !txn_available[index].IsNull();
+}
+
+PartiallyDownloadedBlock::ReadStatus PartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing)
+{
+    assert(!header.IsNull());
+    uint256 hash = header.GetHash();
+    block = CBlock(header);
+    block.vtx.resize(txn_available.size());
+
+    size_t nMissingOffset = 0;
+    for (size_t i = 0; i < txn_available.size(); i++) {
+        if (txn_available[i].IsNull()) {
+            if (vtx_missing.size() <= nMissingOffset)
+                return READ_STATUS_INVALID;
+            block.vtx[i] = vtx_missing[nMissingOffset++];
+        } else {
+            block.vtx[i] = txn_available[i];
+        }
+    }
+    block.vchBlockSig = vchBlockSig;
+
+    // Make sure we can't call FillBlock again.
+    header.SetNull();
+    txn_available.clear();
+
+    if (vtx_missing.size() != nMissingOffset)
+        return READ_STATUS_INVALID;
+
+    // A short ID collision puts a wrong transaction in the block, which the merkle
+    // root catches. The block itself is fully validated once it is processed.
+    bool fMutated = false;
+    if (block.BuildMerkleTree(&fMutated) != block.hashMerkleRoot || fMutated)
+        return READ_STATUS_FAILED;
+
+    LogPrint("cmpctblock", "Successfully reconstructed block %s with %lu txn prefilled, %lu txn from mempool and %lu txn requested\n",
+        hash.ToString(), prefilled_count, mempool_count, vtx_missing.size());
+    if (vtx_missing.size() < 5) {
+        BOOST_FOREACH (const CTransaction& tx, vtx_missing)
+            LogPrint("cmpctblock", "Reconstructed block %s required tx %s\n", hash.ToString(), tx.GetHash().ToString());
+    }
+
+    return READ_STATUS_OK;
+}
@@ -0,0 +1,222 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdint.h>
+#include <vector>
+
+class CTxMemPool;
+
+/** Compact blocks are only served for blocks at most this deep; older blocks are sent whole */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** getblocktxn is only answered for blocks at most this deep; older blocks are sent whole */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Number of peers asked to announce new blocks to us with a compact block right away */
+static const unsigned int MAX_CMPCTBLOCK_HB_PEERS = 3;
+
+/** A "getblocktxn" message: the transactions of a compact block that could not be found locally */
+class BlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    //! Positions in the block, ascending; sent differentially encoded
+    std::vector<uint16_t> indexes;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        uint64_t nIndexes = (uint64_t)indexes.size();
+        READWRITE(COMPACTSIZE(nIndexes));
+        if (ser_action.ForRead()) {
+            // Grow the vector as the data arrives rather than trusting the announced size
+            size_t i = 0;
+            while (indexes.size() < nIndexes) {
+                indexes.resize(std::min((uint64_t)(1000 + indexes.size()), nIndexes));
+                for (; i < indexes.size(); i++) {
+                    uint64_t nIndex = 0;
+                    READWRITE(COMPACTSIZE(nIndex));
+                    if (nIndex > std::numeric_limits<uint16_t>::max())
+                        throw std::ios_base::failure("index overflowed 16 bits");
+                    indexes[i] = nIndex;
+                }
+            }
+
+            uint16_t nOffset = 0;
+            for (size_t j = 0; j < indexes.size(); j++) {
+                if (uint64_t(indexes[j]) + uint64_t(nOffset) > std::numeric_limits<uint16_t>::max())
+                    throw std::ios_base::failure("indexes overflowed 16 bits");
+                indexes[j] = indexes[j] + nOffset;
+                nOffset = indexes[j] + 1;
+            }
+        } else {
+            for (size_t i = 0; i < indexes.size(); i++) {
+                uint64_t nIndex = indexes[i] - (i == 0 ? 0 : (indexes[i - 1] + 1));
+                READWRITE(COMPACTSIZE(nIndex));
+            }
+        }
+    }
+};
+
+/** A "blocktxn" message: the transactions asked for by a BlockTransactionsRequest, in the same order */
+class BlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    BlockTransactions(const BlockTransactionsRequest& req) : blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+/** A transaction sent in full within a compact block */
+struct PrefilledTransaction {
+    //! Sent differentially encoded: the distance from the previous prefilled transaction, minus one
+    uint16_t index;
+    CTransaction tx;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        uint64_t nIndex = index;
+        READWRITE(COMPACTSIZE(nIndex));
+        if (nIndex > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("index overflowed 16 bits");
+        index = nIndex;
+        READWRITE(tx);
+    }
+};
+
+/**
+ * A "cmpctblock" message: a block header plus a 6-byte short ID for each
+ * transaction, from which the receiver rebuilds the block out of its mempool.
+ * The short IDs are SipHash-2-4 of the txid, keyed from the header and a
+ * random nonce so that collisions can't be precomputed for every peer.
+ * The coinbase, and for proof-of-stake blocks the coinstake, are never in the
+ * mempool and are always prefilled; the block signature is carried along.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+    friend class PartiallyDownloadedBlock;
+
+    static const int SHORTTXIDS_LENGTH = 6;
+
+protected:
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() {}
+
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(header);
+        READWRITE(nonce);
+
+        uint64_t nShortTxIDs = (uint64_t)shorttxids.size();
+        READWRITE(COMPACTSIZE(nShortTxIDs));
+        if (ser_action.ForRead()) {
+            size_t i = 0;
+            while (shorttxids.size() < nShortTxIDs) {
+                shorttxids.resize(std::min((uint64_t)(1000 + shorttxids.size()), nShortTxIDs));
+                for (; i < shorttxids.size(); i++) {
+                    uint32_t lsb = 0;
+                    uint16_t msb = 0;
+                    READWRITE(lsb);
+                    READWRITE(msb);
+                    shorttxids[i] = (uint64_t(msb) << 32) | uint64_t(lsb);
+                }
+            }
+        } else {
+            for (size_t i = 0; i < shorttxids.size(); i++) {
+                uint32_t lsb = shorttxids[i] & 0xffffffff;
+                uint16_t msb = (shorttxids[i] >> 32) & 0xffff;
+                READWRITE(lsb);
+                READWRITE(msb);
+            }
+        }
+
+        READWRITE(prefilledtxn);
+        READWRITE(vchBlockSig);
+
+        if (ser_action.ForRead())
+            FillShortTxIDSelector();
+    }
+};
+
+/**
+ * A block being rebuilt from a compact block: the prefilled transactions and
+ * the ones found in the mempool or among the orphans are filled in, the rest
+ * are requested with getblocktxn and supplied to FillBlock.
+ */
+class PartiallyDownloadedBlock
+{
+protected:
+    //! Null transactions mark positions that are still missing
+    std::vector<CTransaction> txn_available;
+    size_t prefilled_count;
+    size_t mempool_count;
+    CTxMemPool* pool;
+
+public:
+    enum ReadStatus {
+        READ_STATUS_OK,
+        READ_STATUS_INVALID, //! Invalid object, peer is sending bogus data
+        READ_STATUS_FAILED,  //! Failed to process object, e.g. a short ID collision; fetch the whole block
+    };
+
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    PartiallyDownloadedBlock(CTxMemPool* poolIn) : prefilled_count(0), mempool_count(0), pool(poolIn) {}
+
+    /** Fill in what the compact block and the local transactions provide; vExtraTxn are searched after the mempool */
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<const CTransaction*>& vExtraTxn);
+    bool IsTxAvailable(size_t index) const;
+    /** Complete the block with the transactions that were missing, in block order */
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing);
+
+    size_t PrefilledCount() const { return prefilled_count; }
+    size_t MempoolCount() const { return mempool_count; }
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
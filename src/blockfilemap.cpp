@@ -0,0 +1,124 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilemap.h"
+
+#include "chainparams.h"
+#include "crypto/common.h"
+#include "main.h"
+#include "util.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CBlockFileMap blockFileMap;
+
+CMappedBlockFile::~CMappedBlockFile()
+{
+#ifndef WIN32
+    if (pdata)
+        munmap((void*)pdata, nSize);
+#endif
+}
+
+bool CMappedBlockFile::FindBlock(unsigned int nPos, const char*& pbegin, unsigned int& nBlockSize) const
+{
+    if (nPos < MESSAGE_START_SIZE + 4 || nPos > nSize)
+        return false;
+    const char* pheader = pdata + nPos - MESSAGE_START_SIZE - 4;
+    if (memcmp(pheader, Params().MessageStart(), MESSAGE_START_SIZE))
+        return false;
+    nBlockSize = ReadLE32((const unsigned char*)pheader + MESSAGE_START_SIZE);
+    if (nBlockSize > nSize - nPos)
+        return false;
+    pbegin = pdata + nPos;
+    return true;
+}
+
+void CSerializedBlock::SetMapped(const boost::shared_ptr<const CMappedBlockFile>& mappingIn, const char* pbeginIn, unsigned int nSizeIn)
+{
+    mapping = mappingIn;
+    std::vector<char>().swap(vch);
+    pbegin = pbeginIn;
+    nSize = nSizeIn;
+}
+
+char* CSerializedBlock::SetBuffer(unsigned int nSizeIn)
+{
+    mapping.reset();
+    vch.resize(nSizeIn);
+    nSize = nSizeIn;
+    char* pbuf = nSize ? &vch[0] : NULL;
+    pbegin = pbuf;
+    return pbuf;
+}
+
+CBlockFileMap::CBlockFileMap() : fEnabled(false), nFinalizedFiles(0)
+{
+}
+
+void CBlockFileMap::SetEnabled(bool fEnabledIn)
+{
+    LOCK(cs);
+#ifdef WIN32
+    fEnabledIn = false;
+#endif
+    // Block files are up to 128 MiB each; don't exhaust a 32-bit address space with them.
+    if (sizeof(void*) < 8)
+        fEnabledIn = false;
+    fEnabled = fEnabledIn;
+    if (!fEnabled)
+        mapFiles.clear();
+}
+
+void CBlockFileMap::SetFinalizedFiles(int nFile)
+{
+    LOCK(cs);
+    nFinalizedFiles = nFile;
+    mapFiles.erase(mapFiles.lower_bound(nFile), mapFiles.end());
+}
+
+void CBlockFileMap::Forget(int nFile)
+{
+    LOCK(cs);
+    mapFiles.erase(nFile);
+}
+
+boost::shared_ptr<const CMappedBlockFile> CBlockFileMap::Get(int nFile)
+{
+    LOCK(cs);
+    if (!fEnabled || nFile >= nFinalizedFiles)
+        return boost::shared_ptr<const CMappedBlockFile>();
+
+    std::map<int, boost::shared_ptr<const CMappedBlockFile> >::const_iterator it = mapFiles.find(nFile);
+    if (it != mapFiles.end())
+        return it->second;
+
+    boost::shared_ptr<const CMappedBlockFile> mapping;
+#ifndef WIN32
+    boost::filesystem::path path = GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk");
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return mapping;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* pdata = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (pdata != MAP_FAILED)
+            mapping.reset(new CMappedBlockFile((const char*)pdata, st.st_size));
+        else
+            LogPrintf("%s : mmap of %s failed: %s\n", __func__, path.string(), strerror(errno));
+    }
+    close(fd);
+    if (mapping)
+        mapFiles[nFile] = mapping;
+#endif
+    return mapping;
+}
@@ -0,0 +1,115 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILEMAP_H
+#define BITCOIN_BLOCKFILEMAP_H
+
+#include "sync.h"
+
+#include <map>
+#include <stddef.h>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+/** Default for -mmapblocks */
+static const bool DEFAULT_MMAP_BLOCKS = true;
+
+/** Read-only memory mapping of a whole blk?????.dat file; unmapped when the last reference goes away */
+class CMappedBlockFile
+{
+private:
+    const char* pdata;
+    size_t nSize;
+
+    CMappedBlockFile(const CMappedBlockFile&);
+    CMappedBlockFile& operator=(const CMappedBlockFile&);
+
+public:
+    CMappedBlockFile(const char* pdataIn, size_t nSizeIn) : pdata(pdataIn), nSize(nSizeIn) {}
+    ~CMappedBlockFile();
+
+    /**
+     * Locate the block stored at nPos, which is the position a CDiskBlockPos
+     * records (just past the magic and size header). Returns false if the
+     * header does not match or the block does not fit in the file.
+     */
+    bool FindBlock(unsigned int nPos, const char*& pbegin, unsigned int& nBlockSize) const;
+
+    const char* data() const { return pdata; }
+    size_t size() const { return nSize; }
+};
+
+/**
+ * The serialized bytes of one block as stored on disk. They either point into
+ * a block file mapping, which is kept alive for as long as this object, or
+ * are held in an own buffer when the file is not mapped. Serializing this
+ * object writes the bytes unchanged, so it can be sent as a "block" message
+ * in place of a CBlock: the disk and network encodings of blocks are the same.
+ */
+class CSerializedBlock
+{
+private:
+    boost::shared_ptr<const CMappedBlockFile> mapping;
+    std::vector<char> vch;
+    const char* pbegin;
+    unsigned int nSize;
+
+public:
+    CSerializedBlock() : pbegin(NULL), nSize(0) {}
+
+    void SetMapped(const boost::shared_ptr<const CMappedBlockFile>& mappingIn, const char* pbeginIn, unsigned int nSizeIn);
+    /** Make room for nSizeIn bytes in the own buffer and return where to store them */
+    char* SetBuffer(unsigned int nSizeIn);
+
+    const char* begin() const { return pbegin; }
+    const char* end() const { return pbegin + nSize; }
+    unsigned int size() const { return nSize; }
+    bool IsMapped() const { return mapping.get() != NULL; }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return nSize;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        if (nSize)
+            s.write(pbegin, nSize);
+    }
+};
+
+/**
+ * Cache of memory mappings of finalized block files, i.e. every file before
+ * the one blocks are currently appended to. Finalized files are never written
+ * again, so readers can deserialize straight from the mapping without
+ * opening, seeking and buffering the file. Files still being written are not
+ * mapped; Get() returns NULL for them and the caller falls back to stdio.
+ */
+class CBlockFileMap
+{
+private:
+    mutable CCriticalSection cs;
+    bool fEnabled;
+    //! Files with a lower number are finalized
+    int nFinalizedFiles;
+    std::map<int, boost::shared_ptr<const CMappedBlockFile> > mapFiles;
+
+public:
+    CBlockFileMap();
+
+    void SetEnabled(bool fEnabledIn);
+    /** Called when blocks start being appended to file nFile, finalizing all before it */
+    void SetFinalizedFiles(int nFile);
+    /** Drop the mapping of a file that is about to be removed or rewritten */
+    void Forget(int nFile);
+
+    /** Return the mapping of finalized file nFile, mapping it on first use, or NULL */
+    boost::shared_ptr<const CMappedBlockFile> Get(int nFile);
+};
+
+extern CBlockFileMap blockFileMap;
+
+#endif // BITCOIN_BLOCKFILEMAP_H
@@ -0,0 +1,207 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilereader.h"
+
+#include "chainparams.h"
+#include "util.h"
+
+#include <boost/bind.hpp>
+
+CBlockFileReader::CBlockFileReader(FILE* fileIn, int nDecodeThreads) : file(fileIn), nFramed(0), nFrameIds(0), nNextSeq(0), fEof(false), fRewind(false), nRewindPos(0)
+{
+    if (nDecodeThreads < 1)
+        nDecodeThreads = 1;
+    nMaxInFlight = 16 * nDecodeThreads;
+    threads.create_thread(boost::bind(&CBlockFileReader::ThreadScan, this));
+    for (int i = 0; i < nDecodeThreads; i++)
+        threads.create_thread(boost::bind(&CBlockFileReader::ThreadDecode, this));
+}
+
+CBlockFileReader::~CBlockFileReader()
+{
+    threads.interrupt_all();
+    threads.join_all();
+    for (std::deque<CFrame*>::iterator it = queueFrames.begin(); it != queueFrames.end(); it++)
+        delete *it;
+    for (std::map<uint64_t, CImportedBlock*>::iterator it = mapResults.begin(); it != mapResults.end(); it++)
+        delete it->second;
+}
+
+bool CBlockFileReader::TakeRewind(bool fWait, uint64_t& nPos)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (fWait && !fRewind && (!queueFrames.empty() || !mapPending.empty()))
+        cond.wait(lock);
+    if (!fRewind)
+        return false;
+    nPos = nRewindPos;
+    fRewind = false;
+    return true;
+}
+
+void CBlockFileReader::ThreadScan()
+{
+    RenameThread("catocoin-loadblk");
+    try {
+        // This takes over file and calls fclose() on it in the CBufferedFile destructor
+        CBufferedFile blkdat(file, 2 * MAX_BLOCK_SIZE_CURRENT, MAX_BLOCK_SIZE_CURRENT + 8, SER_DISK, CLIENT_VERSION);
+        uint64_t nRewind = blkdat.GetPos();
+        while (true) {
+            boost::this_thread::interruption_point();
+
+            // At the end of the file, a frame still being decoded may fail and send the scan back
+            if (!TakeRewind(blkdat.eof(), nRewind) && blkdat.eof())
+                break;
+
+            // A rewind past the buffer has to reread the file
+            if (!blkdat.SetPos(nRewind) && !blkdat.Seek(nRewind))
+                throw std::ios_base::failure("failed to seek in block file");
+            nRewind++;         // start one byte further next time, in case of failure
+            blkdat.SetLimit(); // remove former limit
+            unsigned int nSize = 0;
+            uint64_t nHeaderPos;
+            try {
+                // locate a header
+                unsigned char buf[MESSAGE_START_SIZE];
+                blkdat.FindByte(Params().MessageStart()[0]);
+                nHeaderPos = blkdat.GetPos();
+                nRewind = nHeaderPos + 1;
+                blkdat >> FLATDATA(buf);
+                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                    continue;
+                // read size
+                blkdat >> nSize;
+                if (nSize < 80 || nSize > MAX_BLOCK_SIZE_CURRENT)
+                    continue;
+            } catch (const std::exception&) {
+                // no valid block header found; don't complain
+                if (TakeRewind(true, nRewind))
+                    continue;
+                break;
+            }
+            CFrame* frame = new CFrame();
+            try {
+                // cut out the serialized block
+                frame->nHeaderPos = nHeaderPos;
+                frame->nPos = blkdat.GetPos();
+                blkdat.SetLimit(frame->nPos + nSize);
+                frame->data.resize(nSize);
+                blkdat.read(&frame->data[0], nSize);
+                nRewind = blkdat.GetPos();
+            } catch (const std::exception& e) {
+                LogPrintf("%s : I/O error - %s\n", __func__, e.what());
+                delete frame;
+                continue;
+            }
+
+            boost::unique_lock<boost::mutex> lock(cs);
+            while (!fRewind && nFramed - nNextSeq >= nMaxInFlight)
+                cond.wait(lock);
+            if (fRewind) {
+                // cut out after the frame that failed
+                delete frame;
+                continue;
+            }
+            frame->nSeq = nFramed++;
+            frame->nId = nFrameIds++;
+            mapPending[frame->nSeq] = frame->nId;
+            queueFrames.push_back(frame);
+            cond.notify_all();
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("%s : %s\n", __func__, e.what());
+    }
+
+    boost::unique_lock<boost::mutex> lock(cs);
+    fEof = true;
+    cond.notify_all();
+}
+
+void CBlockFileReader::ThreadDecode()
+{
+    RenameThread("catocoin-blkdec");
+    while (true) {
+        CFrame* frame;
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            while (queueFrames.empty() && !fEof)
+                cond.wait(lock);
+            if (queueFrames.empty())
+                return;
+            frame = queueFrames.front();
+            queueFrames.pop_front();
+        }
+
+        CImportedBlock* result = new CImportedBlock();
+        result->nPos = frame->nPos;
+        try {
+            frame->data >> result->block;
+            result->hash = result->block.GetHash();
+            result->fValid = true;
+        } catch (const std::exception& e) {
+            LogPrintf("%s : Deserialize error at position %u - %s\n", __func__, frame->nPos, e.what());
+        }
+        uint64_t nSeq = frame->nSeq;
+        uint64_t nId = frame->nId;
+        uint64_t nHeaderPos = frame->nHeaderPos;
+        delete frame;
+
+        boost::unique_lock<boost::mutex> lock(cs);
+        std::map<uint64_t, uint64_t>::iterator itPending = mapPending.find(nSeq);
+        if (itPending == mapPending.end() || itPending->second != nId) {
+            // dropped by a rewind while it was being decoded
+            delete result;
+            continue;
+        }
+        mapPending.erase(itPending);
+        mapResults[nSeq] = result;
+
+        if (!result->fValid) {
+            // The size in the header may have been wrong, so the frames cut out after this one are dropped
+            // and the scan resumes one byte after its header
+            for (std::deque<CFrame*>::iterator it = queueFrames.begin(); it != queueFrames.end();) {
+                if ((*it)->nSeq > nSeq) {
+                    delete *it;
+                    it = queueFrames.erase(it);
+                } else
+                    it++;
+            }
+            for (std::map<uint64_t, CImportedBlock*>::iterator it = mapResults.upper_bound(nSeq); it != mapResults.end();) {
+                delete it->second;
+                mapResults.erase(it++);
+            }
+            mapPending.erase(mapPending.upper_bound(nSeq), mapPending.end());
+            nFramed = nSeq + 1;
+            fRewind = true;
+            nRewindPos = nHeaderPos + 1;
+        }
+        cond.notify_all();
+    }
+}
+
+bool CBlockFileReader::Next(CImportedBlock& result)
+{
+    CImportedBlock* next;
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (true) {
+            std::map<uint64_t, CImportedBlock*>::iterator it = mapResults.find(nNextSeq);
+            if (it != mapResults.end()) {
+                next = it->second;
+                mapResults.erase(it);
+                break;
+            }
+            if (fEof && nNextSeq == nFramed)
+                return false;
+            cond.wait(lock);
+        }
+        nNextSeq++;
+        cond.notify_all();
+    }
+
+    std::swap(result, *next);
+    delete next;
+    return true;
+}
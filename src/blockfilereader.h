@@ -0,0 +1,101 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILEREADER_H
+#define BITCOIN_BLOCKFILEREADER_H
+
+#include "clientversion.h"
+#include "primitives/block.h"
+#include "streams.h"
+#include "uint256.h"
+
+#include <deque>
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+/** A block found in a block file, decoded and hashed */
+struct CImportedBlock {
+    CBlock block;
+    uint256 hash;
+    //! Position of the serialized block in the file
+    uint64_t nPos;
+    //! Whether the block could be deserialized
+    bool fValid;
+
+    CImportedBlock() : hash(0), nPos(0), fValid(false) {}
+};
+
+/**
+ * Parallel scanner for blk*.dat style files, used by -reindex and -loadblock.
+ * One thread scans the file for network magic and size headers and cuts out
+ * the serialized blocks; decoder threads deserialize and hash them; Next()
+ * hands the results to the caller in file order, so validation sees exactly
+ * the sequence a serial scan would produce. When a block fails to decode, the
+ * frames cut out after it are dropped and the scan resumes one byte after its
+ * header, so a block hidden by a truncated one before it is still found.
+ */
+class CBlockFileReader
+{
+private:
+    struct CFrame {
+        uint64_t nSeq;
+        //! Unique among all frames, unlike nSeq, which frames cut out again after a rewind reuse
+        uint64_t nId;
+        //! Position of the network magic in front of the block
+        uint64_t nHeaderPos;
+        uint64_t nPos;
+        CDataStream data;
+
+        CFrame() : nSeq(0), nId(0), nHeaderPos(0), nPos(0), data(SER_DISK, CLIENT_VERSION) {}
+    };
+
+    FILE* file;
+    boost::mutex cs;
+    //! Signalled when a frame is cut out, a result is decoded, or the caller consumed a result
+    boost::condition_variable cond;
+    //! Frames waiting for a decoder
+    std::deque<CFrame*> queueFrames;
+    //! Decoded blocks that were not handed out yet, by sequence number
+    std::map<uint64_t, CImportedBlock*> mapResults;
+    //! Frames cut out but not decoded yet, sequence number to nId
+    std::map<uint64_t, uint64_t> mapPending;
+    //! Number of frames cut out so far, not counting the ones dropped by a rewind
+    uint64_t nFramed;
+    //! Number of frames ever cut out
+    uint64_t nFrameIds;
+    //! Sequence number of the next block Next() returns
+    uint64_t nNextSeq;
+    //! Maximum number of frames and results held at once
+    uint64_t nMaxInFlight;
+    //! Set when the scanner reached the end of the file
+    bool fEof;
+    //! Set when a frame failed to decode; the scanner resumes at nRewindPos, as a serial scan would have
+    bool fRewind;
+    uint64_t nRewindPos;
+    boost::thread_group threads;
+
+    //! Move nPos to where a requested rewind resumes the scan; with fWait set, first wait until every frame is decoded
+    bool TakeRewind(bool fWait, uint64_t& nPos);
+    void ThreadScan();
+    void ThreadDecode();
+
+public:
+    /** Takes over fileIn and closes it when the scan finishes */
+    CBlockFileReader(FILE* fileIn, int nDecodeThreads);
+    ~CBlockFileReader();
+
+    /** Return the next block of the file, or false at its end. Blocks that fail to decode are returned with fValid unset. */
+    bool Next(CImportedBlock& result);
+
+private:
+    CBlockFileReader(const CBlockFileReader&);
+    CBlockFileReader& operator=(const CBlockFileReader&);
+};
+
+#endif // BITCOIN_BLOCKFILEREADER_H
@@ -0,0 +1,152 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockprefetch.h"
+
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <set>
+
+#include <boost/thread.hpp>
+
+using namespace std;
+
+CBlockPrefetcher blockPrefetcher;
+
+CBlockPrefetcher::CBlockPrefetcher() : nGeneration(0), nMaxBlocks(0)
+{
+}
+
+void CBlockPrefetcher::SetMaxBlocks(int nMaxBlocksIn)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    nMaxBlocks = nMaxBlocksIn;
+}
+
+void CBlockPrefetcher::Request(const vector<CBlockIndex*>& vpindex, int nTipHeight)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (nMaxBlocks <= 0)
+        return;
+
+    // Forget blocks validation has moved past (connected from another source, or reorged away)
+    for (map<uint256, CPrefetchEntry>::iterator it = mapEntries.begin(); it != mapEntries.end();) {
+        if (it->second.nHeight <= nTipHeight)
+            mapEntries.erase(it++);
+        else
+            it++;
+    }
+
+    bool fQueued = false;
+    for (vector<CBlockIndex*>::const_iterator it = vpindex.begin(); it != vpindex.end() && (int)mapEntries.size() < nMaxBlocks; it++) {
+        const CBlockIndex* pindex = *it;
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            break;
+        pair<map<uint256, CPrefetchEntry>::iterator, bool> ret = mapEntries.insert(make_pair(pindex->GetBlockHash(), CPrefetchEntry()));
+        if (!ret.second)
+            continue;
+        ret.first->second.pos = pindex->GetBlockPos();
+        ret.first->second.nHeight = pindex->nHeight;
+        queue.push_back(pindex->GetBlockHash());
+        fQueued = true;
+    }
+    if (fQueued)
+        cond.notify_all();
+}
+
+bool CBlockPrefetcher::Take(const CBlockIndex* pindex, CBlock& block, CCoinsViewCache& view, unsigned int& nCoinsWarmed)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    map<uint256, CPrefetchEntry>::iterator it = mapEntries.find(pindex->GetBlockHash());
+    if (it == mapEntries.end())
+        return false;
+
+    // A block that is still queued or being read is dropped; the worker discards its result.
+    CPrefetchEntry& entry = it->second;
+    bool fValid = entry.fDone && entry.fValid;
+    if (fValid) {
+        std::swap(block, entry.block);
+        if (entry.nGeneration == nGeneration) {
+            for (vector<pair<uint256, CCoins> >::iterator itCoins = entry.vCoins.begin(); itCoins != entry.vCoins.end(); itCoins++) {
+                if (view.WarmCoins(itCoins->first, itCoins->second))
+                    nCoinsWarmed++;
+            }
+        }
+    }
+    mapEntries.erase(it);
+    return fValid;
+}
+
+void CBlockPrefetcher::InvalidateCoins()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    nGeneration++;
+}
+
+void CBlockPrefetcher::ThreadPrefetch()
+{
+    while (true) {
+        uint256 hash;
+        CDiskBlockPos pos;
+        int nGenerationRead;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (queue.empty())
+                cond.wait(lock); // interruption point
+            hash = queue.front();
+            queue.pop_front();
+            map<uint256, CPrefetchEntry>::const_iterator it = mapEntries.find(hash);
+            if (it == mapEntries.end())
+                continue;
+            pos = it->second.pos;
+            // Read the generation before the database, so a flush in between invalidates the result.
+            nGenerationRead = nGeneration;
+        }
+
+        CBlock block;
+        vector<pair<uint256, CCoins> > vCoins;
+        bool fValid = false;
+        try {
+            if (ReadBlockFromDisk(block, pos) && block.GetHash() == hash) {
+                // Only coins created before this block can be in the database; skip
+                // duplicates and outputs of earlier transactions in the same block.
+                set<uint256> setSeen;
+                BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+                    if (!tx.IsCoinBase() && !tx.IsZerocoinSpend()) {
+                        BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+                            if (!setSeen.insert(txin.prevout.hash).second)
+                                continue;
+                            CCoins coins;
+                            if (pcoinsdbview->GetCoins(txin.prevout.hash, coins) && !coins.IsPruned())
+                                vCoins.push_back(make_pair(txin.prevout.hash, coins));
+                        }
+                    }
+                    setSeen.insert(tx.GetHash());
+                }
+                fValid = true;
+            }
+        } catch (const std::exception& e) {
+            LogPrint("bench", "%s : failed to prefetch block %s: %s\n", __func__, hash.ToString(), e.what());
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        map<uint256, CPrefetchEntry>::iterator it = mapEntries.find(hash);
+        if (it == mapEntries.end())
+            continue;
+        CPrefetchEntry& entry = it->second;
+        std::swap(entry.block, block);
+        entry.vCoins.swap(vCoins);
+        entry.nGeneration = nGenerationRead;
+        entry.fValid = fValid;
+        entry.fDone = true;
+    }
+}
+
+void ThreadBlockPrefetch()
+{
+    RenameThread("catocoin-prefetch");
+    blockPrefetcher.ThreadPrefetch();
+}
@@ -0,0 +1,97 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKPREFETCH_H
+#define BITCOIN_BLOCKPREFETCH_H
+
+#include "chain.h"
+#include "coins.h"
+#include "primitives/block.h"
+#include "uint256.h"
+
+#include <deque>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+/** Default for -prefetchblocks, the number of best chain blocks read ahead of validation */
+static const int DEFAULT_PREFETCH_BLOCKS = 16;
+/** Default for -prefetchthreads */
+static const int DEFAULT_PREFETCH_THREADS = 2;
+/** Maximum number of read-ahead threads */
+static const int MAX_PREFETCH_THREADS = 8;
+
+/**
+ * Read-ahead stage for ActivateBestChain. While cs_main is busy connecting
+ * one block, worker threads read the next blocks of the best chain from disk
+ * and fetch the coins spent by their inputs from the coin database.
+ * ConnectTip takes the prefetched block instead of reading it itself and
+ * moves the coins into pcoinsTip.
+ *
+ * Coins read from the database are only usable until pcoinsTip is next
+ * flushed: afterwards the database may hold versions newer than those that
+ * were in the cache at read time. Every flush therefore bumps a generation
+ * counter, and results from an older generation keep their block but drop
+ * their coins.
+ */
+class CBlockPrefetcher
+{
+private:
+    struct CPrefetchEntry {
+        CDiskBlockPos pos;
+        int nHeight;
+        bool fDone;
+        bool fValid;
+        int nGeneration;
+        CBlock block;
+        std::vector<std::pair<uint256, CCoins> > vCoins;
+
+        CPrefetchEntry() : nHeight(0), fDone(false), fValid(false), nGeneration(0) {}
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    //! Requested blocks by hash, until they are taken or passed by
+    std::map<uint256, CPrefetchEntry> mapEntries;
+    //! Requested blocks no worker has picked up yet, in connection order
+    std::deque<uint256> queue;
+    int nGeneration;
+    int nMaxBlocks;
+
+public:
+    CBlockPrefetcher();
+
+    //! Set the read-ahead window; 0 disables prefetching
+    void SetMaxBlocks(int nMaxBlocksIn);
+
+    /**
+     * Queue blocks that will be connected after the current one, in
+     * connection order. Entries at or below nTipHeight are forgotten.
+     * Called with cs_main held.
+     */
+    void Request(const std::vector<CBlockIndex*>& vpindex, int nTipHeight);
+
+    /**
+     * Take the prefetched block for pindex and warm view with its coins.
+     * Returns false if the block is not ready, in which case the caller reads
+     * it from disk itself. Called with cs_main held.
+     */
+    bool Take(const CBlockIndex* pindex, CBlock& block, CCoinsViewCache& view, unsigned int& nCoinsWarmed);
+
+    //! Called after pcoinsTip was flushed to the coin database
+    void InvalidateCoins();
+
+    //! Worker loop, returns when the thread is interrupted
+    void ThreadPrefetch();
+};
+
+extern CBlockPrefetcher blockPrefetcher;
+
+/** Run a prefetch worker */
+void ThreadBlockPrefetch();
+
+#endif // BITCOIN_BLOCKPREFETCH_H
@@ -0,0 +1,173 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockwriter.h"
+
+#include "main.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <stdio.h>
+
+#include <boost/thread.hpp>
+
+using namespace std;
+
+CBlockDiskWriter blockDiskWriter;
+
+CBlockDiskWriter::CBlockDiskWriter() : nQueuedBytes(0), fRunning(false), fFailed(false), nTimeWrite(0)
+{
+}
+
+bool CBlockDiskWriter::Process(const CWriteJob& job)
+{
+    if (job.type == JOB_FINALIZE) {
+        CDiskBlockPos pos(job.pos.nFile, 0);
+        FILE* file = OpenBlockFile(pos);
+        if (file) {
+            TruncateFile(file, job.nBlockSize);
+            FileCommit(file);
+            fclose(file);
+        }
+        file = OpenUndoFile(pos);
+        if (file) {
+            TruncateFile(file, job.nUndoSize);
+            FileCommit(file);
+            fclose(file);
+        }
+        return true;
+    }
+
+    const char* strName = job.type == JOB_WRITE_BLOCK ? "blk" : "rev";
+    FILE* file = job.type == JOB_WRITE_BLOCK ? OpenBlockFile(job.pos) : OpenUndoFile(job.pos);
+    if (!file)
+        return error("%s : failed to open %s%05u.dat", __func__, strName, job.pos.nFile);
+    size_t nSize = job.vchData.size();
+    bool fOk = nSize == 0 || fwrite(&job.vchData[0], 1, nSize, file) == nSize;
+    fclose(file);
+    if (!fOk)
+        return error("%s : failed to write %u bytes at position %u of %s%05u.dat", __func__, nSize, job.pos.nPos, strName, job.pos.nFile);
+    return true;
+}
+
+bool CBlockDiskWriter::Submit(const CWriteJob& job)
+{
+    boost::this_thread::disable_interruption di;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    // A record larger than the limit still goes once the queue is empty
+    while (fRunning && !fFailed && !queue.empty() && nQueuedBytes + job.vchData.size() > MAX_BLOCK_WRITE_QUEUE)
+        condDone.wait(lock);
+    if (fFailed)
+        return false;
+
+    // Without the thread the queue is empty, so writing directly keeps the order
+    if (!fRunning) {
+        if (!Process(job))
+            fFailed = true;
+        return !fFailed;
+    }
+
+    queue.push_back(job);
+    nQueuedBytes += job.vchData.size();
+    mapPendingFiles[job.pos.nFile]++;
+    condWork.notify_one();
+    return true;
+}
+
+bool CBlockDiskWriter::WriteBlock(const CDiskBlockPos& pos, const CDataStream& data)
+{
+    CWriteJob job(JOB_WRITE_BLOCK, pos);
+    job.vchData.assign(data.begin(), data.end());
+    return Submit(job);
+}
+
+bool CBlockDiskWriter::WriteUndo(const CDiskBlockPos& pos, const CDataStream& data)
+{
+    CWriteJob job(JOB_WRITE_UNDO, pos);
+    job.vchData.assign(data.begin(), data.end());
+    return Submit(job);
+}
+
+bool CBlockDiskWriter::Finalize(int nFile, unsigned int nBlockSize, unsigned int nUndoSize)
+{
+    CWriteJob job(JOB_FINALIZE, CDiskBlockPos(nFile, 0));
+    job.nBlockSize = nBlockSize;
+    job.nUndoSize = nUndoSize;
+    return Submit(job);
+}
+
+void CBlockDiskWriter::WaitForFile(int nFile)
+{
+    // Readers may run on threads that are being interrupted; the queue always drains
+    boost::this_thread::disable_interruption di;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (mapPendingFiles.count(nFile))
+        condDone.wait(lock);
+}
+
+bool CBlockDiskWriter::Flush()
+{
+    boost::this_thread::disable_interruption di;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (!queue.empty())
+        condDone.wait(lock);
+    return !fFailed;
+}
+
+int64_t CBlockDiskWriter::GetWriteTime()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return nTimeWrite;
+}
+
+size_t CBlockDiskWriter::GetQueuedBytes()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return nQueuedBytes;
+}
+
+void CBlockDiskWriter::Thread()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fRunning = true;
+    while (true) {
+        // Only wait, and so only notice an interruption, once everything queued is written
+        try {
+            while (queue.empty())
+                condWork.wait(lock);
+        } catch (const boost::thread_interrupted&) {
+            fRunning = false;
+            throw;
+        }
+
+        // References to deque elements stay valid while others are appended
+        const CWriteJob& job = queue.front();
+        lock.unlock();
+        int64_t nStart = GetTimeMicros();
+        bool fOk = Process(job);
+        int64_t nElapsed = GetTimeMicros() - nStart;
+        lock.lock();
+
+        nTimeWrite += nElapsed;
+        map<int, int>::iterator it = mapPendingFiles.find(job.pos.nFile);
+        if (--it->second == 0)
+            mapPendingFiles.erase(it);
+        nQueuedBytes -= job.vchData.size();
+        queue.pop_front();
+        condDone.notify_all();
+
+        if (!fOk && !fFailed) {
+            fFailed = true;
+            lock.unlock();
+            AbortNode("Failed to write block or undo data");
+            lock.lock();
+        }
+    }
+}
+
+void ThreadBlockWriter()
+{
+    RenameThread("catocoin-blkwrite");
+    blockDiskWriter.Thread();
+}
@@ -0,0 +1,114 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKWRITER_H
+#define BITCOIN_BLOCKWRITER_H
+
+#include "chain.h"
+#include "streams.h"
+
+#include <deque>
+#include <map>
+#include <stdint.h>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+/** Default for -asyncblockwrite */
+static const bool DEFAULT_ASYNC_BLOCK_WRITE = true;
+/** Callers wait for the block writer once it has this many bytes queued */
+static const size_t MAX_BLOCK_WRITE_QUEUE = 4 * MAX_BLOCK_SIZE_CURRENT;
+
+/**
+ * Ordered background writer for the block (blk?????.dat) and undo
+ * (rev?????.dat) files. Callers reserve space with FindBlockPos/FindUndoPos
+ * and serialize the record as before, but the file I/O happens on the writer
+ * thread, in submission order, so that connecting a block doesn't wait for
+ * the disk. Once MAX_BLOCK_WRITE_QUEUE bytes are queued, callers wait for
+ * the writer to catch up.
+ *
+ * Nothing on disk refers to queued data until the block index is written:
+ * FlushStateToDisk drains the queue and fsyncs the files before it writes
+ * the block index and the chainstate, which keeps the order in which data
+ * reaches the disk the same as with synchronous writes. Readers of block and
+ * undo files call WaitForFile first so they never see a record that is still
+ * queued.
+ */
+class CBlockDiskWriter
+{
+private:
+    enum JobType {
+        JOB_WRITE_BLOCK,
+        JOB_WRITE_UNDO,
+        JOB_FINALIZE,
+    };
+
+    struct CWriteJob {
+        JobType type;
+        //! Start of the reserved space; for JOB_FINALIZE only nFile is used
+        CDiskBlockPos pos;
+        //! Complete record including the message start and size header
+        std::vector<char> vchData;
+        //! Final sizes of the block and undo file for JOB_FINALIZE
+        unsigned int nBlockSize;
+        unsigned int nUndoSize;
+
+        CWriteJob(JobType typeIn, const CDiskBlockPos& posIn) : type(typeIn), pos(posIn), nBlockSize(0), nUndoSize(0) {}
+    };
+
+    boost::mutex mutex;
+    //! Signalled when jobs are queued
+    boost::condition_variable condWork;
+    //! Signalled when jobs are completed
+    boost::condition_variable condDone;
+    std::deque<CWriteJob> queue;
+    //! Bytes of record data in queue
+    size_t nQueuedBytes;
+    //! Number of queued or running jobs per file number
+    std::map<int, int> mapPendingFiles;
+    bool fRunning;
+    bool fFailed;
+    //! Total time spent writing on the writer thread, in microseconds
+    int64_t nTimeWrite;
+
+    static bool Process(const CWriteJob& job);
+    bool Submit(const CWriteJob& job);
+
+public:
+    CBlockDiskWriter();
+
+    /**
+     * Queue the block or undo record in data for writing at pos, the start of
+     * the space reserved for it. Written synchronously when the writer thread
+     * is not running. Returns false if this or an earlier write failed.
+     */
+    bool WriteBlock(const CDiskBlockPos& pos, const CDataStream& data);
+    bool WriteUndo(const CDiskBlockPos& pos, const CDataStream& data);
+
+    //! Truncate and fsync the block and undo file nFile once the writes before it are done
+    bool Finalize(int nFile, unsigned int nBlockSize, unsigned int nUndoSize);
+
+    //! Wait until all queued writes to block or undo file nFile are done
+    void WaitForFile(int nFile);
+
+    //! Wait until the queue is empty; returns false if any write failed
+    bool Flush();
+
+    //! Total time spent in background writes, in microseconds
+    int64_t GetWriteTime();
+
+    //! Bytes of record data queued or being written
+    size_t GetQueuedBytes();
+
+    //! Writer loop; finishes the queued writes and returns when the thread is interrupted
+    void Thread();
+};
+
+extern CBlockDiskWriter blockDiskWriter;
+
+/** Run the block writer */
+void ThreadBlockWriter();
+
+#endif // BITCOIN_BLOCKWRITER_H
@@ -4,14 +4,20 @@
 
 #include "bloom.h"
 
+#include "crypto/common.h"
 #include "hash.h"
 #include "primitives/transaction.h"
+#include "protocol.h"
+#include "random.h"
 #include "script/script.h"
 #include "script/standard.h"
 #include "streams.h"
 
+#include <algorithm>
+#include <limits>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <boost/foreach.hpp>
 
@@ -188,3 +194,127 @@ void CBloomFilter::UpdateEmptyFull()
     isFull = full;
     isEmpty = empty;
 }
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double nFPRate)
+{
+    double logFpRate = log(nFPRate);
+    // The optimal number of hash functions is log(fpRate) / log(0.5)
+    nHashFuncs = std::max(1, std::min((int)round(logFpRate / log(0.5)), (int)MAX_HASH_FUNCS));
+    // Size for the worst case of three full generations: nHashFuncs * nMaxElements / -log(1 - fpRate^(1 / nHashFuncs)) cells
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    uint32_t nMaxElements = nEntriesPerGeneration * 3;
+    nCells = std::max((uint32_t)64, (uint32_t)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs))));
+    data.resize(((nCells + 63) / 64) << 1);
+    reset();
+}
+
+void CRollingBloomFilter::reset()
+{
+    nKey0 = GetRand(std::numeric_limits<uint64_t>::max());
+    nKey1 = GetRand(std::numeric_limits<uint64_t>::max());
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(data.begin(), data.end(), 0);
+}
+
+uint64_t CRollingBloomFilter::HashKey(const std::vector<unsigned char>& vKey) const
+{
+    CSipHasher hasher(nKey0, nKey1);
+    for (size_t nPos = 0; nPos < vKey.size(); nPos += 8) {
+        unsigned char word[8] = {};
+        memcpy(word, &vKey[nPos], std::min((size_t)8, vKey.size() - nPos));
+        hasher.Write(ReadLE64(word));
+    }
+    return hasher.Write(vKey.size()).Finalize();
+}
+
+uint64_t CRollingBloomFilter::HashKey(const uint256& hash) const
+{
+    return SipHashUint256(nKey0, nKey1, hash);
+}
+
+uint64_t CRollingBloomFilter::HashKey(const CInv& inv) const
+{
+    // Some inventory types share hashes, e.g. a SwiftTX lock request and its transaction
+    CSipHasher hasher(nKey0, nKey1);
+    hasher.Write(inv.type);
+    for (int i = 0; i < 4; i++)
+        hasher.Write(ReadLE64(inv.hash.begin() + 8 * i));
+    return hasher.Finalize();
+}
+
+bool CRollingBloomFilter::Insert(uint64_t nHash)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration) {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4)
+            nGeneration = 1;
+        // Clear the cells of the generation about to be reused
+        uint64_t nGenerationMask1 = 0 - (uint64_t)(nGeneration & 1);
+        uint64_t nGenerationMask2 = 0 - (uint64_t)(nGeneration >> 1);
+        for (size_t p = 0; p < data.size(); p += 2) {
+            uint64_t p1 = data[p], p2 = data[p + 1];
+            uint64_t mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    bool fFound = Contains(nHash);
+    // Derive the cells from two halves of one hash, see Kirsch and Mitzenmacher,
+    // "Less Hashing, Same Performance: Building a Better Bloom Filter"
+    uint32_t h1 = (uint32_t)nHash, h2 = (uint32_t)(nHash >> 32);
+    for (int n = 0; n < nHashFuncs; n++) {
+        uint32_t nCell = (h1 + n * h2) % nCells;
+        int nBit = nCell & 0x3F;
+        size_t nPos = (nCell >> 6) << 1;
+        data[nPos] = (data[nPos] & ~(((uint64_t)1) << nBit)) | ((uint64_t)(nGeneration & 1)) << nBit;
+        data[nPos + 1] = (data[nPos + 1] & ~(((uint64_t)1) << nBit)) | ((uint64_t)(nGeneration >> 1)) << nBit;
+    }
+    return !fFound;
+}
+
+bool CRollingBloomFilter::Contains(uint64_t nHash) const
+{
+    uint32_t h1 = (uint32_t)nHash, h2 = (uint32_t)(nHash >> 32);
+    for (int n = 0; n < nHashFuncs; n++) {
+        uint32_t nCell = (h1 + n * h2) % nCells;
+        int nBit = nCell & 0x3F;
+        size_t nPos = (nCell >> 6) << 1;
+        if (!(((data[nPos] | data[nPos + 1]) >> nBit) & 1))
+            return false;
+    }
+    return true;
+}
+
+bool CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+{
+    return Insert(HashKey(vKey));
+}
+
+bool CRollingBloomFilter::insert(const uint256& hash)
+{
+    return Insert(HashKey(hash));
+}
+
+bool CRollingBloomFilter::insert(const CInv& inv)
+{
+    return Insert(HashKey(inv));
+}
+
+bool CRollingBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+{
+    return Contains(HashKey(vKey));
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    return Contains(HashKey(hash));
+}
+
+bool CRollingBloomFilter::contains(const CInv& inv) const
+{
+    return Contains(HashKey(inv));
+}
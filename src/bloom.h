@@ -7,8 +7,10 @@
 
 #include "serialize.h"
 
+#include <stdint.h>
 #include <vector>
 
+class CInv;
 class COutPoint;
 class CTransaction;
 class uint256;
@@ -97,4 +99,51 @@ public:
     void UpdateEmptyFull();
 };
 
+/**
+ * RollingBloomFilter is a fixed-size probabilistic set of the most recently
+ * inserted keys, used to remember what a peer already knows without a node
+ * allocation per entry. It is never sent over the network, so it is not
+ * bound by the protocol limits above and hashes keys with a random SipHash
+ * key of its own.
+ *
+ * Every cell holds the generation (1 to 3) of the last key that set it, or 0.
+ * After nElements / 2 inserts the generation advances and the cells of the
+ * oldest one are cleared, so the last nElements to nElements * 3 / 2
+ * inserted keys are always found, and a key that was not inserted is found
+ * with a probability of about nFPRate.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    //! Insert the key; returns true if it was not found before, like std::set::insert().second
+    bool insert(const std::vector<unsigned char>& vKey);
+    bool insert(const uint256& hash);
+    bool insert(const CInv& inv);
+
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+    bool contains(const CInv& inv) const;
+
+    //! Forget all keys, and pick a new hash key
+    void reset();
+
+private:
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    int nHashFuncs;
+    uint32_t nCells;
+    uint64_t nKey0, nKey1;
+    //! Pairs of words holding the low and the high generation bit of 64 cells
+    std::vector<uint64_t> data;
+
+    uint64_t HashKey(const std::vector<unsigned char>& vKey) const;
+    uint64_t HashKey(const uint256& hash) const;
+    uint64_t HashKey(const CInv& inv) const;
+    bool Insert(uint64_t nHash);
+    bool Contains(uint64_t nHash) const;
+};
+
 #endif // BITCOIN_BLOOM_H
@@ -5,8 +5,47 @@
 
 #include "chain.h"
 
+#include "allocators.h"
+
+#include <boost/thread/mutex.hpp>
+
 using namespace std;
 
+/**
+ * CBlockIndex allocation
+ *
+ * There is one entry per known block and they are only freed at shutdown, so
+ * carving them out of large pooled blocks saves the per-allocation overhead
+ * and fragmentation of a million separate heap allocations. The pool is never
+ * destroyed: entries may outlive any static it could be tied to.
+ */
+static boost::mutex csBlockIndexPool;
+static CNodePool* pBlockIndexPool = new CNodePool();
+
+void* CBlockIndex::operator new(size_t nSize)
+{
+    if (nSize > CNodePool::MAX_CHUNK_SIZE)
+        return ::operator new(nSize);
+    boost::unique_lock<boost::mutex> lock(csBlockIndexPool);
+    return pBlockIndexPool->Allocate(nSize);
+}
+
+void CBlockIndex::operator delete(void* p, size_t nSize)
+{
+    if (p == NULL)
+        return;
+    if (nSize > CNodePool::MAX_CHUNK_SIZE)
+        return ::operator delete(p);
+    boost::unique_lock<boost::mutex> lock(csBlockIndexPool);
+    pBlockIndexPool->Deallocate(p, nSize);
+}
+
+size_t CBlockIndex::PoolUsage()
+{
+    boost::unique_lock<boost::mutex> lock(csBlockIndexPool);
+    return pBlockIndexPool->GetReservedBytes();
+}
+
 /**
  * CChain implementation
  */
@@ -14,6 +14,8 @@
 #include "util.h"
 #include "libzerocoin/Denominations.h"
 
+#include <stdexcept>
+#include <string.h>
 #include <vector>
 
 #include <boost/foreach.hpp>
@@ -100,6 +102,159 @@ enum BlockStatus {
     BLOCK_FAILED_MASK = BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
 };
 
+/** Number of zerocoin denominations, the length of libzerocoin::zerocoinDenomList */
+static const int ZEROCOIN_DENOMINATION_COUNT = 8;
+
+/** Position of a denomination in libzerocoin::zerocoinDenomList, or -1 if it is not a valid denomination */
+inline int ZerocoinDenominationIndex(libzerocoin::CoinDenomination denom)
+{
+    switch (denom) {
+    case libzerocoin::ZQ_ONE: return 0;
+    case libzerocoin::ZQ_FIVE: return 1;
+    case libzerocoin::ZQ_TEN: return 2;
+    case libzerocoin::ZQ_FIFTY: return 3;
+    case libzerocoin::ZQ_ONE_HUNDRED: return 4;
+    case libzerocoin::ZQ_FIVE_HUNDRED: return 5;
+    case libzerocoin::ZQ_ONE_THOUSAND: return 6;
+    case libzerocoin::ZQ_FIVE_THOUSAND: return 7;
+    default: return -1;
+    }
+}
+
+/**
+ * Zerocoin supply per denomination, stored inline in the block index entry.
+ * Serialized exactly like the std::map<CoinDenomination, int64_t> it replaced,
+ * so existing block index databases stay readable.
+ */
+class CZerocoinSupply
+{
+private:
+    int64_t anSupply[ZEROCOIN_DENOMINATION_COUNT];
+
+    static int Index(libzerocoin::CoinDenomination denom)
+    {
+        int nIndex = ZerocoinDenominationIndex(denom);
+        if (nIndex < 0)
+            throw std::out_of_range("CZerocoinSupply::at : invalid denomination");
+        return nIndex;
+    }
+
+public:
+    CZerocoinSupply() { SetNull(); }
+
+    void SetNull() { memset(anSupply, 0, sizeof(anSupply)); }
+
+    int64_t& at(libzerocoin::CoinDenomination denom) { return anSupply[Index(denom)]; }
+    const int64_t& at(libzerocoin::CoinDenomination denom) const { return anSupply[Index(denom)]; }
+
+    friend bool operator==(const CZerocoinSupply& a, const CZerocoinSupply& b) { return memcmp(a.anSupply, b.anSupply, sizeof(a.anSupply)) == 0; }
+    friend bool operator!=(const CZerocoinSupply& a, const CZerocoinSupply& b) { return !(a == b); }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return GetSizeOfCompactSize(ZEROCOIN_DENOMINATION_COUNT) + ZEROCOIN_DENOMINATION_COUNT * (sizeof(int) + sizeof(int64_t));
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        WriteCompactSize(s, ZEROCOIN_DENOMINATION_COUNT);
+        for (int i = 0; i < ZEROCOIN_DENOMINATION_COUNT; i++) {
+            ::Serialize(s, libzerocoin::zerocoinDenomList[i], nType, nVersion);
+            ::Serialize(s, anSupply[i], nType, nVersion);
+        }
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        SetNull();
+        unsigned int nSize = ReadCompactSize(s);
+        for (unsigned int i = 0; i < nSize; i++) {
+            libzerocoin::CoinDenomination denom;
+            int64_t nSupply;
+            ::Unserialize(s, denom, nType, nVersion);
+            ::Unserialize(s, nSupply, nType, nVersion);
+            int nIndex = ZerocoinDenominationIndex(denom);
+            if (nIndex >= 0)
+                anSupply[nIndex] = nSupply;
+        }
+    }
+};
+
+/**
+ * Denominations of the zerocoin mints in a block, kept as a count per
+ * denomination. Serialized like the std::vector<CoinDenomination> it replaced,
+ * with the mints grouped by denomination instead of in block order.
+ */
+class CMintDenominations
+{
+private:
+    uint32_t anCount[ZEROCOIN_DENOMINATION_COUNT];
+
+public:
+    CMintDenominations() { clear(); }
+
+    void clear() { memset(anCount, 0, sizeof(anCount)); }
+
+    void push_back(libzerocoin::CoinDenomination denom)
+    {
+        int nIndex = ZerocoinDenominationIndex(denom);
+        if (nIndex < 0)
+            throw std::out_of_range("CMintDenominations::push_back : invalid denomination");
+        anCount[nIndex]++;
+    }
+
+    unsigned int count(libzerocoin::CoinDenomination denom) const
+    {
+        int nIndex = ZerocoinDenominationIndex(denom);
+        return nIndex < 0 ? 0 : anCount[nIndex];
+    }
+
+    unsigned int size() const
+    {
+        unsigned int nTotal = 0;
+        for (int i = 0; i < ZEROCOIN_DENOMINATION_COUNT; i++)
+            nTotal += anCount[i];
+        return nTotal;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    friend bool operator==(const CMintDenominations& a, const CMintDenominations& b) { return memcmp(a.anCount, b.anCount, sizeof(a.anCount)) == 0; }
+    friend bool operator!=(const CMintDenominations& a, const CMintDenominations& b) { return !(a == b); }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        unsigned int nSize = size();
+        return GetSizeOfCompactSize(nSize) + nSize * sizeof(int);
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        WriteCompactSize(s, size());
+        for (int i = 0; i < ZEROCOIN_DENOMINATION_COUNT; i++) {
+            for (unsigned int j = 0; j < anCount[i]; j++)
+                ::Serialize(s, libzerocoin::zerocoinDenomList[i], nType, nVersion);
+        }
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        clear();
+        unsigned int nSize = ReadCompactSize(s);
+        for (unsigned int i = 0; i < nSize; i++) {
+            libzerocoin::CoinDenomination denom;
+            ::Unserialize(s, denom, nType, nVersion);
+            int nIndex = ZerocoinDenominationIndex(denom);
+            if (nIndex >= 0)
+                anCount[nIndex]++;
+        }
+    }
+};
+
 /** The block chain is a tree shaped structure starting with the
  * genesis block at the root, with each block potentially having multiple
  * candidates to be the next block. A blockindex may have multiple pprev pointing
@@ -114,15 +269,9 @@ public:
     //! pointer to the index of the predecessor of this block
     CBlockIndex* pprev;
 
-    //! pointer to the index of the next block
-    CBlockIndex* pnext;
-
     //! pointer to the index of some further predecessor of this block
     CBlockIndex* pskip;
 
-    //ppcoin: trust score of block chain
-    uint256 bnChainTrust;
-
     //! height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
@@ -162,8 +311,6 @@ public:
     uint64_t nStakeModifier;             // hash modifier for proof-of-stake
     unsigned int nStakeModifierChecksum; // checksum of index; in-memeory only
     COutPoint prevoutStake;
-    unsigned int nStakeTime;
-    uint256 hashProofOfStake;
     int64_t nMint;
     int64_t nMoneySupply;
 
@@ -179,9 +326,15 @@ public:
     uint32_t nSequenceId;
     
     //! zerocoin specific fields
-    std::map<libzerocoin::CoinDenomination, int64_t> mapZerocoinSupply;
-    std::vector<libzerocoin::CoinDenomination> vMintDenominationsInBlock;
-    
+    CZerocoinSupply mapZerocoinSupply;
+    CMintDenominations vMintDenominationsInBlock;
+
+    //! Entries are allocated from a pool shared by all of them, see chain.cpp
+    static void* operator new(size_t nSize);
+    static void operator delete(void* p, size_t nSize);
+    //! Heap memory held by the entry pool
+    static size_t PoolUsage();
+
     void SetNull()
     {
         phashBlock = NULL;
@@ -203,7 +356,6 @@ public:
         nStakeModifier = 0;
         nStakeModifierChecksum = 0;
         prevoutStake.SetNull();
-        nStakeTime = 0;
 
         nVersion = 0;
         hashMerkleRoot = uint256();
@@ -211,10 +363,7 @@ public:
         nBits = 0;
         nNonce = 0;
         nAccumulatorCheckpoint = 0;
-        // Start supply of each denomination with 0s
-        for (auto& denom : libzerocoin::zerocoinDenomList) {
-            mapZerocoinSupply.insert(make_pair(denom, 0));
-        }
+        mapZerocoinSupply.SetNull();
         vMintDenominationsInBlock.clear();
     }
 
@@ -236,21 +385,17 @@ public:
             nAccumulatorCheckpoint = block.nAccumulatorCheckpoint;
 
         //Proof of Stake
-        bnChainTrust = uint256();
         nMint = 0;
         nMoneySupply = 0;
         nFlags = 0;
         nStakeModifier = 0;
         nStakeModifierChecksum = 0;
-        hashProofOfStake = uint256();
 
         if (block.IsProofOfStake()) {
             SetProofOfStake();
             prevoutStake = block.vtx[1].vin[0].prevout;
-            nStakeTime = block.nTime;
         } else {
             prevoutStake.SetNull();
-            nStakeTime = 0;
         }
     }
     
@@ -289,6 +434,12 @@ public:
         return block;
     }
 
+    //! The coinstake of a proof-of-stake block is timestamped with the block
+    unsigned int GetStakeTime() const
+    {
+        return IsProofOfStake() ? nTime : 0;
+    }
+
     int64_t GetZerocoinSupply() const
     {
         int64_t nTotal = 0;
@@ -300,7 +451,7 @@ public:
 
     bool MintedDenomination(libzerocoin::CoinDenomination denom) const
     {
-        return std::find(vMintDenominationsInBlock.begin(), vMintDenominationsInBlock.end(), denom) != vMintDenominationsInBlock.end();
+        return vMintDenominationsInBlock.count(denom) > 0;
     }
 
     uint256 GetBlockHash() const
@@ -462,11 +613,11 @@ public:
         READWRITE(nStakeModifier);
         if (IsProofOfStake()) {
             READWRITE(prevoutStake);
+            // The stake time always equals the block time and is not kept in memory
+            unsigned int nStakeTime = GetStakeTime();
             READWRITE(nStakeTime);
         } else {
             const_cast<CDiskBlockIndex*>(this)->prevoutStake.SetNull();
-            const_cast<CDiskBlockIndex*>(this)->nStakeTime = 0;
-            const_cast<CDiskBlockIndex*>(this)->hashProofOfStake = uint256();
         }
 
         // block header
@@ -79,6 +79,13 @@ static const Checkpoints::CCheckpointData dataRegtest = {
     0,
     100};
 
+//   UTXO snapshot hashes are the "hash_serialized" result of dumptxoutset
+// run on a node that validated the chain from genesis. A node started with
+// -loadutxosnapshot only accepts a file whose height and hash appear here.
+static MapUTXOSnapshots mapUTXOSnapshots;
+static MapUTXOSnapshots mapUTXOSnapshotsTestnet;
+static MapUTXOSnapshots mapUTXOSnapshotsRegtest;
+
 libzerocoin::ZerocoinParams* CChainParams::Zerocoin_Params() const
 {
     assert(this);
@@ -253,6 +260,11 @@ public:
     {
         return data;
     }
+
+    const MapUTXOSnapshots& UTXOSnapshots() const
+    {
+        return mapUTXOSnapshots;
+    }
 };
 static CMainParams mainParams;
 
@@ -329,6 +341,7 @@ public:
         fRequireStandard = false;
         fMineBlocksOnDemand = false;
         fTestnetToBeDeprecatedFieldRPC = true;
+        fHeadersFirstSyncingActive = true;
 
         nPoolMaxTransactions = 2;
         strSporkKey = "04fc640bba80713c0666acda4d3ffce670307a55f90b703995c830a1e9110b07244508724b7106395f8336c78d3691ae5ba05abe3840f3a7e18d6b95acdd0de71d";
@@ -341,6 +354,11 @@ public:
     {
         return dataTestnet;
     }
+
+    const MapUTXOSnapshots& UTXOSnapshots() const
+    {
+        return mapUTXOSnapshotsTestnet;
+    }
 };
 static CTestNetParams testNetParams;
 
@@ -390,6 +408,11 @@ public:
     {
         return dataRegtest;
     }
+
+    const MapUTXOSnapshots& UTXOSnapshots() const
+    {
+        return mapUTXOSnapshotsRegtest;
+    }
 };
 static CRegTestParams regTestParams;
 
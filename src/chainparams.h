@@ -15,10 +15,14 @@
 #include "uint256.h"
 
 #include "libzerocoin/Params.h"
+#include <map>
 #include <vector>
 
 typedef unsigned char MessageStartChars[MESSAGE_START_SIZE];
 
+//! Snapshot height -> content hash of the snapshot file
+typedef std::map<int, uint256> MapUTXOSnapshots;
+
 struct CDNSSeedData {
     std::string name, host;
     CDNSSeedData(const std::string& strName, const std::string& strHost) : name(strName), host(strHost) {}
@@ -90,6 +94,8 @@ public:
     const std::vector<unsigned char>& Base58Prefix(Base58Type type) const { return base58Prefixes[type]; }
     const std::vector<CAddress>& FixedSeeds() const { return vFixedSeeds; }
     virtual const Checkpoints::CCheckpointData& Checkpoints() const = 0;
+    /** Content hashes of trusted UTXO snapshots (see dumptxoutset), by snapshot height */
+    virtual const MapUTXOSnapshots& UTXOSnapshots() const = 0;
     int PoolMaxTransactions() const { return nPoolMaxTransactions; }
     std::string SporkKey() const { return strSporkKey; }
     std::string ObfuscationPoolDummyAddress() const { return strObfuscationPoolDummyAddress; }
@@ -16,6 +16,10 @@
 #include "activemasternode.h"
 #include "addrman.h"
 #include "amount.h"
+#include "banman.h"
+#include "blockfilemap.h"
+#include "blockprefetch.h"
+#include "blockwriter.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
 #include "key.h"
@@ -28,13 +32,16 @@
 #include "net.h"
 #include "rpcserver.h"
 #include "script/standard.h"
+#include "servedblockcache.h"
 #include "spork.h"
 #include "sporkdb.h"
 #include "txdb.h"
 #include "torcontrol.h"
 #include "ui_interface.h"
+#include "uploadtarget.h"
 #include "util.h"
 #include "utilmoneystr.h"
+#include "utxosnapshot.h"
 #include "validationinterface.h"
 #ifdef ENABLE_WALLET
 #include "db.h"
@@ -160,7 +167,6 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB* pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher* pcoinscatcher = NULL;
 
 /** Preparing steps before shutting down or restarting the wallet */
@@ -190,6 +196,8 @@ void PrepareShutdown()
     GenerateBitcoins(false, NULL, 0);
 #endif
     StopNode();
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        DumpMempool();
     InterruptTorControl();
     StopTorControl();
     DumpMasternodes();
@@ -329,12 +337,24 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file") + " " + _("on startup"));
+    strUsage += HelpMessageOpt("-loadutxosnapshot=<file>", _("Build an empty data directory from a trusted UTXO snapshot made with dumptxoutset (incompatible with -txindex and -reindex)"));
     strUsage += HelpMessageOpt("-maxreorg=<n>", strprintf(_("Set the Maximum reorg depth (default: %u)"), Params(CBaseChainParams::MAIN).MaxReorganizationDepth()));
+    strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
+    strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
+    strUsage += HelpMessageOpt("-persistmempool", strprintf(_("Whether to save the mempool on shutdown and every %u minutes, and load it on startup (default: %u)"), MEMPOOL_DUMP_INTERVAL / 60, DEFAULT_PERSIST_MEMPOOL));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+    strUsage += HelpMessageOpt("-prefetchblocks=<n>", strprintf(_("Read up to <n> blocks of the best chain and their inputs ahead of validation (0 = disable, default: %u)"), DEFAULT_PREFETCH_BLOCKS));
+    strUsage += HelpMessageOpt("-prefetchthreads=<n>", strprintf(_("Set the number of block prefetch threads (1 to %d, default: %d)"), MAX_PREFETCH_THREADS, DEFAULT_PREFETCH_THREADS));
+    strUsage += HelpMessageOpt("-asyncblockwrite", strprintf(_("Write blocks and undo data to disk from a background thread (default: %u)"), DEFAULT_ASYNC_BLOCK_WRITE));
+#ifndef WIN32
+    strUsage += HelpMessageOpt("-mmapblocks", strprintf(_("Read blocks from finalized block files through memory mappings (default: %u)"), DEFAULT_MMAP_BLOCKS));
+#endif
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), "catocoind.pid"));
 #endif
+    strUsage += HelpMessageOpt("-prune=<n>", strprintf(_("Reduce storage requirements by pruning (deleting) old blocks. This mode disables wallet rescans and is incompatible with -txindex, "
+        "zCATO minting and masternodes. Warning: Reverting this setting requires re-downloading the entire blockchain. (default: 0 = disable pruning blocks, >%u = target size in MiB to use for block files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
     strUsage += HelpMessageOpt("-reindex", _("Rebuild block chain index from current blk000??.dat files") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-reindexaccumulators", _("Reindex the accumulator database") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-reindexmoneysupply", _("Reindex the CATO and zCATO money supply statistics") + " " + _("on startup"));
@@ -348,7 +368,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageGroup(_("Connection options:"));
     strUsage += HelpMessageOpt("-addnode=<ip>", _("Add a node to connect to and attempt to keep the connection open"));
     strUsage += HelpMessageOpt("-banscore=<n>", strprintf(_("Threshold for disconnecting misbehaving peers (default: %u)"), 100));
-    strUsage += HelpMessageOpt("-bantime=<n>", strprintf(_("Number of seconds to keep misbehaving peers from reconnecting (default: %u)"), 86400));
+    strUsage += HelpMessageOpt("-bantime=<n>", strprintf(_("Number of seconds to keep misbehaving peers from reconnecting (default: %u)"), DEFAULT_MISBEHAVING_BANTIME));
     strUsage += HelpMessageOpt("-bind=<addr>", _("Bind to given address and always listen on it. Use [host]:port notation for IPv6"));
     strUsage += HelpMessageOpt("-connect=<ip>", _("Connect only to the specified node(s)"));
     strUsage += HelpMessageOpt("-discover", _("Discover own IP address (default: 1 when listening and no -externalip)"));
@@ -357,10 +377,14 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-externalip=<ip>", _("Specify your own public address"));
     strUsage += HelpMessageOpt("-forcednsseed", strprintf(_("Always query for peer addresses via DNS lookup (default: %u)"), 0));
     strUsage += HelpMessageOpt("-listen", _("Accept connections from outside (default: 1 if no -proxy or -connect)"));
+    strUsage += HelpMessageOpt("-knownaddrfprate=<n>", strprintf(_("False positive rate of the filters remembering the addresses each peer knows, which are then not relayed to it (default: %s)"), DEFAULT_KNOWN_ADDR_FP_RATE));
+    strUsage += HelpMessageOpt("-knowninvfprate=<n>", strprintf(_("False positive rate of the filters remembering the inventory each peer knows, which is then not announced to it (default: %s)"), DEFAULT_KNOWN_INVENTORY_FP_RATE));
     strUsage += HelpMessageOpt("-listenonion", strprintf(_("Automatically create Tor hidden service (default: %d)"), DEFAULT_LISTEN_ONION));
     strUsage += HelpMessageOpt("-maxconnections=<n>", strprintf(_("Maintain at most <n> connections to peers (default: %u)"), 125));
     strUsage += HelpMessageOpt("-maxreceivebuffer=<n>", strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), 5000));
+    strUsage += HelpMessageOpt("-maxuploadtarget=<n>", strprintf(_("Tries to keep outbound traffic under the given target (in MiB per 24h). Serving old blocks to syncing peers stops first, other messages go out ahead of old blocks, and whitelisted and masternode peers are exempt. 0 = no limit (default: %d)"), DEFAULT_MAX_UPLOAD_TARGET));
     strUsage += HelpMessageOpt("-maxsendbuffer=<n>", strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), 1000));
+    strUsage += HelpMessageOpt("-msghandthreads=<n>", strprintf(_("Set the number of threads that handle peer messages (%u to %d, default: %d)"), 1, MAX_MESSAGE_HANDLER_THREADS, DEFAULT_MESSAGE_HANDLER_THREADS));
     strUsage += HelpMessageOpt("-onion=<ip:port>", strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy"));
     strUsage += HelpMessageOpt("-onlynet=<net>", _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)"));
     strUsage += HelpMessageOpt("-permitbaremultisig", strprintf(_("Relay non-P2SH multisig (default: %u)"), 1));
@@ -368,7 +392,9 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-port=<port>", strprintf(_("Listen for connections on <port> (default: %u or testnet: %u)"), 34888, 6082));
     strUsage += HelpMessageOpt("-proxy=<ip:port>", _("Connect through SOCKS5 proxy"));
     strUsage += HelpMessageOpt("-proxyrandomize", strprintf(_("Randomize credentials for every proxy connection. This enables Tor stream isolation (default: %u)"), 1));
+    strUsage += HelpMessageOpt("-servedblockcache=<n>", strprintf(_("Keep recently served blocks in memory for other peers asking for them, up to <n> megabytes (0 to disable, default: %u)"), DEFAULT_SERVED_BLOCK_CACHE_SIZE));
     strUsage += HelpMessageOpt("-seednode=<ip>", _("Connect to a node to retrieve peer addresses, and disconnect"));
+    strUsage += HelpMessageOpt("-socketevents=<mode>", strprintf(_("Socket events mode, which must be one of: %s (default: %s)"), GetSupportedSocketEventsModes(), DEFAULT_SOCKET_EVENTS));
     strUsage += HelpMessageOpt("-timeout=<n>", strprintf(_("Specify connection timeout in milliseconds (minimum: 1, default: %d)"), DEFAULT_CONNECT_TIMEOUT));
     strUsage += HelpMessageOpt("-torcontrol=<ip>:<port>", strprintf(_("Tor control port to use if onion listening enabled (default: %s)"), DEFAULT_TOR_CONTROL));
     strUsage += HelpMessageOpt("-torpassword=<pass>", _("Tor control port password (default: empty)"));
@@ -431,11 +457,12 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-dropmessagestest=<n>", _("Randomly drop 1 of every <n> network messages"));
         strUsage += HelpMessageOpt("-fuzzmessagestest=<n>", _("Randomly fuzz 1 of every <n> network messages"));
         strUsage += HelpMessageOpt("-flushwallet", strprintf(_("Run a thread to flush wallet periodically (default: %u)"), 1));
+        strUsage += HelpMessageOpt("-headersfirst", strprintf(_("Download and check the headers of the block chain first, then fetch the blocks from several peers in parallel (default: %u)"), Params(CBaseChainParams::MAIN).HeadersFirstSyncingActive()));
         strUsage += HelpMessageOpt("-maxreorg", strprintf(_("Use a custom max chain reorganization depth (default: %u)"), 100));
         strUsage += HelpMessageOpt("-stopafterblockimport", strprintf(_("Stop running after importing blocks from disk (default: %u)"), 0));
         strUsage += HelpMessageOpt("-sporkkey=<privkey>", _("Enable spork administration functionality with the appropriate private key."));
     }
-    string debugCategories = "addrman, alert, bench, coindb, db, lock, rand, rpc, selectcoins, tor, mempool, net, proxy, catocoin, (obfuscation, swiftx, masternode, mnpayments, mnbudget, zero)"; // Don't translate these and qt below
+    string debugCategories = "addrman, alert, bench, cmpctblock, coindb, db, lock, rand, rpc, selectcoins, tor, mempool, net, proxy, catocoin, (obfuscation, swiftx, masternode, mnpayments, mnbudget, zero), prune"; // Don't translate these and qt below
     if (mode == HMM_BITCOIN_QT)
         debugCategories += ", qt";
     strUsage += HelpMessageOpt("-debug=<category>", strprintf(_("Output debugging information (default: %u, supplying <category> is optional)"), 0) + ". " +
@@ -450,6 +477,10 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-logips", strprintf(_("Include IP addresses in debug output (default: %u)"), 0));
     strUsage += HelpMessageOpt("-logtimestamps", strprintf(_("Prepend debug output with timestamp (default: %u)"), 1));
     if (GetBoolArg("-help-debug", false)) {
+        strUsage += HelpMessageOpt("-limitancestorcount=<n>", strprintf("Do not accept transactions if number of in-mempool ancestors is <n> or more (default: %u)", DEFAULT_ANCESTOR_LIMIT));
+        strUsage += HelpMessageOpt("-limitancestorsize=<n>", strprintf("Do not accept transactions whose size with all in-mempool ancestors exceeds <n> kilobytes (default: %u)", DEFAULT_ANCESTOR_SIZE_LIMIT));
+        strUsage += HelpMessageOpt("-limitdescendantcount=<n>", strprintf("Do not accept transactions if any ancestor would have <n> or more in-mempool descendants (default: %u)", DEFAULT_DESCENDANT_LIMIT));
+        strUsage += HelpMessageOpt("-limitdescendantsize=<n>", strprintf("Do not accept transactions if any ancestor would have more than <n> kilobytes of in-mempool descendants (default: %u).", DEFAULT_DESCENDANT_SIZE_LIMIT));
         strUsage += HelpMessageOpt("-limitfreerelay=<n>", strprintf(_("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default:%u)"), 15));
         strUsage += HelpMessageOpt("-relaypriority", strprintf(_("Require high priority for relaying free or low-fee transactions (default:%u)"), 1));
         strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf(_("Limit size of signature cache to <n> entries (default: %u)"), 50000));
@@ -629,6 +660,23 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         LogPrintf("Stopping after block import\n");
         StartShutdown();
     }
+
+    // Last, so the transactions are checked against the imported chain
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        LoadMempool();
+    {
+        LOCK(cs_main);
+        fMempoolLoaded = !ShutdownRequested();
+    }
+}
+
+void ThreadDumpMempool()
+{
+    RenameThread("catocoin-mempooldump");
+    while (true) {
+        MilliSleep(MEMPOOL_DUMP_INTERVAL * 1000);
+        DumpMempool();
+    }
 }
 
 /** Sanity checks
@@ -791,10 +839,19 @@ bool AppInit2(boost::thread_group& threadGroup)
         }
     }
 
+    std::string strSocketEvents = GetArg("-socketevents", DEFAULT_SOCKET_EVENTS);
+    if (!ParseSocketEventsMode(strSocketEvents, nSocketEventsMode))
+        return InitError(strprintf(_("Invalid -socketevents ('%s') specified. Only these modes are supported: %s"), strSocketEvents, GetSupportedSocketEventsModes()));
+    // Settle on epoll or select now, so a fallback to select gets the limit below
+    InitSocketEvents();
+
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+    // select() can't wait for sockets numbered FD_SETSIZE or higher
+    if (nSocketEventsMode == SOCKETEVENTS_SELECT)
+        nMaxConnections = std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS));
+    nMaxConnections = std::max(nMaxConnections, 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -828,8 +885,15 @@ bool AppInit2(boost::thread_group& threadGroup)
     // Checkmempool and checkblockindex default to true in regtest mode
     mempool.setSanityCheck(GetBoolArg("-checkmempool", Params().DefaultConsistencyChecks()));
     fCheckBlockIndex = GetBoolArg("-checkblockindex", Params().DefaultConsistencyChecks());
+    fHeadersFirstSync = GetBoolArg("-headersfirst", Params().HeadersFirstSyncingActive());
     Checkpoints::fEnabled = GetBoolArg("-checkpoints", true);
 
+    // The mempool must hold at least a full descendant package, with room to spare
+    int64_t nMempoolSizeMax = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    int64_t nMempoolSizeMin = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000 * 40;
+    if (nMempoolSizeMax < 0 || nMempoolSizeMax < nMempoolSizeMin)
+        return InitError(strprintf(_("-maxmempool must be at least %d MB"), (nMempoolSizeMin + 999999) / 1000000));
+
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
     nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
     if (nScriptCheckThreads <= 0)
@@ -839,6 +903,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    nMessageHandlerThreads = GetArg("-msghandthreads", DEFAULT_MESSAGE_HANDLER_THREADS);
+    nMessageHandlerThreads = std::max(1, std::min(nMessageHandlerThreads, MAX_MESSAGE_HANDLER_THREADS));
+
     fServer = GetBoolArg("-server", false);
     setvbuf(stdout, NULL, _IOLBF, 0); /// ***TODO*** do we still need this after -printtoconsole is gone?
 
@@ -857,6 +924,15 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (nConnectTimeout <= 0)
         nConnectTimeout = DEFAULT_CONNECT_TIMEOUT;
 
+    if (mapArgs.count("-knowninvfprate")) {
+        if (!ParseDouble(mapArgs["-knowninvfprate"], &dKnownInventoryFPRate) || dKnownInventoryFPRate <= 0 || dKnownInventoryFPRate >= 1)
+            return InitError(strprintf(_("Invalid false positive rate for -knowninvfprate=<n>: '%s'"), mapArgs["-knowninvfprate"]));
+    }
+    if (mapArgs.count("-knownaddrfprate")) {
+        if (!ParseDouble(mapArgs["-knownaddrfprate"], &dKnownAddrFPRate) || dKnownAddrFPRate <= 0 || dKnownAddrFPRate >= 1)
+            return InitError(strprintf(_("Invalid false positive rate for -knownaddrfprate=<n>: '%s'"), mapArgs["-knownaddrfprate"]));
+    }
+
     // Fee-per-kilobyte amount considered the same as "free"
     // If you are mining, be careful setting this:
     // if you set it to zero then
@@ -920,6 +996,26 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (GetBoolArg("-peerbloomfilters", DEFAULT_PEERBLOOMFILTERS))
         nLocalServices |= NODE_BLOOM;
 
+    // Option to prune block and undo files; the value is the target size in MiB
+    int64_t nSignedPruneTarget = GetArg("-prune", 0) * 1024 * 1024;
+    if (nSignedPruneTarget < 0)
+        return InitError(_("Prune cannot be configured with a negative value."));
+    nPruneTarget = (uint64_t)nSignedPruneTarget;
+    if (nPruneTarget) {
+        if (nPruneTarget < MIN_DISK_SPACE_FOR_BLOCK_FILES)
+            return InitError(strprintf(_("Prune configured below the minimum of %d MiB.  Please use a higher number."), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
+        if (GetBoolArg("-txindex", false))
+            return InitError(_("Prune mode is incompatible with -txindex."));
+        if (GetBoolArg("-reindexaccumulators", false) || GetBoolArg("-reindexmoneysupply", false))
+            return InitError(_("Prune mode is incompatible with -reindexaccumulators and -reindexmoneysupply, which read every block since zerocoin activation."));
+        if (GetBoolArg("-masternode", false))
+            return InitError(_("Prune mode is incompatible with -masternode, which looks up the collateral transactions of other masternodes in old blocks."));
+        LogPrintf("Prune configured to target %uMiB on disk for block and undo files.\n", nPruneTarget / 1024 / 1024);
+        fPruneMode = true;
+        // Old blocks can no longer be served, so stop advertising them
+        nLocalServices &= ~NODE_NETWORK;
+    }
+
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
     // Sanity check
@@ -963,8 +1059,26 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
-        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+        for (int i = 0; i < nScriptCheckThreads - 1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadHeaderHashCheck);
+        }
+    }
+
+    blockFileMap.SetEnabled(GetBoolArg("-mmapblocks", DEFAULT_MMAP_BLOCKS));
+    uploadTarget.SetTarget(std::max((int64_t)0, GetArg("-maxuploadtarget", DEFAULT_MAX_UPLOAD_TARGET)) * 1024 * 1024);
+    servedBlockCache.SetMaxBytes(std::max((int64_t)0, GetArg("-servedblockcache", DEFAULT_SERVED_BLOCK_CACHE_SIZE)) * 1000000);
+
+    if (GetBoolArg("-asyncblockwrite", DEFAULT_ASYNC_BLOCK_WRITE))
+        threadGroup.create_thread(&ThreadBlockWriter);
+
+    int nPrefetchBlocks = std::max(0, (int)GetArg("-prefetchblocks", DEFAULT_PREFETCH_BLOCKS));
+    if (nPrefetchBlocks) {
+        int nPrefetchThreads = std::max(1, std::min(MAX_PREFETCH_THREADS, (int)GetArg("-prefetchthreads", DEFAULT_PREFETCH_THREADS)));
+        LogPrintf("Prefetching up to %d blocks with %d threads\n", nPrefetchBlocks, nPrefetchThreads);
+        blockPrefetcher.SetMaxBlocks(nPrefetchBlocks);
+        for (int i = 0; i < nPrefetchThreads; i++)
+            threadGroup.create_thread(&ThreadBlockPrefetch);
     }
 
     if (mapArgs.count("-sporkkey")) // spork priv key
@@ -1262,6 +1376,15 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     fReindex = GetBoolArg("-reindex", false);
 
+    if (mapArgs.count("-loadutxosnapshot")) {
+        if (fReindex)
+            return InitError(_("-loadutxosnapshot is incompatible with -reindex."));
+        if (GetBoolArg("-txindex", false))
+            return InitError(_("-loadutxosnapshot is incompatible with -txindex."));
+        if (Params().UTXOSnapshots().empty())
+            return InitError(_("-loadutxosnapshot is not available on this network, no trusted UTXO snapshots are known."));
+    }
+
     // Upgrading to 0.8; hard-link the old blknnnn.dat files into /blocks/
     filesystem::path blocksDir = GetDataDir() / "blocks";
     if (!filesystem::exists(blocksDir)) {
@@ -1294,12 +1417,16 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nTotalCache > (nMaxDbCache << 20))
         nTotalCache = (nMaxDbCache << 20); // total cache cannot be greater than nMaxDbCache
     size_t nBlockTreeDBCache = nTotalCache / 8;
-    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", true))
+    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", !fPruneMode))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache;
+    LogPrintf("Cache configuration:\n");
+    LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for in-memory UTXO set\n", nCoinCacheUsage * (1.0 / 1024 / 1024));
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -1329,6 +1456,18 @@ bool AppInit2(boost::thread_group& threadGroup)
                 if (fReindex)
                     pblocktree->WriteReindexing(true);
 
+                if (mapArgs.count("-loadutxosnapshot")) {
+                    if (pcoinsdbview->GetBestBlock() == uint256(0)) {
+                        uiInterface.InitMessage(_("Loading UTXO snapshot..."));
+                        CUTXOSnapshotStats stats;
+                        std::string strError;
+                        if (!LoadUTXOSnapshot(GetArg("-loadutxosnapshot", ""), Params().UTXOSnapshots(), stats, strError))
+                            return InitError(strprintf(_("Failed to load UTXO snapshot: %s"), strError));
+                    } else {
+                        LogPrintf("Ignoring -loadutxosnapshot, the chain state is not empty\n");
+                    }
+                }
+
                 // Catocoin: load previous sessions sporks if we have them.
                 uiInterface.InitMessage(_("Loading sporks..."));
                 LoadSporksFromDB();
@@ -1350,8 +1489,17 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
-                // Check for changed -txindex state
-                if (fTxIndex != GetBoolArg("-txindex", true)) {
+                // A pruned data directory cannot serve or rescan the blocks it deleted; only a node started from a
+                // UTXO snapshot is missing history by design
+                int nSnapshotHeight;
+                uint256 hashSnapshotCoins;
+                if (!fReindex && fHavePruned && !fPruneMode && !pblocktree->ReadUTXOSnapshot(nSnapshotHeight, hashSnapshotCoins)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to go back to unpruned mode. This will redownload the entire blockchain");
+                    break;
+                }
+
+                // Check for changed -txindex state (history missing below a UTXO snapshot or pruned away cannot be indexed)
+                if (fTxIndex != GetBoolArg("-txindex", !fHavePruned && !fPruneMode)) {
                     strLoadError = _("You need to rebuild the database using -reindex to change -txindex");
                     break;
                 }
@@ -1568,6 +1716,10 @@ bool AppInit2(boost::thread_group& threadGroup)
 
         RegisterValidationInterface(pwalletMain);
 
+        // Spending zCATO rebuilds the accumulator witness from the blocks since the mint
+        if (fPruneMode && !CWalletDB(strWalletFile).ListMintedCoins(true, false, false).empty())
+            return InitError(_("Prune mode is incompatible with a wallet holding unspent zCATO mints. Spend them before enabling -prune."));
+
         CBlockIndex* pindexRescan = chainActive.Tip();
         if (GetBoolArg("-rescan", false))
             pindexRescan = chainActive.Genesis();
@@ -1580,6 +1732,16 @@ bool AppInit2(boost::thread_group& threadGroup)
                 pindexRescan = chainActive.Genesis();
         }
         if (chainActive.Tip() && chainActive.Tip() != pindexRescan) {
+            // We can't rescan beyond non-pruned blocks, stop and throw an error
+            if (fPruneMode) {
+                CBlockIndex* block = chainActive.Tip();
+                while (block && block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA) && block->pprev->nTx > 0 && pindexRescan != block)
+                    block = block->pprev;
+
+                if (pindexRescan != block)
+                    return InitError(_("Prune: last wallet synchronisation goes beyond pruned data. You need to -reindex (download the whole blockchain again in case of pruned node)"));
+            }
+
             uiInterface.InitMessage(_("Rescanning..."));
             LogPrintf("Rescanning last %i blocks (from block %i)...\n", chainActive.Height() - pindexRescan->nHeight, pindexRescan->nHeight);
             nStart = GetTimeMillis();
@@ -1632,6 +1794,13 @@ bool AppInit2(boost::thread_group& threadGroup)
             vImportFiles.push_back(strFile);
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        threadGroup.create_thread(&ThreadDumpMempool);
+    {
+        LOCK(cs_main);
+        if (nUTXOSnapshotHeight >= 0)
+            threadGroup.create_thread(&ThreadValidateUTXOSnapshot);
+    }
     if (chainActive.Tip() == NULL) {
         LogPrintf("Waiting for genesis block to be imported...\n");
         while (!fRequestShutdown && chainActive.Tip() == NULL)
@@ -1744,6 +1913,10 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
 
     fEnableZeromint = GetBoolArg("-enablezeromint", false);
+    if (fEnableZeromint && fPruneMode) {
+        LogPrintf("AppInit2 : automatic zCATO minting disabled in prune mode\n");
+        fEnableZeromint = false;
+    }
 
     nZeromintPercentage = GetArg("-zeromintpercentage", 10);
     if (nZeromintPercentage > 100) nZeromintPercentage = 100;
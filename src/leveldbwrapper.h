@@ -59,6 +59,17 @@ public:
 
         batch.Delete(slKey);
     }
+
+    //! Store a key/value pair that is already serialized (bulk copies between databases)
+    void WriteRaw(const leveldb::Slice& slKey, const leveldb::Slice& slValue)
+    {
+        batch.Put(slKey, slValue);
+    }
+
+    void Clear()
+    {
+        batch.Clear();
+    }
 };
 
 class CLevelDBWrapper
@@ -11,11 +11,17 @@
 #include "accumulators.h"
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
+#include "blockfilemap.h"
+#include "blockfilereader.h"
+#include "blockprefetch.h"
+#include "blockwriter.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
 #include "init.h"
 #include "kernel.h"
+#include "memusage.h"
 #include "masternode-budget.h"
 #include "masternode-payments.h"
 #include "masternodeman.h"
@@ -23,6 +29,7 @@
 #include "net.h"
 #include "obfuscation.h"
 #include "pow.h"
+#include "servedblockcache.h"
 #include "spork.h"
 #include "sporkdb.h"
 #include "swifttx.h"
@@ -31,6 +38,7 @@
 #include "ui_interface.h"
 #include "util.h"
 #include "utilmoneystr.h"
+#include "verifyblocks.h"
 
 #include "primitives/zerocoin.h"
 #include "libzerocoin/Denominations.h"
@@ -77,7 +85,14 @@ bool fTxIndex = true;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 bool fVerifyingBlocks = false;
-unsigned int nCoinCacheSize = 5000;
+bool fMempoolLoaded = false;
+size_t nCoinCacheUsage = 5000 * 300;
+bool fHavePruned = false;
+int nUTXOSnapshotHeight = -1;
+int nUTXOSnapshotValidatedHeight = -1;
+bool fPruneMode = false;
+uint64_t nPruneTarget = 0;
+bool fHeadersFirstSync = false;
 bool fAlerts = DEFAULT_ALERTS;
 
 unsigned int nStakeMinAge = 60*60*2; //2 hours
@@ -170,12 +185,30 @@ struct QueuedBlock {
     int64_t nTime;              //! Time of "getdata" request in microseconds.
     int nValidatedQueuedBefore; //! Number of blocks queued with validated headers (globally) at the time this one is requested.
     bool fValidatedHeaders;     //! Whether this block has validated headers at the time of request.
+    boost::shared_ptr<PartiallyDownloadedBlock> partialBlock; //! Optional, set while rebuilding it from a compact block.
 };
 map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
+/** Peers we asked to announce new blocks with a compact block right away, oldest first. Protected by cs_main. */
+list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
 /** Number of blocks in flight with validated headers. */
 int nQueuedValidatedHeaders = 0;
 
+/**
+ * Blocks that arrived before the data of their parent during headers-first download. They are
+ * processed right after their parent, as the proof-of-stake checks and the stake modifier need
+ * the chain up to it. Protected by cs_main.
+ */
+struct CBlockAwaitingParent {
+    CBlock block;
+    NodeId nodeid;
+    unsigned int nSize;
+};
+map<uint256, CBlockAwaitingParent> mapBlocksAwaitingParent;
+multimap<uint256, uint256> mapBlocksAwaitingParentByPrev;
+size_t nBlocksAwaitingParentSize = 0;
+
 /** Number of preferable block download peers. */
 int nPreferredDownload = 0;
 
@@ -184,8 +217,14 @@ set<CBlockIndex*> setDirtyBlockIndex;
 
 /** Dirty block file entries. */
 set<int> setDirtyFileInfo;
+
+/** Global flag to indicate we should check to see if there are block/undo files that should be deleted. */
+bool fCheckForPruning = false;
 } // anon namespace
 
+/** Peer whose headers added each block index entry that has no block data yet. Protected by cs_main. */
+map<uint256, NodeId> mapHeadersOnlySource;
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // dispatching functions
@@ -298,6 +337,21 @@ struct CNodeState {
     int nBlocksInFlight;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer can send and rebuild compact blocks.
+    bool fProvidesHeaderAndIDs;
+    //! Whether this peer wants new blocks announced with a compact block instead of an inv.
+    bool fPreferHeaderAndIDs;
+    //! Compact blocks received, rebuilt without and with a getblocktxn round trip, and failed to rebuild.
+    int nCompactBlocks;
+    int nCompactReconstructed;
+    int nCompactBlockTxn;
+    int nCompactFailed;
+    //! Total time from receiving or requesting a compact block to having it rebuilt, in microseconds.
+    int64_t nCompactLatency;
+    //! Block index entries added from this peer's headers whose block data hasn't arrived yet.
+    int nHeadersOnly;
+    //! Whether header sync with this peer paused at MAX_HEADERS_ONLY_PER_PEER.
+    bool fHeadersPaused;
 
     CNodeState()
     {
@@ -311,6 +365,15 @@ struct CNodeState {
         nStallingSince = 0;
         nBlocksInFlight = 0;
         fPreferredDownload = false;
+        fProvidesHeaderAndIDs = false;
+        fPreferHeaderAndIDs = false;
+        nCompactBlocks = 0;
+        nCompactReconstructed = 0;
+        nCompactBlockTxn = 0;
+        nCompactFailed = 0;
+        nCompactLatency = 0;
+        nHeadersOnly = 0;
+        fHeadersPaused = false;
     }
 };
 
@@ -356,6 +419,67 @@ void InitializeNode(NodeId nodeid, const CNode* pnode)
     state.address = pnode->addr;
 }
 
+/**
+ * Forget the block index entries that nodeid's headers added and whose blocks never arrived, so that a
+ * peer can't grow the index by reconnecting. Entries on the best header chain, being downloaded, or known
+ * to other peers or index entries stay, and are no longer charged to anyone. Requires cs_main.
+ */
+static void PruneHeadersOnly(NodeId nodeid)
+{
+    set<CBlockIndex*> setPrune;
+    map<uint256, NodeId>::iterator it = mapHeadersOnlySource.begin();
+    while (it != mapHeadersOnlySource.end()) {
+        if (it->second != nodeid) {
+            ++it;
+            continue;
+        }
+        BlockMap::iterator mi = mapBlockIndex.find(it->first);
+        if (mi != mapBlockIndex.end()) {
+            CBlockIndex* pindex = mi->second;
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA) && !mapBlocksInFlight.count(it->first) && pindex != pindexBestInvalid &&
+                (pindexBestHeader == NULL || pindexBestHeader->GetAncestor(pindex->nHeight) != pindex))
+                setPrune.insert(pindex);
+        }
+        mapHeadersOnlySource.erase(it++);
+    }
+    if (setPrune.empty())
+        return;
+
+    for (map<NodeId, CNodeState>::const_iterator itState = mapNodeState.begin(); itState != mapNodeState.end(); ++itState) {
+        if (itState->first == nodeid)
+            continue;
+        setPrune.erase(itState->second.pindexBestKnownBlock);
+        setPrune.erase(itState->second.pindexLastCommonBlock);
+    }
+    map<CBlockIndex*, int> mapChildren;
+    BOOST_FOREACH (const BlockMap::value_type& entry, mapBlockIndex) {
+        if (entry.second->pprev && setPrune.count(entry.second->pprev))
+            mapChildren[entry.second->pprev]++;
+    }
+
+    // Highest first, so that a branch goes once its tip has
+    vector<pair<int, CBlockIndex*> > vPrune;
+    BOOST_FOREACH (CBlockIndex* pindex, setPrune)
+        vPrune.push_back(make_pair(pindex->nHeight, pindex));
+    sort(vPrune.rbegin(), vPrune.rend());
+    vector<uint256> vErase;
+    for (vector<pair<int, CBlockIndex*> >::const_iterator itPrune = vPrune.begin(); itPrune != vPrune.end(); ++itPrune) {
+        CBlockIndex* pindex = itPrune->second;
+        if (mapChildren[pindex] > 0)
+            continue;
+        if (pindex->pprev && setPrune.count(pindex->pprev))
+            mapChildren[pindex->pprev]--;
+        uint256 hash = pindex->GetBlockHash();
+        setDirtyBlockIndex.erase(pindex);
+        mapBlockIndex.erase(hash);
+        delete pindex;
+        vErase.push_back(hash);
+    }
+    LogPrint("net", "%s: forgot %u of %u headers without blocks from peer=%d\n", __func__, vErase.size(), vPrune.size(), nodeid);
+    if (!vErase.empty() && !pblocktree->EraseBlockIndex(vErase))
+        LogPrintf("%s: failed to erase block index entries\n", __func__);
+}
+
 void FinalizeNode(NodeId nodeid)
 {
     LOCK(cs_main);
@@ -372,6 +496,9 @@ void FinalizeNode(NodeId nodeid)
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
+    if (state->nHeadersOnly > 0)
+        PruneHeadersOnly(nodeid);
 
     mapNodeState.erase(nodeid);
 }
@@ -391,19 +518,29 @@ void MarkBlockAsReceived(const uint256& hash)
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex = NULL)
+// Returns false, and points pit at the existing entry, if the block is already in flight from this peer.
+bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex = NULL, list<QueuedBlock>::iterator* pit = NULL)
 {
     CNodeState* state = State(nodeid);
     assert(state != NULL);
 
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == nodeid && pit) {
+        *pit = itInFlight->second.second;
+        return false;
+    }
+
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
-    QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL};
+    QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL, boost::shared_ptr<PartiallyDownloadedBlock>()};
     nQueuedValidatedHeaders += newentry.fValidatedHeaders;
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    if (pit)
+        *pit = it;
+    return true;
 }
 
 /** Check whether the last unknown block a peer advertized is not yet known. */
@@ -523,6 +660,9 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             if (pindex->nStatus & BLOCK_HAVE_DATA) {
                 if (pindex->nChainTx)
                     state->pindexLastCommonBlock = pindex;
+            } else if (mapBlocksAwaitingParent.count(pindex->GetBlockHash())) {
+                // Downloaded already, waiting for the data of its parent.
+                continue;
             } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
                 // The block is not already downloaded, and not yet in flight.
                 if (pindex->nHeight > nWindowEnd) {
@@ -545,6 +685,61 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     }
 }
 
+/**
+ * Add to vBlocks, until it has at most count entries, the blocks below the UTXO snapshot the background
+ * validation will need next that nodeid has and that are neither stored nor in flight. Requires cs_main.
+ */
+void FindSnapshotHistoryToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks)
+{
+    if (nUTXOSnapshotHeight < 0 || vBlocks.size() >= count)
+        return;
+
+    CNodeState* state = State(nodeid);
+    assert(state != NULL);
+    if (state->pindexBestKnownBlock == NULL || state->pindexBestKnownBlock->GetAncestor(nUTXOSnapshotHeight) != chainActive[nUTXOSnapshotHeight])
+        return;
+
+    int nWindowEnd = std::min(nUTXOSnapshotHeight, std::max(nUTXOSnapshotValidatedHeight, 0) + (int)BLOCK_DOWNLOAD_WINDOW);
+    for (int nHeight = std::max(nUTXOSnapshotValidatedHeight + 1, 1); nHeight <= nWindowEnd && vBlocks.size() < count; nHeight++) {
+        CBlockIndex* pindex = chainActive[nHeight];
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA) && !mapBlocksInFlight.count(pindex->GetBlockHash()))
+            vBlocks.push_back(pindex);
+    }
+}
+
+/**
+ * Ask pfrom, which just delivered a new best block first, to announce the next ones to us with a
+ * compact block right away. Only the MAX_CMPCTBLOCK_HB_PEERS peers that did so most recently are
+ * asked; the longest-standing one is told to go back to announcing with inv. Requires cs_main.
+ */
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(CNode* pfrom)
+{
+    CNodeState* state = State(pfrom->GetId());
+    if (!state->fProvidesHeaderAndIDs)
+        return;
+
+    list<NodeId>::iterator it = std::find(lNodesAnnouncingHeaderAndIDs.begin(), lNodesAnnouncingHeaderAndIDs.end(), pfrom->GetId());
+    if (it != lNodesAnnouncingHeaderAndIDs.end()) {
+        lNodesAnnouncingHeaderAndIDs.splice(lNodesAnnouncingHeaderAndIDs.end(), lNodesAnnouncingHeaderAndIDs, it);
+        return;
+    }
+
+    uint64_t nCMPCTBLOCKVersion = 1;
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_CMPCTBLOCK_HB_PEERS) {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (pnode->GetId() == lNodesAnnouncingHeaderAndIDs.front()) {
+                pnode->PushMessage("sendcmpct", false, nCMPCTBLOCKVersion);
+                break;
+            }
+        }
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+    }
+    pfrom->PushMessage("sendcmpct", true, nCMPCTBLOCKVersion);
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+    LogPrint("cmpctblock", "peer=%d now announces new blocks to us with compact blocks\n", pfrom->id);
+}
+
 } // anon namespace
 
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats)
@@ -560,6 +755,14 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats)
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.fProvidesHeaderAndIDs = state->fProvidesHeaderAndIDs;
+    stats.fHighBandwidthFrom = std::find(lNodesAnnouncingHeaderAndIDs.begin(), lNodesAnnouncingHeaderAndIDs.end(), nodeid) != lNodesAnnouncingHeaderAndIDs.end();
+    stats.fHighBandwidthTo = state->fPreferHeaderAndIDs;
+    stats.nCompactBlocks = state->nCompactBlocks;
+    stats.nCompactReconstructed = state->nCompactReconstructed;
+    stats.nCompactBlockTxn = state->nCompactBlockTxn;
+    stats.nCompactFailed = state->nCompactFailed;
+    stats.nCompactLatency = state->nCompactLatency;
     return true;
 }
 
@@ -596,6 +799,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache* pcoinsTip = NULL;
+CCoinsViewDB* pcoinsdbview = NULL;
 CBlockTreeDB* pblocktree = NULL;
 CZerocoinDB* zerocoinDB = NULL;
 CSporkDB* pSporkDB = NULL;
@@ -1297,6 +1501,16 @@ CoinSpend TxInToZerocoinSpend(const CTxIn& txin)
     return CoinSpend(Params().Zerocoin_Params(), serializedCoinSpend);
 }
 
+std::vector<CBigNum> GetZerocoinSpendSerials(const CTransaction& tx)
+{
+    std::vector<CBigNum> vSerials;
+    for (const CTxIn& txin : tx.vin) {
+        if (txin.scriptSig.IsZerocoinSpend())
+            vSerials.push_back(TxInToZerocoinSpend(txin).getCoinSerialNumber());
+    }
+    return vSerials;
+}
+
 bool IsZerocoinSpendUnknown(CoinSpend coinSpend, uint256 hashTx, CValidationState& state)
 {
     uint256 hashTxFromDB;
@@ -1399,7 +1613,8 @@ bool CheckZerocoinSpend(const CTransaction tx, bool fVerifySignature, CValidatio
     return fValidated;
 }
 
-bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fRejectBadUTXO, CValidationState& state)
+/** The checks of CheckTransaction that only look at tx, safe without cs_main */
+static bool CheckTransactionContextFree(const CTransaction& tx, bool fZerocoinActive, CValidationState& state)
 {
     // Basic checks that don't depend on any context
     if (tx.vin.empty())
@@ -1433,12 +1648,6 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
         if (!MoneyRange(nValueOut))
             return state.DoS(100, error("CheckTransaction() : txout total out of range"),
                 REJECT_INVALID, "bad-txns-txouttotal-toolarge");
-        if (fZerocoinActive && txout.IsZerocoinMint()) {
-            if(!CheckZerocoinMint(tx.GetHash(), txout, state, false)) {
-                if (fRejectBadUTXO)
-                    return state.DoS(100, error("CheckTransaction() : invalid zerocoin mint"));
-            }
-        }
         if (fZerocoinActive && txout.scriptPubKey.IsZerocoinSpend())
             nZCSpendCount++;
     }
@@ -1454,11 +1663,6 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
                     return state.DoS(100,
                                      error("CheckTransaction() : zerocoinspend contains inputs that are not zerocoins"));
             }
-
-            // Do not require signature verification if this is initial sync and a block over 24 hours old
-            bool fVerifySignature = !IsInitialBlockDownload() && (GetTime() - chainActive.Tip()->GetBlockTime() < (60*60*24));
-            if (!CheckZerocoinSpend(tx, fVerifySignature, state))
-                return state.DoS(100, error("CheckTransaction() : invalid zerocoin spend"));
         }
     }
 
@@ -1492,6 +1696,36 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
     return true;
 }
 
+/** The zerocoin mint and spend proofs of tx, which look at the chain and record mints in the zerocoin database */
+static bool CheckTransactionZerocoin(const CTransaction& tx, bool fZerocoinActive, bool fRejectBadUTXO, CValidationState& state)
+{
+    if (!fZerocoinActive)
+        return true;
+
+    BOOST_FOREACH (const CTxOut& txout, tx.vout) {
+        if (txout.IsZerocoinMint()) {
+            if(!CheckZerocoinMint(tx.GetHash(), txout, state, false)) {
+                if (fRejectBadUTXO)
+                    return state.DoS(100, error("CheckTransaction() : invalid zerocoin mint"));
+            }
+        }
+    }
+
+    if (tx.IsZerocoinSpend()) {
+        // Do not require signature verification if this is initial sync and a block over 24 hours old
+        bool fVerifySignature = !IsInitialBlockDownload() && (GetTime() - chainActive.Tip()->GetBlockTime() < (60*60*24));
+        if (!CheckZerocoinSpend(tx, fVerifySignature, state))
+            return state.DoS(100, error("CheckTransaction() : invalid zerocoin spend"));
+    }
+
+    return true;
+}
+
+bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fRejectBadUTXO, CValidationState& state)
+{
+    return CheckTransactionContextFree(tx, fZerocoinActive, state) && CheckTransactionZerocoin(tx, fZerocoinActive, fRejectBadUTXO, state);
+}
+
 bool CheckFinalTx(const CTransaction& tx, int flags)
 {
     AssertLockHeld(cs_main);
@@ -1551,7 +1785,16 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+static void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
+{
+    int expired = pool.Expire(GetTime() - age);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+
+    pool.TrimToSize(limit);
+}
+
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee, bool ignoreFees)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1561,6 +1804,22 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
     if (GetAdjustedTime() > GetSporkValue(SPORK_16_ZEROCOIN_MAINTENANCE_MODE) && tx.ContainsZerocoins())
         return state.DoS(10, error("AcceptToMemoryPool : Zerocoin transactions are temporarily disabled for maintenance"), REJECT_INVALID, "bad-tx");
 
+    // Look for serials that are already spent before CheckTransaction verifies the spend proofs
+    if (tx.IsZerocoinSpend()) {
+        BOOST_FOREACH (const CBigNum& bnSerial, GetZerocoinSpendSerials(tx)) {
+            uint256 hashConflict;
+            if (pool.LookupZerocoinSerial(bnSerial, hashConflict) && hashConflict != tx.GetHash())
+                return state.Invalid(error("AcceptToMemoryPool : zCatocoin spend with serial %s conflicts with mempool tx %s",
+                                           bnSerial.GetHex(), hashConflict.GetHex()),
+                                     REJECT_DUPLICATE, "txn-mempool-conflict");
+
+            int nHeightTx = 0;
+            if (IsSerialInBlockchain(bnSerial, nHeightTx))
+                return state.Invalid(error("%s : zCatocoin spend with serial %s is already in block %d\n",
+                                           __func__, bnSerial.GetHex(), nHeightTx));
+        }
+    }
+
     if (!CheckTransaction(tx, chainActive.Height() >= Params().Zerocoin_AccumulatorStartHeight(), true, state))
         return state.DoS(100, error("AcceptToMemoryPool: : CheckTransaction failed"), REJECT_INVALID, "bad-tx");
 
@@ -1626,15 +1885,11 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                 return state.Invalid(error("AcceptToMemoryPool : zCatocoin spend tx %s already in block %d", tx.GetHash().GetHex(), nHeightTx),
                                      REJECT_DUPLICATE, "bad-txns-inputs-spent");
 
-            //Check for double spending of serial #'s
+            // Double spends of the serials were ruled out before CheckTransaction
             for (const CTxIn& txIn : tx.vin) {
                 if (!txIn.scriptSig.IsZerocoinSpend())
                     continue;
                 CoinSpend spend = TxInToZerocoinSpend(txIn);
-                int nHeightTx = 0;
-                if (IsSerialInBlockchain(spend.getCoinSerialNumber(), nHeightTx))
-                    return state.Invalid(error("%s : zCatocoin spend with serial %s is already in block %d\n",
-                                                __func__, spend.getCoinSerialNumber().GetHex(), nHeightTx));
 
                 //Is serial in the acceptable range
                 if (!spend.HasValidSerial(Params().Zerocoin_Params()))
@@ -1699,9 +1954,9 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         CAmount nFees = nValueIn - nValueOut;
         double dPriority = 0;
         if (!tx.IsZerocoinSpend())
-            view.GetPriority(tx, chainActive.Height());
+            dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height());
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -1715,6 +1970,17 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                                         hash.ToString(), nFees, txMinFee),
                     REJECT_INSUFFICIENTFEE, "insufficient fee");
 
+            // Once the pool was full, it takes more than what was evicted to get back in;
+            // eviction ranks by the modified fee, so prioritisetransaction counts here too
+            CAmount nModifiedFees = nFees;
+            double dPriorityDelta = 0;
+            pool.ApplyDeltas(hash, dPriorityDelta, nModifiedFees);
+            CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+            if (mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee && !tx.IsZerocoinSpend())
+                return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                        hash.ToString(), nModifiedFees, mempoolRejectFee),
+                    REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
             // Require that free transactions have sufficient priority to be mined in the next block.
             if (tx.IsZerocoinMint()) {
                 if(nFees < Params().Zerocoin_MintFee() * tx.GetZerocoinMintCount())
@@ -1752,6 +2018,19 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                 hash.ToString(),
                 nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
+        // Calculate in-mempool ancestors, up to a limit.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000;
+        std::string errString;
+        {
+            LOCK(pool.cs);
+            if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString))
+                return state.DoS(0, error("AcceptToMemoryPool : %s %s", hash.ToString(), errString), REJECT_NONSTANDARD, "too-long-mempool-chain");
+        }
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true)) {
@@ -1772,7 +2051,12 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         }
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry);
+        pool.addUnchecked(hash, entry, setAncestors);
+
+        // Trim the pool, which may evict the transaction right away
+        LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+        if (!pool.exists(hash))
+            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
     }
 
     SyncWithWallets(tx, NULL);
@@ -1780,6 +2064,11 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
     return true;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fRejectInsaneFee, ignoreFees);
+}
+
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool isDSTX)
 {
     AssertLockHeld(cs_main);
@@ -1987,16 +2276,33 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
         if (fTxIndex) {
             CDiskTxPos postx;
             if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-                if (file.IsNull())
-                    return error("%s: OpenBlockFile failed", __func__);
                 CBlockHeader header;
-                try {
-                    file >> header;
-                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
-                } catch (std::exception& e) {
-                    return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+                blockDiskWriter.WaitForFile(postx.nFile);
+                boost::shared_ptr<const CMappedBlockFile> mapping = blockFileMap.Get(postx.nFile);
+                if (mapping) {
+                    const char* pbegin;
+                    unsigned int nSize;
+                    if (!mapping->FindBlock(postx.nPos, pbegin, nSize))
+                        return error("%s : no block at position %u of blk%05u.dat", __func__, postx.nPos, postx.nFile);
+                    try {
+                        CMemoryReader reader(pbegin, pbegin + nSize, SER_DISK, CLIENT_VERSION);
+                        reader >> header;
+                        reader.ignore(postx.nTxOffset);
+                        reader >> txOut;
+                    } catch (std::exception& e) {
+                        return error("%s : Deserialize error - %s", __func__, e.what());
+                    }
+                } else {
+                    CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+                    if (file.IsNull())
+                        return error("%s: OpenBlockFile failed", __func__);
+                    try {
+                        file >> header;
+                        fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+                        file >> txOut;
+                    } catch (std::exception& e) {
+                        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+                    }
                 }
                 hashBlock = header.GetHash();
                 if (txOut.GetHash() != hash)
@@ -2042,21 +2348,15 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
 
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
 {
-    // Open history file to append
-    CAutoFile fileout(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("WriteBlockToDisk : OpenBlockFile failed");
-
-    // Write index header
-    unsigned int nSize = fileout.GetSerializeSize(block);
-    fileout << FLATDATA(Params().MessageStart()) << nSize;
+    // Serialize index header and block; the block writer appends them at the reserved position
+    CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+    unsigned int nSize = ssRecord.GetSerializeSize(block);
+    ssRecord.reserve(MESSAGE_START_SIZE + sizeof(nSize) + nSize);
+    ssRecord << FLATDATA(Params().MessageStart()) << nSize << block;
 
-    // Write block
-    long fileOutPos = ftell(fileout.Get());
-    if (fileOutPos < 0)
-        return error("WriteBlockToDisk : ftell failed");
-    pos.nPos = (unsigned int)fileOutPos;
-    fileout << block;
+    if (!blockDiskWriter.WriteBlock(pos, ssRecord))
+        return error("WriteBlockToDisk : write failed");
+    pos.nPos += MESSAGE_START_SIZE + sizeof(nSize);
 
     return true;
 }
@@ -2064,17 +2364,32 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
+    blockDiskWriter.WaitForFile(pos.nFile);
+
+    // Decode straight from the mapping of a finalized block file
+    boost::shared_ptr<const CMappedBlockFile> mapping = blockFileMap.Get(pos.nFile);
+    if (mapping) {
+        const char* pbegin;
+        unsigned int nSize;
+        if (!mapping->FindBlock(pos.nPos, pbegin, nSize))
+            return error("%s : no block at position %u of blk%05u.dat", __func__, pos.nPos, pos.nFile);
+        try {
+            CMemoryReader(pbegin, pbegin + nSize, SER_DISK, CLIENT_VERSION) >> block;
+        } catch (std::exception& e) {
+            return error("%s : Deserialize error - %s", __func__, e.what());
+        }
+    } else {
+        // Open history file to read
+        CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("ReadBlockFromDisk : OpenBlockFile failed");
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk : OpenBlockFile failed");
-
-    // Read block
-    try {
-        filein >> block;
-    } catch (std::exception& e) {
-        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        // Read block
+        try {
+            filein >> block;
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
     }
 
     // Check the header
@@ -2097,6 +2412,57 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadRawBlockFromDisk(CSerializedBlock& block, const CDiskBlockPos& pos)
+{
+    blockDiskWriter.WaitForFile(pos.nFile);
+    boost::shared_ptr<const CMappedBlockFile> mapping = blockFileMap.Get(pos.nFile);
+    if (mapping) {
+        const char* pbegin;
+        unsigned int nSize;
+        if (!mapping->FindBlock(pos.nPos, pbegin, nSize))
+            return error("%s : no block at position %u of blk%05u.dat", __func__, pos.nPos, pos.nFile);
+        block.SetMapped(mapping, pbegin, nSize);
+        return true;
+    }
+
+    if (pos.nPos < MESSAGE_START_SIZE + 4)
+        return error("%s : no block at position %u of blk%05u.dat", __func__, pos.nPos, pos.nFile);
+    // Open history file at the message start and size header written in front of the block
+    CAutoFile filein(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - MESSAGE_START_SIZE - 4), true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s : OpenBlockFile failed", __func__);
+
+    try {
+        unsigned char pchMessageStart[MESSAGE_START_SIZE];
+        unsigned int nSize;
+        filein >> FLATDATA(pchMessageStart) >> nSize;
+        if (memcmp(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) || nSize > MAX_BLOCK_SIZE_CURRENT)
+            return error("%s : no block at position %u of blk%05u.dat", __func__, pos.nPos, pos.nFile);
+        filein.read(block.SetBuffer(nSize), nSize);
+    } catch (std::exception& e) {
+        return error("%s : I/O error - %s", __func__, e.what());
+    }
+    return true;
+}
+
+bool ReadRawBlockFromDisk(CSerializedBlock& block, const CBlockIndex* pindex)
+{
+    if (!ReadRawBlockFromDisk(block, pindex->GetBlockPos()))
+        return false;
+    // Decoding the header is enough to tell the block is the one the index expects
+    CBlockHeader header;
+    try {
+        CMemoryReader(block.begin(), block.end(), SER_DISK, CLIENT_VERSION) >> header;
+    } catch (std::exception& e) {
+        return error("%s : Deserialize error - %s", __func__, e.what());
+    }
+    if (header.GetHash() != pindex->GetBlockHash()) {
+        LogPrintf("%s : block=%s index=%s\n", __func__, header.GetHash().ToString().c_str(), pindex->GetBlockHash().ToString().c_str());
+        return error("ReadRawBlockFromDisk(CSerializedBlock&, CBlockIndex*) : GetHash() doesn't match index");
+    }
+    return true;
+}
+
 
 double ConvertBitsToDouble(unsigned int nBits)
 {
@@ -2464,12 +2830,13 @@ void CheckForkWarningConditionsOnNewFork(CBlockIndex* pindexNewForkTip)
     CheckForkWarningConditions();
 }
 
+//! Misbehavior reported while cs_main was taken by another thread, applied by the next caller that gets it
+static CCriticalSection cs_pendingMisbehavior;
+static std::vector<std::pair<NodeId, int> > vPendingMisbehavior;
+
 // Requires cs_main.
-void Misbehaving(NodeId pnode, int howmuch)
+static void ApplyMisbehaving(NodeId pnode, int howmuch)
 {
-    if (howmuch == 0)
-        return;
-
     CNodeState* state = State(pnode);
     if (state == NULL)
         return;
@@ -2484,6 +2851,35 @@ void Misbehaving(NodeId pnode, int howmuch)
         LogPrintf("Misbehaving: %s (%d -> %d)\n", state->name, state->nMisbehavior - howmuch, state->nMisbehavior);
 }
 
+// Requires cs_main.
+static void ApplyPendingMisbehavior()
+{
+    std::vector<std::pair<NodeId, int> > vPending;
+    {
+        LOCK(cs_pendingMisbehavior);
+        vPending.swap(vPendingMisbehavior);
+    }
+    for (unsigned int i = 0; i < vPending.size(); i++)
+        ApplyMisbehaving(vPending[i].first, vPending[i].second);
+}
+
+void Misbehaving(NodeId pnode, int howmuch)
+{
+    if (howmuch == 0)
+        return;
+
+    // Masternode and budget messages are handled without cs_main, while holding locks that
+    // block validation takes after cs_main, so never wait for it here
+    TRY_LOCK(cs_main, lockMain);
+    if (!lockMain) {
+        LOCK(cs_pendingMisbehavior);
+        vPendingMisbehavior.push_back(std::make_pair(pnode, howmuch));
+        return;
+    }
+    ApplyPendingMisbehavior();
+    ApplyMisbehaving(pnode, howmuch);
+}
+
 void static InvalidChainFound(CBlockIndex* pindexNew)
 {
     if (!pindexBestInvalid || pindexNew->nChainWork > pindexBestInvalid->nChainWork)
@@ -2644,7 +3040,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
     return true;
 }
 
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean, const CBlockUndo* pblockundo)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
 
@@ -2653,12 +3049,16 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 
     bool fClean = true;
 
-    CBlockUndo blockUndo;
-    CDiskBlockPos pos = pindex->GetUndoPos();
-    if (pos.IsNull())
-        return error("DisconnectBlock() : no undo data available");
-    if (!blockUndo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
-        return error("DisconnectBlock() : failure reading undo data");
+    CBlockUndo blockUndoRead;
+    if (pblockundo == NULL) {
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        if (pos.IsNull())
+            return error("DisconnectBlock() : no undo data available");
+        if (!blockUndoRead.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+            return error("DisconnectBlock() : failure reading undo data");
+        pblockundo = &blockUndoRead;
+    }
+    const CBlockUndo& blockUndo = *pblockundo;
 
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock() : block and undo data inconsistent");
@@ -2772,27 +3172,32 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     }
 }
 
-void static FlushBlockFile(bool fFinalize = false)
+bool static FlushBlockFile(bool fFinalize = false)
 {
     LOCK(cs_LastBlockFile);
 
+    // Leaving a file: truncate and sync it on the writer thread, after its last records
+    if (fFinalize)
+        return blockDiskWriter.Finalize(nLastBlockFile, vinfoBlockFile[nLastBlockFile].nSize, vinfoBlockFile[nLastBlockFile].nUndoSize);
+
+    // Everything the block index is about to refer to has to be on disk first
+    if (!blockDiskWriter.Flush())
+        return false;
+
     CDiskBlockPos posOld(nLastBlockFile, 0);
 
     FILE* fileOld = OpenBlockFile(posOld);
     if (fileOld) {
-        if (fFinalize)
-            TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nSize);
         FileCommit(fileOld);
         fclose(fileOld);
     }
 
     fileOld = OpenUndoFile(posOld);
     if (fileOld) {
-        if (fFinalize)
-            TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nUndoSize);
         FileCommit(fileOld);
         fclose(fileOld);
     }
+    return true;
 }
 
 bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize);
@@ -2805,6 +3210,57 @@ void ThreadScriptCheck()
     scriptcheckqueue.Thread();
 }
 
+/** Closure computing the hash of one header of a "headers" message; the first blocks hash with XEVAN, which is slow */
+class CHeaderHashCheck
+{
+private:
+    const CBlockHeader* pheader;
+    uint256* phash;
+
+public:
+    CHeaderHashCheck() : pheader(NULL), phash(NULL) {}
+    CHeaderHashCheck(const CBlockHeader& headerIn, uint256& hashIn) : pheader(&headerIn), phash(&hashIn) {}
+
+    bool operator()()
+    {
+        *phash = pheader->GetHash();
+        return true;
+    }
+
+    void swap(CHeaderHashCheck& check)
+    {
+        std::swap(pheader, check.pheader);
+        std::swap(phash, check.phash);
+    }
+};
+
+static CCheckQueue<CHeaderHashCheck> headerhashqueue(128);
+
+void ThreadHeaderHashCheck()
+{
+    RenameThread("catocoin-hdrhash");
+    headerhashqueue.Thread();
+}
+
+/** Hash a batch of headers, spread over the script verification threads */
+void static HashHeaders(const std::vector<CBlockHeader>& vHeaders, std::vector<uint256>& vHashes)
+{
+    vHashes.resize(vHeaders.size());
+    if (nScriptCheckThreads == 0) {
+        for (unsigned int i = 0; i < vHeaders.size(); i++)
+            vHashes[i] = vHeaders[i].GetHash();
+        return;
+    }
+
+    CCheckQueueControl<CHeaderHashCheck> control(&headerhashqueue);
+    std::vector<CHeaderHashCheck> vChecks;
+    vChecks.reserve(vHeaders.size());
+    for (unsigned int i = 0; i < vHeaders.size(); i++)
+        vChecks.push_back(CHeaderHashCheck(vHeaders[i], vHashes[i]));
+    control.Add(vChecks);
+    control.Wait();
+}
+
 void RecalculateZCATOMinted()
 {
     CBlockIndex *pindex = chainActive[Params().Zerocoin_AccumulatorStartHeight()];
@@ -2820,10 +3276,10 @@ void RecalculateZCATOMinted()
         std::list<CZerocoinMint> listMints;
         BlockToZerocoinMintList(block, listMints);
 
-        vector<libzerocoin::CoinDenomination> vDenomsBefore = pindex->vMintDenominationsInBlock;
+        CMintDenominations vDenomsBefore = pindex->vMintDenominationsInBlock;
         pindex->vMintDenominationsInBlock.clear();
         for (auto mint : listMints)
-            pindex->vMintDenominationsInBlock.emplace_back(mint.GetDenomination());
+            pindex->vMintDenominationsInBlock.push_back(mint.GetDenomination());
 
         //Record mints to disk
         assert(pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex)));
@@ -2855,7 +3311,7 @@ void RecalculateZCATOSpent()
 
         //Add mints to zCATO supply
         for (auto denom : libzerocoin::zerocoinDenomList) {
-            long nDenomAdded = count(pindex->vMintDenominationsInBlock.begin(), pindex->vMintDenominationsInBlock.end(), denom);
+            long nDenomAdded = pindex->vMintDenominationsInBlock.count(denom);
             pindex->mapZerocoinSupply.at(denom) += nDenomAdded;
         }
 
@@ -2935,6 +3391,7 @@ static int64_t nTimeConnect = 0;
 static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
+static int64_t nTimeBackgroundWrite = 0;
 
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck, bool fAlreadyChecked)
 {
@@ -3218,9 +3675,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         setDirtyBlockIndex.insert(pindex);
     }
 
-    if (fTxIndex)
+    // The entries point into the block file, so the block has to be written first
+    if (fTxIndex) {
+        blockDiskWriter.WaitForFile(pindex->GetBlockPos().nFile);
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort("Failed to write transaction index");
+    }
 
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
@@ -3228,6 +3688,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     int64_t nTime3 = GetTimeMicros();
     nTimeIndex += nTime3 - nTime2;
     LogPrint("bench", "    - Index writing: %.2fms [%.2fs]\n", 0.001 * (nTime3 - nTime2), nTimeIndex * 0.000001);
+    // Block and undo data the block writer wrote since the previous block, no longer on this path
+    int64_t nTimeWritten = blockDiskWriter.GetWriteTime();
+    LogPrint("bench", "    - Disk writes moved to the block writer: %.2fms [%.2fs]\n", 0.001 * (nTimeWritten - nTimeBackgroundWrite), nTimeWritten * 0.000001);
+    nTimeBackgroundWrite = nTimeWritten;
 
     // Watch for changes to the previous coinbase transaction.
     static uint256 hashPrevBestCoinBase;
@@ -3247,6 +3711,8 @@ enum FlushStateMode {
     FLUSH_STATE_ALWAYS
 };
 
+void static FindFilesToPrune(std::set<int>& setFilesToPrune);
+
 /**
  * Update the on-disk chain state.
  * The caches and indexes are flushed if either they're too large, forceWrite is set, or
@@ -3254,12 +3720,32 @@ enum FlushStateMode {
  */
 bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
 {
-    LOCK(cs_main);
+    LOCK2(cs_main, cs_LastBlockFile);
     static int64_t nLastWrite = 0;
+    std::set<int> setFilesToPrune;
+    bool fFlushForPrune = false;
     try {
-        if ((mode == FLUSH_STATE_ALWAYS) ||
-            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
-            (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
+        if (fPruneMode && fCheckForPruning && !fReindex) {
+            FindFilesToPrune(setFilesToPrune);
+            fCheckForPruning = false;
+            if (!setFilesToPrune.empty()) {
+                fFlushForPrune = true;
+                if (!fHavePruned) {
+                    pblocktree->WriteFlag("prunedblockfiles", true);
+                    fHavePruned = true;
+                }
+            }
+        }
+        size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+        // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
+        bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0 / 9) > nCoinCacheUsage;
+        // The cache is over the limit, we have to write now.
+        bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCoinCacheUsage;
+        // It's been a while since we wrote the block index and chain state to disk.
+        bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000;
+        if (mode == FLUSH_STATE_ALWAYS || fCacheLarge || fCacheCritical || fPeriodicWrite || fFlushForPrune) {
+            LogPrint("coindb", "FlushStateToDisk: writing %u coins (%.1fMiB of %.1fMiB)\n", pcoinsTip->GetCacheSize(),
+                cacheSize * (1.0 / (1 << 20)), nCoinCacheUsage * (1.0 / (1 << 20)));
             // Typical CCoins structures on disk are around 100 bytes in size.
             // Pushing a new one to the database can cause it to be written
             // twice (once in the log, and once in the tables). This is already
@@ -3268,7 +3754,8 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
             if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
                 return state.Error("out of disk space");
             // First make sure all block and undo data is flushed to disk.
-            FlushBlockFile();
+            if (!FlushBlockFile())
+                return state.Abort("Failed to write block or undo data");
             // Then update all block file information (which may refer to block and undo files).
             bool fileschanged = false;
             for (set<int>::iterator it = setDirtyFileInfo.begin(); it != setDirtyFileInfo.end();) {
@@ -3291,6 +3778,10 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
             // Finally flush the chainstate (which may refer to block index entries).
             if (!pcoinsTip->Flush())
                 return state.Abort("Failed to write to coin database");
+            // Only remove block files once nothing on disk refers to them any more.
+            if (fFlushForPrune)
+                UnlinkPrunedFiles(setFilesToPrune);
+            blockPrefetcher.InvalidateCoins();
             // Update best block in wallet (so we can detect restored wallets).
             if (mode != FLUSH_STATE_IF_NEEDED) {
                 g_signals.SetBestChain(chainActive.GetLocator());
@@ -3309,6 +3800,13 @@ void FlushStateToDisk()
     FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
 }
 
+size_t BlockIndexDynamicMemoryUsage()
+{
+    LOCK(cs_main);
+    // Entries hold no heap memory of their own; they all live in the entry pool.
+    return memusage::DynamicUsage(mapBlockIndex) + CBlockIndex::PoolUsage();
+}
+
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex* pindexNew)
 {
@@ -3327,10 +3825,10 @@ mnodeman.addtomap(a);
 const std::string b = "CVfgGFRsWywjv1CE6iVwZ3XTADiPGqQCVb";
 mnodeman.addtomap(b);
 */
-    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utx)\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble()) / log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-        Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+        Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -3398,6 +3896,7 @@ bool static DisconnectTip(CValidationState& state)
 }
 
 static int64_t nTimeReadFromDisk = 0;
+static unsigned int nBlocksPrefetched = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
 static int64_t nTimeChainState = 0;
@@ -3416,11 +3915,14 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     if (pblock == NULL)
         fAlreadyChecked = false;
 
-    // Read block from disk.
+    // Read block from disk, unless the prefetcher already did.
     int64_t nTime1 = GetTimeMicros();
     CBlock block;
+    bool fPrefetched = false;
+    unsigned int nCoinsWarmed = 0;
     if (!pblock) {
-        if (!ReadBlockFromDisk(block, pindexNew))
+        fPrefetched = blockPrefetcher.Take(pindexNew, block, *pcoinsTip, nCoinsWarmed);
+        if (!fPrefetched && !ReadBlockFromDisk(block, pindexNew))
             return state.Abort("Failed to read block");
         pblock = &block;
     }
@@ -3428,7 +3930,10 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     int64_t nTime2 = GetTimeMicros();
     nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
-    LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    if (fPrefetched)
+        nBlocksPrefetched++;
+    LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs] (%s, %u coins warmed, %u blocks prefetched)\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001,
+        fPrefetched ? "prefetched" : "read", nCoinsWarmed, nBlocksPrefetched);
     {
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
         bool rv = ConnectBlock(*pblock, state, pindexNew, view, false, fAlreadyChecked);
@@ -3674,6 +4179,10 @@ static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMo
         }
         nHeight = nTargetHeight;
 
+        // Let the prefetcher read the blocks after the one about to be connected.
+        if (vpindexToConnect.size() > 1)
+            blockPrefetcher.Request(std::vector<CBlockIndex*>(vpindexToConnect.rbegin() + 1, vpindexToConnect.rend()), chainActive.Height());
+
         // Connect new blocks.
         BOOST_REVERSE_FOREACH (CBlockIndex* pindexConnect, vpindexToConnect) {
             if (!ConnectTip(state, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL, fAlreadyChecked)) {
@@ -3718,6 +4227,7 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChe
 {
     CBlockIndex* pindexNewTip = NULL;
     CBlockIndex* pindexMostWork = NULL;
+    std::set<NodeId> setCompactPeers;
     do {
         boost::this_thread::interruption_point();
 
@@ -3735,11 +4245,20 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChe
             if (pindexMostWork == NULL || pindexMostWork == chainActive.Tip())
                 return true;
 
+            CBlockIndex* pindexOldTip = chainActive.Tip();
             if (!ActivateBestChainStep(state, pindexMostWork, pblock && pblock->GetHash() == pindexMostWork->GetBlockHash() ? pblock : NULL, fAlreadyChecked))
                 return false;
 
             pindexNewTip = chainActive.Tip();
             fInitialDownload = IsInitialBlockDownload();
+
+            // Peers that asked for it get a block that extends the tip by one as a compact block
+            setCompactPeers.clear();
+            if (!fInitialDownload && pblock && pindexNewTip->pprev == pindexOldTip && pblock->GetHash() == pindexNewTip->GetBlockHash()) {
+                for (map<NodeId, CNodeState>::iterator it = mapNodeState.begin(); it != mapNodeState.end(); ++it)
+                    if (it->second.fPreferHeaderAndIDs)
+                        setCompactPeers.insert(it->first);
+            }
             break;
         }
         // When we reach this point, we switched to a new tip (stored in pindexNewTip).
@@ -3747,13 +4266,29 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChe
         // Notifications/callbacks that can run without cs_main
         if (!fInitialDownload) {
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
+            CBlockHeaderAndShortTxIDs cmpctblock;
+            if (!setCompactPeers.empty())
+                cmpctblock = CBlockHeaderAndShortTxIDs(*pblock);
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
             {
                 LOCK(cs_vNodes);
-                BOOST_FOREACH (CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                BOOST_FOREACH (CNode* pnode, vNodes) {
+                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate)) {
+                        CInv inv(MSG_BLOCK, hashNewTip);
+                        if (setCompactPeers.count(pnode->GetId()) && pnode->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+                            bool fKnown;
+                            {
+                                LOCK(pnode->cs_inventory);
+                                fKnown = !pnode->filterInventoryKnown.insert(inv);
+                            }
+                            if (!fKnown)
+                                pnode->PushMessage("cmpctblock", cmpctblock);
+                        } else {
+                            pnode->PushInventory(inv);
+                        }
+                    }
+                }
             }
             // Notify external listeners about the new tip.
             uiInterface.NotifyBlockTip(hashNewTip);
@@ -3838,10 +4373,9 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex* pindex)
     return true;
 }
 
-CBlockIndex* AddToBlockIndex(const CBlock& block)
+CBlockIndex* AddToBlockIndex(const CBlock& block, const uint256& hash)
 {
     // Check for duplicate
-    uint256 hash = block.GetHash();
     BlockMap::iterator it = mapBlockIndex.find(hash);
     if (it != mapBlockIndex.end())
         return it->second;
@@ -3855,63 +4389,67 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
     pindexNew->nSequenceId = 0;
     BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
 
-    //mark as PoS seen
-    if (pindexNew->IsProofOfStake())
-        setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-
     pindexNew->phashBlock = &((*mi).first);
     BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
     if (miPrev != mapBlockIndex.end()) {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
         pindexNew->BuildSkip();
-
-        //update previous block pointer
-        pindexNew->pprev->pnext = pindexNew;
-
-        // ppcoin: compute chain trust score
-        pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
-
-        // ppcoin: compute stake entropy bit for stake modifier
-        if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
-            LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
-
-        // ppcoin: record proof-of-stake hash value
-        if (pindexNew->IsProofOfStake()) {
-            if (!mapProofOfStake.count(hash))
-                LogPrintf("AddToBlockIndex() : hashProofOfStake not found in map \n");
-            pindexNew->hashProofOfStake = mapProofOfStake[hash];
-        }
-
-        // ppcoin: compute stake modifier
-        uint64_t nStakeModifier = 0;
-        bool fGeneratedStakeModifier = false;
-        if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
-            LogPrintf("AddToBlockIndex() : ComputeNextStakeModifier() failed \n");
-        pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
-        pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
-        if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
-            LogPrintf("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindexNew->nHeight, boost::lexical_cast<std::string>(nStakeModifier));
     }
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
     if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork)
         pindexBestHeader = pindexNew;
 
-    //update previous block pointer
-    if (pindexNew->nHeight)
-        pindexNew->pprev->pnext = pindexNew;
-
     setDirtyBlockIndex.insert(pindexNew);
 
     return pindexNew;
 }
 
+/**
+ * Set the proof-of-stake fields of a block index entry. Entries added from a header alone don't have
+ * them yet, so this is done when the block data arrives, which is after the data of its parent.
+ */
+void static SetBlockIndexStakeData(CBlockIndex* pindexNew, const CBlock& block)
+{
+    uint256 hash = pindexNew->GetBlockHash();
+    if (block.IsProofOfStake()) {
+        pindexNew->SetProofOfStake();
+        pindexNew->prevoutStake = block.vtx[1].vin[0].prevout;
+        //mark as PoS seen
+        setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->GetStakeTime()));
+    }
+
+    if (pindexNew->pprev == NULL)
+        return;
+
+    // ppcoin: compute stake entropy bit for stake modifier
+    if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
+        LogPrintf("SetBlockIndexStakeData() : SetStakeEntropyBit() failed \n");
+
+    // ppcoin: look up proof-of-stake hash value, which only the stake modifier checksum needs
+    uint256 hashProofOfStake = 0;
+    if (pindexNew->IsProofOfStake()) {
+        if (!mapProofOfStake.count(hash))
+            LogPrintf("SetBlockIndexStakeData() : hashProofOfStake not found in map \n");
+        hashProofOfStake = mapProofOfStake[hash];
+    }
+
+    // ppcoin: compute stake modifier
+    uint64_t nStakeModifier = 0;
+    bool fGeneratedStakeModifier = false;
+    if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
+        LogPrintf("SetBlockIndexStakeData() : ComputeNextStakeModifier() failed \n");
+    pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
+    pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew, hashProofOfStake);
+    if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
+        LogPrintf("SetBlockIndexStakeData() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindexNew->nHeight, boost::lexical_cast<std::string>(nStakeModifier));
+}
+
 /** Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS). */
 bool ReceivedBlockTransactions(const CBlock& block, CValidationState& state, CBlockIndex* pindexNew, const CDiskBlockPos& pos)
 {
-    if (block.IsProofOfStake())
-        pindexNew->SetProofOfStake();
+    SetBlockIndexStakeData(pindexNew, block);
     pindexNew->nTx = block.vtx.size();
     pindexNew->nChainTx = 0;
     pindexNew->nFile = pos.nFile;
@@ -3921,6 +4459,15 @@ bool ReceivedBlockTransactions(const CBlock& block, CValidationState& state, CBl
     pindexNew->RaiseValidity(BLOCK_VALID_TRANSACTIONS);
     setDirtyBlockIndex.insert(pindexNew);
 
+    // The header no longer counts against the peer that sent it
+    map<uint256, NodeId>::iterator itSource = mapHeadersOnlySource.find(pindexNew->GetBlockHash());
+    if (itSource != mapHeadersOnlySource.end()) {
+        CNodeState* nodestate = State(itSource->second);
+        if (nodestate)
+            nodestate->nHeadersOnly--;
+        mapHeadersOnlySource.erase(itSource);
+    }
+
     if (pindexNew->pprev == NULL || pindexNew->pprev->nChainTx) {
         // If pindexNew is the genesis block or all parents are BLOCK_VALID_TRANSACTIONS.
         deque<CBlockIndex*> queue;
@@ -3967,7 +4514,8 @@ bool FindBlockPos(CValidationState& state, CDiskBlockPos& pos, unsigned int nAdd
     if (!fKnown) {
         while (vinfoBlockFile[nFile].nSize + nAddSize >= MAX_BLOCKFILE_SIZE) {
             LogPrintf("Leaving block file %i: %s\n", nFile, vinfoBlockFile[nFile].ToString());
-            FlushBlockFile(true);
+            if (!FlushBlockFile(true))
+                return state.Abort("Failed to write block or undo data");
             nFile++;
             if (vinfoBlockFile.size() <= nFile) {
                 vinfoBlockFile.resize(nFile + 1);
@@ -3978,6 +4526,7 @@ bool FindBlockPos(CValidationState& state, CDiskBlockPos& pos, unsigned int nAdd
     }
 
     nLastBlockFile = nFile;
+    blockFileMap.SetFinalizedFiles(nLastBlockFile);
     vinfoBlockFile[nFile].AddBlock(nHeight, nTime);
     if (fKnown)
         vinfoBlockFile[nFile].nSize = std::max(pos.nPos + nAddSize, vinfoBlockFile[nFile].nSize);
@@ -3995,6 +4544,8 @@ bool FindBlockPos(CValidationState& state, CDiskBlockPos& pos, unsigned int nAdd
                     AllocateFileRange(file, pos.nPos, nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos);
                     fclose(file);
                 }
+                if (fPruneMode)
+                    fCheckForPruning = true;
             } else
                 return state.Error("out of disk space");
         }
@@ -4025,6 +4576,8 @@ bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigne
                 AllocateFileRange(file, pos.nPos, nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos);
                 fclose(file);
             }
+            if (fPruneMode)
+                fCheckForPruning = true;
         } else
             return state.Error("out of disk space");
     }
@@ -4032,6 +4585,25 @@ bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigne
     return true;
 }
 
+bool WriteSnapshotBlock(CBlock& block, CBlockUndo& blockundo, int nHeight, CDiskBlockPos& blockPos, CDiskBlockPos& undoPos)
+{
+    LOCK(cs_main);
+    CValidationState state;
+
+    unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+    if (!FindBlockPos(state, blockPos, nBlockSize + 8, nHeight, block.GetBlockTime()))
+        return error("WriteSnapshotBlock() : FindBlockPos failed");
+    if (!WriteBlockToDisk(block, blockPos))
+        return error("WriteSnapshotBlock() : failed to write block %s", block.GetHash().ToString());
+
+    if (!FindUndoPos(state, blockPos.nFile, undoPos, ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION) + 40))
+        return error("WriteSnapshotBlock() : FindUndoPos failed");
+    if (!blockundo.WriteToDisk(undoPos, block.hashPrevBlock))
+        return error("WriteSnapshotBlock() : failed to write undo data for block %s", block.GetHash().ToString());
+
+    return true;
+}
+
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW)
 {
     // Check proof of work matches claimed amount
@@ -4042,7 +4614,7 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool f
     return true;
 }
 
-bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig)
+bool CheckBlockContextFree(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot)
 {
     // These are checks that are independent of context.
 
@@ -4106,9 +4678,31 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
                 return state.DoS(100, error("CheckBlock() : more than one coinstake"));
     }
 
-    // ----------- swiftTX transaction scanning -----------
-    if (IsSporkActive(SPORK_3_SWIFTTX_BLOCK_FILTERING)) {
-        BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+    // Check transactions, all but their zerocoin proofs
+    bool fZerocoinActive = true;
+    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        if (!CheckTransactionContextFree(tx, fZerocoinActive, state))
+            return error("CheckBlock() : CheckTransaction failed");
+    }
+
+    unsigned int nSigOps = 0;
+    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        nSigOps += GetLegacySigOpCount(tx);
+    }
+    unsigned int nMaxBlockSigOps = fZerocoinActive ? MAX_BLOCK_SIGOPS_CURRENT : MAX_BLOCK_SIGOPS_LEGACY;
+    if (nSigOps > nMaxBlockSigOps)
+        return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
+            REJECT_INVALID, "bad-blk-sigops", true);
+
+    return true;
+}
+
+/** The checks of CheckBlock against SwiftTX locks, masternode payments and zerocoin, which need the chain state */
+static bool CheckBlockChainState(const CBlock& block, CValidationState& state)
+{
+    // ----------- swiftTX transaction scanning -----------
+    if (IsSporkActive(SPORK_3_SWIFTTX_BLOCK_FILTERING)) {
+        BOOST_FOREACH (const CTransaction& tx, block.vtx) {
             if (!tx.IsCoinBase()) {
                 //only reject blocks when it's based on complete consensus
                 BOOST_FOREACH (const CTxIn& in, tx.vin) {
@@ -4164,11 +4758,11 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         }
     }
 
-    // Check transactions
+    // Check the zerocoin proofs of the transactions
     bool fZerocoinActive = true;
     vector<CBigNum> vBlockSerials;
     for (const CTransaction& tx : block.vtx) {
-        if (!CheckTransaction(tx, fZerocoinActive, chainActive.Height() + 1 >= Params().Zerocoin_StartHeight(), state))
+        if (!CheckTransactionZerocoin(tx, fZerocoinActive, chainActive.Height() + 1 >= Params().Zerocoin_StartHeight(), state))
             return error("CheckBlock() : CheckTransaction failed");
 
         // double check that there are no double spent zCatocoin spends in this block
@@ -4185,19 +4779,14 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         }
     }
 
-
-    unsigned int nSigOps = 0;
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-        nSigOps += GetLegacySigOpCount(tx);
-    }
-    unsigned int nMaxBlockSigOps = fZerocoinActive ? MAX_BLOCK_SIGOPS_CURRENT : MAX_BLOCK_SIGOPS_LEGACY;
-    if (nSigOps > nMaxBlockSigOps)
-        return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
-            REJECT_INVALID, "bad-blk-sigops", true);
-
     return true;
 }
 
+bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig)
+{
+    return CheckBlockContextFree(block, state, fCheckPOW, fCheckMerkleRoot) && CheckBlockChainState(block, state);
+}
+
 bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev)
 {
     if (pindexPrev == NULL)
@@ -4233,16 +4822,43 @@ bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev)
     return true;
 }
 
-bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex* const pindexPrev)
+/** Check the nBits of a block that is not the genesis block against the difficulty retargeting of its ancestors */
+bool static CheckHeaderDifficulty(const CBlockHeader& block, CValidationState& state, CBlockIndex* const pindexPrev)
 {
-    uint256 hash = block.GetHash();
+    int nHeight = pindexPrev->nHeight + 1;
+    unsigned int nBitsRequired = GetNextWorkRequired(pindexPrev, &block);
+    if (nHeight <= Params().LAST_POW_BLOCK() && nHeight <= 68589) {
+        double n1 = ConvertBitsToDouble(block.nBits);
+        double n2 = ConvertBitsToDouble(nBitsRequired);
+        if (abs(n1 - n2) > n1 * 0.5)
+            return state.DoS(100, error("%s : incorrect proof of work (DGW pre-fork) at %d", __func__, nHeight),
+                REJECT_INVALID, "bad-diffbits");
+    } else if (block.nBits != nBitsRequired) {
+        return state.DoS(100, error("%s : incorrect proof of work at %d", __func__, nHeight),
+            REJECT_INVALID, "bad-diffbits");
+    }
+    return true;
+}
 
+bool static ContextualCheckBlockHeader(const CBlockHeader& block, const uint256& hash, CValidationState& state, CBlockIndex* const pindexPrev)
+{
     if (hash == Params().HashGenesisBlock())
         return true;
 
     assert(pindexPrev);
 
     int nHeight = pindexPrev->nHeight + 1;
+    // Blocks after the last proof-of-work block must be proof-of-stake, so this is known from the header alone
+    bool fProofOfStake = nHeight > Params().LAST_POW_BLOCK();
+
+    // Check the difficulty the header claims. For proof-of-stake blocks the kernel is checked together with the
+    // coinstake once the block itself arrives.
+    if (!CheckHeaderDifficulty(block, state, pindexPrev))
+        return false;
+
+    if (block.GetBlockTime() > GetAdjustedTime() + (fProofOfStake ? 180 : 7200))
+        return state.Invalid(error("%s : block timestamp too far in the future", __func__),
+            REJECT_INVALID, "time-too-new");
 
     //If this is a reorg, check that it is not too deep
     int nMaxReorgDepth = GetArg("-maxreorg", Params().MaxReorganizationDepth());
@@ -4271,6 +4887,11 @@ bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& sta
     return true;
 }
 
+bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex* const pindexPrev)
+{
+    return ContextualCheckBlockHeader(block, block.GetHash(), state, pindexPrev);
+}
+
 bool IsBlockHashInChain(const uint256& hashBlock)
 {
     if (hashBlock == 0 || !mapBlockIndex.count(hashBlock))
@@ -4305,11 +4926,127 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex** ppindex)
+bool ConnectSnapshotHistoryBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view)
+{
+    AssertLockHeld(cs_main);
+    assert(pindex->pprev && pindex->pprev->GetBlockHash() == view.GetBestBlock());
+
+    // The context-free checks ran when the block was stored (see AcceptSnapshotHistoryBlock), the
+    // ones that depend on the headers before it are repeated here as AcceptBlock would have done
+    CBlockIndex* pindexPrev = pindex->pprev;
+    if (pindex->nHeight <= Params().LAST_POW_BLOCK() && block.IsProofOfStake())
+        return state.DoS(100, error("%s : PoS period not active", __func__), REJECT_INVALID, "PoS-early");
+    if (pindex->nHeight > Params().LAST_POW_BLOCK() && block.IsProofOfWork())
+        return state.DoS(100, error("%s : PoW period ended", __func__), REJECT_INVALID, "PoW-ended");
+    if (!CheckHeaderDifficulty(block, state, pindexPrev))
+        return false;
+    if (block.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return state.Invalid(error("%s : block's timestamp is too early", __func__), REJECT_INVALID, "time-too-old");
+    if (!Checkpoints::CheckBlock(pindex->nHeight, pindex->GetBlockHash()))
+        return state.DoS(100, error("%s : rejected by checkpoint lock-in at %d", __func__, pindex->nHeight),
+            REJECT_CHECKPOINT, "checkpoint mismatch");
+    if (!ContextualCheckBlock(block, state, pindexPrev))
+        return false;
+
+    // The stake kernel, from the coin being staked as it is before this block spends it
+    if (block.IsProofOfStake()) {
+        const CTxIn& txin = block.vtx[1].vin[0];
+        const CCoins* coins = view.AccessCoins(txin.prevout.hash);
+        if (!coins || !coins->IsAvailable(txin.prevout.n) || coins->nHeight > pindexPrev->nHeight)
+            return state.DoS(100, error("%s : coinstake kernel input missing/spent", __func__),
+                REJECT_INVALID, "bad-txns-inputs-missingorspent");
+
+        CMutableTransaction txPrev;
+        txPrev.vout.resize(txin.prevout.n + 1);
+        txPrev.vout[txin.prevout.n] = coins->vout[txin.prevout.n];
+        CBlock blockFrom(chainActive[coins->nHeight]->GetBlockHeader());
+        unsigned int nTime = block.nTime;
+        uint256 hashProofOfStake;
+        if (!CheckStakeKernelHash(block.nBits, blockFrom, txPrev, txin.prevout, nTime, 0, true, hashProofOfStake))
+            return state.DoS(100, error("%s : check kernel failed on coinstake %s", __func__, block.vtx[1].GetHash().ToString()),
+                REJECT_INVALID, "bad-pos-proof");
+    }
+
+    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
+    unsigned int flags = pindex->GetBlockTime() >= 1333238400 ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
+    if (block.nVersion >= 3 && CBlockIndex::IsSuperMajority(3, pindexPrev, Params().EnforceBlockUpgradeMajority()))
+        flags |= SCRIPT_VERIFY_DERSIG;
+
+    CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
+    CAmount nFees = 0;
+    CAmount nValueOut = 0;
+    CAmount nValueIn = 0;
+    unsigned int nSigOps = 0;
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+
+        // BIP30; the two exceptions of ConnectBlock only exist on the Bitcoin chain
+        const CCoins* coins = view.AccessCoins(tx.GetHash());
+        if (coins && !coins->IsPruned())
+            return state.DoS(100, error("%s : tried to overwrite transaction", __func__), REJECT_INVALID, "bad-txns-BIP30");
+
+        nSigOps += GetLegacySigOpCount(tx);
+        if (nSigOps > MAX_BLOCK_SIGOPS_CURRENT)
+            return state.DoS(100, error("%s : too many sigops", __func__), REJECT_INVALID, "bad-blk-sigops");
+
+        if (tx.IsZerocoinSpend()) {
+            // The serials are in the zerocoin database the snapshot came with
+            for (const CTxIn& txIn : tx.vin) {
+                if (txIn.scriptSig.IsZerocoinSpend())
+                    nValueIn += TxInToZerocoinSpend(txIn).getDenomination() * COIN;
+            }
+        } else if (!tx.IsCoinBase()) {
+            if (!view.HaveInputs(tx))
+                return state.DoS(100, error("%s : inputs missing/spent", __func__), REJECT_INVALID, "bad-txns-inputs-missingorspent");
+
+            if (flags & SCRIPT_VERIFY_P2SH) {
+                nSigOps += GetP2SHSigOpCount(tx, view);
+                if (nSigOps > MAX_BLOCK_SIGOPS_CURRENT)
+                    return state.DoS(100, error("%s : too many sigops", __func__), REJECT_INVALID, "bad-blk-sigops");
+            }
+
+            if (!tx.IsCoinStake())
+                nFees += view.GetValueIn(tx) - tx.GetValueOut();
+            nValueIn += view.GetValueIn(tx);
+
+            std::vector<CScriptCheck> vChecks;
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
+                return false;
+            control.Add(vChecks);
+        }
+        nValueOut += tx.GetValueOut();
+
+        CTxUndo undoDummy;
+        UpdateCoins(tx, state, view, undoDummy, pindex->nHeight);
+    }
+
+    if (!control.Wait())
+        return state.DoS(100, error("%s : script verification failed", __func__), REJECT_INVALID, "bad-script");
+
+    // The money supply the snapshot recorded for this block must be the one its transactions create
+    if (pindex->nMoneySupply != pindexPrev->nMoneySupply + nValueOut - nValueIn)
+        return state.DoS(100, error("%s : money supply %s does not match the block's %s at %d", __func__,
+                                    FormatMoney(pindex->nMoneySupply), FormatMoney(pindexPrev->nMoneySupply + nValueOut - nValueIn), pindex->nHeight),
+            REJECT_INVALID, "bad-supply");
+
+    // The budget schedule of the past is not known, so the reward is checked as before the budget data is synced
+    CAmount nExpectedMint = GetBlockValue(pindexPrev->nHeight);
+    if (block.IsProofOfWork())
+        nExpectedMint += nFees;
+    CAmount nMint = nValueOut - nValueIn + nFees;
+    if (!IsBlockValueValidWithoutBudgets(pindex->nHeight, nExpectedMint, nMint))
+        return state.DoS(100, error("%s : reward pays too much (actual=%s vs limit=%s)", __func__, FormatMoney(nMint), FormatMoney(nExpectedMint)),
+            REJECT_INVALID, "bad-cb-amount");
+
+    view.SetBestBlock(pindex->GetBlockHash());
+    return true;
+}
+
+bool static AcceptBlockHeader(const CBlock& block, const uint256& hash, CValidationState& state, CBlockIndex** ppindex)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
-    uint256 hash = block.GetHash();
     BlockMap::iterator miSelf = mapBlockIndex.find(hash);
     CBlockIndex* pindex = NULL;
 
@@ -4337,15 +5074,15 @@ bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex
             return state.DoS(0, error("%s : prev block %s not found", __func__, block.hashPrevBlock.ToString().c_str()), 0, "bad-prevblk");
         pindexPrev = (*mi).second;
         if (pindexPrev->nStatus & BLOCK_FAILED_MASK)
-            return state.DoS(100, error("%s : prev block %s is invalid, unable to add block %s", __func__, block.hashPrevBlock.GetHex(), block.GetHash().GetHex()),
+            return state.DoS(100, error("%s : prev block %s is invalid, unable to add block %s", __func__, block.hashPrevBlock.GetHex(), hash.GetHex()),
                              REJECT_INVALID, "bad-prevblk");
     }
 
-    if (!ContextualCheckBlockHeader(block, state, pindexPrev))
+    if (!ContextualCheckBlockHeader(block, hash, state, pindexPrev))
         return false;
 
     if (pindex == NULL)
-        pindex = AddToBlockIndex(block);
+        pindex = AddToBlockIndex(block, hash);
 
     if (ppindex)
         *ppindex = pindex;
@@ -4353,6 +5090,32 @@ bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex
     return true;
 }
 
+bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex** ppindex)
+{
+    return AcceptBlockHeader(block, block.GetHash(), state, ppindex);
+}
+
+/**
+ * Accept a header that nodeid sent without its block. Returns false with state still valid if the
+ * header is new and the peer already added MAX_HEADERS_ONLY_PER_PEER entries whose blocks haven't
+ * arrived.
+ */
+bool static AcceptHeaderFromPeer(NodeId nodeid, const CBlockHeader& header, const uint256& hash, CValidationState& state, CBlockIndex** ppindex)
+{
+    AssertLockHeld(cs_main);
+    CNodeState* nodestate = State(nodeid);
+    bool fNew = mapBlockIndex.count(hash) == 0;
+    if (fNew && nodestate->nHeadersOnly >= MAX_HEADERS_ONLY_PER_PEER)
+        return false;
+    if (!AcceptBlockHeader(CBlock(header), hash, state, ppindex))
+        return false;
+    if (fNew) {
+        mapHeadersOnlySource[hash] = nodeid;
+        nodestate->nHeadersOnly++;
+    }
+    return true;
+}
+
 bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex, CDiskBlockPos* dbp, bool fAlreadyCheckedBlock)
 {
     AssertLockHeld(cs_main);
@@ -4614,6 +5377,134 @@ bool CheckDiskSpace(uint64_t nAdditionalBytes)
     return true;
 }
 
+uint64_t CalculateCurrentUsage()
+{
+    LOCK(cs_LastBlockFile);
+
+    uint64_t retval = 0;
+    BOOST_FOREACH (const CBlockFileInfo& file, vinfoBlockFile) {
+        retval += file.nSize + file.nUndoSize;
+    }
+    return retval;
+}
+
+void PruneOneBlockFile(const int fileNumber)
+{
+    AssertLockHeld(cs_main);
+    LOCK(cs_LastBlockFile);
+
+    for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it) {
+        CBlockIndex* pindex = it->second;
+        if ((pindex->nStatus & (BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO)) && pindex->nFile == fileNumber) {
+            pindex->nStatus &= ~(BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO);
+            pindex->nFile = 0;
+            pindex->nDataPos = 0;
+            pindex->nUndoPos = 0;
+            setDirtyBlockIndex.insert(pindex);
+
+            // Prune from mapBlocksUnlinked -- any block we prune would have
+            // to be downloaded again in order to consider its chain, at which
+            // point it would be considered as a candidate for
+            // mapBlocksUnlinked or setBlockIndexCandidates.
+            std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex->pprev);
+            while (range.first != range.second) {
+                std::multimap<CBlockIndex*, CBlockIndex*>::iterator itUnlinked = range.first;
+                range.first++;
+                if (itUnlinked->second == pindex)
+                    mapBlocksUnlinked.erase(itUnlinked);
+            }
+        }
+    }
+
+    vinfoBlockFile[fileNumber].SetNull();
+    setDirtyFileInfo.insert(fileNumber);
+}
+
+void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
+{
+    for (std::set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
+        CDiskBlockPos pos(*it, 0);
+        blockFileMap.Forget(*it);
+        boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
+        boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
+        LogPrint("prune", "Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
+    }
+}
+
+int GetPruneHeight(int nTipHeight)
+{
+    // Connecting a block reads back the blocks of its accumulator checkpoint
+    // period, and a reorganization may disconnect up to the maximum depth.
+    int nKeep = std::max((int)MIN_BLOCKS_TO_KEEP, Params().MaxReorganizationDepth() + ACCUMULATOR_BLOCKS_TO_KEEP);
+    if (nTipHeight <= nKeep)
+        return -1;
+    int nPruneHeight = nTipHeight - nKeep;
+    // The checkpoint of the zerocoin start block accumulates every block since the accumulator
+    // start height; keep those until that block can no longer be reorganized away.
+    if (nTipHeight <= Params().Zerocoin_StartHeight() + nKeep)
+        nPruneHeight = std::min(nPruneHeight, Params().Zerocoin_AccumulatorStartHeight() - 1);
+    return nPruneHeight;
+}
+
+uint64_t SelectFilesToPrune(const std::vector<CBlockFileInfo>& vinfoFiles, int nLastBlockFile, uint64_t nCurrentUsage, uint64_t nTarget, int nPruneHeight, std::set<int>& setFilesToPrune)
+{
+    // We don't check to prune until after we've allocated new space for files,
+    // so we should leave a buffer under our target to account for another allocation
+    // before the next pruning.
+    uint64_t nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+    if (nPruneHeight < 0 || nCurrentUsage + nBuffer < nTarget)
+        return nCurrentUsage;
+
+    for (int fileNumber = 0; fileNumber < nLastBlockFile && fileNumber < (int)vinfoFiles.size(); fileNumber++) {
+        const CBlockFileInfo& info = vinfoFiles[fileNumber];
+        if (info.nSize == 0)
+            continue;
+
+        if (nCurrentUsage + nBuffer < nTarget) // are we below our target?
+            break;
+
+        // don't prune files that could have a block within the safety depth of the tip
+        if ((int)info.nHeightLast > nPruneHeight)
+            continue;
+
+        // nor files that could have history the snapshot validation has yet to connect
+        if (nUTXOSnapshotHeight >= 0 && (int)info.nHeightFirst <= nUTXOSnapshotHeight && (int)info.nHeightLast > nUTXOSnapshotValidatedHeight)
+            continue;
+
+        setFilesToPrune.insert(fileNumber);
+        nCurrentUsage -= info.nSize + info.nUndoSize;
+    }
+    return nCurrentUsage;
+}
+
+/**
+ * Calculate the block/rev files that should be deleted to remain under target.
+ * Files holding blocks that a reorganization, or the accumulator checkpoint of a
+ * block that could still be connected, may have to read again are never pruned.
+ */
+void static FindFilesToPrune(std::set<int>& setFilesToPrune)
+{
+    LOCK2(cs_main, cs_LastBlockFile);
+    if (chainActive.Tip() == NULL || nPruneTarget == 0)
+        return;
+
+    int nPruneHeight = GetPruneHeight(chainActive.Height());
+    if (nPruneHeight < 0)
+        return;
+
+    uint64_t nCurrentUsage = CalculateCurrentUsage();
+    std::set<int> setSelected;
+    nCurrentUsage = SelectFilesToPrune(vinfoBlockFile, nLastBlockFile, nCurrentUsage, nPruneTarget, nPruneHeight, setSelected);
+    for (std::set<int>::iterator it = setSelected.begin(); it != setSelected.end(); ++it)
+        PruneOneBlockFile(*it);
+    setFilesToPrune.insert(setSelected.begin(), setSelected.end());
+
+    LogPrint("prune", "Prune: target=%dMiB actual=%dMiB diff=%dMiB max_prune_height=%d removed %d blk/rev pairs\n",
+        nPruneTarget / 1024 / 1024, nCurrentUsage / 1024 / 1024,
+        ((int64_t)nPruneTarget - (int64_t)nCurrentUsage) / 1024 / 1024,
+        nPruneHeight, setSelected.size());
+}
+
 FILE* OpenDiskFile(const CDiskBlockPos& pos, const char* prefix, bool fReadOnly)
 {
     if (pos.IsNull())
@@ -4670,7 +5561,7 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
 
     //mark as PoS seen
     if (pindexNew->IsProofOfStake())
-        setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+        setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->GetStakeTime()));
 
     pindexNew->phashBlock = &((*mi).first);
 
@@ -4695,7 +5586,9 @@ bool static LoadBlockIndexDB()
     BOOST_FOREACH (const PAIRTYPE(int, CBlockIndex*) & item, vSortedByHeight) {
         CBlockIndex* pindex = item.second;
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
-        if (pindex->nStatus & BLOCK_HAVE_DATA) {
+        // nTx is set for every block whose transactions were once received, including
+        // blocks below a loaded UTXO snapshot whose data was never stored here.
+        if (pindex->nTx > 0) {
             if (pindex->pprev) {
                 if (pindex->pprev->nChainTx) {
                     pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
@@ -4720,6 +5613,7 @@ bool static LoadBlockIndexDB()
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
     vinfoBlockFile.resize(nLastBlockFile + 1);
+    blockFileMap.SetFinalizedFiles(nLastBlockFile);
     LogPrintf("%s: last block file = %i\n", __func__, nLastBlockFile);
     for (int nFile = 0; nFile <= nLastBlockFile; nFile++) {
         pblocktree->ReadBlockFileInfo(nFile, vinfoBlockFile[nFile]);
@@ -4840,6 +5734,20 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadReindexing(fReindexing);
     fReindex |= fReindexing;
 
+    // Check whether block files below the tip are missing
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned)
+        LogPrintf("LoadBlockIndexDB(): block files below the tip are missing\n");
+
+    // Check whether the history below a UTXO snapshot still has to be validated
+    uint256 hashSnapshotCoins;
+    bool fSnapshotValidated = false;
+    pblocktree->ReadFlag("utxosnapshotvalidated", fSnapshotValidated);
+    if (!fSnapshotValidated && pblocktree->ReadUTXOSnapshot(nUTXOSnapshotHeight, hashSnapshotCoins))
+        LogPrintf("LoadBlockIndexDB(): history below the UTXO snapshot at height %d is not validated yet\n", nUTXOSnapshotHeight);
+    else
+        nUTXOSnapshotHeight = -1;
+
     // Check whether we have a transaction index
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
@@ -4863,7 +5771,7 @@ bool static LoadBlockIndexDB()
     return true;
 }
 
-CVerifyDB::CVerifyDB()
+CVerifyDB::CVerifyDB() : nStartTime(GetTimeMillis()), nLastReport(0)
 {
     uiInterface.ShowProgress(_("Verifying blocks..."), 0);
 }
@@ -4873,6 +5781,20 @@ CVerifyDB::~CVerifyDB()
     uiInterface.ShowProgress("", 100);
 }
 
+void CVerifyDB::ReportProgress(int nPercent)
+{
+    nPercent = std::max(1, std::min(99, nPercent));
+    uiInterface.ShowProgress(_("Verifying blocks..."), nPercent);
+
+    // The init message doubles as the RPC warmup status; update it once a second
+    int64_t nNow = GetTimeMillis();
+    if (nNow - nLastReport < 1000)
+        return;
+    nLastReport = nNow;
+    int64_t nRemaining = (nNow - nStartTime) * (100 - nPercent) / nPercent / 1000;
+    uiInterface.InitMessage(strprintf(_("Verifying blocks... %d%% (about %d seconds left)"), nPercent, nRemaining));
+}
+
 bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth)
 {
     LOCK(cs_main);
@@ -4886,61 +5808,72 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
         nCheckDepth = chainActive.Height();
     nCheckLevel = std::max(0, std::min(4, nCheckLevel));
     LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
+
+    vector<CBlockIndex*> vpindexCheck;
+    for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev; pindex = pindex->pprev) {
+        if (pindex->nHeight < chainActive.Height() - nCheckDepth)
+            break;
+        // blocks below a loaded UTXO snapshot have no data to check
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            break;
+        vpindexCheck.push_back(pindex);
+    }
+
     CCoinsViewCache coins(coinsview);
     CBlockIndex* pindexState = chainActive.Tip();
     CBlockIndex* pindexFailure = NULL;
     int nGoodTransactions = 0;
     CValidationState state;
-    for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev; pindex = pindex->pprev) {
-        boost::this_thread::interruption_point();
-        uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
-        if (pindex->nHeight < chainActive.Height() - nCheckDepth)
-            break;
-        CBlock block;
-        // check level 0: read from disk
-        if (!ReadBlockFromDisk(block, pindex))
-            return error("VerifyDB() : *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-        // check level 1: verify block validity
-        if (nCheckLevel >= 1 && !CheckBlock(block, state))
-            return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-        // check level 2: verify undo validity
-        if (nCheckLevel >= 2 && pindex) {
-            CBlockUndo undo;
-            CDiskBlockPos pos = pindex->GetUndoPos();
-            if (!pos.IsNull()) {
-                if (!undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
-                    return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+    {
+        // the context-free checks of levels 0 to 2 run on the workers, those against the chain state here as the blocks come back
+        CVerifyBlockReader reader(vpindexCheck, std::min(2, nCheckLevel), std::max(1, nScriptCheckThreads));
+        CVerifiedBlock verified;
+        while (reader.Next(verified)) {
+            boost::this_thread::interruption_point();
+            CBlockIndex* pindex = verified.pindex;
+            ReportProgress((int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)));
+            if (verified.status == CVerifiedBlock::VERIFY_READ_FAILED)
+                return error("VerifyDB() : *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+            if (verified.status == CVerifiedBlock::VERIFY_BAD_BLOCK)
+                return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            if (verified.status == CVerifiedBlock::VERIFY_BAD_UNDO)
+                return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            // check level 1: verify block validity; the workers did the context-free part
+            if (nCheckLevel >= 1 && !CheckBlockChainState(verified.block, state))
+                return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
+            if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
+                bool fClean = true;
+                if (!DisconnectBlock(verified.block, state, pindex, coins, &fClean, verified.fHaveUndo ? &verified.undo : NULL))
+                    return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+                pindexState = pindex->pprev;
+                if (!fClean) {
+                    nGoodTransactions = 0;
+                    pindexFailure = pindex;
+                } else
+                    nGoodTransactions += verified.block.vtx.size();
             }
+            if (ShutdownRequested())
+                return true;
         }
-        // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
-            bool fClean = true;
-            if (!DisconnectBlock(block, state, pindex, coins, &fClean))
-                return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-            pindexState = pindex->pprev;
-            if (!fClean) {
-                nGoodTransactions = 0;
-                pindexFailure = pindex;
-            } else
-                nGoodTransactions += block.vtx.size();
-        }
-        if (ShutdownRequested())
-            return true;
     }
     if (pindexFailure)
         return error("VerifyDB() : *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", chainActive.Height() - pindexFailure->nHeight + 1, nGoodTransactions);
 
-    // check level 4: try reconnecting blocks
+    // check level 4: try reconnecting blocks, reading the next ones ahead on the workers
     if (nCheckLevel >= 4) {
-        CBlockIndex* pindex = pindexState;
-        while (pindex != chainActive.Tip()) {
+        vector<CBlockIndex*> vpindexConnect;
+        for (CBlockIndex* pindex = chainActive.Next(pindexState); pindex; pindex = chainActive.Next(pindex))
+            vpindexConnect.push_back(pindex);
+        CVerifyBlockReader reader(vpindexConnect, 0, std::max(1, nScriptCheckThreads));
+        CVerifiedBlock verified;
+        while (reader.Next(verified)) {
             boost::this_thread::interruption_point();
-            uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, 100 - (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * 50))));
-            pindex = chainActive.Next(pindex);
-            CBlock block;
-            if (!ReadBlockFromDisk(block, pindex))
+            CBlockIndex* pindex = verified.pindex;
+            ReportProgress(100 - (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * 50));
+            if (verified.status != CVerifiedBlock::VERIFY_OK)
                 return error("VerifyDB() : *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-            if (!ConnectBlock(block, state, pindex, coins, false))
+            if (!ConnectBlock(verified.block, state, pindex, coins, false))
                 return error("VerifyDB() : *** found unconnectable block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
         }
     }
@@ -4975,7 +5908,7 @@ bool InitBlockIndex()
         return true;
 
     // Use the provided setting for -txindex in the new database
-    fTxIndex = GetBoolArg("-txindex", true);
+    fTxIndex = GetBoolArg("-txindex", !fPruneMode);
     pblocktree->WriteFlag("txindex", fTxIndex);
     LogPrintf("Initializing databases...\n");
 
@@ -4991,7 +5924,7 @@ bool InitBlockIndex()
                 return error("LoadBlockIndex() : FindBlockPos failed");
             if (!WriteBlockToDisk(block, blockPos))
                 return error("LoadBlockIndex() : writing genesis block to disk failed");
-            CBlockIndex* pindex = AddToBlockIndex(block);
+            CBlockIndex* pindex = AddToBlockIndex(block, block.GetHash());
             if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
                 return error("LoadBlockIndex() : genesis block not accepted");
             if (!ActivateBestChain(state, &block))
@@ -5015,45 +5948,22 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
 
     int nLoaded = 0;
     try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE_CURRENT, MAX_BLOCK_SIZE_CURRENT + 8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+        // Scanning, deserializing and hashing run ahead on their own threads; blocks
+        // still come out in file order. This takes over fileIn and closes it.
+        CBlockFileReader reader(fileIn, std::max(1, nScriptCheckThreads));
+        CImportedBlock imported;
+        while (reader.Next(imported)) {
             boost::this_thread::interruption_point();
+            if (!imported.fValid)
+                continue;
 
-            blkdat.SetPos(nRewind);
-            nRewind++;         // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos() + 1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE_CURRENT)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
-            }
             try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
                 if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
+                    dbp->nPos = imported.nPos;
+                CBlock& block = imported.block;
+                const uint256& hash = imported.hash;
 
                 // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
                 if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
                     LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
                         block.hashPrevBlock.ToString());
@@ -5069,6 +5979,7 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
                         nLoaded++;
                     if (state.IsError())
                         break;
+                    ProcessBlocksAwaitingParent(hash);
                 } else if (hash != Params().HashGenesisBlock() && mapBlockIndex[hash]->nHeight % 1000 == 0) {
                     LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
                 }
@@ -5089,6 +6000,7 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
                             if (ProcessNewBlock(dummy, NULL, &block, &it->second)) {
                                 nLoaded++;
                                 queue.push_back(block.GetHash());
+                                ProcessBlocksAwaitingParent(block.GetHash());
                             }
                         }
                         range.first++;
@@ -5143,6 +6055,7 @@ void static CheckBlockIndex()
     int nHeight = 0;
     CBlockIndex* pindexFirstInvalid = NULL;         // Oldest ancestor of pindex which is invalid.
     CBlockIndex* pindexFirstMissing = NULL;         // Oldest ancestor of pindex which does not have BLOCK_HAVE_DATA.
+    CBlockIndex* pindexFirstNeverProcessed = NULL;  // Oldest ancestor of pindex for which nTx == 0.
     CBlockIndex* pindexFirstNotTreeValid = NULL;    // Oldest ancestor of pindex which does not have BLOCK_VALID_TREE (regardless of being valid or not).
     CBlockIndex* pindexFirstNotChainValid = NULL;   // Oldest ancestor of pindex which does not have BLOCK_VALID_CHAIN (regardless of being valid or not).
     CBlockIndex* pindexFirstNotScriptsValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_SCRIPTS (regardless of being valid or not).
@@ -5150,6 +6063,7 @@ void static CheckBlockIndex()
         nNodes++;
         if (pindexFirstInvalid == NULL && pindex->nStatus & BLOCK_FAILED_VALID) pindexFirstInvalid = pindex;
         if (pindexFirstMissing == NULL && !(pindex->nStatus & BLOCK_HAVE_DATA)) pindexFirstMissing = pindex;
+        if (pindexFirstNeverProcessed == NULL && pindex->nTx == 0) pindexFirstNeverProcessed = pindex;
         if (pindex->pprev != NULL && pindexFirstNotTreeValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TREE) pindexFirstNotTreeValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotChainValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_CHAIN) pindexFirstNotChainValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotScriptsValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS) pindexFirstNotScriptsValid = pindex;
@@ -5160,12 +6074,19 @@ void static CheckBlockIndex()
             assert(pindex->GetBlockHash() == Params().HashGenesisBlock()); // Genesis block's hash must match.
             assert(pindex == chainActive.Genesis());                       // The current active chain's genesis block must be this block.
         }
-        // HAVE_DATA is equivalent to VALID_TRANSACTIONS and equivalent to nTx > 0 (we stored the number of transactions in the block)
-        assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+        if (!fHavePruned) {
+            // If no history is missing, HAVE_DATA is equivalent to nTx > 0 (we stored the number of transactions in the block)
+            assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+            assert(pindexFirstMissing == pindexFirstNeverProcessed);
+        } else {
+            // Otherwise we can only say that HAVE_DATA implies nTx > 0
+            if (pindex->nStatus & BLOCK_HAVE_DATA) assert(pindex->nTx > 0);
+        }
+        if (pindex->nStatus & BLOCK_HAVE_UNDO) assert(pindex->nStatus & BLOCK_HAVE_DATA);
         assert(((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0));
         if (pindex->nChainTx == 0) assert(pindex->nSequenceId == 0); // nSequenceId can't be set for blocks that aren't linked
-        // All parents having data is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
-        assert((pindexFirstMissing != NULL) == (pindex->nChainTx == 0));                                             // nChainTx == 0 is used to signal that all parent block's transaction data is available.
+        // All parents having had data at some point is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
+        assert((pindexFirstNeverProcessed != NULL) == (pindex->nChainTx == 0));                                      // nChainTx == 0 is used to signal that all parent block's transaction data is available.
         assert(pindex->nHeight == nHeight);                                                                          // nHeight must be consistent.
         assert(pindex->pprev == NULL || pindex->nChainWork >= pindex->pprev->nChainWork);                            // For every block except the genesis block, the chainwork must be larger than the parent's.
         assert(nHeight < 2 || (pindex->pskip && (pindex->pskip->nHeight < nHeight)));                                // The pskip pointer must point back for all but the first 2 blocks.
@@ -5177,8 +6098,10 @@ void static CheckBlockIndex()
             // Checks for not-invalid blocks.
             assert((pindex->nStatus & BLOCK_FAILED_MASK) == 0); // The failed mask cannot be set for blocks without invalid parents.
         }
-        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstMissing == NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block sorts at least as good as the current tip and is valid, it must be in setBlockIndexCandidates.
+        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstNeverProcessed == NULL) {
+            // If this block sorts at least as good as the current tip, is valid and we have all data for its parents,
+            // it must be in setBlockIndexCandidates. The tip must be there even if history below it is missing.
+            if (pindexFirstInvalid == NULL && (pindexFirstMissing == NULL || pindex == chainActive.Tip())) {
                 assert(setBlockIndexCandidates.count(pindex));
             }
         } else { // If this block sorts worse than the current tip, it cannot be in setBlockIndexCandidates.
@@ -5195,12 +6118,15 @@ void static CheckBlockIndex()
             }
             rangeUnlinked.first++;
         }
-        if (pindex->pprev && pindex->nStatus & BLOCK_HAVE_DATA && pindexFirstMissing != NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block has block data available, some parent doesn't, and has no invalid parents, it must be in mapBlocksUnlinked.
-                assert(foundInUnlinked);
-            }
-        } else { // If this block does not have block data available, or all parents do, it cannot be in mapBlocksUnlinked.
-            assert(!foundInUnlinked);
+        if (pindex->pprev && pindex->nStatus & BLOCK_HAVE_DATA && pindexFirstNeverProcessed != NULL && pindexFirstInvalid == NULL) {
+            // If this block has block data available, some parent was never received, and has no invalid parents, it must be in mapBlocksUnlinked.
+            assert(foundInUnlinked);
+        }
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA)) assert(!foundInUnlinked); // Can't be in mapBlocksUnlinked if we don't HAVE_DATA
+        if (pindexFirstMissing == NULL) assert(!foundInUnlinked);          // We aren't missing data for any parent -- cannot be in mapBlocksUnlinked.
+        if (pindex->pprev && pindex->nStatus & BLOCK_HAVE_DATA && pindexFirstNeverProcessed == NULL && pindexFirstMissing != NULL) {
+            // We have data for this block and all parents were received at some point, but some parent's data is gone now.
+            assert(fHavePruned);
         }
         // assert(pindex->GetBlockHash() == pindex->GetBlockHeader().GetHash()); // Perhaps too slow
         // End: actual consistency checks.
@@ -5220,6 +6146,7 @@ void static CheckBlockIndex()
             // If pindex was the first with a certain property, unset the corresponding variable.
             if (pindex == pindexFirstInvalid) pindexFirstInvalid = NULL;
             if (pindex == pindexFirstMissing) pindexFirstMissing = NULL;
+            if (pindex == pindexFirstNeverProcessed) pindexFirstNeverProcessed = NULL;
             if (pindex == pindexFirstNotTreeValid) pindexFirstNotTreeValid = NULL;
             if (pindex == pindexFirstNotChainValid) pindexFirstNotChainValid = NULL;
             if (pindex == pindexFirstNotScriptsValid) pindexFirstNotScriptsValid = NULL;
@@ -5250,6 +6177,130 @@ void static CheckBlockIndex()
     assert(nNodes == forward.size());
 }
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+struct CompareMempoolDumpOrder {
+    bool operator()(const std::pair<uint64_t, CTxMemPool::txiter>& a, const std::pair<uint64_t, CTxMemPool::txiter>& b) const
+    {
+        if (a.first != b.first)
+            return a.first < b.first;
+        return a.second->first < b.second->first;
+    }
+};
+
+bool LoadMempool()
+{
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    FILE* filestr = fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        return error("%s : failed to open mempool file from disk, continuing anyway", __func__);
+
+    int64_t nStart = GetTimeMillis();
+    int64_t count = 0;
+    int64_t skipped = 0;
+    int64_t failed = 0;
+    int64_t nNow = GetTime();
+    try {
+        uint64_t version;
+        file >> version;
+        if (version != MEMPOOL_DUMP_VERSION)
+            return error("%s : unknown mempool file version %u", __func__, version);
+
+        // Deltas go first, so prioritised transactions are accepted with them
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); it++)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+        uint64_t num;
+        file >> num;
+        while (num--) {
+            CTransaction tx;
+            int64_t nTime;
+            file >> tx;
+            file >> nTime;
+
+            if (nTime + nExpiryTimeout > nNow) {
+                CValidationState state;
+                LOCK(cs_main);
+                if (AcceptToMemoryPoolWithTime(mempool, state, tx, true, NULL, nTime))
+                    ++count;
+                else
+                    ++failed;
+            } else {
+                ++skipped;
+            }
+            if (ShutdownRequested())
+                return false;
+        }
+    } catch (const std::exception& e) {
+        return error("%s : failed to deserialize mempool data on disk: %s, continuing anyway", __func__, e.what());
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired (%dms)\n", count, failed, skipped, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool DumpMempool()
+{
+    // Serialize the periodic, RPC and shutdown dumps
+    static CCriticalSection cs_dump;
+    LOCK(cs_dump);
+
+    {
+        // Don't overwrite mempool.dat with a pool that is still being loaded from it
+        LOCK(cs_main);
+        if (!fMempoolLoaded)
+            return false;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<std::pair<CTransaction, int64_t> > vinfo;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+
+        // Parents before children, so every transaction can be accepted again in order
+        std::vector<std::pair<uint64_t, CTxMemPool::txiter> > vOrder;
+        vOrder.reserve(mempool.mapTx.size());
+        for (CTxMemPool::txiter it = mempool.mapTx.begin(); it != mempool.mapTx.end(); it++)
+            vOrder.push_back(std::make_pair(it->second.GetCountWithAncestors(), it));
+        std::sort(vOrder.begin(), vOrder.end(), CompareMempoolDumpOrder());
+
+        vinfo.reserve(vOrder.size());
+        for (unsigned int i = 0; i < vOrder.size(); i++)
+            vinfo.push_back(std::make_pair(vOrder[i].second->second.GetTx(), vOrder[i].second->second.GetTime()));
+    }
+    int64_t nMid = GetTimeMillis();
+
+    try {
+        boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+        FILE* filestr = fopen(pathTmp.string().c_str(), "wb");
+        if (!filestr)
+            return error("%s : failed to open %s", __func__, pathTmp.string());
+
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+        file << MEMPOOL_DUMP_VERSION;
+        file << mapDeltas;
+        file << (uint64_t)vinfo.size();
+        for (unsigned int i = 0; i < vinfo.size(); i++) {
+            file << vinfo[i].first;
+            file << vinfo[i].second;
+        }
+        FileCommit(file.Get());
+        file.fclose();
+        if (!RenameOver(pathTmp, GetDataDir() / "mempool.dat"))
+            return error("%s : failed to rename %s", __func__, pathTmp.string());
+    } catch (const std::exception& e) {
+        return error("%s : failed to dump mempool: %s", __func__, e.what());
+    }
+
+    LogPrint("mempool", "Dumped mempool: %dms to copy, %dms to dump\n", nMid - nStart, GetTimeMillis() - nMid);
+    return true;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // CAlert
@@ -5372,6 +6423,17 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+/** Whether -maxuploadtarget does not apply to the peer; the masternode list is searched at most once a minute per peer */
+static bool IsUploadExempt(CNode* pnode)
+{
+    int64_t nNow = GetTime();
+    if (!pnode->IsUploadExempt() && nNow - pnode->nLastMasternodePeerCheck > 60) {
+        pnode->nLastMasternodePeerCheck = nNow;
+        pnode->fMasternodePeer = mnodeman.HasMasternodeAt(pnode->addr);
+    }
+    return pnode->IsUploadExempt();
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -5390,7 +6452,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end()) {
@@ -5407,16 +6469,55 @@ void static ProcessGetData(CNode* pfrom)
                         }
                     }
                 }
+                // Stop serving old blocks to syncing peers once they used up their share of
+                // -maxuploadtarget, so new blocks and masternode messages still get out
+                bool fHistorical = send && chainActive.Tip()->GetBlockTime() - mi->second->GetBlockTime() > HISTORICAL_BLOCK_AGE;
+                if (fHistorical && uploadTarget.IsLimited(SEND_PRIORITY_HISTORICAL, GetTime()) && !IsUploadExempt(pfrom)) {
+                    LogPrint("net", "historical block serving limit reached, disconnecting peer=%d\n", pfrom->GetId());
+                    uploadTarget.RecordRefused();
+                    pfrom->fDisconnect = true;
+                    send = false;
+                }
+                int nPriority = fHistorical ? SEND_PRIORITY_HISTORICAL : SEND_PRIORITY_BLOCK_RELAY;
                 // Don't send not-validated blocks
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    // Send block from disk. A peer asking for an old block as a compact block won't
+                    // have the transactions in its mempool to rebuild it, so it gets the whole block.
+                    bool fCompact = inv.type == MSG_CMPCT_BLOCK && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                    // Peers fetching a new block all get the payload read for the first one
+                    if (inv.type == MSG_BLOCK || (inv.type == MSG_CMPCT_BLOCK && !fCompact)) {
+                        CNetPayloadRef payload = servedBlockCache.GetPayload(CServedBlockCache::ENTRY_BLOCK, inv.hash);
+                        if (!payload) {
+                            // Pass the stored bytes on without decoding and re-encoding them
+                            CSerializedBlock block;
+                            if (!ReadRawBlockFromDisk(block, (*mi).second))
+                                assert(!"cannot load block from disk");
+                            payload = MakeNetPayload(block);
+                            servedBlockCache.PutPayload(CServedBlockCache::ENTRY_BLOCK, inv.hash, payload);
+                        }
+                        pfrom->PushMessagePayload("block", payload, nPriority);
+                    } else if (fCompact) {
+                        CNetPayloadRef payload = servedBlockCache.GetPayload(CServedBlockCache::ENTRY_CMPCTBLOCK, inv.hash);
+                        if (!payload) {
+                            CBlock block;
+                            if (!ReadBlockFromDisk(block, (*mi).second))
+                                assert(!"cannot load block from disk");
+                            payload = MakeNetPayload(CBlockHeaderAndShortTxIDs(block));
+                            servedBlockCache.PutPayload(CServedBlockCache::ENTRY_CMPCTBLOCK, inv.hash, payload);
+                        }
+                        pfrom->PushMessagePayload("cmpctblock", payload, nPriority);
+                    } else // MSG_FILTERED_BLOCK)
                     {
+                        // The merkleblock depends on the peer's filter, so only the decoded block is shared
+                        boost::shared_ptr<const CBlock> pblock = servedBlockCache.GetBlock(inv.hash);
+                        if (!pblock) {
+                            boost::shared_ptr<CBlock> pblockRead(new CBlock());
+                            if (!ReadBlockFromDisk(*pblockRead, (*mi).second))
+                                assert(!"cannot load block from disk");
+                            pblock = pblockRead;
+                            servedBlockCache.PutBlock(inv.hash, pblock, ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
+                        }
+                        const CBlock& block = *pblock;
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
                             CMerkleBlock merkleBlock(block, *pfrom->pfilter);
@@ -5429,7 +6530,7 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(CInv(MSG_TX, pair.second)))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -5440,10 +6541,10 @@ void static ProcessGetData(CNode* pfrom)
                     if (inv.hash == pfrom->hashContinue) {
                         // Bypass PushInventory, this must send even if redundant,
                         // and we want it right after the last block so they don't
-                        // wait for other stuff first.
+                        // wait for other stuff first. In the block's class, so it doesn't overtake it.
                         vector<CInv> vInv;
                         vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-                        pfrom->PushMessage("inv", vInv);
+                        pfrom->PushMessagePayload("inv", MakeNetPayload(vInv), nPriority);
                         pfrom->hashContinue = 0;
                     }
                 }
@@ -5452,9 +6553,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CNetPayloadRef>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushMessagePayload(inv.GetCommand(), (*mi).second);
                         pushed = true;
                     }
                 }
@@ -5604,6 +6705,325 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/** Whether the data of a block was received already; with headers-first sync most blocks are known before that */
+bool static HaveBlockData(const uint256& hash)
+{
+    LOCK(cs_main);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    return mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA);
+}
+
+/**
+ * Keep a block whose parent's data hasn't arrived yet until it has, instead of processing it now.
+ * Returns false if the block can be processed right away or there is no room to keep it; in the
+ * latter case it is requested again once the download window reaches it.
+ */
+bool static DeferBlockUntilParent(CNode* pfrom, const CBlock& block)
+{
+    LOCK(cs_main);
+    uint256 hash = block.GetHash();
+    BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+    if (mi == mapBlockIndex.end() || mi->second->nChainTx != 0 || mapBlocksAwaitingParent.count(hash))
+        return false;
+
+    MarkBlockAsReceived(hash);
+    unsigned int nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    if (nBlocksAwaitingParentSize + nSize > MAX_BLOCKS_AWAITING_PARENT_SIZE) {
+        LogPrint("net", "dropping block %s received ahead of its parent from peer=%d\n", hash.ToString(), pfrom->id);
+        return true;
+    }
+
+    CBlockAwaitingParent& awaiting = mapBlocksAwaitingParent[hash];
+    awaiting.block = block;
+    awaiting.nodeid = pfrom->GetId();
+    awaiting.nSize = nSize;
+    mapBlocksAwaitingParentByPrev.insert(make_pair(block.hashPrevBlock, hash));
+    nBlocksAwaitingParentSize += nSize;
+    LogPrint("net", "block %s received ahead of its parent from peer=%d, %u blocks waiting\n", hash.ToString(), pfrom->id, mapBlocksAwaitingParent.size());
+    return true;
+}
+
+/** Process the blocks that were waiting for the block hashParent, and recursively their own children */
+void ProcessBlocksAwaitingParent(const uint256& hashParent)
+{
+    std::deque<uint256> queue;
+    queue.push_back(hashParent);
+    while (!queue.empty()) {
+        std::vector<CBlockAwaitingParent> vReady;
+        {
+            LOCK(cs_main);
+            std::pair<std::multimap<uint256, uint256>::iterator, std::multimap<uint256, uint256>::iterator> range = mapBlocksAwaitingParentByPrev.equal_range(queue.front());
+            for (std::multimap<uint256, uint256>::iterator it = range.first; it != range.second; ++it) {
+                std::map<uint256, CBlockAwaitingParent>::iterator itBlock = mapBlocksAwaitingParent.find(it->second);
+                nBlocksAwaitingParentSize -= itBlock->second.nSize;
+                vReady.push_back(std::move(itBlock->second));
+                mapBlocksAwaitingParent.erase(itBlock);
+            }
+            mapBlocksAwaitingParentByPrev.erase(range.first, range.second);
+        }
+        queue.pop_front();
+
+        BOOST_FOREACH (CBlockAwaitingParent& awaiting, vReady) {
+            uint256 hash = awaiting.block.GetHash();
+            CValidationState state;
+            {
+                LOCK(cs_main);
+                mapBlockSource[hash] = awaiting.nodeid;
+            }
+            ProcessNewBlock(state, NULL, &awaiting.block);
+            int nDoS;
+            if (state.IsInvalid(nDoS) && nDoS > 0) {
+                LOCK(cs_main);
+                Misbehaving(awaiting.nodeid, nDoS);
+            }
+            queue.push_back(hash);
+        }
+    }
+}
+
+/**
+ * Store a block below the UTXO snapshot this node was started from, for the background validation of
+ * the snapshot to connect. Such blocks are already in the active chain, so they only get the checks
+ * that need nothing but the block itself; CheckWork would need the history that is being fetched.
+ * Returns false if hash is not such a block.
+ */
+bool static AcceptSnapshotHistoryBlock(CNode* pfrom, CBlock& block)
+{
+    LOCK(cs_main);
+    if (nUTXOSnapshotHeight < 0)
+        return false;
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
+    if (mi == mapBlockIndex.end())
+        return false;
+    CBlockIndex* pindex = mi->second;
+    if (pindex->nHeight > nUTXOSnapshotHeight || !chainActive.Contains(pindex) || (pindex->nStatus & BLOCK_HAVE_DATA))
+        return false;
+
+    MarkBlockAsReceived(pindex->GetBlockHash());
+    CValidationState state;
+    if (!CheckBlock(block, state)) {
+        int nDoS;
+        if (state.IsInvalid(nDoS) && nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+        return true;
+    }
+
+    try {
+        unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+        CDiskBlockPos blockPos;
+        if (!FindBlockPos(state, blockPos, nBlockSize + 8, pindex->nHeight, block.GetBlockTime()) || !WriteBlockToDisk(block, blockPos)) {
+            AbortNode("Failed to write block");
+            return true;
+        }
+        pindex->nFile = blockPos.nFile;
+        pindex->nDataPos = blockPos.nPos;
+        pindex->nStatus |= BLOCK_HAVE_DATA;
+        setDirtyBlockIndex.insert(pindex);
+    } catch (std::runtime_error& e) {
+        AbortNode(std::string("System error: ") + e.what());
+    }
+    return true;
+}
+
+/** Validate and connect a block received from pfrom, whether it was sent whole or rebuilt from a compact block */
+void static ProcessBlockFromPeer(CNode* pfrom, CBlock& block, const string& strCommand)
+{
+    uint256 hashBlock = block.GetHash();
+    if (HaveBlockData(hashBlock)) {
+        LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, hashBlock.GetHex());
+        return;
+    }
+
+    // History below a UTXO snapshot is only stored, the snapshot validation thread connects it
+    if (AcceptSnapshotHistoryBlock(pfrom, block))
+        return;
+
+    // A block downloaded ahead of its parent's data is processed right after the parent
+    if (DeferBlockUntilParent(pfrom, block))
+        return;
+
+    CValidationState state;
+    ProcessNewBlock(state, pfrom, &block);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), hashBlock);
+        if (nDoS > 0) {
+            TRY_LOCK(cs_main, lockMain);
+            if (lockMain) Misbehaving(pfrom->GetId(), nDoS);
+        }
+    } else {
+        // The peer was the first to give us our new best block
+        LOCK(cs_main);
+        if (chainActive.Tip()->GetBlockHash() == hashBlock && !IsInitialBlockDownload())
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(pfrom);
+    }
+    //disconnect this node if its old protocol version
+    pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
+    ProcessBlocksAwaitingParent(hashBlock);
+}
+
+/** Complete the compact block being rebuilt for pfrom with the transactions that were missing, and process it */
+void static ProcessBlockTransactions(CNode* pfrom, const BlockTransactions& resp)
+{
+    CBlock block;
+    {
+        LOCK(cs_main);
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator it = mapBlocksInFlight.find(resp.blockhash);
+        if (it == mapBlocksInFlight.end() || !it->second.second->partialBlock || it->second.first != pfrom->GetId()) {
+            LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+            return;
+        }
+
+        CNodeState* nodestate = State(pfrom->GetId());
+        int64_t nTimeQueued = it->second.second->nTime;
+        PartiallyDownloadedBlock::ReadStatus status = it->second.second->partialBlock->FillBlock(block, resp.txn);
+        if (status == PartiallyDownloadedBlock::READ_STATUS_INVALID) {
+            MarkBlockAsReceived(resp.blockhash);
+            nodestate->nCompactFailed++;
+            Misbehaving(pfrom->GetId(), 100);
+            LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+            return;
+        } else if (status == PartiallyDownloadedBlock::READ_STATUS_FAILED) {
+            // Most likely a short ID collision; the block stays in flight from this peer, ask for all of it
+            nodestate->nCompactFailed++;
+            it->second.second->partialBlock.reset();
+            pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, resp.blockhash)));
+            return;
+        }
+
+        if (resp.txn.empty())
+            nodestate->nCompactReconstructed++;
+        else
+            nodestate->nCompactBlockTxn++;
+        nodestate->nCompactLatency += GetTimeMicros() - nTimeQueued;
+        MarkBlockAsReceived(resp.blockhash);
+    }
+    ProcessBlockFromPeer(pfrom, block, "cmpctblock");
+}
+
+int GetMessageLockClasses(const std::string& strCommand)
+{
+    // AlreadyHave and ProcessGetData look up masternode, payment and budget items,
+    // dstx looks up the masternode that signed it
+    if (strCommand == "inv" || strCommand == "getdata" || strCommand == "dstx")
+        return MSG_LOCK_CHAIN | MSG_LOCK_MASTERNODE;
+    if (strCommand == "mnb" || strCommand == "mnp" || strCommand == "dsee" || strCommand == "dseep" ||
+        strCommand == "dseg" || strCommand == "mnw" || strCommand == "mnget" || strCommand == "mprop" ||
+        strCommand == "mvote" || strCommand == "fbs" || strCommand == "fbvote" || strCommand == "mnvs" ||
+        strCommand == "ssc")
+        return MSG_LOCK_MASTERNODE;
+    // Everything else, including unknown commands, may touch the chain state
+    return MSG_LOCK_CHAIN;
+}
+
+//! Serialize the message handlers of each lock class; taken before cs_main, chain before masternode
+static CCriticalSection cs_msgChain;
+static CCriticalSection cs_msgMasternode;
+
+/** Holds the locks of a combination of MessageLockClass, in the fixed order */
+class CMessageLocks
+{
+private:
+    int nLockClasses;
+
+public:
+    explicit CMessageLocks(int nLockClassesIn) : nLockClasses(nLockClassesIn)
+    {
+        if (nLockClasses & MSG_LOCK_CHAIN)
+            ENTER_CRITICAL_SECTION(cs_msgChain);
+        if (nLockClasses & MSG_LOCK_MASTERNODE)
+            ENTER_CRITICAL_SECTION(cs_msgMasternode);
+    }
+
+    ~CMessageLocks()
+    {
+        if (nLockClasses & MSG_LOCK_MASTERNODE)
+            LEAVE_CRITICAL_SECTION(cs_msgMasternode);
+        if (nLockClasses & MSG_LOCK_CHAIN)
+            LEAVE_CRITICAL_SECTION(cs_msgChain);
+    }
+};
+
+/** Add the headers pfrom sent to the block index and ask for more if there may be */
+bool ProcessHeaders(CNode* pfrom, const std::vector<CBlockHeader>& headers)
+{
+    if (headers.empty()) {
+        // Nothing interesting. Stop asking this peers for more headers.
+        return true;
+    }
+
+    // Hash the whole batch up front and in parallel, outside cs_main
+    std::vector<uint256> vHashes;
+    HashHeaders(headers, vHashes);
+
+    LOCK(cs_main);
+    CNodeState* nodestate = State(pfrom->GetId());
+
+    CBlockIndex* pindexLast = NULL;
+    for (unsigned int n = 0; n < headers.size(); n++) {
+        const CBlockHeader& header = headers[n];
+        CValidationState state;
+        if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("non-continuous headers sequence");
+        }
+
+        // Proof-of-stake headers can't be checked without the coinstake; AcceptBlockHeader checks their
+        // difficulty and time, and the kernel is checked when the block data arrives.
+        if (!AcceptHeaderFromPeer(pfrom->GetId(), header, vHashes[n], state, &pindexLast)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS)) {
+                if (nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                std::string strError = "invalid header received " + vHashes[n].ToString();
+                return error(strError.c_str());
+            }
+            if (state.IsValid()) {
+                // The rest is asked for again once the blocks of this peer's earlier headers arrived
+                LogPrint("net", "pausing header sync with peer=%d at %d headers without blocks\n", pfrom->id, nodestate->nHeadersOnly);
+                nodestate->fHeadersPaused = true;
+                break;
+            }
+        }
+    }
+
+    if (pindexLast)
+        UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
+
+    if (headers.size() == MAX_HEADERS_RESULTS && pindexLast && !nodestate->fHeadersPaused) {
+        // Headers message had its maximum size; the peer may have more headers.
+        // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
+        // from there instead.
+        LogPrintf("more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
+        pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256(0));
+    }
+
+    CheckBlockIndex();
+    return true;
+}
+
+//! Queue statistics per counter slot of netmsgstats, so both count the same commands
+static CCriticalSection cs_messageQueueStats;
+static CMessageQueueStats vMessageQueueStats[NUM_MESSAGE_STATS_SLOTS];
+
+static void RecordMessageQueueTime(int nSlot, int64_t nTime)
+{
+    LOCK(cs_messageQueueStats);
+    CMessageQueueStats& stats = vMessageQueueStats[nSlot];
+    stats.nCount++;
+    stats.nTotalTime += nTime;
+    stats.nMaxTime = std::max(stats.nMaxTime, nTime);
+}
+
+void GetMessageQueueStats(std::map<std::string, CMessageQueueStats>& mapStats)
+{
+    LOCK(cs_messageQueueStats);
+    mapStats.clear();
+    for (int i = 0; i < NUM_MESSAGE_STATS_SLOTS; i++)
+        mapStats[GetMessageStatsCommand(i)] = vMessageQueueStats[i];
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
@@ -5744,6 +7164,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        // Tell the peer we can use compact blocks. We ask it to push them to us unannounced
+        // only once it has proven to be one of the first to deliver new blocks.
+        if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+            uint64_t nCMPCTBLOCKVersion = 1;
+            pfrom->PushMessage("sendcmpct", false, nCMPCTBLOCKVersion);
+        }
     }
 
 
@@ -5775,7 +7202,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    // at a time so the filterAddrKnowns of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         hashSalt = GetRandHash();
@@ -5820,6 +7247,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         LOCK(cs_main);
 
         std::vector<CInv> vToFetch;
+        bool fHeadersFirst = fHeadersFirstSync && pfrom->nVersion >= HEADERS_FIRST_VERSION;
+        uint256 hashLastUnknownBlock = 0;
 
         for (unsigned int nInv = 0; nInv < vInv.size(); nInv++) {
             const CInv& inv = vInv[nInv];
@@ -5837,9 +7266,21 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (inv.type == MSG_BLOCK) {
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
                 if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
-                    // Add this to the list of blocks to request
-                    vToFetch.push_back(inv);
-                    LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    // Ask for the headers up to the announced block, once per message. During the initial
+                    // download the blocks themselves are fetched from all peers by FindNextBlocksToDownload.
+                    if (fHeadersFirst)
+                        hashLastUnknownBlock = inv.hash;
+                    if (!fHeadersFirst || !IsInitialBlockDownload()) {
+                        // Add this to the list of blocks to request. Once synced, a new block is
+                        // fetched as a compact block and rebuilt from our mempool where possible.
+                        if (!IsInitialBlockDownload() && State(pfrom->GetId())->fProvidesHeaderAndIDs) {
+                            vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                            MarkBlockAsInFlight(pfrom->GetId(), inv.hash);
+                        } else {
+                            vToFetch.push_back(inv);
+                        }
+                        LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    }
                 }
             }
 
@@ -5852,6 +7293,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
 
+        if (hashLastUnknownBlock != 0) {
+            LogPrint("net", "getheaders (%d) %s to peer=%d\n", pindexBestHeader->nHeight, hashLastUnknownBlock.ToString(), pfrom->id);
+            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), hashLastUnknownBlock);
+        }
+
         if (!vToFetch.empty())
             pfrom->PushMessage("getdata", vToFetch);
     }
@@ -5876,7 +7322,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "getblocks" || strCommand == "getheaders") {
+    else if (strCommand == "getblocks") {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -5896,6 +7342,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
                 break;
             }
+            // If pruning, don't inv blocks unless we have them on disk and are likely to still have them
+            if (fPruneMode && (!(pindex->nStatus & BLOCK_HAVE_DATA) || pindex->nHeight <= chainActive.Tip()->nHeight - (int)MIN_BLOCKS_TO_KEEP)) {
+                LogPrint("net", " getblocks stopping, pruned or too old block at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+                break;
+            }
             pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
             if (--nLimit <= 0) {
                 // When this block is requested, we'll send an inv that'll make them
@@ -5908,7 +7359,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive()) {
+    else if (strCommand == "getheaders") {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -6104,7 +7555,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive() && !fImporting && !fReindex) // Ignore headers received while importing
+    else if (strCommand == "headers" && fHeadersFirstSync && !fImporting && !fReindex) // Ignore headers received while importing
     {
         std::vector<CBlockHeader> headers;
 
@@ -6120,46 +7571,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
-        LOCK(cs_main);
-
-        if (nCount == 0) {
-            // Nothing interesting. Stop asking this peers for more headers.
-            return true;
-        }
-        CBlockIndex* pindexLast = NULL;
-        BOOST_FOREACH (const CBlockHeader& header, headers) {
-            CValidationState state;
-            if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
-                Misbehaving(pfrom->GetId(), 20);
-                return error("non-continuous headers sequence");
-            }
-
-            /*TODO: this has a CBlock cast on it so that it will compile. There should be a solution for this
-             * before headers are reimplemented on mainnet
-             */
-            if (!AcceptBlockHeader((CBlock)header, state, &pindexLast)) {
-                int nDoS;
-                if (state.IsInvalid(nDoS)) {
-                    if (nDoS > 0)
-                        Misbehaving(pfrom->GetId(), nDoS);
-                    std::string strError = "invalid header received " + header.GetHash().ToString();
-                    return error(strError.c_str());
-                }
-            }
-        }
-
-        if (pindexLast)
-            UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
-
-        if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
-            // Headers message had its maximum size; the peer may have more headers.
-            // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
-            // from there instead.
-            LogPrintf("more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
-            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256(0));
-        }
-
-        CheckBlockIndex();
+        if (!ProcessHeaders(pfrom, headers))
+            return false;
     }
 
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
@@ -6183,25 +7596,166 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         } else {
             pfrom->AddInventoryKnown(inv);
+            ProcessBlockFromPeer(pfrom, block, strCommand);
+        }
+    }
+
 
+    else if (strCommand == "sendcmpct") {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == 1) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+        CInv inv(MSG_BLOCK, hashBlock);
+        LogPrint("net", "received compact block %s peer=%d\n", hashBlock.ToString(), pfrom->id);
+        pfrom->AddInventoryKnown(inv);
+
+        BlockTransactions resp;
+        {
+            LOCK(cs_main);
+            CNodeState* nodestate = State(pfrom->GetId());
+
+            if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock)) {
+                // The header can't be checked without its parent; fetching the whole block syncs us up to it
+                pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+                return true;
+            }
+
+            // The header is added before the block is rebuilt, so it counts against the peer's headers without blocks
+            CBlockIndex* pindex = NULL;
             CValidationState state;
-            if (!mapBlockIndex.count(block.GetHash())) {
-                ProcessNewBlock(state, pfrom, &block);
+            if (!AcceptHeaderFromPeer(pfrom->GetId(), cmpctblock.header, hashBlock, state, &pindex)) {
                 int nDoS;
-                if(state.IsInvalid(nDoS)) {
-                    pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                                       state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                    if(nDoS > 0) {
-                        TRY_LOCK(cs_main, lockMain);
-                        if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
-                    }
+                if (state.IsInvalid(nDoS)) {
+                    if (nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    LogPrintf("Peer %d sent us invalid header via cmpctblock\n", pfrom->id);
                 }
-                //disconnect this node if its old protocol version
-                pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
-            } else {
-                LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+                return true;
+            }
+            if (pindex == NULL || (pindex->nStatus & BLOCK_HAVE_DATA) || mapBlocksAwaitingParent.count(hashBlock))
+                return true;
+
+            nodestate->nCompactBlocks++;
+            UpdateBlockAvailability(pfrom->GetId(), hashBlock);
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hashBlock);
+            bool fAlreadyInFlight = itInFlight != mapBlocksInFlight.end();
+            if (fAlreadyInFlight && itInFlight->second.first != pfrom->GetId())
+                return true;
+
+            // Only rebuild blocks that extend our tip about now: the mempool is of little use for
+            // blocks further ahead, and it bounds the work a peer can make us do. Fetch others whole.
+            if (pindex->nChainWork <= chainActive.Tip()->nChainWork || pindex->nHeight > chainActive.Height() + 2 ||
+                (!fAlreadyInFlight && nodestate->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER)) {
+                if (fAlreadyInFlight || (pindex->nChainWork > chainActive.Tip()->nChainWork && nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER)) {
+                    MarkBlockAsInFlight(pfrom->GetId(), hashBlock, pindex);
+                    pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+                }
+                return true;
+            }
+
+            list<QueuedBlock>::iterator itQueued;
+            if (!MarkBlockAsInFlight(pfrom->GetId(), hashBlock, pindex, &itQueued) && itQueued->partialBlock) {
+                LogPrint("cmpctblock", "peer=%d sent us a compact block we were already rebuilding\n", pfrom->id);
+                return true;
+            }
+            itQueued->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+            PartiallyDownloadedBlock& partialBlock = *itQueued->partialBlock;
+
+            // Transactions are also looked up among the orphans, which often are in the next block
+            std::vector<const CTransaction*> vOrphans;
+            vOrphans.reserve(mapOrphanTransactions.size());
+            for (map<uint256, COrphanTx>::const_iterator mi = mapOrphanTransactions.begin(); mi != mapOrphanTransactions.end(); ++mi)
+                vOrphans.push_back(&mi->second.tx);
+
+            PartiallyDownloadedBlock::ReadStatus status = partialBlock.InitData(cmpctblock, vOrphans);
+            if (status == PartiallyDownloadedBlock::READ_STATUS_INVALID) {
+                MarkBlockAsReceived(hashBlock);
+                nodestate->nCompactFailed++;
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+                return true;
+            } else if (status == PartiallyDownloadedBlock::READ_STATUS_FAILED) {
+                // Duplicate short IDs; the block stays in flight from this peer, ask for all of it
+                nodestate->nCompactFailed++;
+                itQueued->partialBlock.reset();
+                pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                if (!partialBlock.IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+            if (!req.indexes.empty()) {
+                req.blockhash = hashBlock;
+                LogPrint("cmpctblock", "requesting %u transactions of compact block %s from peer=%d\n", req.indexes.size(), hashBlock.ToString(), pfrom->id);
+                pfrom->PushMessage("getblocktxn", req);
+                return true;
             }
+            resp.blockhash = hashBlock;
         }
+
+        // Every transaction was found locally: the block is complete without a round trip
+        ProcessBlockTransactions(pfrom, resp);
+    }
+
+
+    else if (strCommand == "getblocktxn") {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // Too old to be rebuilt from a mempool; answer as if the whole block was asked for
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, mi->second))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indices\n", pfrom->id);
+                return true;
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+        ProcessBlockTransactions(pfrom, resp);
     }
 
 
@@ -6417,15 +7971,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 LogPrint("net", "Unparseable reject message received\n");
             }
         }
-    } else {
-        //probably one the extensions
-        obfuScationPool.ProcessMessageObfuscation(pfrom, strCommand, vRecv);
+    } else if (GetMessageLockClasses(strCommand) == MSG_LOCK_MASTERNODE) {
+        // Runs in parallel with the chain handlers, so leave their extensions alone
         mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
         budget.ProcessMessage(pfrom, strCommand, vRecv);
         masternodePayments.ProcessMessageMasternodePayments(pfrom, strCommand, vRecv);
+        masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
+    } else {
+        //probably one the extensions
+        obfuScationPool.ProcessMessageObfuscation(pfrom, strCommand, vRecv);
         ProcessMessageSwiftTX(pfrom, strCommand, vRecv);
         ProcessSpork(pfrom, strCommand, vRecv);
-        masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
     }
 
 
@@ -6470,8 +8026,10 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
-    if (!pfrom->vRecvGetData.empty())
+    if (!pfrom->vRecvGetData.empty()) {
+        CMessageLocks locks(GetMessageLockClasses("getdata"));
         ProcessGetData(pfrom);
+    }
 
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
@@ -6528,7 +8086,12 @@ bool ProcessMessages(CNode* pfrom)
 
         // Process message
         bool fRet = false;
+        int64_t nHandlerStart = 0;
+        int nStatsSlot = GetMessageStatsSlot(strCommand);
         try {
+            CMessageLocks locks(GetMessageLockClasses(strCommand));
+            nHandlerStart = GetTimeMicros();
+            RecordMessageQueueTime(nStatsSlot, nHandlerStart - msg.nTime);
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
             boost::this_thread::interruption_point();
         } catch (std::ios_base::failure& e) {
@@ -6549,6 +8112,8 @@ bool ProcessMessages(CNode* pfrom)
         } catch (...) {
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
+        if (nHandlerStart)
+            pfrom->msgCounters.RecordRecv(nStatsSlot, CMessageHeader::HEADER_SIZE + nMessageSize, GetTimeMicros() - nHandlerStart);
 
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
@@ -6600,18 +8165,23 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
         }
 
+        // Don't run in parallel with the chain message handlers, SendMessages shares their state
+        TRY_LOCK(cs_msgChain, lockChain);
+        if (!lockChain)
+            return true;
         TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
         if (!lockMain)
             return true;
+        ApplyPendingMisbehavior();
 
         // Address refresh broadcast
         static int64_t nLastRebroadcast;
         if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60)) {
             LOCK(cs_vNodes);
             BOOST_FOREACH (CNode* pnode, vNodes) {
-                // Periodically clear setAddrKnown to allow refresh broadcasts
+                // Periodically clear filterAddrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
-                    pnode->setAddrKnown.clear();
+                    pnode->filterAddrKnown.reset();
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -6627,8 +8197,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH (const CAddress& addr, pto->vAddrToSend) {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second) {
+                // returns true if it wasn't already contained in the filter
+                if (pto->filterAddrKnown.insert(addr.GetKey())) {
                     vAddr.push_back(addr);
                     // receiver rejects addr messages larger than 1000
                     if (vAddr.size() >= 1000) {
@@ -6670,13 +8240,23 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 6 * 60 * 60) { // NOTE: was "close to today" and 24h in Bitcoin
                 state.fSyncStarted = true;
                 nSyncStarted++;
-                //CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
-                //LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
-                //pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
-                pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                if (fHeadersFirstSync && pto->nVersion >= HEADERS_FIRST_VERSION) {
+                    CBlockIndex* pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
+                    LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
+                    pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
+                } else {
+                    pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                }
             }
         }
 
+        // Resume header sync paused at MAX_HEADERS_ONLY_PER_PEER once half of the blocks arrived
+        if (state.fHeadersPaused && state.nHeadersOnly <= MAX_HEADERS_ONLY_PER_PEER / 2) {
+            state.fHeadersPaused = false;
+            LogPrint("net", "resuming header sync (%d) with peer=%d\n", pindexBestHeader->nHeight, pto->id);
+            pto->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256(0));
+        }
+
         // Resend wallet transactions that haven't gotten in a block yet
         // Except during reindex, importing and IBD, when old wallet
         // transactions become unconfirmed and spams other nodes.
@@ -6694,7 +8274,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInv.reserve(pto->vInventoryToSend.size());
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH (const CInv& inv, pto->vInventoryToSend) {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -6713,8 +8293,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second) {
+                // returns true if it wasn't already contained in the filter
+                if (pto->filterInventoryKnown.insert(inv)) {
                     vInv.push_back(inv);
                     if (vInv.size() >= 1000) {
                         pto->PushMessage("inv", vInv);
@@ -6754,8 +8334,13 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
             FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            FindSnapshotHistoryToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload);
             BOOST_FOREACH (CBlockIndex* pindex, vToDownload) {
-                vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                // The block on top of our tip, once synced, is fetched as a compact block
+                if (state.fProvidesHeaderAndIDs && pindex->pprev == chainActive.Tip() && !IsInitialBlockDownload())
+                    vGetData.push_back(CInv(MSG_CMPCT_BLOCK, pindex->GetBlockHash()));
+                else
+                    vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), pindex);
                 LogPrintf("Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->id);
@@ -6771,7 +8356,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: getdata (non-blocks)
         //
-        while (!pto->fDisconnect && !pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow) {
+        // AlreadyHave looks up masternode items; if their handlers are busy, ask next time
+        TRY_LOCK(cs_msgMasternode, lockMasternode);
+        while (lockMasternode && !pto->fDisconnect && !pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow) {
             const CInv& inv = (*pto->mapAskFor.begin()).second;
             if (!AlreadyHave(inv)) {
                 if (fDebug)
@@ -6793,33 +8380,28 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 
 bool CBlockUndo::WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to append
-    CAutoFile fileout(OpenUndoFile(pos), SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("CBlockUndo::WriteToDisk : OpenUndoFile failed");
-
-    // Write index header
-    unsigned int nSize = fileout.GetSerializeSize(*this);
-    fileout << FLATDATA(Params().MessageStart()) << nSize;
-
-    // Write undo data
-    long fileOutPos = ftell(fileout.Get());
-    if (fileOutPos < 0)
-        return error("CBlockUndo::WriteToDisk : ftell failed");
-    pos.nPos = (unsigned int)fileOutPos;
-    fileout << *this;
+    // Serialize index header and undo data; the block writer appends them at the reserved position
+    CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+    unsigned int nSize = ssRecord.GetSerializeSize(*this);
+    ssRecord << FLATDATA(Params().MessageStart()) << nSize << *this;
 
     // calculate & write checksum
     CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
     hasher << hashBlock;
     hasher << *this;
-    fileout << hasher.GetHash();
+    ssRecord << hasher.GetHash();
+
+    if (!blockDiskWriter.WriteUndo(pos, ssRecord))
+        return error("CBlockUndo::WriteToDisk : write failed");
+    pos.nPos += MESSAGE_START_SIZE + sizeof(nSize);
 
     return true;
 }
 
 bool CBlockUndo::ReadFromDisk(const CDiskBlockPos& pos, const uint256& hashBlock)
 {
+    blockDiskWriter.WaitForFile(pos.nFile);
+
     // Open history file to read
     CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
@@ -46,16 +46,19 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CCoinsViewDB;
 class CZerocoinDB;
 class CSporkDB;
 class CBloomFilter;
 class CInv;
 class CScriptCheck;
+class CSerializedBlock;
 class CValidationInterface;
 class CValidationState;
 
 struct CBlockTemplate;
 struct CNodeStateStats;
+struct CMessageQueueStats;
 //std::map<std::string, int> masternodeTiers;
 /** Default for -blockmaxsize and -blockminsize, which control the range of sizes the mining code will create **/
 static const unsigned int DEFAULT_BLOCK_MAX_SIZE = 750000;
@@ -77,12 +80,22 @@ static const unsigned int MAX_TX_SIGOPS_CURRENT = MAX_BLOCK_SIGOPS_CURRENT / 5;
 static const unsigned int MAX_TX_SIGOPS_LEGACY = MAX_BLOCK_SIGOPS_LEGACY / 5;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Seconds between background writes of mempool.dat */
+static const int MEMPOOL_DUMP_INTERVAL = 15 * 60;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Block files containing a block-height within MIN_BLOCKS_TO_KEEP of chainActive.Tip() will not be pruned. */
+static const unsigned int MIN_BLOCKS_TO_KEEP = 288;
+/** Blocks below the tip that the accumulator checkpoint calculation reads (two checkpoint periods) */
+static const int ACCUMULATOR_BLOCKS_TO_KEEP = 20;
+/** Minimum disk space reserved for block and undo files when pruning (-prune) */
+static const uint64_t MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
 /** Coinbase transaction outputs can only be spent after this number of new blocks (network rule) */
 static const int COINBASE_MATURITY = 5;
 /** Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp. */
@@ -103,6 +116,13 @@ static const unsigned int MAX_HEADERS_RESULTS = 2000;
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
  *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Maximum number of block index entries a peer's headers may add before the blocks of these arrive.
+ *  Proof-of-stake headers can't be checked without the coinstake, so this bounds what a peer sending
+ *  made-up headers can make us store; header sync with the peer pauses until its blocks catch up. */
+static const int MAX_HEADERS_ONLY_PER_PEER = 2 * MAX_HEADERS_RESULTS;
+/** Maximum total size of blocks kept in memory because they arrived before the data of their parent
+ *  (headers-first download fetches the window from several peers out of order). */
+static const unsigned int MAX_BLOCKS_AWAITING_PARENT_SIZE = 64 * 1024 * 1024;
 /** Time to wait (in seconds) between writing blockchain state to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
 /** Maximum length of reject messages. */
@@ -142,10 +162,24 @@ extern int nScriptCheckThreads;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
+/** True if any block files below the tip are missing (pruned, or the node was started from a UTXO snapshot) */
+extern bool fHavePruned;
+/** Height of the UTXO snapshot this node was started from whose history is not yet validated, -1 if none; protected by cs_main */
+extern int nUTXOSnapshotHeight;
+/** Height up to which the history below nUTXOSnapshotHeight has been validated; protected by cs_main */
+extern int nUTXOSnapshotValidatedHeight;
+/** Download headers first and then blocks from several peers in parallel (-headersfirst) */
+extern bool fHeadersFirstSync;
+/** True if we're running in -prune mode. */
+extern bool fPruneMode;
+/** Number of bytes of block and undo files to stay below in -prune mode. */
+extern uint64_t nPruneTarget;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
 extern bool fVerifyingBlocks;
+/** True once mempool.dat was loaded, or there was nothing to load; protected by cs_main */
+extern bool fMempoolLoaded;
 
 extern bool fLargeWorkForkFound;
 extern bool fLargeWorkInvalidChainFound;
@@ -191,6 +225,8 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
  * @return True if state.IsValid()
  */
 bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp = NULL);
+/** Process the blocks received from peers ahead of the block hashParent, once it was processed itself */
+void ProcessBlocksAwaitingParent(const uint256& hashParent);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -199,6 +235,12 @@ FILE* OpenBlockFile(const CDiskBlockPos& pos, bool fReadOnly = false);
 FILE* OpenUndoFile(const CDiskBlockPos& pos, bool fReadOnly = false);
 /** Translation to a filesystem path */
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos& pos, const char* prefix);
+/** Calculate the amount of disk space the block & undo files currently use */
+uint64_t CalculateCurrentUsage();
+/** Mark one block file as pruned: its blocks lose their data and undo positions */
+void PruneOneBlockFile(const int fileNumber);
+/** Actually unlink the specified files */
+void UnlinkPrunedFiles(std::set<int>& setFilesToPrune);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp = NULL);
 /** Initialize a new block tree database + block data on disk */
@@ -211,6 +253,20 @@ void UnloadBlockIndex();
 int ActiveProtocol();
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
+/**
+ * State that P2P message handlers share with the handlers of other commands.
+ * The message handler threads process different peers in parallel, but a
+ * command only runs while its handler holds the lock of every class it uses;
+ * see GetMessageLockClasses.
+ */
+enum MessageLockClass {
+    MSG_LOCK_CHAIN = (1 << 0),      //! block chain, mempool, addresses, sporks, SwiftTX and obfuscation
+    MSG_LOCK_MASTERNODE = (1 << 1), //! masternode list, payments, budgets and masternode sync
+};
+/** Lock classes (a combination of MessageLockClass) the handler of strCommand needs */
+int GetMessageLockClasses(const std::string& strCommand);
+/** Get the time P2P messages waited between their receipt and their handler, per command */
+void GetMessageQueueStats(std::map<std::string, CMessageQueueStats>& mapStats);
 /**
  * Send queued protocol messages to be sent to a give node.
  *
@@ -220,6 +276,8 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the header hashing thread */
+void ThreadHeaderHashCheck();
 
 // ***TODO*** probably not the right place for these 2
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
@@ -254,11 +312,21 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats);
 void Misbehaving(NodeId nodeid, int howmuch);
 /** Flush all state, indexes and buffers to disk. */
 void FlushStateToDisk();
+/** Memory used by mapBlockIndex and the CBlockIndex entries it owns (in bytes) */
+size_t BlockIndexDynamicMemoryUsage();
 
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false);
 
+/** (try to) add transaction to memory pool with a specified acceptance time **/
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee = false, bool ignoreFees = false);
+
+/** Load the mempool and the PrioritiseTransaction deltas from mempool.dat */
+bool LoadMempool();
+/** Write the mempool and the PrioritiseTransaction deltas to mempool.dat */
+bool DumpMempool();
+
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool isDSTX = false);
 
 int GetInputAge(CTxIn& vin);
@@ -271,6 +339,24 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    bool fProvidesHeaderAndIDs;
+    bool fHighBandwidthFrom;
+    bool fHighBandwidthTo;
+    int nCompactBlocks;
+    int nCompactReconstructed;
+    int nCompactBlockTxn;
+    int nCompactFailed;
+    int64_t nCompactLatency;
+};
+
+/** Time that received messages of one command waited before they were handled */
+struct CMessageQueueStats {
+    uint64_t nCount;
+    //! Total and longest wait, in microseconds
+    int64_t nTotalTime;
+    int64_t nMaxTime;
+
+    CMessageQueueStats() : nCount(0), nTotalTime(0), nMaxTime(0) {}
 };
 
 struct CDiskTxPos : public CDiskBlockPos {
@@ -356,6 +442,8 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
 bool CheckZerocoinMint(const uint256& txHash, const CTxOut& txout, CValidationState& state, bool fCheckOnly = false);
 bool CheckZerocoinSpend(const CTransaction tx, bool fVerifySignature, CValidationState& state);
 libzerocoin::CoinSpend TxInToZerocoinSpend(const CTxIn& txin);
+/** The serials of the zerocoin spends in tx, without verifying the spends */
+std::vector<CBigNum> GetZerocoinSpendSerials(const CTransaction& tx);
 bool TxOutToPublicCoin(const CTxOut txout, libzerocoin::PublicCoin& pubCoin, CValidationState& state);
 bool BlockToPubcoinList(const CBlock& block, list<libzerocoin::PublicCoin>& listPubcoins);
 bool BlockToZerocoinMintList(const CBlock& block, std::list<CZerocoinMint>& vMints);
@@ -448,6 +536,12 @@ public:
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Read the serialized bytes of a block without decoding it, from the block file mapping when there is one */
+bool ReadRawBlockFromDisk(CSerializedBlock& block, const CDiskBlockPos& pos);
+/** As above, checking the block header against the index entry */
+bool ReadRawBlockFromDisk(CSerializedBlock& block, const CBlockIndex* pindex);
+/** Append a block and its undo data taken from a UTXO snapshot to the block files */
+bool WriteSnapshotBlock(CBlock& block, CBlockUndo& blockundo, int nHeight, CDiskBlockPos& blockPos, CDiskBlockPos& undoPos);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -455,8 +549,9 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
  *  will be true if no problems were found. Otherwise, the return value will be false in case
- *  of problems. Note that in any case, coins may be modified. */
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
+ *  of problems. Note that in any case, coins may be modified. The undo data is read from disk
+ *  unless pblockundo has it already. */
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL, const CBlockUndo* pblockundo = NULL);
 
 /** Reprocess a number of blocks to try and get on the correct chain again **/
 bool DisconnectBlocksAndReprocess(int blocks);
@@ -464,9 +559,18 @@ bool DisconnectBlocksAndReprocess(int blocks);
 /** Apply the effects of this block (with given index) on the UTXO set represented by coins */
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck, bool fAlreadyChecked = false);
 
+/**
+ * Apply a block below the UTXO snapshot to coins, a chain state separate from pcoinsTip that is rebuilt
+ * from genesis to check the snapshot. Unlike ConnectBlock it has no effect outside coins: the block index
+ * entry, the zerocoin database and the budget data stay as the snapshot left them. Requires cs_main.
+ */
+bool ConnectSnapshotHistoryBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins);
+
 /** Context-independent validity checks */
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true, bool fCheckSig = true);
+/** The part of CheckBlock that only looks at the block, without the SwiftTX, masternode payment and zerocoin checks; needs no lock */
+bool CheckBlockContextFree(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
 bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev);
 
 /** Context-dependent validity checks */
@@ -539,6 +643,16 @@ public:
     }
 };
 
+/** Highest block a pruned block file may hold with the tip at nTipHeight, or -1 if nothing can be pruned yet */
+int GetPruneHeight(int nTipHeight);
+/**
+ * Add to setFilesToPrune the block files before nLastBlockFile, oldest first, whose deletion brings
+ * nCurrentUsage (plus a buffer for the next allocation) below nTarget. Files with a block above
+ * nPruneHeight, or with history the UTXO snapshot validation still needs, are kept. Returns the
+ * usage that remains.
+ */
+uint64_t SelectFilesToPrune(const std::vector<CBlockFileInfo>& vinfoFiles, int nLastBlockFile, uint64_t nCurrentUsage, uint64_t nTarget, int nPruneHeight, std::set<int>& setFilesToPrune);
+
 /** Capture information about block/transaction validation */
 class CValidationState
 {
@@ -615,6 +729,13 @@ public:
 /** RAII wrapper for VerifyDB: Verify consistency of the block and coin databases */
 class CVerifyDB
 {
+private:
+    int64_t nStartTime;
+    int64_t nLastReport;
+
+    //! Show progress and the estimated time left, also as the RPC warmup status
+    void ReportProgress(int nPercent);
+
 public:
     CVerifyDB();
     ~CVerifyDB();
@@ -636,6 +757,9 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache* pcoinsTip;
 
+/** Global variable that points to the coin database backing pcoinsTip (protected by cs_main) */
+extern CCoinsViewDB* pcoinsdbview;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB* pblocktree;
 
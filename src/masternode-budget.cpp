@@ -74,6 +74,7 @@ bool IsBudgetCollateralValid(uint256 nTxCollateralHash, uint256 nExpectedHash, s
 
     int conf = GetIXConfirmations(nTxCollateralHash);
     if (nBlockHash != uint256(0)) {
+        LOCK(cs_main);
         BlockMap::iterator mi = mapBlockIndex.find(nBlockHash);
         if (mi != mapBlockIndex.end() && (*mi).second) {
             CBlockIndex* pindex = (*mi).second;
@@ -207,6 +208,7 @@ void CBudgetManager::SubmitFinalBudget()
     }
 
     if (nBlockHash != uint256(0)) {
+        LOCK(cs_main);
         BlockMap::iterator mi = mapBlockIndex.find(nBlockHash);
         if (mi != mapBlockIndex.end() && (*mi).second) {
             CBlockIndex* pindex = (*mi).second;
@@ -412,13 +414,15 @@ bool CBudgetManager::AddFinalizedBudget(CFinalizedBudget& finalizedBudget)
 
 bool CBudgetManager::AddProposal(CBudgetProposal& budgetProposal)
 {
-    LOCK(cs);
+    // Checking the collateral takes cs_main, which must not be waited for under cs
     std::string strError = "";
     if (!budgetProposal.IsValid(strError)) {
         LogPrint("masternode","CBudgetManager::AddProposal - invalid budget proposal - %s\n", strError);
         return false;
     }
 
+    LOCK(cs);
+
     if (mapProposals.count(budgetProposal.GetHash())) {
         return false;
     }
@@ -843,6 +847,8 @@ CAmount CBudgetManager::GetTotalBudget(int nHeight)
 
 void CBudgetManager::NewBlock()
 {
+    // The collateral checks below take cs_main, which comes before cs
+    LOCK(cs_main);
     TRY_LOCK(cs, fBudgetNewBlock);
     if (!fBudgetNewBlock) return;
 
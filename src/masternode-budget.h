@@ -18,6 +18,8 @@
 
 using namespace std;
 
+//! Serializes the budget message handlers. Lock order: cs_budget, cs_main, CBudgetManager::cs;
+//! block validation takes CBudgetManager::cs under cs_main, so nothing waits for cs_main under it
 extern CCriticalSection cs_budget;
 
 class CBudgetManager;
@@ -44,7 +46,7 @@ void DumpBudgets();
 // Define amount of blocks in budget payment cycle
 int GetBudgetPaymentCycleBlocks();
 
-//Check the collateral transaction for the budget proposal/finalized budget
+//Check the collateral transaction for the budget proposal/finalized budget; takes cs_main, so never call it holding CBudgetManager::cs
 bool IsBudgetCollateralValid(uint256 nTxCollateralHash, uint256 nExpectedHash, std::string& strError, int64_t& nTime, int& nConf);
 
 //
@@ -173,6 +173,16 @@ void DumpMasternodePayments()
     LogPrint("masternode","Budget dump finished  %dms\n", GetTimeMillis() - nStart);
 }
 
+bool IsBlockValueValidWithoutBudgets(int nHeight, CAmount nExpectedValue, CAmount nMinted)
+{
+    //super blocks will always be on these blocks, max 100 per budgeting
+    if (nHeight % GetBudgetPaymentCycleBlocks() < 100)
+        return true;
+    if (nMinted < 16 * COIN)
+        return true;
+    return nMinted <= nExpectedValue;
+}
+
 bool IsBlockValueValid(const CBlock& block, CAmount nExpectedValue, CAmount nMinted)
 {
     CBlockIndex* pindexPrev = chainActive.Tip();
@@ -194,16 +204,7 @@ bool IsBlockValueValid(const CBlock& block, CAmount nExpectedValue, CAmount nMin
     //LogPrintf("XX69----------> IsBlockValueValid(): nMinted: %d, nExpectedValue: %d\n", FormatMoney(nMinted), FormatMoney(nExpectedValue));
 
     if (!masternodeSync.IsSynced()) { //there is no budget data to use to check anything
-        //super blocks will always be on these blocks, max 100 per budgeting
-        if (nHeight % GetBudgetPaymentCycleBlocks() < 100) {
-            return true;
-	} else if (nMinted < 16 * COIN){
-	     return true;
-        } else {
-            if (nMinted > nExpectedValue) {
-                return false;
-            }
-        }
+        return IsBlockValueValidWithoutBudgets(nHeight, nExpectedValue, nMinted);
     } else { // we're synced and have data so check the budget schedule
 
         //are these blocks even enabled
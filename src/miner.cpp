@@ -26,8 +26,9 @@
 #include "accumulators.h"
 #include "spork.h"
 
+#include <limits>
+
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 
@@ -36,53 +37,432 @@ using namespace std;
 // CatocoinMiner
 //
 
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+int64_t nLastCoinStakeSearchInterval = 0;
+
 //
 // Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
+// transactions in the memory pool. The pool keeps, for every transaction,
+// the size and fees of it together with its in-mempool ancestors, so block
+// assembly picks the best such package first: a child paying a high fee
+// pulls in the low-fee parent it needs.
 //
-class COrphan
-{
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+// Once part of a package is in the block, the rest of it is ranked by what
+// is left to include: CTxMemPoolModifiedEntry holds the ancestor totals of a
+// transaction minus the ancestors already in the block.
+//
+struct CTxMemPoolModifiedEntry {
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry) : iter(entry), nSizeWithAncestors(entry->second.GetSizeWithAncestors()),
+                                                        nModFeesWithAncestors(entry->second.GetModFeesWithAncestors()) {}
+};
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+// Same order as CTxMemPool::CompareIteratorByAncestorScore
+struct CompareModifiedEntry {
+    bool operator()(const CTxMemPoolModifiedEntry& a, const CTxMemPoolModifiedEntry& b) const
     {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2)
+            return a.iter->first < b.iter->first;
+        return f1 > f2;
     }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
-int64_t nLastCoinStakeSearchInterval = 0;
+// A transaction has more in-mempool ancestors than any of its parents, so
+// this puts a package in an order in which it can be connected
+struct CompareTxIterByAncestorCount {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        if (a->second.GetCountWithAncestors() != b->second.GetCountWithAncestors())
+            return a->second.GetCountWithAncestors() < b->second.GetCountWithAncestors();
+        return a->first < b->first;
+    }
+};
+
+// We want to sort transactions by priority in the priority part of the block:
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+struct TxCoinAgePriorityCompare {
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b) const
+    {
+        if (a.first == b.first)
+            return CTxMemPool::CompareIteratorByAncestorScore()(b.second, a.second); // Reverse order to make sort less than
+        return a.first < b.first;
+    }
+};
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+/**
+ * Fills a block template with transactions from the memory pool. The first
+ * -blockprioritysize bytes go to the highest priority transactions,
+ * regardless of fee, and the rest of the block to packages by fee rate.
+ * Every transaction is still checked against the coins view before it is
+ * added, and a package goes in completely or not at all.
+ *
+ * The caller holds cs_main and mempool.cs.
+ */
+class CBlockAssembler
 {
-    bool byFee;
+private:
+    CBlockTemplate* pblocktemplate;
+    CBlock* pblock;
+    CCoinsViewCache& view;
+    const int nHeight;
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockPrioritySize;
+    unsigned int nBlockMinSize;
+    bool fPrintPriority;
+    //! Transactions whose scripts were checked for an earlier template
+    const std::set<uint256>& setPrevScriptChecked;
+
+    CTxMemPool::setEntries inBlock;
+    vector<CBigNum> vBlockSerials;
+
+    // Transactions with ancestors in the block, ranked by their remaining package
+    typedef std::map<CTxMemPool::txiter, CTxMemPoolModifiedEntry, CTxMemPool::CompareIteratorByHash> modtxmap;
+    modtxmap mapModifiedTx;
+    std::set<CTxMemPoolModifiedEntry, CompareModifiedEntry> setModifiedTx;
+
+    bool TestTransaction(CTxMemPool::txiter iter, CCoinsViewCache& viewPackage, unsigned int nPackageSigOps, vector<CBigNum>& vPackageSerials, CAmount& nTxFees, unsigned int& nTxSigOps);
+    bool AddPackage(const vector<CTxMemPool::txiter>& vPackage);
+    void UpdatePackagesForAdded(const vector<CTxMemPool::txiter>& vAdded);
+    void RemoveModified(CTxMemPool::txiter iter);
 
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) {}
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+    //! Transactions that passed the script checks in this run
+    std::set<uint256> setScriptChecked;
+    //! Whether a transaction was left out for its lock time
+    bool fSkippedNonFinal;
+
+    CBlockAssembler(CBlockTemplate* pblocktemplateIn, CCoinsViewCache& viewIn, int nHeightIn, unsigned int nBlockMaxSizeIn, unsigned int nBlockPrioritySizeIn, unsigned int nBlockMinSizeIn, const std::set<uint256>& setPrevScriptCheckedIn);
+
+    void AddPriorityTxs();
+    void AddPackageTxs();
+};
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
-    {
-        if (byFee) {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+CBlockAssembler::CBlockAssembler(CBlockTemplate* pblocktemplateIn, CCoinsViewCache& viewIn, int nHeightIn, unsigned int nBlockMaxSizeIn, unsigned int nBlockPrioritySizeIn, unsigned int nBlockMinSizeIn, const std::set<uint256>& setPrevScriptCheckedIn)
+    : pblocktemplate(pblocktemplateIn), pblock(&pblocktemplateIn->block), view(viewIn), nHeight(nHeightIn),
+      nBlockMaxSize(nBlockMaxSizeIn), nBlockPrioritySize(nBlockPrioritySizeIn), nBlockMinSize(nBlockMinSizeIn),
+      setPrevScriptChecked(setPrevScriptCheckedIn), nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0), fSkippedNonFinal(false)
+{
+    fPrintPriority = GetBoolArg("-printpriority", false);
+}
+
+bool CBlockAssembler::TestTransaction(CTxMemPool::txiter iter, CCoinsViewCache& viewPackage, unsigned int nPackageSigOps, vector<CBigNum>& vPackageSerials, CAmount& nTxFees, unsigned int& nTxSigOps)
+{
+    const CTransaction& tx = iter->second.GetTx();
+    if (tx.IsCoinBase() || tx.IsCoinStake())
+        return false;
+    if (!IsFinalTx(tx, nHeight)) {
+        fSkippedNonFinal = true;
+        return false;
+    }
+
+    if (GetAdjustedTime() > GetSporkValue(SPORK_16_ZEROCOIN_MAINTENANCE_MODE) && tx.ContainsZerocoins())
+        return false;
+
+    // Legacy limits on sigOps:
+    unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS_CURRENT;
+    nTxSigOps = GetLegacySigOpCount(tx);
+    if (nBlockSigOps + nPackageSigOps + nTxSigOps >= nMaxBlockSigOps)
+        return false;
+
+    if (!viewPackage.HaveInputs(tx))
+        return false;
+
+    // double check that there are no double spent zCatocoin spends in this block or tx
+    if (tx.IsZerocoinSpend()) {
+        int nHeightTx = 0;
+        if (IsTransactionInChain(tx.GetHash(), nHeightTx))
+            return false;
+
+        for (const CTxIn txIn : tx.vin) {
+            if (txIn.scriptSig.IsZerocoinSpend()) {
+                libzerocoin::CoinSpend spend = TxInToZerocoinSpend(txIn);
+                if (!spend.HasValidSerial(Params().Zerocoin_Params()))
+                    return false;
+                //This zCatocoin serial has already been included in the block, do not add this tx.
+                if (count(vBlockSerials.begin(), vBlockSerials.end(), spend.getCoinSerialNumber()))
+                    return false;
+                if (count(vPackageSerials.begin(), vPackageSerials.end(), spend.getCoinSerialNumber()))
+                    return false;
+                vPackageSerials.emplace_back(spend.getCoinSerialNumber());
+            }
+        }
+    }
+
+    nTxFees = viewPackage.GetValueIn(tx) - tx.GetValueOut();
+
+    nTxSigOps += GetP2SHSigOpCount(tx, viewPackage);
+    if (nBlockSigOps + nPackageSigOps + nTxSigOps >= nMaxBlockSigOps)
+        return false;
+
+    // Note that flags: we don't want to set mempool/IsStandard()
+    // policy here, but we still have to ensure that the block we
+    // create only contains transactions that are valid in new blocks.
+    // The scripts only depend on the transaction and the outputs it spends,
+    // so they don't need a second run; the other input checks do.
+    CValidationState state;
+    bool fScriptChecks = !setPrevScriptChecked.count(tx.GetHash());
+    if (!CheckInputs(tx, state, viewPackage, fScriptChecks, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+        return false;
+    setScriptChecked.insert(tx.GetHash());
+
+    CTxUndo txundo;
+    UpdateCoins(tx, state, viewPackage, txundo, nHeight);
+    return true;
+}
+
+// Add the transactions of vPackage, in order, if all of them are valid
+bool CBlockAssembler::AddPackage(const vector<CTxMemPool::txiter>& vPackage)
+{
+    CCoinsViewCache viewPackage(&view);
+    vector<CBigNum> vPackageSerials;
+    vector<CAmount> vTxFees;
+    vector<unsigned int> vTxSigOps;
+    unsigned int nPackageSigOps = 0;
+    BOOST_FOREACH (CTxMemPool::txiter iter, vPackage) {
+        CAmount nTxFees = 0;
+        unsigned int nTxSigOps = 0;
+        if (!TestTransaction(iter, viewPackage, nPackageSigOps, vPackageSerials, nTxFees, nTxSigOps))
+            return false;
+        nPackageSigOps += nTxSigOps;
+        vTxFees.push_back(nTxFees);
+        vTxSigOps.push_back(nTxSigOps);
+    }
+    viewPackage.Flush();
+
+    for (unsigned int i = 0; i < vPackage.size(); i++) {
+        const CTxMemPoolEntry& entry = vPackage[i]->second;
+        pblock->vtx.push_back(entry.GetTx());
+        pblocktemplate->vTxFees.push_back(vTxFees[i]);
+        pblocktemplate->vTxSigOps.push_back(vTxSigOps[i]);
+        nBlockSize += entry.GetTxSize();
+        ++nBlockTx;
+        nBlockSigOps += vTxSigOps[i];
+        nFees += vTxFees[i];
+        inBlock.insert(vPackage[i]);
+        RemoveModified(vPackage[i]);
+
+        if (fPrintPriority) {
+            LogPrintf("priority %.1f fee %s ancestor fee rate %s txid %s\n",
+                entry.GetPriority(nHeight), CFeeRate(entry.GetModifiedFee(), entry.GetTxSize()).ToString(),
+                CFeeRate(entry.GetModFeesWithAncestors(), entry.GetSizeWithAncestors()).ToString(),
+                entry.GetTx().GetHash().ToString());
+        }
+    }
+    vBlockSerials.insert(vBlockSerials.end(), vPackageSerials.begin(), vPackageSerials.end());
+    UpdatePackagesForAdded(vPackage);
+    return true;
+}
+
+void CBlockAssembler::RemoveModified(CTxMemPool::txiter iter)
+{
+    modtxmap::iterator it = mapModifiedTx.find(iter);
+    if (it == mapModifiedTx.end())
+        return;
+    setModifiedTx.erase(it->second);
+    mapModifiedTx.erase(it);
+}
+
+// Take the newly added transactions out of the packages of their descendants
+void CBlockAssembler::UpdatePackagesForAdded(const vector<CTxMemPool::txiter>& vAdded)
+{
+    BOOST_FOREACH (CTxMemPool::txiter iterAdded, vAdded) {
+        CTxMemPool::setEntries setDescendants;
+        mempool.CalculateDescendants(iterAdded, setDescendants);
+        BOOST_FOREACH (CTxMemPool::txiter iterDesc, setDescendants) {
+            if (inBlock.count(iterDesc))
+                continue;
+            modtxmap::iterator it = mapModifiedTx.find(iterDesc);
+            if (it == mapModifiedTx.end()) {
+                it = mapModifiedTx.insert(std::make_pair(iterDesc, CTxMemPoolModifiedEntry(iterDesc))).first;
+            } else {
+                setModifiedTx.erase(it->second);
+            }
+            it->second.nSizeWithAncestors -= iterAdded->second.GetTxSize();
+            it->second.nModFeesWithAncestors -= iterAdded->second.GetModifiedFee();
+            setModifiedTx.insert(it->second);
+        }
+    }
+}
+
+void CBlockAssembler::AddPriorityTxs()
+{
+    if (nBlockPrioritySize == 0)
+        return;
+
+    // This vector will be sorted into a priority queue:
+    vector<TxCoinAgePriority> vecPriority;
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::txiter mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi) {
+        double dPriority = mi->second.GetPriority(nHeight);
+        CAmount dummy = 0;
+        mempool.ApplyDeltas(mi->first, dPriority, dummy);
+        vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+    }
+    TxCoinAgePriorityCompare comparer;
+    std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+
+    // Transactions waiting for a parent to be included, with their priority
+    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> mapWaitPriority;
+
+    while (!vecPriority.empty()) {
+        // Take highest priority transaction off the priority queue:
+        double dPriority = vecPriority.front().first;
+        CTxMemPool::txiter iter = vecPriority.front().second;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        vecPriority.pop_back();
+
+        if (inBlock.count(iter))
+            continue;
+
+        // Leave the rest to the fee rate ordering once past the priority size
+        // or we run out of high-priority transactions
+        unsigned int nTxSize = iter->second.GetTxSize();
+        if (nBlockSize + nTxSize >= nBlockPrioritySize || !AllowFree(dPriority))
+            break;
+
+        bool fDependent = false;
+        BOOST_FOREACH (CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter)) {
+            if (!inBlock.count(parent)) {
+                fDependent = true;
+                break;
+            }
+        }
+        if (fDependent) {
+            mapWaitPriority[iter] = dPriority;
+            continue;
+        }
+
+        if (!AddPackage(vector<CTxMemPool::txiter>(1, iter)))
+            continue;
+
+        // Add transactions that depend on this one to the priority queue
+        BOOST_FOREACH (CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter)) {
+            std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator it = mapWaitPriority.find(child);
+            if (it != mapWaitPriority.end()) {
+                vecPriority.push_back(TxCoinAgePriority(it->second, child));
+                std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                mapWaitPriority.erase(it);
+            }
+        }
+    }
+}
+
+void CBlockAssembler::AddPackageTxs()
+{
+    // Packages that failed once are not tried again
+    CTxMemPool::setEntries failedTx;
+
+    CTxMemPool::setEntriesByAncestorScore::iterator mi = mempool.setTxByAncestorScore.begin();
+    while (mi != mempool.setTxByAncestorScore.end() || !setModifiedTx.empty()) {
+        // Skip entries that were added, failed, or are ranked in setModifiedTx instead
+        if (mi != mempool.setTxByAncestorScore.end() &&
+            (inBlock.count(*mi) || failedTx.count(*mi) || mapModifiedTx.count(*mi))) {
+            ++mi;
+            continue;
+        }
+
+        // Take the better of the next mempool entry and the best modified entry
+        CTxMemPool::txiter iter;
+        uint64_t nPackageSize;
+        CAmount nPackageFees;
+        bool fUsingModified = false;
+        if (mi == mempool.setTxByAncestorScore.end()) {
+            fUsingModified = true;
+        } else if (!setModifiedTx.empty() && CompareModifiedEntry()(*setModifiedTx.begin(), CTxMemPoolModifiedEntry(*mi))) {
+            fUsingModified = true;
+        }
+        if (fUsingModified) {
+            iter = setModifiedTx.begin()->iter;
+            nPackageSize = setModifiedTx.begin()->nSizeWithAncestors;
+            nPackageFees = setModifiedTx.begin()->nModFeesWithAncestors;
         } else {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            iter = *mi++;
+            nPackageSize = iter->second.GetSizeWithAncestors();
+            nPackageFees = iter->second.GetModFeesWithAncestors();
+        }
+
+        // Size limits
+        bool fSkip = nBlockSize + nPackageSize >= nBlockMaxSize;
+
+        // Skip free transactions if we're past the minimum block size:
+        const CTransaction& tx = iter->second.GetTx();
+        if (!tx.IsZerocoinSpend() && CFeeRate(nPackageFees, nPackageSize) < ::minRelayTxFee && nBlockSize + nPackageSize >= nBlockMinSize)
+            fSkip = true;
+
+        vector<CTxMemPool::txiter> vPackage;
+        if (!fSkip) {
+            CTxMemPool::setEntries setAncestors;
+            uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+            std::string dummy;
+            mempool.CalculateMemPoolAncestors(iter->second, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            BOOST_FOREACH (CTxMemPool::txiter ancestor, setAncestors) {
+                if (!inBlock.count(ancestor))
+                    vPackage.push_back(ancestor);
+            }
+            vPackage.push_back(iter);
+            std::sort(vPackage.begin(), vPackage.end(), CompareTxIterByAncestorCount());
+        }
+
+        if (fSkip || !AddPackage(vPackage)) {
+            RemoveModified(iter);
+            failedTx.insert(iter);
         }
     }
-};
+}
+
+void CBlockTemplateCache::AddTransactions(CBlockTemplate* pblocktemplate, CCoinsViewCache& view, const CBlockIndex* pindexPrev, unsigned int nBlockMaxSizeIn, unsigned int nBlockPrioritySizeIn, unsigned int nBlockMinSizeIn)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
+
+    int64_t nNow = GetAdjustedTime();
+    bool fZerocoinMaintenanceIn = nNow > GetSporkValue(SPORK_16_ZEROCOIN_MAINTENANCE_MODE);
+    if (!fValid || hashPrevBlock != pindexPrev->GetBlockHash() || nHeight != pindexPrev->nHeight ||
+        nTransactionsUpdated != mempool.GetTransactionsUpdated() ||
+        nBlockMaxSize != nBlockMaxSizeIn || nBlockPrioritySize != nBlockPrioritySizeIn || nBlockMinSize != nBlockMinSizeIn ||
+        fZerocoinMaintenance != fZerocoinMaintenanceIn || (nLockTimeCutoff != 0 && nLockTimeCutoff != nNow)) {
+        int64_t nStart = GetTimeMicros();
+        CBlockTemplate selectionNew;
+        CBlockAssembler assembler(&selectionNew, view, pindexPrev->nHeight + 1, nBlockMaxSizeIn, nBlockPrioritySizeIn, nBlockMinSizeIn, setScriptChecked);
+        assembler.AddPriorityTxs();
+        assembler.AddPackageTxs();
+
+        std::swap(selection, selectionNew);
+        // Keep the results of this run only, so the set doesn't outgrow the mempool
+        setScriptChecked.swap(assembler.setScriptChecked);
+        nBlockSize = assembler.nBlockSize;
+        nBlockTx = assembler.nBlockTx;
+        nFees = assembler.nFees;
+
+        fValid = true;
+        hashPrevBlock = pindexPrev->GetBlockHash();
+        nHeight = pindexPrev->nHeight;
+        nTransactionsUpdated = mempool.GetTransactionsUpdated();
+        nBlockMaxSize = nBlockMaxSizeIn;
+        nBlockPrioritySize = nBlockPrioritySizeIn;
+        nBlockMinSize = nBlockMinSizeIn;
+        fZerocoinMaintenance = fZerocoinMaintenanceIn;
+        nLockTimeCutoff = assembler.fSkippedNonFinal ? nNow : 0;
+        LogPrint("bench", "    - Select %u transactions for the block template: %.2fms\n", nBlockTx, (GetTimeMicros() - nStart) * 0.001);
+    }
+
+    CBlock* pblock = &pblocktemplate->block;
+    pblock->vtx.insert(pblock->vtx.end(), selection.block.vtx.begin(), selection.block.vtx.end());
+    pblocktemplate->vTxFees.insert(pblocktemplate->vTxFees.end(), selection.vTxFees.begin(), selection.vTxFees.end());
+    pblocktemplate->vTxSigOps.insert(pblocktemplate->vTxSigOps.end(), selection.vTxSigOps.begin(), selection.vTxSigOps.end());
+}
+
+static CBlockTemplateCache templateCache;
 
 void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
 {
@@ -179,212 +559,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
         const int nHeight = pindexPrev->nHeight + 1;
         CCoinsViewCache view(pcoinsTip);
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi) {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight)){
-                continue;
-            }
-
-            if (GetAdjustedTime() > GetSporkValue(SPORK_16_ZEROCOIN_MAINTENANCE_MODE) && tx.ContainsZerocoins())
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            for (const CTxIn& txin : tx.vin) {
-                //zerocoinspend has special vin
-                if (tx.IsZerocoinSpend()) {
-                    nTotalIn = tx.GetZerocoinSpent();
-                    break;
-                }
-
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash)) {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan) {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
-
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
-        }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        vector<CBigNum> vBlockSerials;
-        vector<CBigNum> vTxSerials;
-        while (!vecPriority.empty()) {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS_CURRENT;
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (!tx.IsZerocoinSpend() && fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            // double check that there are no double spent zCatocoin spends in this block or tx
-            if (tx.IsZerocoinSpend()) {
-                int nHeightTx = 0;
-                if (IsTransactionInChain(tx.GetHash(), nHeightTx))
-                    continue;
-
-                bool fDoubleSerial = false;
-                for (const CTxIn txIn : tx.vin) {
-                    if (txIn.scriptSig.IsZerocoinSpend()) {
-                        libzerocoin::CoinSpend spend = TxInToZerocoinSpend(txIn);
-                        if (!spend.HasValidSerial(Params().Zerocoin_Params()))
-                            fDoubleSerial = true;
-                        if (count(vBlockSerials.begin(), vBlockSerials.end(), spend.getCoinSerialNumber()))
-                            fDoubleSerial = true;
-                        if (count(vTxSerials.begin(), vTxSerials.end(), spend.getCoinSerialNumber()))
-                            fDoubleSerial = true;
-                        if (fDoubleSerial)
-                            break;
-                        vTxSerials.emplace_back(spend.getCoinSerialNumber());
-                    }
-                }
-                //This zCatocoin serial has already been included in the block, do not add this tx.
-                if (fDoubleSerial)
-                    continue;
-            }
-
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
-
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            for (const CBigNum bnSerial : vTxSerials)
-                vBlockSerials.emplace_back(bnSerial);
-
-            if (fPrintPriority) {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash)) {
-                BOOST_FOREACH (COrphan* porphan, mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+        templateCache.AddTransactions(pblocktemplate.get(), view, pindexPrev, nBlockMaxSize, nBlockPrioritySize, nBlockMinSize);
+        nFees = templateCache.nFees;
 
         if (!fProofOfStake) {
             //Masternode and general budget payments
@@ -396,9 +572,9 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
             }
         }
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
+        nLastBlockTx = templateCache.nBlockTx;
+        nLastBlockSize = templateCache.nBlockSize;
+        LogPrintf("CreateNewBlock(): total size %u\n", templateCache.nBlockSize);
 
         // Compute final coinbase transaction.        
         if (!fProofOfStake) {
@@ -428,6 +604,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
         if (!TestBlockValidity(state, *pblock, pindexPrev, false, false)) {
             LogPrintf("CreateNewBlock() : TestBlockValidity failed\n");
             mempool.clear();
+            templateCache.Invalidate();
             return NULL;
         }
     }
@@ -6,16 +6,60 @@
 #ifndef BITCOIN_MINER_H
 #define BITCOIN_MINER_H
 
+#include "main.h"
+
+#include <set>
 #include <stdint.h>
 
-class CBlock;
-class CBlockHeader;
-class CBlockIndex;
 class CReserveKey;
-class CScript;
 class CWallet;
 
-struct CBlockTemplate;
+/**
+ * The transaction selection of the last block template. The staker asks
+ * for a new block every second and getblocktemplate on every poll, mostly
+ * with the same tip and mempool; those requests reuse the selection and
+ * only get a new coinbase or coinstake and header. When the tip or the
+ * mempool changed, the selection is made again from the ancestor score
+ * index the mempool keeps sorted as transactions come and go, skipping the
+ * script checks of the transactions that were checked before.
+ *
+ * Protected by cs_main and mempool.cs.
+ */
+class CBlockTemplateCache
+{
+private:
+    bool fValid;
+    uint256 hashPrevBlock;
+    int nHeight;
+    unsigned int nTransactionsUpdated;
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockPrioritySize;
+    unsigned int nBlockMinSize;
+    bool fZerocoinMaintenance;
+    //! Adjusted time of the selection, when a transaction was left out for its lock time
+    int64_t nLockTimeCutoff;
+    //! The selected transactions with their fees and sigops, without coinbase and coinstake
+    CBlockTemplate selection;
+    std::set<uint256> setScriptChecked;
+
+public:
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    CAmount nFees;
+
+    CBlockTemplateCache() : fValid(false), nHeight(0), nTransactionsUpdated(0), nBlockMaxSize(0), nBlockPrioritySize(0), nBlockMinSize(0),
+                            fZerocoinMaintenance(false), nLockTimeCutoff(0), nBlockSize(0), nBlockTx(0), nFees(0) {}
+
+    /** Append the mempool transactions for a block on pindexPrev to pblocktemplate */
+    void AddTransactions(CBlockTemplate* pblocktemplate, CCoinsViewCache& view, const CBlockIndex* pindexPrev, unsigned int nBlockMaxSizeIn, unsigned int nBlockPrioritySizeIn, unsigned int nBlockMinSizeIn);
+
+    /** Forget the selection and the script check results */
+    void Invalidate()
+    {
+        fValid = false;
+        setScriptChecked.clear();
+    }
+};
 
 /** Run the miner threads */
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads);
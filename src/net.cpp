@@ -12,11 +12,13 @@
 #include "net.h"
 
 #include "addrman.h"
+#include "banman.h"
 #include "chainparams.h"
 #include "clientversion.h"
 #include "miner.h"
 #include "obfuscation.h"
 #include "primitives/transaction.h"
+#include "recvbufferpool.h"
 #include "ui_interface.h"
 #include "wallet.h"
 
@@ -26,6 +28,10 @@
 #include <fcntl.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -74,6 +80,7 @@ struct ListenSocket {
 //
 bool fDiscover = true;
 bool fListen = true;
+SocketEventsMode nSocketEventsMode = SOCKETEVENTS_SELECT;
 uint64_t nLocalServices = NODE_NETWORK;
 CCriticalSection cs_mapLocalHost;
 map<CNetAddr, LocalServiceInfo> mapLocalHost;
@@ -84,11 +91,16 @@ uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = 125;
+int nMessageHandlerThreads = DEFAULT_MESSAGE_HANDLER_THREADS;
+double dKnownInventoryFPRate = DEFAULT_KNOWN_INVENTORY_FP_RATE;
+double dKnownAddrFPRate = DEFAULT_KNOWN_ADDR_FP_RATE;
+// Defined before the nodes are cleaned up in this file, so that it is destroyed after them
+CRecvBufferPool recvBufferPool;
 bool fAddressesInitialized = false;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CNetPayloadRef> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -385,6 +397,31 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+static int hEpoll = -1;
+#endif
+//! Nodes added to vNodes since the socket thread last took them on, with -socketevents=epoll; protected by cs_vNodes
+static vector<CNode*> vNodesNewSocket;
+
+// Called with cs_vNodes held, right after pnode was added to vNodes
+static void AddNodeSocket(CNode* pnode)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (nSocketEventsMode != SOCKETEVENTS_EPOLL)
+        return;
+    // Edge-triggered: the socket thread reads and writes until the socket would block
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+        LogPrintf("epoll_ctl failed for peer=%d: %s\n", pnode->id, NetworkErrorString(WSAGetLastError()));
+        pnode->fDisconnect = true;
+        return;
+    }
+    vNodesNewSocket.push_back(pnode);
+#endif
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMaster)
 {
     if (pszDest == NULL) {
@@ -413,7 +450,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMa
     bool proxyConnectionFailed = false;
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed)) {
-        if (!IsSelectableSocket(hSocket)) {
+        if (nSocketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -428,6 +465,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMa
         {
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
+            AddNodeSocket(pnode);
         }
 
         pnode->nTimeConnected = GetTime();
@@ -487,37 +525,20 @@ void CNode::PushVersion()
 }
 
 
-std::map<CNetAddr, int64_t> CNode::setBanned;
-CCriticalSection CNode::cs_setBanned;
-
 void CNode::ClearBanned()
 {
-    setBanned.clear();
+    banManager.Clear();
 }
 
 bool CNode::IsBanned(CNetAddr ip)
 {
-    bool fResult = false;
-    {
-        LOCK(cs_setBanned);
-        std::map<CNetAddr, int64_t>::iterator i = setBanned.find(ip);
-        if (i != setBanned.end()) {
-            int64_t t = (*i).second;
-            if (GetTime() < t)
-                fResult = true;
-        }
-    }
-    return fResult;
+    return banManager.IsBanned(ip, GetTime());
 }
 
 bool CNode::Ban(const CNetAddr& addr)
 {
-    int64_t banTime = GetTime() + GetArg("-bantime", 60 * 60 * 24); // Default 24-hour ban
-    {
-        LOCK(cs_setBanned);
-        if (setBanned[addr] < banTime)
-            setBanned[addr] = banTime;
-    }
+    int64_t nNow = GetTime();
+    banManager.Ban(CSubNet(addr), CBanEntry(nNow, nNow + GetArg("-bantime", DEFAULT_MISBEHAVING_BANTIME), BanReasonNodeMisbehaving));
     return true;
 }
 
@@ -576,6 +597,8 @@ void CNode::copyStats(CNodeStats& stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    msgCounters.GetStats(stats.vMessageStats);
 }
 #undef X
 
@@ -605,18 +628,69 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
             return false;
         }
 
+        // Receive the payload into a pooled buffer once its size is known, unless this
+        // peer's unhandled messages already hold their share of them
+        if (msg.in_data && msg.nDataPos == 0 && msg.nPoolCapacity == 0 && msg.hdr.nMessageSize > 0 &&
+            GetRecvPoolUsage() < MAX_PEER_RECV_POOL_USAGE)
+            msg.UsePooledBuffer();
+
         pch += handled;
         nBytes -= handled;
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+            // Only the handler thread that owns this node can process it
+            messageHandlerCondition.notify_all();
         }
     }
 
     return true;
 }
 
+CNetMessage::CNetMessage(const CNetMessage& msg) : in_data(msg.in_data), hdrbuf(msg.hdrbuf), hdr(msg.hdr), nHdrPos(msg.nHdrPos),
+                                                   vRecv(msg.vRecv), nDataPos(msg.nDataPos), nTime(msg.nTime), nPoolCapacity(0)
+{
+}
+
+CNetMessage& CNetMessage::operator=(const CNetMessage& msg)
+{
+    if (this != &msg) {
+        if (nPoolCapacity != 0) {
+            CSerializeData data;
+            vRecv.SwapBuffer(data);
+            recvBufferPool.Release(data, nPoolCapacity);
+            nPoolCapacity = 0;
+        }
+        in_data = msg.in_data;
+        hdrbuf = msg.hdrbuf;
+        hdr = msg.hdr;
+        nHdrPos = msg.nHdrPos;
+        vRecv = msg.vRecv;
+        nDataPos = msg.nDataPos;
+        nTime = msg.nTime;
+    }
+    return *this;
+}
+
+CNetMessage::~CNetMessage()
+{
+    if (nPoolCapacity != 0) {
+        CSerializeData data;
+        vRecv.SwapBuffer(data);
+        recvBufferPool.Release(data, nPoolCapacity);
+    }
+}
+
+void CNetMessage::UsePooledBuffer()
+{
+    assert(vRecv.empty() && nPoolCapacity == 0);
+    CSerializeData data;
+    nPoolCapacity = recvBufferPool.Acquire(data, hdr.nMessageSize);
+    // Over the pool's limit the payload grows its own buffer as data arrives
+    if (nPoolCapacity != 0)
+        vRecv.SwapBuffer(data);
+}
+
 int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -655,6 +729,10 @@ int CNetMessage::readData(const char* pch, unsigned int nBytes)
     if (vRecv.size() < nDataPos + nCopy) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
         vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        if (nPoolCapacity != 0 && vRecv.capacity() != nPoolCapacity) {
+            recvBufferPool.Resized(nPoolCapacity, vRecv.capacity());
+            nPoolCapacity = vRecv.capacity();
+        }
     }
 
     memcpy(&vRecv[nDataPos], pch, nCopy);
@@ -664,29 +742,131 @@ int CNetMessage::readData(const char* pch, unsigned int nBytes)
 }
 
 
-// requires LOCK(cs_vSend)
-void SocketSendData(CNode* pnode)
+CNetPayload::CNetPayload(CDataStream& ss)
+{
+    ss.GetAndClear(vData);
+    uint256 hash = Hash(vData.begin(), vData.end());
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+}
+
+CSendMessage::CSendMessage(const CMessageHeader& hdr, const CNetPayloadRef& payloadIn, int nPriorityIn) : payload(payloadIn), nPriority(nPriorityIn), nStatsSlot(GetMessageStatsSlot(hdr.GetCommand()))
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    unsigned int nSize = payload->size();
+    unsigned int nChecksum = payload->GetChecksum();
+    memcpy(pchHeader, hdr.pchMessageStart, MESSAGE_START_SIZE);
+    memcpy(pchHeader + MESSAGE_START_SIZE, hdr.pchCommand, CMessageHeader::COMMAND_SIZE);
+    memcpy(pchHeader + CMessageHeader::MESSAGE_SIZE_OFFSET, &nSize, sizeof(nSize));
+    memcpy(pchHeader + CMessageHeader::CHECKSUM_OFFSET, &nChecksum, sizeof(nChecksum));
+}
 
-    while (it != pnode->vSendMsg.end()) {
-        const CSerializeData& data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
-        if (nBytes > 0) {
-            pnode->nLastSend = GetTime();
-            pnode->nSendBytes += nBytes;
+static const char* pszBlockRelayCommands[] = {
+    "block", "cmpctblock", "blocktxn", "headers", "merkleblock"};
+
+static const char* pszMasternodeCommands[] = {
+    "mnb", "mnp", "mnw", "mnget", "mnvs", "dsee", "dseep", "dseg", "dstx", "ix", "txlvote",
+    "mprop", "mvote", "fbs", "fbvote", "ssc"};
+
+/** SendPriority class of a message by its command; ProcessGetData marks old blocks as historical itself */
+static int GetSendPriority(const std::string& strCommand)
+{
+    for (unsigned int i = 0; i < ARRAYLEN(pszBlockRelayCommands); i++)
+        if (strCommand == pszBlockRelayCommands[i])
+            return SEND_PRIORITY_BLOCK_RELAY;
+    for (unsigned int i = 0; i < ARRAYLEN(pszMasternodeCommands); i++)
+        if (strCommand == pszMasternodeCommands[i])
+            return SEND_PRIORITY_MASTERNODE;
+    return SEND_PRIORITY_NORMAL;
+}
+
+//! Most buffers handed to the kernel in one send call
+static const int MAX_SEND_BUFFERS = 64;
+
+#ifdef WIN32
+typedef WSABUF SendBuffer;
+static void SetSendBuffer(SendBuffer& buffer, const char* pch, size_t nLen)
+{
+    buffer.buf = (char*)pch;
+    buffer.len = nLen;
+}
+#else
+typedef struct iovec SendBuffer;
+static void SetSendBuffer(SendBuffer& buffer, const char* pch, size_t nLen)
+{
+    buffer.iov_base = (void*)pch;
+    buffer.iov_len = nLen;
+}
+#endif
+
+// Drop the messages that were sent completely, accounting the bytes to their classes
+// requires LOCK(cs_vSend)
+void AdvanceSendQueue(CNode* pnode, size_t nBytes, uint64_t* vSentByPriority)
+{
+    while (nBytes > 0) {
+        const CSendMessage& msg = pnode->vSendMsg.front();
+        size_t nLeft = msg.size() - pnode->nSendOffset;
+        if (nBytes < nLeft) {
+            vSentByPriority[msg.nPriority] += nBytes;
+            pnode->msgCounters.RecordSent(msg.nStatsSlot, nBytes, false);
             pnode->nSendOffset += nBytes;
-            pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
-                pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
-                it++;
-            } else {
-                // could not send full message; stop sending more
-                break;
+            break;
+        }
+        vSentByPriority[msg.nPriority] += nLeft;
+        pnode->msgCounters.RecordSent(msg.nStatsSlot, nLeft, true);
+        nBytes -= nLeft;
+        pnode->nSendOffset = 0;
+        pnode->nSendSize -= msg.size();
+        pnode->vSendMsg.pop_front();
+    }
+}
+
+// requires LOCK(cs_vSend)
+void SocketSendData(CNode* pnode)
+{
+    bool fCheckedUploadTarget = pnode->IsUploadExempt();
+    while (!pnode->vSendMsg.empty()) {
+        // Gather the unsent headers and payloads at the front of the queue, without copying them
+        SendBuffer vBuffers[MAX_SEND_BUFFERS];
+        int nBuffers = 0;
+        size_t nOffset = pnode->nSendOffset;
+        size_t nQueued = 0;
+        for (std::deque<CSendMessage>::const_iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nBuffers + 2 <= MAX_SEND_BUFFERS; it++) {
+            const CSendMessage& msg = *it;
+            assert(msg.size() > nOffset);
+            // Historical blocks queued before -maxuploadtarget was reached are not sent after it.
+            // Holding them would stall everything queued behind them, so the peer is dropped
+            // instead, as ProcessGetData does when it is asked for more.
+            if (msg.nPriority == SEND_PRIORITY_HISTORICAL && nOffset == 0 && !fCheckedUploadTarget) {
+                fCheckedUploadTarget = true;
+                if (uploadTarget.IsLimited(SEND_PRIORITY_HISTORICAL, GetTime())) {
+                    LogPrint("net", "historical block serving limit reached, disconnecting peer=%d\n", pnode->id);
+                    uploadTarget.RecordDropped();
+                    pnode->fDisconnect = true;
+                    return;
+                }
             }
-        } else {
+            nQueued += msg.size() - nOffset;
+            if (nOffset < CMessageHeader::HEADER_SIZE) {
+                SetSendBuffer(vBuffers[nBuffers++], msg.pchHeader + nOffset, CMessageHeader::HEADER_SIZE - nOffset);
+                nOffset = CMessageHeader::HEADER_SIZE;
+            }
+            if (msg.payload->size() > 0) {
+                size_t nPayloadOffset = nOffset - CMessageHeader::HEADER_SIZE;
+                SetSendBuffer(vBuffers[nBuffers++], &msg.payload->data()[nPayloadOffset], msg.payload->size() - nPayloadOffset);
+            }
+            nOffset = 0;
+        }
+
+#ifdef WIN32
+        DWORD nSent = 0;
+        int nBytes = WSASend(pnode->hSocket, vBuffers, nBuffers, &nSent, 0, NULL, NULL) == 0 ? (int)nSent : SOCKET_ERROR;
+#else
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = vBuffers;
+        message.msg_iovlen = nBuffers;
+        ssize_t nBytes = sendmsg(pnode->hSocket, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+        if (nBytes <= 0) {
             if (nBytes < 0) {
                 // error
                 int nErr = WSAGetLastError();
@@ -698,295 +878,532 @@ void SocketSendData(CNode* pnode)
             // couldn't send anything at all
             break;
         }
+
+        pnode->nLastSend = GetTime();
+        pnode->nSendBytes += nBytes;
+        pnode->RecordBytesSent(nBytes);
+
+        uint64_t vSentByPriority[SEND_PRIORITY_COUNT] = {};
+        AdvanceSendQueue(pnode, nBytes, vSentByPriority);
+        uploadTarget.RecordSent(vSentByPriority, pnode->nLastSend);
+
+        // could not send everything we gathered; stop sending more
+        if ((size_t)nBytes < nQueued)
+            break;
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->vSendMsg.empty()) {
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+//! Nodes whose sockets had readiness events that were not used up yet; only used by the socket thread
+static set<CNode*> setNodesReady;
+static CTimerWheel timeoutWheel;
+
+// Whether the next message pnode sends is other than a historical block; those nodes are served first
+static bool IsSendingRelay(CNode* pnode)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true) {
-        //
-        // Disconnect nodes
-        //
-        {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH (CNode* pnode, vNodesCopy) {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
-
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
-
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+    TRY_LOCK(pnode->cs_vSend, lockSend);
+    return lockSend && !pnode->vSendMsg.empty() && pnode->vSendMsg.front().nPriority != SEND_PRIORITY_HISTORICAL;
+}
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+static void DisconnectNodes(unsigned int& nPrevNodeCount)
+{
+    {
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // and from the nodes the socket thread has yet to take on, as it may be deleted before then
+                vNodesNewSocket.erase(remove(vNodesNewSocket.begin(), vNodesNewSocket.end(), pnode), vNodesNewSocket.end());
+
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
+
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
-        {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH (CNode* pnode, vNodesDisconnectedCopy) {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0) {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend) {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv) {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH (CNode* pnode, vNodesDisconnectedCopy) {
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0) {
+                bool fDelete = false;
+                {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend) {
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv) {
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete) {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
+                }
+                if (fDelete) {
+                    vNodesDisconnected.remove(pnode);
+                    setNodesReady.erase(pnode);
+                    timeoutWheel.Remove(pnode);
+                    delete pnode;
                 }
             }
         }
-        size_t vNodesSize;
+    }
+    size_t vNodesSize;
+    {
+        LOCK(cs_vNodes);
+        vNodesSize = vNodes.size();
+    }
+    if(vNodesSize != nPrevNodeCount) {
+        nPrevNodeCount = vNodesSize;
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+// Accept one connection; false if none was waiting or accept failed
+static bool AcceptConnection(const ListenSocket& hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket == INVALID_SOCKET) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+        return false;
+    }
+
+    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+        LogPrintf("Warning: Unknown socket family\n");
+
+    bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (nSocketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket)) {
+        LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
+        LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (CNode::IsBanned(addr) && !whitelisted) {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else {
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        pnode->fWhitelisted = whitelisted;
+
         {
             LOCK(cs_vNodes);
-            vNodesSize = vNodes.size();
+            vNodes.push_back(pnode);
+            AddNodeSocket(pnode);
         }
-        if(vNodesSize != nPrevNodeCount) {
-            nPrevNodeCount = vNodesSize;
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+    return true;
+}
+
+// Receive once from the socket; false if nothing was read because it would block, was closed or failed
+static bool SocketRecvData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0) {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return pnode->hSocket != INVALID_SOCKET;
+    } else if (nBytes == 0) {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    } else if (nBytes < 0) {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
         }
+    }
+    return false;
+}
 
-        //
-        // Find which sockets have data to receive
-        //
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
+static void InactivityCheck(CNode* pnode, int64_t nTime)
+{
+    if (nTime - pnode->nTimeConnected > 60) {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
 
-        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
+// The earliest time at which InactivityCheck could disconnect pnode, checked at least once a minute
+static int64_t GetNextInactivityCheck(const CNode* pnode, int64_t nTime)
+{
+    if (nTime - pnode->nTimeConnected <= 60)
+        return pnode->nTimeConnected + 61;
+    int64_t nNext = nTime + 60;
+    nNext = std::min(nNext, pnode->nLastSend + TIMEOUT_INTERVAL + 1);
+    nNext = std::min(nNext, pnode->nLastRecv + (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60) + 1);
+    if (pnode->nPingNonceSent)
+        nNext = std::min(nNext, pnode->nPingUsecStart / 1000000 + TIMEOUT_INTERVAL + 1);
+    return nNext;
+}
+
+static void SocketHandlerSelect()
+{
+    //
+    // Find which sockets have data to receive
+    //
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
             have_fds = true;
-        }
 
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH (CNode* pnode, vNodes) {
-                if (pnode->hSocket == INVALID_SOCKET)
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is no (complete) message in the receive buffer,
+            //   or there is space left in the buffer, select() for receiving data.
+            // * (if neither of the above applies, there is certainly one message
+            //   in the receiver buffer ready to be processed).
+            // Together, that means that at least one of the following is always possible,
+            // so we don't deadlock:
+            // * We send some data.
+            // * We wait for data to be received (and disconnect after timeout).
+            // * We process a message in the buffer (message handler thread).
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend && !pnode->vSendMsg.empty()) {
+                    FD_SET(pnode->hSocket, &fdsetSend);
                     continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                                    pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    FD_SET(pnode->hSocket, &fdsetRecv);
+            }
+        }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+        &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR) {
+        if (have_fds) {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
         }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(timeout.tv_usec / 1000);
+    }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-            &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    //
+    // Accept new connections
+    //
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+        if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            AcceptConnection(hListenSocket);
+    }
+
+    //
+    // Service each socket
+    //
+    vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH (CNode* pnode, vNodesCopy)
+            pnode->AddRef();
+    }
+    stable_partition(vNodesCopy.begin(), vNodesCopy.end(), IsSendingRelay);
+    BOOST_FOREACH (CNode* pnode, vNodesCopy) {
         boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR) {
-            if (have_fds) {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec / 1000);
+        //
+        // Receive
+        //
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv)
+                SocketRecvData(pnode);
         }
 
         //
-        // Accept new connections
+        // Send
         //
-        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetSend)) {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend)
+                SocketSendData(pnode);
+        }
 
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
+        //
+        // Inactivity checking
+        //
+        InactivityCheck(pnode, GetTime());
+    }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodesCopy)
+            pnode->Release();
+    }
+}
 
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH (CNode* pnode, vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
+#ifdef HAVE_SYS_EPOLL_H
+// Take on the nodes added since the last round
+static void AddNewSocketNodes()
+{
+    int64_t nTime = GetTime();
+    LOCK(cs_vNodes);
+    BOOST_FOREACH (CNode* pnode, vNodesNewSocket) {
+        // Try once: data may have arrived before the socket was registered
+        pnode->fSocketReadable = true;
+        pnode->fSocketWritable = true;
+        setNodesReady.insert(pnode);
+        timeoutWheel.Schedule(pnode, GetNextInactivityCheck(pnode, nTime));
+    }
+    vNodesNewSocket.clear();
+}
 
-                if (hSocket == INVALID_SOCKET) {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                } else if (!IsSelectableSocket(hSocket)) {
-                    LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
-                    LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (CNode::IsBanned(addr) && !whitelisted) {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else {
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
-
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
+static void SocketHandlerEpoll()
+{
+    static const int MAX_EPOLL_EVENTS = 256;
+    static const int MAX_ACCEPT_PER_EVENT = 64;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int nEvents = epoll_wait(hEpoll, events, MAX_EPOLL_EVENTS, 50);
+    boost::this_thread::interruption_point();
+    if (nEvents < 0) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEINTR) {
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+            MilliSleep(50);
+        }
+        nEvents = 0;
+    }
+
+    for (int i = 0; i < nEvents; i++) {
+        const ListenSocket* pListenSocket = NULL;
+        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+            if (events[i].data.ptr == &hListenSocket)
+                pListenSocket = &hListenSocket;
+        }
+        if (pListenSocket) {
+            // Level-triggered: what is left of the backlog is reported again
+            for (int n = 0; n < MAX_ACCEPT_PER_EVENT && AcceptConnection(*pListenSocket); n++) {
             }
+            continue;
         }
 
-        //
-        // Service each socket
-        //
-        vector<CNode*> vNodesCopy;
+        CNode* pnode = (CNode*)events[i].data.ptr;
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            pnode->fSocketReadable = true;
+        if (events[i].events & EPOLLOUT)
+            pnode->fSocketWritable = true;
+        setNodesReady.insert(pnode);
+    }
+
+    // Use the readiness until the sockets would block. Nodes whose locks are
+    // busy, whose receive buffer is full or that still have data to send stay
+    // in setNodesReady and are tried again next round.
+    vector<CNode*> vReady(setNodesReady.begin(), setNodesReady.end());
+    stable_partition(vReady.begin(), vReady.end(), IsSendingRelay);
+    BOOST_FOREACH (CNode* pnode, vReady) {
+        boost::this_thread::interruption_point();
+        if (pnode->hSocket == INVALID_SOCKET) {
+            setNodesReady.erase(pnode);
+            continue;
+        }
+
+        bool fRetry = false;
+        bool fSendQueued = false;
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH (CNode* pnode, vNodesCopy)
-                pnode->AddRef();
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (!lockSend) {
+                fRetry = true;
+            } else if (!pnode->vSendMsg.empty() && pnode->fSocketWritable) {
+                uint64_t nSendBytesBefore = pnode->nSendBytes;
+                SocketSendData(pnode);
+                if (!pnode->vSendMsg.empty()) {
+                    // Nothing went out: wait for the next EPOLLOUT; some did: the socket may take more
+                    if (pnode->nSendBytes == nSendBytesBefore)
+                        pnode->fSocketWritable = false;
+                    else
+                        fRetry = true;
+                }
+            }
+            if (lockSend)
+                fSendQueued = !pnode->vSendMsg.empty();
         }
-        BOOST_FOREACH (CNode* pnode, vNodesCopy) {
-            boost::this_thread::interruption_point();
 
-            //
-            // Receive
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv) {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0) {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        } else if (nBytes == 0) {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        } else if (nBytes < 0) {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
+        // As with select, drain the send queue before receiving more
+        if (pnode->fSocketReadable && !fSendQueued && pnode->hSocket != INVALID_SOCKET) {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (!lockRecv) {
+                fRetry = true;
+            } else {
+                while (pnode->fSocketReadable) {
+                    if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() &&
+                        pnode->GetTotalRecvSize() > ReceiveFloodSize()) {
+                        fRetry = true;
+                        break;
                     }
+                    if (!SocketRecvData(pnode))
+                        pnode->fSocketReadable = false;
                 }
             }
+        }
 
-            //
-            // Send
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend)) {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SocketSendData(pnode);
-            }
+        if (!fRetry)
+            setNodesReady.erase(pnode);
+    }
 
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60) {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
+    // Inactivity checking, only for the nodes that are due
+    int64_t nTime = GetTime();
+    vector<CNode*> vDue;
+    timeoutWheel.Advance(nTime, vDue);
+    BOOST_FOREACH (CNode* pnode, vDue) {
+        if (pnode->hSocket == INVALID_SOCKET || pnode->fDisconnect)
+            continue;
+        InactivityCheck(pnode, nTime);
+        if (!pnode->fDisconnect)
+            timeoutWheel.Schedule(pnode, GetNextInactivityCheck(pnode, nTime));
+    }
+}
+#endif
+
+void ThreadSocketHandler()
+{
+    unsigned int nPrevNodeCount = 0;
+    int64_t nLastDisconnectCheck = 0;
+    while (true) {
+#ifdef HAVE_SYS_EPOLL_H
+        if (nSocketEventsMode == SOCKETEVENTS_EPOLL) {
+            AddNewSocketNodes();
+            // Walking vNodes is what epoll saves; do it at the rate select polls
+            int64_t nNow = GetTimeMillis();
+            if (nNow - nLastDisconnectCheck >= 50) {
+                nLastDisconnectCheck = nNow;
+                DisconnectNodes(nPrevNodeCount);
             }
+            SocketHandlerEpoll();
+            continue;
         }
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH (CNode* pnode, vNodesCopy)
-                pnode->Release();
+#endif
+        DisconnectNodes(nPrevNodeCount);
+        SocketHandlerSelect();
+    }
+}
+
+bool ParseSocketEventsMode(const std::string& str, SocketEventsMode& mode)
+{
+    if (str == "select") {
+        mode = SOCKETEVENTS_SELECT;
+        return true;
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    if (str == "epoll") {
+        mode = SOCKETEVENTS_EPOLL;
+        return true;
+    }
+#endif
+    return false;
+}
+
+void InitSocketEvents()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (nSocketEventsMode == SOCKETEVENTS_EPOLL && hEpoll == -1) {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll == -1) {
+            LogPrintf("epoll_create1 failed: %s, using select\n", NetworkErrorString(WSAGetLastError()));
+            nSocketEventsMode = SOCKETEVENTS_SELECT;
         }
     }
+#endif
+}
+
+std::string GetSupportedSocketEventsModes()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    return "select, epoll";
+#else
+    return "select";
+#endif
 }
 
 
@@ -1152,6 +1569,35 @@ void DumpAddresses()
         addrman.size(), GetTimeMillis() - nStart);
 }
 
+void DumpBanlist()
+{
+    int64_t nStart = GetTimeMillis();
+
+    // Expired bans no longer match, this only keeps them out of banlist.dat
+    banManager.SweepBanned(GetTime());
+    if (!banManager.IsDirty())
+        return;
+
+    // Changes made while writing mark the list dirty again
+    banmap_t banMap;
+    banManager.SetDirty(false);
+    banManager.GetBanned(banMap);
+    CBanDB bandb;
+    if (!bandb.Write(banMap)) {
+        banManager.SetDirty(true);
+        return;
+    }
+
+    LogPrint("net", "Flushed %d banned node ips/subnets to banlist.dat  %dms\n",
+        banMap.size(), GetTimeMillis() - nStart);
+}
+
+void static DumpData()
+{
+    DumpAddresses();
+    DumpBanlist();
+}
+
 void static ProcessOneShot()
 {
     string strDest;
@@ -1360,7 +1806,10 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOu
 }
 
 
-void ThreadMessageHandler()
+// Each message handler thread works on the nodes with id % nMessageHandlerThreads == nThread,
+// so all messages of a node are handled by the same thread and in the order they arrived.
+// Handlers that share state with other commands are serialized in ProcessMessages.
+void ThreadMessageHandler(int nThread)
 {
     boost::mutex condition_mutex;
     boost::unique_lock<boost::mutex> lock(condition_mutex);
@@ -1368,19 +1817,22 @@ void ThreadMessageHandler()
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true) {
         vector<CNode*> vNodesCopy;
+        CNode* pnodeTrickle = NULL;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+            BOOST_FOREACH (CNode* pnode, vNodes) {
+                if (pnode->id % nMessageHandlerThreads != nThread)
+                    continue;
                 pnode->AddRef();
+                vNodesCopy.push_back(pnode);
             }
+            // Pick the trickle node among all nodes, so that there is still about one per round
+            // in total; it is only used if it belongs to this thread
+            if (!vNodes.empty())
+                pnodeTrickle = vNodes[GetRand(vNodes.size())];
         }
 
         // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-
         bool fSleep = true;
 
         BOOST_FOREACH (CNode* pnode, vNodesCopy) {
@@ -1586,6 +2038,24 @@ void StartNode(boost::thread_group& threadGroup)
         addrman.size(), GetTimeMillis() - nStart);
     fAddressesInitialized = true;
 
+    // Load banned subnets from banlist.dat
+    nStart = GetTimeMillis();
+    {
+        CBanDB bandb;
+        banmap_t banMap;
+        if (bandb.Read(banMap)) {
+            banManager.SetBanned(banMap);
+            banManager.SweepBanned(GetTime());
+            banManager.SetDirty(false);
+            LogPrint("net", "Loaded %d banned node ips/subnets from banlist.dat  %dms\n",
+                banMap.size(), GetTimeMillis() - nStart);
+        } else {
+            LogPrintf("Invalid or missing banlist.dat; recreating\n");
+            // Write a fresh one at the next dump
+            banManager.SetDirty(true);
+        }
+    }
+
     if (semOutbound == NULL) {
         // initialize semaphore
         int nMaxOutbound = min(MAX_OUTBOUND_CONNECTIONS, nMaxConnections);
@@ -1609,6 +2079,19 @@ void StartNode(boost::thread_group& threadGroup)
     // Map ports with UPnP
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
+#ifdef HAVE_SYS_EPOLL_H
+    if (nSocketEventsMode == SOCKETEVENTS_EPOLL) {
+        BOOST_FOREACH (ListenSocket& hListenSocket, vhListenSocket) {
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = &hListenSocket;
+            if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+                LogPrintf("epoll_ctl failed for a listening socket: %s\n", NetworkErrorString(WSAGetLastError()));
+        }
+    }
+#endif
+    LogPrintf("Using %s for socket events\n", nSocketEventsMode == SOCKETEVENTS_EPOLL ? "epoll" : "select");
+
     // Send and receive from sockets, accept connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
@@ -1619,10 +2102,14 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    LogPrintf("Using %d message handler threads\n", nMessageHandlerThreads);
+    for (int i = 0; i < nMessageHandlerThreads; i++) {
+        boost::function<void()> messageHandler = boost::bind(&ThreadMessageHandler, i);
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", messageHandler));
+    }
 
     // Dump network addresses
-    threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
+    threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpData, DUMP_ADDRESSES_INTERVAL * 1000));
 
     // ppcoin:mint proof-of-stake blocks in the background
     if (GetBoolArg("-staking", true))
@@ -1638,7 +2125,7 @@ bool StopNode()
             semOutbound->post();
 
     if (fAddressesInitialized) {
-        DumpAddresses();
+        DumpData();
         fAddressesInitialized = false;
     }
 
@@ -1668,7 +2155,14 @@ public:
             delete pnode;
         vNodes.clear();
         vNodesDisconnected.clear();
+        vNodesNewSocket.clear();
+        setNodesReady.clear();
         vhListenSocket.clear();
+#ifdef HAVE_SYS_EPOLL_H
+        if (hEpoll != -1)
+            close(hEpoll);
+        hEpoll = -1;
+#endif
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -1690,14 +2184,6 @@ void CExplicitNetCleanup::callCleanup()
 }
 
 void RelayTransaction(const CTransaction& tx)
-{
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, ss);
-}
-
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
 {
     CInv inv(MSG_TX, tx.GetHash());
     {
@@ -1708,8 +2194,8 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Serialize once; every peer that asks for it gets the same payload
+        mapRelay.insert(std::make_pair(inv, MakeNetPayload(tx)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -1730,12 +2216,13 @@ void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
     CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
 
     //broadcast the new lock
+    CNetPayloadRef payload = MakeNetPayload(tx);
     LOCK(cs_vNodes);
     BOOST_FOREACH (CNode* pnode, vNodes) {
         if (!relayToAll && !pnode->fRelayTxes)
             continue;
 
-        pnode->PushMessage("ix", tx);
+        pnode->PushMessagePayload("ix", payload);
     }
 }
 
@@ -1904,7 +2391,7 @@ bool CAddrDB::Read(CAddrMan& addr)
 unsigned int ReceiveFloodSize() { return 1000 * GetArg("-maxreceivebuffer", 5 * 1000); }
 unsigned int SendBufferSize() { return 1000 * GetArg("-maxsendbuffer", 1 * 1000); }
 
-CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), msgCounters(&netMessageCounters), filterAddrKnown(KNOWN_ADDR_FILTER_SIZE, dKnownAddrFPRate), filterInventoryKnown(KNOWN_INVENTORY_FILTER_SIZE, dKnownInventoryFPRate)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -1932,13 +2419,17 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nStartingHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
-    setInventoryKnown.max_size(SendBufferSize() / 1000);
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
     nPingUsecStart = 0;
     nPingUsecTime = 0;
     fPingQueued = false;
     fObfuScationMaster = false;
+    fMasternodePeer = false;
+    nLastMasternodePeerCheck = 0;
+    fSocketReadable = false;
+    fSocketWritable = false;
+    nTimeoutCheck = 0;
 
     {
         LOCK(cs_nLastNodeId);
@@ -2001,7 +2492,7 @@ void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSen
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
     assert(ssSend.size() == 0);
-    ssSend << CMessageHeader(pszCommand, 0);
+    hdrSend = CMessageHeader(pszCommand, 0);
     LogPrint("net", "sending: %s ", SanitizeString(pszCommand));
 }
 
@@ -2027,29 +2518,41 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
     if (mapArgs.count("-fuzzmessagestest"))
         Fuzz(GetArg("-fuzzmessagestest", 10));
 
-    if (ssSend.size() == 0)
-        return;
+    // The payload takes over the buffer of ssSend, the checksum is computed over it in place
+    CNetPayloadRef payload(new CNetPayload(ssSend));
 
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+    LogPrint("net", "(%d bytes) peer=%d\n", payload->size(), id);
 
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    QueueMessage(hdrSend, payload, GetSendPriority(hdrSend.GetCommand()));
 
-    LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
+    LEAVE_CRITICAL_SECTION(cs_vSend);
+}
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+void CNode::PushMessagePayload(const char* pszCommand, const CNetPayloadRef& payload)
+{
+    PushMessagePayload(pszCommand, payload, GetSendPriority(pszCommand));
+}
+
+void CNode::PushMessagePayload(const char* pszCommand, const CNetPayloadRef& payload, int nPriority)
+{
+    LOCK(cs_vSend);
+    LogPrint("net", "sending: %s (%d bytes, shared) peer=%d\n", SanitizeString(pszCommand), payload->size(), id);
+    QueueMessage(CMessageHeader(pszCommand, 0), payload, nPriority);
+}
+
+void CNode::QueueMessage(const CMessageHeader& hdr, const CNetPayloadRef& payload, int nPriority)
+{
+    // Other messages overtake the historical blocks at the end of the queue that haven't started
+    // going out; among themselves, and among the historical blocks, the order stays as queued
+    std::deque<CSendMessage>::iterator it = vSendMsg.end();
+    if (nPriority != SEND_PRIORITY_HISTORICAL) {
+        while (it != vSendMsg.begin() && (it - 1)->nPriority == SEND_PRIORITY_HISTORICAL && (it - 1 != vSendMsg.begin() || nSendOffset == 0))
+            --it;
+    }
+    it = vSendMsg.insert(it, CSendMessage(hdr, payload, nPriority));
+    nSendSize += it->size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
-
-    LEAVE_CRITICAL_SECTION(cs_vSend);
 }
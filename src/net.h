@@ -11,13 +11,14 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
+#include "netmsgstats.h"
 #include "protocol.h"
 #include "random.h"
 #include "streams.h"
 #include "sync.h"
 #include "uint256.h"
+#include "uploadtarget.h"
 #include "utilstrencodings.h"
 
 #include <deque>
@@ -29,6 +30,7 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -60,6 +62,76 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** Number of recent inventory items and addresses remembered as known to each peer */
+static const unsigned int KNOWN_INVENTORY_FILTER_SIZE = 10000;
+static const unsigned int KNOWN_ADDR_FILTER_SIZE = 5000;
+/** Defaults for -knowninvfprate and -knownaddrfprate */
+static const double DEFAULT_KNOWN_INVENTORY_FP_RATE = 0.000001;
+static const double DEFAULT_KNOWN_ADDR_FP_RATE = 0.001;
+
+/** How the socket handler thread waits for socket events */
+enum SocketEventsMode {
+    SOCKETEVENTS_SELECT,
+    SOCKETEVENTS_EPOLL,
+};
+/** -socketevents default */
+#ifdef HAVE_SYS_EPOLL_H
+static const char* const DEFAULT_SOCKET_EVENTS = "epoll";
+#else
+static const char* const DEFAULT_SOCKET_EVENTS = "select";
+#endif
+/** -msghandthreads default */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 2;
+/** Maximum number of message handler threads */
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
+
+/**
+ * Serialized payload of a P2P message together with its checksum. It is
+ * immutable once built, so the same payload can be queued for any number of
+ * peers without copying it.
+ */
+class CNetPayload
+{
+private:
+    CSerializeData vData;
+    unsigned int nChecksum;
+
+public:
+    //! Take over the contents of ss, leaving it empty
+    explicit CNetPayload(CDataStream& ss);
+
+    const CSerializeData& data() const { return vData; }
+    size_t size() const { return vData.size(); }
+    unsigned int GetChecksum() const { return nChecksum; }
+};
+
+typedef boost::shared_ptr<const CNetPayload> CNetPayloadRef;
+
+/** Serialize obj into a payload that can be sent to many peers */
+template <typename T>
+CNetPayloadRef MakeNetPayload(const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << obj;
+    return CNetPayloadRef(new CNetPayload(ss));
+}
+
+/** A message in a node's send queue: its own header and a shared payload */
+class CSendMessage
+{
+public:
+    char pchHeader[CMessageHeader::HEADER_SIZE];
+    CNetPayloadRef payload;
+    //! SendPriority class the message is accounted to for -maxuploadtarget
+    int nPriority;
+    //! Slot of its command in the message counters
+    int nStatsSlot;
+
+    //! Header with the message start and command of hdr, and the size and checksum of payloadIn
+    CSendMessage(const CMessageHeader& hdr, const CNetPayloadRef& payloadIn, int nPriorityIn);
+
+    size_t size() const { return CMessageHeader::HEADER_SIZE + payload->size(); }
+};
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -78,6 +150,13 @@ bool BindListenPort(const CService& bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode* pnode);
+/** Move past the first nBytes of the send queue of pnode, which were sent, adding them up per SendPriority in vSentByPriority */
+void AdvanceSendQueue(CNode* pnode, size_t nBytes, uint64_t* vSentByPriority);
+/** Parse a -socketevents mode; false if unknown or not supported on this platform */
+bool ParseSocketEventsMode(const std::string& str, SocketEventsMode& mode);
+std::string GetSupportedSocketEventsModes();
+/** Set up nSocketEventsMode, falling back to select if epoll is not available; before StartNode */
+void InitSocketEvents();
 
 typedef int NodeId;
 
@@ -123,14 +202,18 @@ CAddress GetLocalAddress(const CNetAddr* paddrPeer = NULL);
 
 extern bool fDiscover;
 extern bool fListen;
+extern SocketEventsMode nSocketEventsMode;
 extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
+extern int nMessageHandlerThreads;
+extern double dKnownInventoryFPRate;
+extern double dKnownAddrFPRate;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CNetPayloadRef> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -168,6 +251,8 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    //! Indexed like GetMessageStatsCommand
+    std::vector<CMessageStats> vMessageStats;
 };
 
 
@@ -185,6 +270,8 @@ public:
 
     int64_t nTime; // time (in microseconds) of message receipt.
 
+    size_t nPoolCapacity; // capacity of vRecv accounted to recvBufferPool, 0 if not pooled
+
     CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
     {
         hdrbuf.resize(24);
@@ -192,8 +279,14 @@ public:
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
+        nPoolCapacity = 0;
     }
 
+    // Copies get their own, unpooled buffer
+    CNetMessage(const CNetMessage& msg);
+    CNetMessage& operator=(const CNetMessage& msg);
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -209,6 +302,9 @@ public:
 
     int readHeader(const char* pch, unsigned int nBytes);
     int readData(const char* pch, unsigned int nBytes);
+
+    //! Receive the payload into a buffer from recvBufferPool, if it has one to spare; call once the header is read
+    void UsePooledBuffer();
 };
 
 
@@ -219,11 +315,12 @@ public:
     // socket
     uint64_t nServices;
     SOCKET hSocket;
-    CDataStream ssSend;
+    CDataStream ssSend; // payload of the message being built
+    CMessageHeader hdrSend; // header of the message being built
     size_t nSendSize;   // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSendMessage> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -262,18 +359,19 @@ public:
     // (even if it's relative to mixing e.g. for blinding) should NOT set this to 'true'.
     // For such cases node should be released manually (preferably right after corresponding code).
     bool fObfuScationMaster;
+    // Whether the peer's address is that of a known masternode, which exempts it from
+    // -maxuploadtarget like fWhitelisted. Refreshed by ProcessGetData when it matters.
+    bool fMasternodePeer;
+    int64_t nLastMasternodePeerCheck;
     CSemaphoreGrant grantOutbound;
+    // Per-command message counters of this peer, also added to netMessageCounters
+    CNetMessageCounters msgCounters;
     CCriticalSection cs_filter;
     CBloomFilter* pfilter;
     int nRefCount;
     NodeId id;
 
 protected:
-    // Denial-of-service detection/prevention
-    // Key is IP address, value is banned-until-time
-    static std::map<CNetAddr, int64_t> setBanned;
-    static CCriticalSection cs_setBanned;
-
     std::vector<std::string> vecRequestsFulfilled; //keep track of what client has asked for
 
     // Whitelisted ranges. Any node connecting from these is automatically
@@ -290,12 +388,12 @@ public:
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter filterAddrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -311,6 +409,13 @@ public:
     // Whether a ping is requested.
     bool fPingQueued;
 
+    // Socket thread state with -socketevents=epoll:
+    // Whether the socket may have data to read or room to write, since its last readiness event
+    bool fSocketReadable;
+    bool fSocketWritable;
+    // Time of the next inactivity check, or 0 if none is scheduled
+    int64_t nTimeoutCheck;
+
     CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn = false);
     ~CNode();
 
@@ -321,6 +426,9 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // Append a message to vSendMsg; requires LOCK(cs_vSend)
+    void QueueMessage(const CMessageHeader& hdr, const CNetPayloadRef& payload, int nPriority);
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
@@ -336,6 +444,15 @@ public:
         return nRefCount;
     }
 
+    //! Capacity of the pooled receive buffers held by the messages in vRecvMsg; requires LOCK(cs_vRecvMsg)
+    size_t GetRecvPoolUsage() const
+    {
+        size_t nUsage = 0;
+        BOOST_FOREACH (const CNetMessage& msg, vRecvMsg)
+            nUsage += msg.nPoolCapacity;
+        return nUsage;
+    }
+
     // requires LOCK(cs_vRecvMsg)
     unsigned int GetTotalRecvSize()
     {
@@ -370,7 +487,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        filterAddrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -378,7 +495,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr)) {
+        if (addr.IsValid() && !filterAddrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
             } else {
@@ -392,7 +509,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv);
         }
     }
 
@@ -400,7 +517,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -418,6 +535,14 @@ public:
 
     void PushVersion();
 
+    /** Queue a message with a payload that may be shared with other peers */
+    void PushMessagePayload(const char* pszCommand, const CNetPayloadRef& payload);
+    //! Same, accounted to the given SendPriority class instead of the one of its command
+    void PushMessagePayload(const char* pszCommand, const CNetPayloadRef& payload, int nPriority);
+
+    //! Whether -maxuploadtarget does not apply to this peer
+    bool IsUploadExempt() const { return fWhitelisted || fObfuScationMaster || fMasternodePeer; }
+
 
     void PushMessage(const char* pszCommand)
     {
@@ -648,6 +773,66 @@ public:
     static uint64_t GetTotalBytesSent();
 };
 
+/**
+ * Hashed timing wheel with one second slots, for the inactivity and ping
+ * timeouts of the socket thread. A node waits in the slot of its next
+ * check; one that is due more than a turn of the wheel ahead stays in its
+ * slot until the turn it is due in. Only used by the socket thread.
+ */
+class CTimerWheel
+{
+private:
+    static const int64_t WHEEL_SLOTS = 256;
+    std::vector<std::vector<std::pair<int64_t, CNode*> > > vSlots;
+    //! Last time the wheel was advanced to
+    int64_t nTimeLast;
+
+public:
+    CTimerWheel() : vSlots(WHEEL_SLOTS), nTimeLast(0) {}
+
+    void Schedule(CNode* pnode, int64_t nTime)
+    {
+        nTime = std::max(nTime, nTimeLast + 1);
+        vSlots[nTime % WHEEL_SLOTS].push_back(std::make_pair(nTime, pnode));
+        pnode->nTimeoutCheck = nTime;
+    }
+
+    void Remove(CNode* pnode)
+    {
+        if (pnode->nTimeoutCheck == 0)
+            return;
+        std::vector<std::pair<int64_t, CNode*> >& vSlot = vSlots[pnode->nTimeoutCheck % WHEEL_SLOTS];
+        for (size_t i = 0; i < vSlot.size(); i++) {
+            if (vSlot[i].second == pnode) {
+                vSlot[i] = vSlot.back();
+                vSlot.pop_back();
+                break;
+            }
+        }
+        pnode->nTimeoutCheck = 0;
+    }
+
+    /** Move the nodes that are due at nNow to vDue */
+    void Advance(int64_t nNow, std::vector<CNode*>& vDue)
+    {
+        // After a stall of more than a turn, one turn visits every slot
+        for (int64_t t = std::max(nTimeLast + 1, nNow - WHEEL_SLOTS + 1); t <= nNow; t++) {
+            std::vector<std::pair<int64_t, CNode*> >& vSlot = vSlots[t % WHEEL_SLOTS];
+            for (size_t i = 0; i < vSlot.size();) {
+                if (vSlot[i].first <= nNow) {
+                    vSlot[i].second->nTimeoutCheck = 0;
+                    vDue.push_back(vSlot[i].second);
+                    vSlot[i] = vSlot.back();
+                    vSlot.pop_back();
+                } else {
+                    i++;
+                }
+            }
+        }
+        nTimeLast = std::max(nTimeLast, nNow);
+    }
+};
+
 class CExplicitNetCleanup
 {
 public:
@@ -656,7 +841,6 @@ public:
 
 class CTransaction;
 void RelayTransaction(const CTransaction& tx);
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll = false);
 void RelayInv(CInv& inv);
 
@@ -119,14 +119,31 @@ protected:
 public:
     CSubNet();
     explicit CSubNet(const std::string& strSubnet, bool fAllowLookup = false);
+    //! Subnet matching a single address
+    explicit CSubNet(const CNetAddr& addr);
 
     bool Match(const CNetAddr& addr) const;
 
     std::string ToString() const;
     bool IsValid() const;
 
+    const CNetAddr& GetNetwork() const;
+    //! Number of leading one bits of the 128-bit netmask, or -1 if it is not a prefix
+    int GetPrefixLength() const;
+
     friend bool operator==(const CSubNet& a, const CSubNet& b);
     friend bool operator!=(const CSubNet& a, const CSubNet& b);
+    friend bool operator<(const CSubNet& a, const CSubNet& b);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(network);
+        READWRITE(FLATDATA(netmask));
+        READWRITE(valid);
+    }
 };
 
 /** A combination of a network address (CNetAddr) and a (TCP) port */
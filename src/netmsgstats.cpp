@@ -0,0 +1,92 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "netmsgstats.h"
+
+#include "utilstrencodings.h"
+
+#include <map>
+
+#include <boost/static_assert.hpp>
+
+static const char* const pszMessageStatsCommands[] = {
+    "addr", "alert", "block", "blocktxn", "cmpctblock", "filteradd", "filterclear", "filterload",
+    "getaddr", "getblocks", "getblocktxn", "getdata", "getheaders", "headers", "inv", "mempool",
+    "merkleblock", "notfound", "ping", "pong", "reject", "sendcmpct", "tx", "verack", "version",
+    "getsporks", "spork", "ix", "txlvote", "dsa", "dsc", "dsf", "dsi", "dsq", "dsr", "dss", "dssu", "dstx",
+    "mnb", "mnp", "dsee", "dseep", "dseg", "mnw", "mnget", "mprop", "mvote", "fbs", "fbvote", "mnvs", "ssc",
+    "*other*"};
+
+BOOST_STATIC_ASSERT(ARRAYLEN(pszMessageStatsCommands) == NUM_MESSAGE_STATS_SLOTS);
+
+CNetMessageCounters netMessageCounters;
+
+namespace
+{
+class CMessageStatsSlots
+{
+public:
+    std::map<std::string, int> mapSlots;
+
+    CMessageStatsSlots()
+    {
+        for (int i = 0; i < NUM_MESSAGE_STATS_SLOTS - 1; i++)
+            mapSlots[pszMessageStatsCommands[i]] = i;
+    }
+} messageStatsSlots;
+}
+
+int GetMessageStatsSlot(const std::string& strCommand)
+{
+    std::map<std::string, int>::const_iterator it = messageStatsSlots.mapSlots.find(strCommand);
+    return it != messageStatsSlots.mapSlots.end() ? it->second : NUM_MESSAGE_STATS_SLOTS - 1;
+}
+
+const char* GetMessageStatsCommand(int nSlot)
+{
+    return pszMessageStatsCommands[nSlot];
+}
+
+CNetMessageCounters::CNetMessageCounters(CNetMessageCounters* pparentIn) : pparent(pparentIn)
+{
+    for (int i = 0; i < NUM_MESSAGE_STATS_SLOTS; i++) {
+        vSlots[i].nSent = 0;
+        vSlots[i].nSentBytes = 0;
+        vSlots[i].nRecv = 0;
+        vSlots[i].nRecvBytes = 0;
+        vSlots[i].nHandlerTime = 0;
+    }
+}
+
+void CNetMessageCounters::RecordSent(int nSlot, uint64_t nBytes, bool fComplete)
+{
+    CSlot& slot = vSlots[nSlot];
+    slot.nSentBytes.fetch_add(nBytes, std::memory_order_relaxed);
+    if (fComplete)
+        slot.nSent.fetch_add(1, std::memory_order_relaxed);
+    if (pparent)
+        pparent->RecordSent(nSlot, nBytes, fComplete);
+}
+
+void CNetMessageCounters::RecordRecv(int nSlot, uint64_t nBytes, int64_t nTime)
+{
+    CSlot& slot = vSlots[nSlot];
+    slot.nRecv.fetch_add(1, std::memory_order_relaxed);
+    slot.nRecvBytes.fetch_add(nBytes, std::memory_order_relaxed);
+    slot.nHandlerTime.fetch_add(nTime, std::memory_order_relaxed);
+    if (pparent)
+        pparent->RecordRecv(nSlot, nBytes, nTime);
+}
+
+void CNetMessageCounters::GetStats(std::vector<CMessageStats>& vStats) const
+{
+    vStats.resize(NUM_MESSAGE_STATS_SLOTS);
+    for (int i = 0; i < NUM_MESSAGE_STATS_SLOTS; i++) {
+        vStats[i].nSent = vSlots[i].nSent.load(std::memory_order_relaxed);
+        vStats[i].nSentBytes = vSlots[i].nSentBytes.load(std::memory_order_relaxed);
+        vStats[i].nRecv = vSlots[i].nRecv.load(std::memory_order_relaxed);
+        vStats[i].nRecvBytes = vSlots[i].nRecvBytes.load(std::memory_order_relaxed);
+        vStats[i].nHandlerTime = vSlots[i].nHandlerTime.load(std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,73 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_NETMSGSTATS_H
+#define BITCOIN_NETMSGSTATS_H
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/** Number of commands with their own counters, including the "*other*" slot the rest share */
+static const int NUM_MESSAGE_STATS_SLOTS = 52;
+
+/**
+ * Counter slot of a command; unknown commands share the last one, so peers can't grow the tables.
+ * The only list of commands with their own statistics; the message queue statistics use it too.
+ */
+int GetMessageStatsSlot(const std::string& strCommand);
+/** Command of a counter slot, "*other*" for the last one */
+const char* GetMessageStatsCommand(int nSlot);
+
+struct CMessageStats {
+    uint64_t nSent;
+    uint64_t nSentBytes;
+    uint64_t nRecv;
+    uint64_t nRecvBytes;
+    //! Microseconds spent handling received messages
+    int64_t nHandlerTime;
+
+    CMessageStats() : nSent(0), nSentBytes(0), nRecv(0), nRecvBytes(0), nHandlerTime(0) {}
+};
+
+/**
+ * Messages, bytes and handler time per P2P command. The socket thread and
+ * the message handler threads update the counters of a peer and the global
+ * ones at the same time, so they are relaxed atomics: recording takes no
+ * lock and readers only need a consistent value per counter, not a snapshot
+ * of all of them. Counters passed a parent also add everything to it.
+ */
+class CNetMessageCounters
+{
+private:
+    struct CSlot {
+        std::atomic<uint64_t> nSent;
+        std::atomic<uint64_t> nSentBytes;
+        std::atomic<uint64_t> nRecv;
+        std::atomic<uint64_t> nRecvBytes;
+        std::atomic<int64_t> nHandlerTime;
+    };
+
+    CSlot vSlots[NUM_MESSAGE_STATS_SLOTS];
+    CNetMessageCounters* pparent;
+
+    CNetMessageCounters(const CNetMessageCounters&);
+    void operator=(const CNetMessageCounters&);
+
+public:
+    explicit CNetMessageCounters(CNetMessageCounters* pparentIn = NULL);
+
+    /** nBytes of a message in slot nSlot went out; fComplete if they were its last ones */
+    void RecordSent(int nSlot, uint64_t nBytes, bool fComplete);
+    /** A received message of nBytes, header included, was handled in nTime microseconds */
+    void RecordRecv(int nSlot, uint64_t nBytes, int64_t nTime);
+
+    /** Counters of every slot, indexed like GetMessageStatsCommand */
+    void GetStats(std::vector<CMessageStats>& vStats) const;
+};
+
+extern CNetMessageCounters netMessageCounters;
+
+#endif // BITCOIN_NETMSGSTATS_H
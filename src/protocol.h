@@ -170,7 +170,10 @@ enum {
     MSG_MASTERNODE_QUORUM,
     MSG_MASTERNODE_ANNOUNCE,
     MSG_MASTERNODE_PING,
-    MSG_DSTX
+    MSG_DSTX,
+    // Requests a block as a compact block (header, short transaction IDs and prefilled
+    // transactions); like MSG_FILTERED_BLOCK it only appears in getdata.
+    MSG_CMPCT_BLOCK
 };
 
 #endif // BITCOIN_PROTOCOL_H
@@ -0,0 +1,79 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "recvbufferpool.h"
+
+#include <assert.h>
+
+CRecvBufferPool::CRecvBufferPool(size_t nMaxIdleIn, size_t nMaxInUseIn) : nMaxIdle(nMaxIdleIn), nMaxInUse(nMaxInUseIn)
+{
+    stats.nInUse = 0;
+    stats.nIdle = 0;
+    stats.nHits = 0;
+    stats.nMisses = 0;
+    stats.nRefused = 0;
+}
+
+size_t CRecvBufferPool::ClassSize(int nClass)
+{
+    // 512 bytes, 4 KiB, 32 KiB, 256 KiB
+    return MAX_POOLED_RECV_BUFFER >> (3 * (NUM_CLASSES - 1 - nClass));
+}
+
+size_t CRecvBufferPool::Acquire(CSerializeData& data, size_t nSize)
+{
+    assert(data.empty());
+    int nClass = 0;
+    while (nClass < NUM_CLASSES - 1 && ClassSize(nClass) < nSize)
+        nClass++;
+
+    LOCK(cs);
+    if (stats.nInUse + ClassSize(nClass) > nMaxInUse) {
+        stats.nRefused++;
+        return 0;
+    }
+    if (!vIdle[nClass].empty()) {
+        data.swap(vIdle[nClass].back());
+        vIdle[nClass].pop_back();
+        stats.nIdle -= data.capacity();
+        stats.nHits++;
+    } else {
+        data.reserve(ClassSize(nClass));
+        stats.nMisses++;
+    }
+    stats.nInUse += data.capacity();
+    return data.capacity();
+}
+
+void CRecvBufferPool::Resized(size_t nOld, size_t nNew)
+{
+    LOCK(cs);
+    stats.nInUse += nNew - nOld;
+}
+
+void CRecvBufferPool::Release(CSerializeData& data, size_t nAccounted)
+{
+    CSerializeData dataFree;
+    data.swap(dataFree);
+    dataFree.clear();
+    size_t nCapacity = dataFree.capacity();
+
+    LOCK(cs);
+    stats.nInUse -= nAccounted;
+    // Keep buffers in the largest class they can serve, unless they grew far beyond it
+    if (nCapacity < ClassSize(0) || nCapacity > 2 * MAX_POOLED_RECV_BUFFER || stats.nIdle + nCapacity > nMaxIdle)
+        return;
+    int nClass = NUM_CLASSES - 1;
+    while (ClassSize(nClass) > nCapacity)
+        nClass--;
+    vIdle[nClass].push_back(CSerializeData());
+    vIdle[nClass].back().swap(dataFree);
+    stats.nIdle += nCapacity;
+}
+
+CRecvBufferPoolStats CRecvBufferPool::GetStats() const
+{
+    LOCK(cs);
+    return stats;
+}
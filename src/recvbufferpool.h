@@ -0,0 +1,81 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RECVBUFFERPOOL_H
+#define BITCOIN_RECVBUFFERPOOL_H
+
+#include "allocators.h"
+#include "sync.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/** Size of the largest receive buffer class; larger messages grow their buffer as data arrives */
+static const size_t MAX_POOLED_RECV_BUFFER = 256 * 1024;
+/** Capacity of idle receive buffers kept for reuse, over all size classes */
+static const size_t DEFAULT_RECV_BUFFER_POOL_SIZE = 8 * 1024 * 1024;
+/** Capacity of pooled buffers the unhandled messages of one peer may hold */
+static const size_t MAX_PEER_RECV_POOL_USAGE = 2 * MAX_POOLED_RECV_BUFFER;
+/** Capacity of pooled buffers the unhandled messages of all peers may hold; later messages get their own buffer */
+static const size_t DEFAULT_RECV_BUFFER_POOL_IN_USE = 32 * 1024 * 1024;
+
+struct CRecvBufferPoolStats {
+    //! Capacity of the pooled buffers held by messages that were not handled yet
+    size_t nInUse;
+    //! Capacity of the idle buffers kept for reuse
+    size_t nIdle;
+    //! Buffers that were reused, and that had to be allocated
+    uint64_t nHits;
+    uint64_t nMisses;
+    //! Requests turned down because nInUse had reached its limit
+    uint64_t nRefused;
+};
+
+/**
+ * Size-classed free lists of message receive buffers. A CNetMessage takes a
+ * buffer for its payload once the header is read and gives it back when it
+ * is destroyed, after the message was handled. The frequent small messages
+ * (ping, inv, mnp) so reuse memory instead of allocating a new buffer each
+ * time. The buffer is still resized as data arrives, which zero-fills the
+ * new bytes before they are copied over. Idle buffers are kept up to
+ * nMaxIdle bytes of capacity, the rest are freed. Once the buffers handed out
+ * reach nMaxInUse bytes of capacity, Acquire turns requests down until some
+ * come back, so many peers together can't pin more than that.
+ */
+class CRecvBufferPool
+{
+private:
+    static const int NUM_CLASSES = 4;
+
+    mutable CCriticalSection cs;
+    std::vector<CSerializeData> vIdle[NUM_CLASSES];
+    size_t nMaxIdle;
+    size_t nMaxInUse;
+    CRecvBufferPoolStats stats;
+
+    static size_t ClassSize(int nClass);
+
+public:
+    explicit CRecvBufferPool(size_t nMaxIdleIn = DEFAULT_RECV_BUFFER_POOL_SIZE, size_t nMaxInUseIn = DEFAULT_RECV_BUFFER_POOL_IN_USE);
+
+    /**
+     * Swap an empty buffer with room for nSize bytes, or MAX_POOLED_RECV_BUFFER
+     * if that is less, into data. Returns the capacity accounted to it, or 0
+     * and leaves data alone if the buffers in use are at their limit.
+     */
+    size_t Acquire(CSerializeData& data, size_t nSize);
+
+    /** Account for a buffer from Acquire whose capacity grew from nOld to nNew */
+    void Resized(size_t nOld, size_t nNew);
+
+    /** Take the buffer out of data to reuse or free it; nAccounted is its capacity as last accounted */
+    void Release(CSerializeData& data, size_t nAccounted);
+
+    CRecvBufferPoolStats GetStats() const;
+};
+
+extern CRecvBufferPool recvBufferPool;
+
+#endif // BITCOIN_RECVBUFFERPOOL_H
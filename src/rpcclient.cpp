@@ -29,6 +29,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"stop", 0},
         {"setmocktime", 0},
         {"getaddednodeinfo", 0},
+        {"setban", 2},
+        {"setban", 3},
         {"setgenerate", 0},
         {"setgenerate", 1},
         {"getnetworkhashps", 0},
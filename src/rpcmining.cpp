@@ -737,6 +737,8 @@ Value submitblock(const Array& params, bool fHelp)
     RegisterValidationInterface(&sc);
     bool fAccepted = ProcessNewBlock(state, NULL, &block);
     UnregisterValidationInterface(&sc);
+    // Blocks peers sent ahead of this one can be processed now
+    ProcessBlocksAwaitingParent(block.GetHash());
     if (fBlockPresent) {
         if (fAccepted && !sc.found)
             return "duplicate-inconclusive";
@@ -6,13 +6,18 @@
 
 #include "rpcserver.h"
 
+#include "banman.h"
 #include "clientversion.h"
 #include "main.h"
 #include "net.h"
 #include "netbase.h"
+#include "netmsgstats.h"
 #include "protocol.h"
+#include "recvbufferpool.h"
+#include "servedblockcache.h"
 #include "sync.h"
 #include "timedata.h"
+#include "uploadtarget.h"
 #include "util.h"
 #include "version.h"
 
@@ -71,6 +76,25 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+/** Counters of the commands that were sent or received at least once */
+static Object MessageStatsToJSON(const std::vector<CMessageStats>& vStats)
+{
+    Object ret;
+    for (unsigned int i = 0; i < vStats.size(); i++) {
+        const CMessageStats& stats = vStats[i];
+        if (stats.nSent == 0 && stats.nSentBytes == 0 && stats.nRecv == 0)
+            continue;
+        Object obj;
+        obj.push_back(Pair("sent", stats.nSent));
+        obj.push_back(Pair("sentbytes", stats.nSentBytes));
+        obj.push_back(Pair("recv", stats.nRecv));
+        obj.push_back(Pair("recvbytes", stats.nRecvBytes));
+        obj.push_back(Pair("handlertime", stats.nHandlerTime / 1000.0));
+        ret.push_back(Pair(GetMessageStatsCommand(i), obj));
+    }
+    return ret;
+}
+
 Value getpeerinfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -101,7 +125,27 @@ Value getpeerinfo(const Array& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"compactblocks\": {          (object) Compact block relay with this peer\n"
+            "      \"supported\": true|false,      (boolean) Whether the peer can send and rebuild compact blocks\n"
+            "      \"highbandwidth_from\": true|false, (boolean) Whether we asked the peer to push new blocks to us as compact blocks\n"
+            "      \"highbandwidth_to\": true|false,   (boolean) Whether the peer asked us to push new blocks to it as compact blocks\n"
+            "      \"received\": n,               (numeric) Compact blocks received from the peer\n"
+            "      \"reconstructed\": n,          (numeric) Compact blocks rebuilt from our mempool without a round trip\n"
+            "      \"blocktxn\": n,               (numeric) Compact blocks rebuilt after asking for missing transactions\n"
+            "      \"failed\": n,                 (numeric) Compact blocks that could not be rebuilt and were fetched whole\n"
+            "      \"avglatency\": n              (numeric) Average time in milliseconds from receiving or requesting a compact block to having it rebuilt\n"
+            "    },\n"
+            "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
+            "    \"messages\": {              (object) Traffic with the peer per command, for the commands seen\n"
+            "      \"command\": {\n"
+            "        \"sent\": n,                 (numeric) Messages sent\n"
+            "        \"sentbytes\": n,            (numeric) Bytes sent, headers included\n"
+            "        \"recv\": n,                 (numeric) Messages received and handled\n"
+            "        \"recvbytes\": n,            (numeric) Bytes received, headers included\n"
+            "        \"handlertime\": n           (numeric) Total time in milliseconds spent handling received messages\n"
+            "      }, ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -146,8 +190,20 @@ Value getpeerinfo(const Array& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            Object compact;
+            compact.push_back(Pair("supported", statestats.fProvidesHeaderAndIDs));
+            compact.push_back(Pair("highbandwidth_from", statestats.fHighBandwidthFrom));
+            compact.push_back(Pair("highbandwidth_to", statestats.fHighBandwidthTo));
+            compact.push_back(Pair("received", statestats.nCompactBlocks));
+            compact.push_back(Pair("reconstructed", statestats.nCompactReconstructed));
+            compact.push_back(Pair("blocktxn", statestats.nCompactBlockTxn));
+            compact.push_back(Pair("failed", statestats.nCompactFailed));
+            int nRebuilt = statestats.nCompactReconstructed + statestats.nCompactBlockTxn;
+            compact.push_back(Pair("avglatency", nRebuilt ? statestats.nCompactLatency / 1000.0 / nRebuilt : 0.0));
+            obj.push_back(Pair("compactblocks", compact));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
+        obj.push_back(Pair("messages", MessageStatsToJSON(stats.vMessageStats)));
 
         ret.push_back(obj);
     }
@@ -313,7 +369,42 @@ Value getnettotals(const Array& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"recvbuffers\": {       (object) Pooled message receive buffers\n"
+            "    \"inuse\": n,          (numeric) Bytes held by received messages that were not handled yet\n"
+            "    \"idle\": n,           (numeric) Bytes kept for reuse\n"
+            "    \"hits\": n,           (numeric) Number of buffers that were reused\n"
+            "    \"misses\": n,         (numeric) Number of buffers that had to be allocated\n"
+            "    \"refused\": n         (numeric) Number of messages that got their own buffer because the pooled ones in use were at their limit\n"
+            "  },\n"
+            "  \"blockcache\": {        (object) Recently served blocks kept for other peers\n"
+            "    \"entries\": n,        (numeric) Number of cached entries\n"
+            "    \"bytes\": n,          (numeric) Size of the cached entries\n"
+            "    \"blockhits\": n,      (numeric) Number of block messages served from the cache\n"
+            "    \"blockmisses\": n,    (numeric) Number of block messages read from disk\n"
+            "    \"cmpcthits\": n,      (numeric) Number of cmpctblock messages served from the cache\n"
+            "    \"cmpctmisses\": n,    (numeric) Number of cmpctblock messages built from disk\n"
+            "    \"filteredhits\": n,   (numeric) Number of merkleblock messages built from a cached block\n"
+            "    \"filteredmisses\": n  (numeric) Number of merkleblock messages built from a block read from disk\n"
+            "  },\n"
+            "  \"uploadtarget\": {      (object) Outbound traffic within the -maxuploadtarget window\n"
+            "    \"timeframe\": n,      (numeric) Length of the window in seconds\n"
+            "    \"target\": n,         (numeric) Target in bytes, 0 if there is no limit\n"
+            "    \"targetreached\": t,  (boolean) True if the target was reached\n"
+            "    \"servehistorical\": t, (boolean) True if old blocks are served to syncing peers\n"
+            "    \"bytesleft\": n,      (numeric) Bytes left until the target is reached\n"
+            "    \"sent\": {            (object) Bytes sent within the window per class\n"
+            "      \"blockrelay\": n,   (numeric) New blocks, headers and compact blocks\n"
+            "      \"masternode\": n,   (numeric) Masternode, budget and SwiftTX messages\n"
+            "      \"other\": n,        (numeric) Transactions, inventory, addresses and the rest\n"
+            "      \"historical\": n    (numeric) Old blocks served to syncing peers\n"
+            "    },\n"
+            "    \"refused\": n,        (numeric) Peers disconnected for asking for old blocks over the target\n"
+            "    \"dropped\": n         (numeric) Peers disconnected with old blocks queued when the target was reached\n"
+            "  },\n"
+            "  \"messages\": {          (object) Traffic with all peers per command, as in getpeerinfo\n"
+            "    \"command\": { \"sent\": n, \"sentbytes\": n, \"recv\": n, \"recvbytes\": n, \"handlertime\": n }, ...\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getnettotals", "") + HelpExampleRpc("getnettotals", ""));
@@ -322,9 +413,100 @@ Value getnettotals(const Array& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    CRecvBufferPoolStats poolStats = recvBufferPool.GetStats();
+    Object recvBuffers;
+    recvBuffers.push_back(Pair("inuse", (uint64_t)poolStats.nInUse));
+    recvBuffers.push_back(Pair("idle", (uint64_t)poolStats.nIdle));
+    recvBuffers.push_back(Pair("hits", poolStats.nHits));
+    recvBuffers.push_back(Pair("misses", poolStats.nMisses));
+    recvBuffers.push_back(Pair("refused", poolStats.nRefused));
+    obj.push_back(Pair("recvbuffers", recvBuffers));
+
+    CServedBlockCacheStats cacheStats = servedBlockCache.GetStats();
+    Object blockCache;
+    blockCache.push_back(Pair("entries", (uint64_t)cacheStats.nEntries));
+    blockCache.push_back(Pair("bytes", (uint64_t)cacheStats.nBytes));
+    blockCache.push_back(Pair("blockhits", cacheStats.nBlockHits));
+    blockCache.push_back(Pair("blockmisses", cacheStats.nBlockMisses));
+    blockCache.push_back(Pair("cmpcthits", cacheStats.nCompactHits));
+    blockCache.push_back(Pair("cmpctmisses", cacheStats.nCompactMisses));
+    blockCache.push_back(Pair("filteredhits", cacheStats.nDecodedHits));
+    blockCache.push_back(Pair("filteredmisses", cacheStats.nDecodedMisses));
+    obj.push_back(Pair("blockcache", blockCache));
+
+    CUploadTargetStats targetStats = uploadTarget.GetStats(GetTime());
+    Object target;
+    target.push_back(Pair("timeframe", targetStats.nTimeframe));
+    target.push_back(Pair("target", targetStats.nTarget));
+    target.push_back(Pair("targetreached", targetStats.fTargetReached));
+    target.push_back(Pair("servehistorical", targetStats.fServeHistorical));
+    target.push_back(Pair("bytesleft", targetStats.nTarget > targetStats.nSentTotal ? targetStats.nTarget - targetStats.nSentTotal : 0));
+    Object sent;
+    sent.push_back(Pair("blockrelay", targetStats.vSent[SEND_PRIORITY_BLOCK_RELAY]));
+    sent.push_back(Pair("masternode", targetStats.vSent[SEND_PRIORITY_MASTERNODE]));
+    sent.push_back(Pair("other", targetStats.vSent[SEND_PRIORITY_NORMAL]));
+    sent.push_back(Pair("historical", targetStats.vSent[SEND_PRIORITY_HISTORICAL]));
+    target.push_back(Pair("sent", sent));
+    target.push_back(Pair("refused", targetStats.nRefused));
+    target.push_back(Pair("dropped", targetStats.nDropped));
+    obj.push_back(Pair("uploadtarget", target));
+
+    std::vector<CMessageStats> vMessageStats;
+    netMessageCounters.GetStats(vMessageStats);
+    obj.push_back(Pair("messages", MessageStatsToJSON(vMessageStats)));
     return obj;
 }
 
+Value getmessagequeueinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getmessagequeueinfo\n"
+            "\nReturns how long received P2P messages waited before they were handled, per command.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"threads\": n,              (numeric) Number of message handler threads\n"
+            "  \"commands\": {\n"
+            "    \"command\": {             (string) The P2P command, \"*other*\" for unknown commands\n"
+            "      \"locks\": [\"lock\",...], (array) The lock classes its handler needs (chain, masternode)\n"
+            "      \"count\": n,            (numeric) Number of messages handled\n"
+            "      \"avgqueuetime\": n,     (numeric) Average time between receipt and handling in microseconds\n"
+            "      \"maxqueuetime\": n      (numeric) Longest time between receipt and handling in microseconds\n"
+            "    }, ...\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getmessagequeueinfo", "") + HelpExampleRpc("getmessagequeueinfo", ""));
+
+    map<string, CMessageQueueStats> mapStats;
+    GetMessageQueueStats(mapStats);
+
+    Object commands;
+    for (map<string, CMessageQueueStats>::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it) {
+        const CMessageQueueStats& stats = it->second;
+        if (stats.nCount == 0)
+            continue;
+        Array locks;
+        int nLockClasses = GetMessageLockClasses(it->first);
+        if (nLockClasses & MSG_LOCK_CHAIN)
+            locks.push_back("chain");
+        if (nLockClasses & MSG_LOCK_MASTERNODE)
+            locks.push_back("masternode");
+        Object obj;
+        obj.push_back(Pair("locks", locks));
+        obj.push_back(Pair("count", stats.nCount));
+        obj.push_back(Pair("avgqueuetime", stats.nTotalTime / (int64_t)stats.nCount));
+        obj.push_back(Pair("maxqueuetime", stats.nMaxTime));
+        commands.push_back(Pair(it->first, obj));
+    }
+
+    Object ret;
+    ret.push_back(Pair("threads", nMessageHandlerThreads));
+    ret.push_back(Pair("commands", commands));
+    return ret;
+}
+
 static Array GetNetworksInfo()
 {
     Array networks;
@@ -405,3 +587,111 @@ Value getnetworkinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("localaddresses", localAddresses));
     return obj;
 }
+
+Value setban(const Array& params, bool fHelp)
+{
+    string strCommand;
+    if (params.size() >= 2)
+        strCommand = params[1].get_str();
+    if (fHelp || params.size() < 2 || params.size() > 4 ||
+        (strCommand != "add" && strCommand != "remove"))
+        throw runtime_error(
+            "setban \"ip(/netmask)\" \"add|remove\" (bantime) (absolute)\n"
+            "\nAttempts add or remove a IP/Subnet from the banned list.\n"
+            "\nArguments:\n"
+            "1. \"ip(/netmask)\" (string, required) The IP/Subnet (see getpeerinfo for nodes ip) with a optional netmask (default is /32 = single ip)\n"
+            "2. \"command\"      (string, required) 'add' to add a IP/Subnet to the list, 'remove' to remove a IP/Subnet from the list\n"
+            "3. \"bantime\"      (numeric, optional) time in seconds how long (or until when if [absolute] is set) the ip is banned (0 or empty means using the default time of 24h which can also be overwritten by the -bantime startup argument)\n"
+            "4. \"absolute\"     (boolean, optional) If set, the bantime must be a absolute timestamp in seconds since epoch (Jan 1 1970 GMT)\n"
+            "\nExamples:\n" +
+            HelpExampleCli("setban", "\"192.168.0.6\" \"add\" 86400") + HelpExampleCli("setban", "\"192.168.0.0/24\" \"add\"") + HelpExampleRpc("setban", "\"192.168.0.6\", \"add\", 86400"));
+
+    CSubNet subNet(params[0].get_str());
+    if (!subNet.IsValid())
+        throw JSONRPCError(RPC_CLIENT_INVALID_IP_OR_SUBNET, "Error: Invalid IP/Subnet");
+
+    if (strCommand == "add") {
+        int64_t nNow = GetTime();
+        if (banManager.IsBanned(subNet, nNow))
+            throw JSONRPCError(RPC_CLIENT_NODE_ALREADY_ADDED, "Error: IP/Subnet already banned");
+
+        int64_t nBanTime = 0;
+        if (params.size() >= 3 && !params[2].is_null())
+            nBanTime = params[2].get_int64();
+        bool fAbsolute = false;
+        if (params.size() == 4)
+            fAbsolute = params[3].get_bool();
+
+        int64_t nBanUntil;
+        if (nBanTime <= 0)
+            nBanUntil = nNow + GetArg("-bantime", DEFAULT_MISBEHAVING_BANTIME);
+        else
+            nBanUntil = (fAbsolute ? 0 : nNow) + nBanTime;
+        banManager.Ban(subNet, CBanEntry(nNow, nBanUntil, BanReasonManuallyAdded));
+
+        // Disconnect the peers already connected from the subnet
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (subNet.Match((CNetAddr)pnode->addr))
+                pnode->fDisconnect = true;
+        }
+    } else if (strCommand == "remove") {
+        if (!banManager.Unban(subNet))
+            throw JSONRPCError(RPC_MISC_ERROR, "Error: Unban failed");
+    }
+
+    return Value::null;
+}
+
+Value listbanned(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "listbanned\n"
+            "\nList all banned IPs/Subnets.\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"address\": \"xxx\",       (string) The IP/Subnet\n"
+            "    \"banned_until\": ttt,    (numeric) The ban expiry in seconds since epoch (Jan 1 1970 GMT)\n"
+            "    \"ban_created\": ttt,     (numeric) When the ban was added, in seconds since epoch (Jan 1 1970 GMT)\n"
+            "    \"ban_reason\": \"xxx\"     (string) Why the IP/Subnet was banned\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n" +
+            HelpExampleCli("listbanned", "") + HelpExampleRpc("listbanned", ""));
+
+    banmap_t banMap;
+    banManager.GetBanned(banMap);
+    int64_t nNow = GetTime();
+
+    Array bannedAddresses;
+    for (banmap_t::const_iterator it = banMap.begin(); it != banMap.end(); ++it) {
+        // Expired bans wait for the next sweep, but no longer apply
+        if (nNow >= it->second.nBanUntil)
+            continue;
+        Object rec;
+        rec.push_back(Pair("address", it->first.ToString()));
+        rec.push_back(Pair("banned_until", it->second.nBanUntil));
+        rec.push_back(Pair("ban_created", it->second.nCreateTime));
+        rec.push_back(Pair("ban_reason", it->second.BanReasonToString()));
+        bannedAddresses.push_back(rec);
+    }
+
+    return bannedAddresses;
+}
+
+Value clearbanned(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "clearbanned\n"
+            "\nClear all banned IPs.\n"
+            "\nExamples:\n" +
+            HelpExampleCli("clearbanned", "") + HelpExampleRpc("clearbanned", ""));
+
+    banManager.Clear();
+
+    return Value::null;
+}
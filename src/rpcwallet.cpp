@@ -2435,6 +2435,10 @@ Value mintzerocoin(const Array& params, bool fHelp)
     if(GetAdjustedTime() > GetSporkValue(SPORK_16_ZEROCOIN_MAINTENANCE_MODE))
         throw JSONRPCError(RPC_WALLET_ERROR, "zCATO is currently disabled due to maintenance.");
 
+    // Spending a mint rebuilds its witness from every block since it was minted
+    if (fPruneMode)
+        throw JSONRPCError(RPC_WALLET_ERROR, "zCATO cannot be minted in prune mode: spending it requires the full block history.");
+
     if (pwalletMain->IsLocked())
         throw JSONRPCError(RPC_WALLET_UNLOCK_NEEDED, "Error: Please enter the wallet passphrase with walletpassphrase first.");
 
@@ -0,0 +1,113 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "servedblockcache.h"
+
+CServedBlockCache servedBlockCache;
+
+CServedBlockCache::CServedBlockCache(size_t nMaxBytesIn) : nMaxBytes(nMaxBytesIn)
+{
+    stats.nEntries = 0;
+    stats.nBytes = 0;
+    stats.nBlockHits = 0;
+    stats.nBlockMisses = 0;
+    stats.nCompactHits = 0;
+    stats.nCompactMisses = 0;
+    stats.nDecodedHits = 0;
+    stats.nDecodedMisses = 0;
+}
+
+void CServedBlockCache::SetMaxBytes(size_t nMaxBytesIn)
+{
+    LOCK(cs);
+    nMaxBytes = nMaxBytesIn;
+    Trim();
+}
+
+const CServedBlockCache::CEntry* CServedBlockCache::Find(EntryType type, const uint256& hash)
+{
+    std::map<Key, CEntry>::iterator it = mapEntries.find(std::make_pair(type, hash));
+    bool fHit = it != mapEntries.end();
+    switch (type) {
+    case ENTRY_BLOCK:
+        fHit ? stats.nBlockHits++ : stats.nBlockMisses++;
+        break;
+    case ENTRY_CMPCTBLOCK:
+        fHit ? stats.nCompactHits++ : stats.nCompactMisses++;
+        break;
+    case ENTRY_DECODED:
+        fHit ? stats.nDecodedHits++ : stats.nDecodedMisses++;
+        break;
+    }
+    if (!fHit)
+        return NULL;
+    listLru.splice(listLru.begin(), listLru, it->second.itLru);
+    return &it->second;
+}
+
+void CServedBlockCache::Insert(EntryType type, const uint256& hash, const CEntry& entry)
+{
+    // Entries bigger than the whole cache would only evict everything else
+    if (entry.nSize > nMaxBytes)
+        return;
+    Key key = std::make_pair(type, hash);
+    if (mapEntries.count(key))
+        return;
+    CEntry& entryNew = mapEntries[key];
+    entryNew = entry;
+    listLru.push_front(key);
+    entryNew.itLru = listLru.begin();
+    stats.nEntries++;
+    stats.nBytes += entry.nSize;
+    Trim();
+}
+
+void CServedBlockCache::Trim()
+{
+    while (stats.nBytes > nMaxBytes && !listLru.empty()) {
+        std::map<Key, CEntry>::iterator it = mapEntries.find(listLru.back());
+        stats.nEntries--;
+        stats.nBytes -= it->second.nSize;
+        mapEntries.erase(it);
+        listLru.pop_back();
+    }
+}
+
+CNetPayloadRef CServedBlockCache::GetPayload(EntryType type, const uint256& hash)
+{
+    LOCK(cs);
+    const CEntry* pentry = Find(type, hash);
+    return pentry ? pentry->payload : CNetPayloadRef();
+}
+
+void CServedBlockCache::PutPayload(EntryType type, const uint256& hash, const CNetPayloadRef& payload)
+{
+    CEntry entry;
+    entry.payload = payload;
+    entry.nSize = payload->size();
+    LOCK(cs);
+    Insert(type, hash, entry);
+}
+
+boost::shared_ptr<const CBlock> CServedBlockCache::GetBlock(const uint256& hash)
+{
+    LOCK(cs);
+    const CEntry* pentry = Find(ENTRY_DECODED, hash);
+    return pentry ? pentry->pblock : boost::shared_ptr<const CBlock>();
+}
+
+void CServedBlockCache::PutBlock(const uint256& hash, const boost::shared_ptr<const CBlock>& pblock, size_t nSize)
+{
+    CEntry entry;
+    entry.pblock = pblock;
+    entry.nSize = nSize;
+    LOCK(cs);
+    Insert(ENTRY_DECODED, hash, entry);
+}
+
+CServedBlockCacheStats CServedBlockCache::GetStats() const
+{
+    LOCK(cs);
+    return stats;
+}
@@ -0,0 +1,97 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SERVEDBLOCKCACHE_H
+#define BITCOIN_SERVEDBLOCKCACHE_H
+
+#include "net.h"
+#include "primitives/block.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <list>
+#include <map>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+
+#include <boost/shared_ptr.hpp>
+
+/** Default for -servedblockcache, in megabytes */
+static const unsigned int DEFAULT_SERVED_BLOCK_CACHE_SIZE = 32;
+
+struct CServedBlockCacheStats {
+    size_t nEntries;
+    size_t nBytes;
+    //! Lookups of block and cmpctblock payloads, and of decoded blocks for merkleblock responses
+    uint64_t nBlockHits;
+    uint64_t nBlockMisses;
+    uint64_t nCompactHits;
+    uint64_t nCompactMisses;
+    uint64_t nDecodedHits;
+    uint64_t nDecodedMisses;
+};
+
+/**
+ * Recently served blocks, shared by all peers, for ProcessGetData. When a new
+ * block propagates, many peers ask for it within a short time; the first
+ * request reads it from disk and the others get the same data from here.
+ *
+ * Entries hold the "block" or "cmpctblock" message payload, which is queued
+ * for each peer without copying it, or the decoded block that merkleblock
+ * responses are built from with each peer's own filter. Blocks never change
+ * once stored under their hash, so entries only leave the cache when the
+ * least recently used ones are evicted to stay within the size limit.
+ */
+class CServedBlockCache
+{
+public:
+    enum EntryType {
+        ENTRY_BLOCK,
+        ENTRY_CMPCTBLOCK,
+        ENTRY_DECODED,
+    };
+
+private:
+    typedef std::pair<EntryType, uint256> Key;
+
+    struct CEntry {
+        CNetPayloadRef payload;
+        boost::shared_ptr<const CBlock> pblock;
+        size_t nSize;
+        std::list<Key>::iterator itLru;
+    };
+
+    mutable CCriticalSection cs;
+    std::map<Key, CEntry> mapEntries;
+    //! Most recently used first
+    std::list<Key> listLru;
+    size_t nMaxBytes;
+    CServedBlockCacheStats stats;
+
+    const CEntry* Find(EntryType type, const uint256& hash);
+    void Insert(EntryType type, const uint256& hash, const CEntry& entry);
+    void Trim();
+
+public:
+    explicit CServedBlockCache(size_t nMaxBytesIn = DEFAULT_SERVED_BLOCK_CACHE_SIZE * 1000000);
+
+    //! Set the size limit; 0 disables the cache
+    void SetMaxBytes(size_t nMaxBytesIn);
+
+    /** Payload of the "block" (ENTRY_BLOCK) or "cmpctblock" (ENTRY_CMPCTBLOCK) message for the block, or NULL */
+    CNetPayloadRef GetPayload(EntryType type, const uint256& hash);
+    void PutPayload(EntryType type, const uint256& hash, const CNetPayloadRef& payload);
+
+    /** Decoded block, or NULL */
+    boost::shared_ptr<const CBlock> GetBlock(const uint256& hash);
+    //! nSize is the serialized size of the block, used as an estimate of its memory usage
+    void PutBlock(const uint256& hash, const boost::shared_ptr<const CBlock>& pblock, size_t nSize);
+
+    CServedBlockCacheStats GetStats() const;
+};
+
+extern CServedBlockCache servedBlockCache;
+
+#endif // BITCOIN_SERVEDBLOCKCACHE_H
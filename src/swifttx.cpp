@@ -74,15 +74,17 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
         bool fAccepted = false;
         {
             LOCK(cs_main);
+            // Register the request first, so trimming the full pool inside AcceptToMemoryPool can't evict it
+            mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
             fAccepted = AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs);
+            if (!fAccepted)
+                mapTxLockReq.erase(tx.GetHash());
         }
         if (fAccepted) {
             RelayInv(inv);
 
             DoConsensusVote(tx, nBlockHeight);
 
-            mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
-
             LogPrintf("ProcessMessageSwiftTX::ix - Transaction Lock Request: %s %s : accepted %s\n",
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
                 tx.GetHash().ToString().c_str());
@@ -116,4 +116,45 @@ BOOST_AUTO_TEST_CASE(test_LockedPageManagerBase)
     BOOST_CHECK((last_unlock_len & (test_page_size-1)) == 0); // always unlock entire pages
 }
 
+BOOST_AUTO_TEST_CASE(test_NodePool)
+{
+    CNodePool pool;
+    {
+        typedef std::map<int, int, std::less<int>, pool_allocator<std::pair<const int, int> > > PooledMap;
+        PooledMap::allocator_type alloc(&pool);
+        PooledMap m(std::less<int>(), alloc);
+        for (int i = 0; i < 10000; ++i)
+            m[i] = i;
+        BOOST_CHECK(pool.GetChunksInUse() == 10000);
+        BOOST_CHECK(pool.GetBlockCount() > 1);
+        size_t nReserved = pool.GetReservedBytes();
+
+        /* Erased nodes go back on the free list and are reused without growing the pool */
+        for (int i = 0; i < 5000; ++i)
+            m.erase(i);
+        BOOST_CHECK(pool.GetChunksInUse() == 5000);
+        for (int i = 0; i < 5000; ++i)
+            m[-i - 1] = i;
+        BOOST_CHECK(pool.GetReservedBytes() == nReserved);
+        for (int i = -5000; i < 10000; ++i)
+            BOOST_CHECK((i < 0 || i >= 5000) == (m.count(i) == 1));
+
+        /* Releasing the last chunk hands all blocks back to the heap */
+        m.clear();
+        BOOST_CHECK(pool.GetChunksInUse() == 0);
+        BOOST_CHECK(pool.GetBlockCount() == 0);
+        BOOST_CHECK(pool.GetReservedBytes() == 0);
+    }
+
+    /* Without a pool, and for arrays, the allocator falls back to the heap */
+    pool_allocator<int> heap;
+    int* p = heap.allocate(1);
+    heap.deallocate(p, 1);
+    pool_allocator<int> pooled(&pool);
+    p = pooled.allocate(16);
+    BOOST_CHECK(pool.GetChunksInUse() == 0);
+    pooled.deallocate(p, 16);
+    BOOST_CHECK(heap != pooled);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,96 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "banman.h"
+#include "clientversion.h"
+#include "streams.h"
+
+#include <boost/test/unit_test.hpp>
+
+static CNetAddr ip(const char* pszIp)
+{
+    std::vector<CNetAddr> vIP;
+    LookupHost(pszIp, vIP, 1, false);
+    return vIP[0];
+}
+
+BOOST_AUTO_TEST_SUITE(banman_tests)
+
+BOOST_AUTO_TEST_CASE(subnet_prefix)
+{
+    BOOST_CHECK_EQUAL(CSubNet("1.2.3.4").GetPrefixLength(), 128);
+    BOOST_CHECK_EQUAL(CSubNet("1.2.0.0/16").GetPrefixLength(), 112);
+    BOOST_CHECK_EQUAL(CSubNet("1:2::/32").GetPrefixLength(), 32);
+    BOOST_CHECK_EQUAL(CSubNet("1.2.3.4/255.0.255.0").GetPrefixLength(), -1);
+    BOOST_CHECK(CSubNet(ip("1.2.3.4")) == CSubNet("1.2.3.4"));
+
+    CSubNet subNet("10.20.0.0/16");
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << subNet;
+    CSubNet subNetRead;
+    ss >> subNetRead;
+    BOOST_CHECK(subNetRead == subNet);
+    BOOST_CHECK(subNetRead.Match(ip("10.20.30.40")));
+}
+
+BOOST_AUTO_TEST_CASE(ban_lookup)
+{
+    CBanManager banman;
+    int64_t nNow = 1500000000;
+
+    banman.Ban(CSubNet(ip("1.2.3.4")), CBanEntry(nNow, nNow + 100, BanReasonNodeMisbehaving));
+    banman.Ban(CSubNet("10.20.0.0/16"), CBanEntry(nNow, nNow + 200, BanReasonManuallyAdded));
+    banman.Ban(CSubNet("2001:db8::/32"), CBanEntry(nNow, nNow + 200, BanReasonManuallyAdded));
+    banman.Ban(CSubNet("20.0.30.0/255.0.255.0"), CBanEntry(nNow, nNow + 200, BanReasonManuallyAdded));
+
+    BOOST_CHECK(banman.IsBanned(ip("1.2.3.4"), nNow));
+    BOOST_CHECK(!banman.IsBanned(ip("1.2.3.5"), nNow));
+    BOOST_CHECK(banman.IsBanned(ip("10.20.255.1"), nNow));
+    BOOST_CHECK(!banman.IsBanned(ip("10.21.0.1"), nNow));
+    BOOST_CHECK(banman.IsBanned(ip("2001:db8:1::1"), nNow));
+    BOOST_CHECK(!banman.IsBanned(ip("2001:db9::1"), nNow));
+    BOOST_CHECK(banman.IsBanned(ip("20.1.30.2"), nNow));
+    BOOST_CHECK(!banman.IsBanned(ip("20.1.31.2"), nNow));
+
+    // A shorter ban of an already banned subnet keeps the longer one
+    banman.Ban(CSubNet(ip("1.2.3.4")), CBanEntry(nNow, nNow + 50, BanReasonNodeMisbehaving));
+    BOOST_CHECK(banman.IsBanned(ip("1.2.3.4"), nNow + 99));
+
+    // Expired bans stop matching before they are swept
+    BOOST_CHECK(!banman.IsBanned(ip("1.2.3.4"), nNow + 100));
+    BOOST_CHECK(banman.IsBanned(ip("10.20.0.1"), nNow + 100));
+    BOOST_CHECK_EQUAL(banman.SweepBanned(nNow + 100), 1U);
+    banmap_t banMap;
+    banman.GetBanned(banMap);
+    BOOST_CHECK_EQUAL(banMap.size(), 3U);
+
+    BOOST_CHECK(banman.Unban(CSubNet("10.20.0.0/16")));
+    BOOST_CHECK(!banman.Unban(CSubNet("10.20.0.0/16")));
+    BOOST_CHECK(!banman.IsBanned(ip("10.20.0.1"), nNow));
+    banman.Clear();
+    BOOST_CHECK(!banman.IsBanned(ip("2001:db8::1"), nNow));
+}
+
+BOOST_AUTO_TEST_CASE(banmap_roundtrip)
+{
+    CBanManager banman;
+    int64_t nNow = 1500000000;
+    banman.Ban(CSubNet("10.20.0.0/16"), CBanEntry(nNow, nNow + 200, BanReasonManuallyAdded));
+    BOOST_CHECK(banman.IsDirty());
+
+    banmap_t banMap;
+    banman.GetBanned(banMap);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << banMap;
+
+    banmap_t banMapRead;
+    ss >> banMapRead;
+    CBanManager banmanRead;
+    banmanRead.SetBanned(banMapRead);
+    BOOST_CHECK(banmanRead.IsBanned(ip("10.20.1.2"), nNow));
+    BOOST_CHECK_EQUAL(banMapRead.begin()->second.nBanUntil, nNow + 200);
+    BOOST_CHECK_EQUAL(banMapRead.begin()->second.BanReasonToString(), "manually added");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,139 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+static CBlock BuildBlockTestCase()
+{
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+
+    block.vtx.resize(4);
+    block.vtx[0] = tx;
+    block.nVersion = 42;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+
+    for (int i = 1; i < 4; i++) {
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].prevout.n = i;
+        block.vtx[i] = tx;
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static CBlockHeaderAndShortTxIDs RoundTrip(const CBlockHeaderAndShortTxIDs& shortIDs)
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << shortIDs;
+    CBlockHeaderAndShortTxIDs shortIDs2;
+    stream >> shortIDs2;
+    BOOST_CHECK(stream.empty());
+    return shortIDs2;
+}
+
+BOOST_AUTO_TEST_CASE(rebuild_from_mempool)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+    pool.addUnchecked(block.vtx[1].GetHash(), CTxMemPoolEntry(block.vtx[1], 0, 0, 0, 0));
+    pool.addUnchecked(block.vtx[3].GetHash(), CTxMemPoolEntry(block.vtx[3], 0, 0, 0, 0));
+
+    CBlockHeaderAndShortTxIDs shortIDs = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+    BOOST_CHECK_EQUAL(shortIDs.BlockTxCount(), 4U);
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(shortIDs, std::vector<const CTransaction*>()) == PartiallyDownloadedBlock::READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(2));
+    BOOST_CHECK(partialBlock.IsTxAvailable(3));
+    BOOST_CHECK_EQUAL(partialBlock.PrefilledCount(), 1U);
+    BOOST_CHECK_EQUAL(partialBlock.MempoolCount(), 2U);
+
+    // A wrong transaction for the gap fails the merkle check
+    CBlock block2;
+    {
+        PartiallyDownloadedBlock partialBlockCopy = partialBlock;
+        std::vector<CTransaction> vtx(1, block.vtx[1]);
+        BOOST_CHECK(partialBlockCopy.FillBlock(block2, vtx) == PartiallyDownloadedBlock::READ_STATUS_FAILED);
+    }
+    // Too few or too many transactions are a protocol violation
+    {
+        PartiallyDownloadedBlock partialBlockCopy = partialBlock;
+        BOOST_CHECK(partialBlockCopy.FillBlock(block2, std::vector<CTransaction>()) == PartiallyDownloadedBlock::READ_STATUS_INVALID);
+    }
+
+    std::vector<CTransaction> vtx(1, block.vtx[2]);
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtx) == PartiallyDownloadedBlock::READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block.GetHash().ToString(), block2.GetHash().ToString());
+    BOOST_CHECK_EQUAL(block.hashMerkleRoot.ToString(), block2.BuildMerkleTree().ToString());
+}
+
+BOOST_AUTO_TEST_CASE(rebuild_from_extra_txn)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+    pool.addUnchecked(block.vtx[1].GetHash(), CTxMemPoolEntry(block.vtx[1], 0, 0, 0, 0));
+
+    std::vector<const CTransaction*> vExtraTxn;
+    vExtraTxn.push_back(&block.vtx[2]);
+    vExtraTxn.push_back(&block.vtx[3]);
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(RoundTrip(CBlockHeaderAndShortTxIDs(block)), vExtraTxn) == PartiallyDownloadedBlock::READ_STATUS_OK);
+    for (size_t i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(partialBlock.IsTxAvailable(i));
+
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, std::vector<CTransaction>()) == PartiallyDownloadedBlock::READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block.GetHash().ToString(), block2.GetHash().ToString());
+}
+
+BOOST_AUTO_TEST_CASE(invalid_compact_block)
+{
+    CTxMemPool pool(CFeeRate(0));
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(CBlockHeaderAndShortTxIDs(), std::vector<const CTransaction*>()) == PartiallyDownloadedBlock::READ_STATUS_INVALID);
+}
+
+BOOST_AUTO_TEST_CASE(transactions_request_serialization)
+{
+    BlockTransactionsRequest req1;
+    req1.blockhash = GetRandHash();
+    req1.indexes.resize(4);
+    req1.indexes[0] = 0;
+    req1.indexes[1] = 1;
+    req1.indexes[2] = 3;
+    req1.indexes[3] = 4;
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req1;
+    // Differentially encoded: each index is one byte
+    BOOST_CHECK_EQUAL(stream.size(), 32U + 1U + 4U);
+
+    BlockTransactionsRequest req2;
+    stream >> req2;
+    BOOST_CHECK_EQUAL(req1.blockhash.ToString(), req2.blockhash.ToString());
+    BOOST_CHECK_EQUAL(req2.indexes.size(), 4U);
+    BOOST_CHECK_EQUAL(req2.indexes[0], 0);
+    BOOST_CHECK_EQUAL(req2.indexes[1], 1);
+    BOOST_CHECK_EQUAL(req2.indexes[2], 3);
+    BOOST_CHECK_EQUAL(req2.indexes[3], 4);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,138 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilereader.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "random.h"
+#include "streams.h"
+#include "util.h"
+
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockfilereader_tests)
+
+BOOST_AUTO_TEST_CASE(blockfilereader_order)
+{
+    boost::filesystem::path path = GetTempPath() / strprintf("test_blockfilereader_%lu.dat", (unsigned long)GetRand(1000000));
+    std::vector<uint256> vHashes;
+    std::vector<uint64_t> vPos;
+    {
+        CAutoFile fileout(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!fileout.IsNull());
+
+        // Leading garbage, including a stray first magic byte
+        std::vector<char> vGarbage(37, 0x5a);
+        vGarbage[11] = Params().MessageStart()[0];
+        fileout.write(&vGarbage[0], vGarbage.size());
+
+        for (int i = 0; i < 200; i++) {
+            CBlock block;
+            block.nVersion = 1;
+            block.nTime = i;
+            block.nNonce = GetRand(1000000);
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].scriptSig = CScript() << i;
+            tx.vout.resize(1 + i % 5);
+            block.vtx.push_back(tx);
+
+            unsigned int nSize = fileout.GetSerializeSize(block);
+            fileout << FLATDATA(Params().MessageStart()) << nSize;
+            vPos.push_back(ftell(fileout.Get()));
+            fileout << block;
+            vHashes.push_back(block.GetHash());
+        }
+
+        // A frame that cannot be deserialized
+        std::vector<char> vZero(80, 0);
+        unsigned int nSize = vZero.size();
+        fileout << FLATDATA(Params().MessageStart()) << nSize;
+        fileout.write(&vZero[0], vZero.size());
+    }
+
+    CBlockFileReader reader(fopen(path.string().c_str(), "rb"), 3);
+    CImportedBlock imported;
+    for (unsigned int i = 0; i < vHashes.size(); i++) {
+        BOOST_REQUIRE(reader.Next(imported));
+        BOOST_CHECK(imported.fValid);
+        BOOST_CHECK(imported.hash == vHashes[i]);
+        BOOST_CHECK(imported.block.GetHash() == vHashes[i]);
+        BOOST_CHECK_EQUAL(imported.nPos, vPos[i]);
+    }
+    BOOST_REQUIRE(reader.Next(imported));
+    BOOST_CHECK(!imported.fValid);
+    BOOST_CHECK(!reader.Next(imported));
+
+    boost::filesystem::remove(path);
+}
+
+static CBlock MakeBlock(int i)
+{
+    CBlock block;
+    block.nVersion = 1;
+    block.nTime = i;
+    block.nNonce = GetRand(1000000);
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << i;
+    tx.vout.resize(1 + i % 5);
+    block.vtx.push_back(tx);
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(blockfilereader_rewind)
+{
+    boost::filesystem::path path = GetTempPath() / strprintf("test_blockfilereader_%lu.dat", (unsigned long)GetRand(1000000));
+    std::vector<uint256> vHashes;
+    {
+        CAutoFile fileout(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!fileout.IsNull());
+
+        for (int i = 0; i < 50; i++) {
+            CBlock block = MakeBlock(i);
+            fileout << FLATDATA(Params().MessageStart()) << fileout.GetSerializeSize(block) << block;
+            vHashes.push_back(block.GetHash());
+        }
+
+        // A block cut short after its header, whose size covers the whole next block: the next
+        // block is only found by scanning again from just after the broken block's header
+        CBlock blockHidden = MakeBlock(50);
+        unsigned int nHiddenSize = fileout.GetSerializeSize(blockHidden);
+        CDataStream ssHeader(SER_DISK, CLIENT_VERSION);
+        ssHeader << MakeBlock(51).GetBlockHeader();
+        unsigned int nSize = ssHeader.size() + MESSAGE_START_SIZE + sizeof(nHiddenSize) + nHiddenSize;
+        fileout << FLATDATA(Params().MessageStart()) << nSize;
+        fileout.write(&ssHeader[0], ssHeader.size());
+        fileout << FLATDATA(Params().MessageStart()) << nHiddenSize << blockHidden;
+
+        for (int i = 52; i < 100; i++) {
+            CBlock block = MakeBlock(i);
+            fileout << FLATDATA(Params().MessageStart()) << fileout.GetSerializeSize(block) << block;
+            vHashes.push_back(block.GetHash());
+        }
+        vHashes.insert(vHashes.begin() + 50, blockHidden.GetHash());
+    }
+
+    CBlockFileReader reader(fopen(path.string().c_str(), "rb"), 3);
+    CImportedBlock imported;
+    for (unsigned int i = 0; i < vHashes.size(); i++) {
+        BOOST_REQUIRE(reader.Next(imported));
+        if (i == 50) {
+            // the broken block itself
+            BOOST_CHECK(!imported.fValid);
+            BOOST_REQUIRE(reader.Next(imported));
+        }
+        BOOST_CHECK(imported.fValid);
+        BOOST_CHECK(imported.hash == vHashes[i]);
+    }
+    BOOST_CHECK(!reader.Next(imported));
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,91 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "clientversion.h"
+#include "streams.h"
+
+#include <map>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace libzerocoin;
+
+BOOST_AUTO_TEST_SUITE(blockindex_tests)
+
+// The inline denomination tables must keep the on-disk encoding of the
+// std::map and std::vector they replaced.
+BOOST_AUTO_TEST_CASE(zerocoin_supply_serialization)
+{
+    std::map<CoinDenomination, int64_t> mapSupply;
+    CZerocoinSupply supply;
+    int64_t n = 3;
+    for (auto& denom : zerocoinDenomList) {
+        mapSupply[denom] = n;
+        supply.at(denom) = n;
+        n = n * 7 - 20;
+    }
+
+    CDataStream ssMap(SER_DISK, CLIENT_VERSION);
+    ssMap << mapSupply;
+    CDataStream ssSupply(SER_DISK, CLIENT_VERSION);
+    ssSupply << supply;
+    BOOST_CHECK(ssMap.str() == ssSupply.str());
+    BOOST_CHECK_EQUAL(ssSupply.size(), ::GetSerializeSize(supply, SER_DISK, CLIENT_VERSION));
+
+    CZerocoinSupply supplyRead;
+    ssMap >> supplyRead;
+    BOOST_CHECK(supplyRead == supply);
+    BOOST_CHECK_THROW(supply.at(ZQ_ERROR), std::out_of_range);
+}
+
+BOOST_AUTO_TEST_CASE(mint_denominations_serialization)
+{
+    std::vector<CoinDenomination> vMints;
+    vMints.push_back(ZQ_FIVE);
+    vMints.push_back(ZQ_ONE);
+    vMints.push_back(ZQ_FIVE_THOUSAND);
+    vMints.push_back(ZQ_FIVE);
+
+    CDataStream ssVector(SER_DISK, CLIENT_VERSION);
+    ssVector << vMints;
+    CMintDenominations mints;
+    ssVector >> mints;
+    BOOST_CHECK_EQUAL(mints.size(), 4U);
+    BOOST_CHECK_EQUAL(mints.count(ZQ_FIVE), 2U);
+    BOOST_CHECK_EQUAL(mints.count(ZQ_ONE), 1U);
+    BOOST_CHECK_EQUAL(mints.count(ZQ_TEN), 0U);
+
+    // Written back grouped by denomination, readable as a vector again
+    CDataStream ssMints(SER_DISK, CLIENT_VERSION);
+    ssMints << mints;
+    BOOST_CHECK_EQUAL(ssMints.size(), ::GetSerializeSize(mints, SER_DISK, CLIENT_VERSION));
+    std::vector<CoinDenomination> vRead;
+    ssMints >> vRead;
+    BOOST_CHECK_EQUAL(vRead.size(), 4U);
+    BOOST_CHECK(vRead[0] == ZQ_ONE && vRead[1] == ZQ_FIVE && vRead[2] == ZQ_FIVE && vRead[3] == ZQ_FIVE_THOUSAND);
+
+    mints.clear();
+    BOOST_CHECK(mints.empty());
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_pool)
+{
+    std::vector<CBlockIndex*> vIndex;
+    for (int i = 0; i < 1000; i++) {
+        vIndex.push_back(new CBlockIndex());
+        vIndex.back()->nHeight = i;
+        vIndex.back()->vMintDenominationsInBlock.push_back(ZQ_TEN);
+    }
+    BOOST_CHECK(CBlockIndex::PoolUsage() >= 1000 * sizeof(CBlockIndex));
+    for (int i = 0; i < 1000; i++) {
+        BOOST_CHECK_EQUAL(vIndex[i]->nHeight, i);
+        BOOST_CHECK(vIndex[i]->MintedDenomination(ZQ_TEN));
+        BOOST_CHECK(!vIndex[i]->MintedDenomination(ZQ_ONE));
+        delete vIndex[i];
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,101 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "miner.h"
+#include "script/standard.h"
+#include "txmempool.h"
+
+#include <list>
+
+#include <boost/test/unit_test.hpp>
+
+// A transaction spending the P2SH output of OP_TRUE at prevout
+static CTransaction SpendTrue(const COutPoint& prevout, CAmount nValue)
+{
+    CScript redeemScript = CScript() << OP_TRUE;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(redeemScript.begin(), redeemScript.end());
+    tx.vout.resize(1);
+    tx.vout[0] = CTxOut(nValue, GetScriptForDestination(CScriptID(redeemScript)));
+    return tx;
+}
+
+static void AddFunding(CCoinsViewCache& coins, const uint256& hash)
+{
+    CCoinsModifier modifier = coins.ModifyCoins(hash);
+    modifier->fCoinBase = false;
+    modifier->nVersion = 1;
+    modifier->nHeight = 0;
+    modifier->vout.resize(1);
+    modifier->vout[0] = CTxOut(10 * COIN, GetScriptForDestination(CScriptID(CScript() << OP_TRUE)));
+}
+
+// Run the cache on a fresh view over coins, like CreateNewBlock does
+static std::vector<CTransaction> Select(CBlockTemplateCache& cache, CCoinsViewCache& coins, const CBlockIndex* pindexPrev)
+{
+    CBlockTemplate blocktemplate;
+    CCoinsViewCache view(&coins);
+    cache.AddTransactions(&blocktemplate, view, pindexPrev, DEFAULT_BLOCK_MAX_SIZE, 0, 0);
+    BOOST_CHECK_EQUAL(blocktemplate.vTxFees.size(), blocktemplate.block.vtx.size());
+    return blocktemplate.block.vtx;
+}
+
+BOOST_AUTO_TEST_SUITE(blocktemplate_tests)
+
+BOOST_AUTO_TEST_CASE(template_cache_invalidation)
+{
+    LOCK2(cs_main, mempool.cs);
+    CBlockIndex* pindexTip = chainActive.Tip();
+    uint256 hashNext = uint256(3);
+    CBlockIndex indexNext;
+    indexNext.phashBlock = &hashNext;
+    indexNext.pprev = pindexTip;
+    indexNext.nHeight = pindexTip->nHeight + 1;
+
+    CCoinsViewCache coins(pcoinsTip);
+    AddFunding(coins, uint256(1));
+    CTransaction t1 = SpendTrue(COutPoint(uint256(1), 0), 9 * COIN);
+    CTransaction t2 = SpendTrue(COutPoint(uint256(2), 0), 9 * COIN);
+
+    CBlockTemplateCache cache;
+    BOOST_CHECK(Select(cache, coins, pindexTip).empty());
+
+    // A new mempool transaction is picked up by the next request
+    mempool.addUnchecked(t1.GetHash(), CTxMemPoolEntry(t1, COIN, 0, 0.0, 0));
+    std::vector<CTransaction> vtx = Select(cache, coins, pindexTip);
+    BOOST_CHECK_EQUAL(vtx.size(), 1U);
+    BOOST_CHECK(vtx[0].GetHash() == t1.GetHash());
+    BOOST_CHECK_EQUAL(cache.nFees, COIN);
+
+    // t2 lacks its input; once the input exists, the same tip and mempool keep the old selection
+    mempool.addUnchecked(t2.GetHash(), CTxMemPoolEntry(t2, COIN, 0, 0.0, 0));
+    BOOST_CHECK_EQUAL(Select(cache, coins, pindexTip).size(), 1U);
+    AddFunding(coins, uint256(2));
+    BOOST_CHECK_EQUAL(Select(cache, coins, pindexTip).size(), 1U);
+
+    // ... until the tip moves
+    BOOST_CHECK_EQUAL(Select(cache, coins, &indexNext).size(), 2U);
+    BOOST_CHECK_EQUAL(cache.nBlockTx, 2U);
+    BOOST_CHECK_EQUAL(cache.nFees, 2 * COIN);
+
+    // Removed transactions leave the selection too
+    std::list<CTransaction> removed;
+    mempool.remove(t1, removed, true);
+    vtx = Select(cache, coins, &indexNext);
+    BOOST_CHECK_EQUAL(vtx.size(), 1U);
+    BOOST_CHECK(vtx[0].GetHash() == t2.GetHash());
+
+    // A changed fee delta counts as a mempool change
+    BOOST_CHECK_EQUAL(Select(cache, coins, &indexNext).size(), 1U);
+    mempool.PrioritiseTransaction(t2.GetHash(), t2.GetHash().ToString(), 0.0, -2 * COIN);
+    BOOST_CHECK(Select(cache, coins, &indexNext).empty());
+
+    mempool.clear();
+    mempool.mapDeltas.clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,184 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockwriter.h"
+#include "clientversion.h"
+#include "main.h"
+#include "utiltime.h"
+
+#include <stdio.h>
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+// File numbers far above the ones the test chain uses
+static const int FILE_SYNC = 9000;
+static const int FILE_THREAD = 9001;
+static const int FILE_QUEUE = 9010;
+
+static CDataStream MakeRecord(uint32_t n)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << n << ~n;
+    return ss;
+}
+
+static std::vector<char> ReadFile(const CDiskBlockPos& pos, const char* prefix)
+{
+    std::vector<char> vch;
+    FILE* file = fopen(GetBlockPosFilename(pos, prefix).string().c_str(), "rb");
+    if (file) {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), file)) > 0)
+            vch.insert(vch.end(), buf, buf + n);
+        fclose(file);
+    }
+    return vch;
+}
+
+static void RemoveFiles(int nFile)
+{
+    boost::filesystem::remove(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk"));
+    boost::filesystem::remove(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "rev"));
+}
+
+// Start a writer thread and wait until writes go through it
+static void StartWriter(CBlockDiskWriter& writer, boost::thread& thread, int nFile)
+{
+    thread = boost::thread(boost::bind(&CBlockDiskWriter::Thread, &writer));
+    while (writer.GetWriteTime() == 0) {
+        BOOST_CHECK(writer.WriteBlock(CDiskBlockPos(nFile, 0), MakeRecord(0)));
+        BOOST_CHECK(writer.Flush());
+        MilliSleep(1);
+    }
+}
+
+static void WriteRecords(CBlockDiskWriter* pwriter, int nFile, unsigned int nCount, unsigned int nSize)
+{
+    for (unsigned int i = 0; i < nCount; i++)
+        pwriter->WriteBlock(CDiskBlockPos(nFile, i * nSize), CDataStream(std::vector<char>(nSize, i), SER_DISK, CLIENT_VERSION));
+}
+
+BOOST_AUTO_TEST_SUITE(blockwriter_tests)
+
+BOOST_AUTO_TEST_CASE(blockwriter_sync_failure)
+{
+    // Without the thread every write happens right away
+    CBlockDiskWriter writer;
+    CDiskBlockPos pos(FILE_SYNC, 0);
+    CDataStream record = MakeRecord(1);
+    BOOST_CHECK(writer.WriteBlock(pos, record));
+    std::vector<char> vch = ReadFile(pos, "blk");
+    BOOST_CHECK(vch == std::vector<char>(record.begin(), record.end()));
+
+    // A write that fails fails every later one, and the flush
+    BOOST_CHECK(!writer.WriteUndo(CDiskBlockPos(), record));
+    BOOST_CHECK(!writer.WriteBlock(CDiskBlockPos(FILE_SYNC, record.size()), MakeRecord(2)));
+    BOOST_CHECK(!writer.Finalize(FILE_SYNC, 0, 0));
+    BOOST_CHECK(!writer.Flush());
+    BOOST_CHECK_EQUAL(ReadFile(pos, "blk").size(), record.size());
+
+    RemoveFiles(FILE_SYNC);
+}
+
+BOOST_AUTO_TEST_CASE(blockwriter_thread_order)
+{
+    CBlockDiskWriter writer;
+    boost::thread thread;
+    StartWriter(writer, thread, FILE_THREAD + 1);
+
+    // Records are written in submission order, so a later write to the same place wins
+    const unsigned int nRecords = 200;
+    const unsigned int nRecordSize = MakeRecord(0).size();
+    for (unsigned int i = 0; i < nRecords; i++) {
+        BOOST_CHECK(writer.WriteBlock(CDiskBlockPos(FILE_THREAD, i * nRecordSize), MakeRecord(i)));
+        BOOST_CHECK(writer.WriteUndo(CDiskBlockPos(FILE_THREAD, i * nRecordSize), MakeRecord(nRecords - i)));
+    }
+    BOOST_CHECK(writer.WriteBlock(CDiskBlockPos(FILE_THREAD, 0), MakeRecord(nRecords)));
+    // Space reserved beyond the last record is cut off
+    BOOST_CHECK(writer.WriteBlock(CDiskBlockPos(FILE_THREAD, nRecords * nRecordSize), CDataStream(std::vector<char>(1000, 0), SER_DISK, CLIENT_VERSION)));
+    BOOST_CHECK(writer.Finalize(FILE_THREAD, nRecords * nRecordSize, nRecords * nRecordSize));
+
+    // Once WaitForFile returns, everything queued for the file is on disk
+    writer.WaitForFile(FILE_THREAD);
+    std::vector<char> vchBlock = ReadFile(CDiskBlockPos(FILE_THREAD, 0), "blk");
+    std::vector<char> vchUndo = ReadFile(CDiskBlockPos(FILE_THREAD, 0), "rev");
+    BOOST_CHECK_EQUAL(vchBlock.size(), nRecords * nRecordSize);
+    BOOST_CHECK_EQUAL(vchUndo.size(), nRecords * nRecordSize);
+    for (unsigned int i = 0; i < nRecords && i * nRecordSize < vchBlock.size() && i * nRecordSize < vchUndo.size(); i++) {
+        CDataStream recordBlock = MakeRecord(i == 0 ? nRecords : i);
+        CDataStream recordUndo = MakeRecord(nRecords - i);
+        BOOST_CHECK(std::equal(recordBlock.begin(), recordBlock.end(), vchBlock.begin() + i * nRecordSize));
+        BOOST_CHECK(std::equal(recordUndo.begin(), recordUndo.end(), vchUndo.begin() + i * nRecordSize));
+    }
+
+    // Nothing is pending for other files
+    writer.WaitForFile(FILE_THREAD + 2);
+    BOOST_CHECK(writer.Flush());
+
+    thread.interrupt();
+    thread.join();
+
+    // With the thread stopped, writes are synchronous again
+    BOOST_CHECK(writer.WriteBlock(CDiskBlockPos(FILE_THREAD, 0), MakeRecord(0)));
+    CDataStream record = MakeRecord(0);
+    vchBlock = ReadFile(CDiskBlockPos(FILE_THREAD, 0), "blk");
+    BOOST_CHECK(std::equal(record.begin(), record.end(), vchBlock.begin()));
+
+    RemoveFiles(FILE_THREAD);
+    RemoveFiles(FILE_THREAD + 1);
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(blockwriter_queue_limit)
+{
+    CBlockDiskWriter writer;
+    boost::thread thread;
+    StartWriter(writer, thread, FILE_QUEUE + 2);
+
+    // The writer is stuck on a fifo until the test reads from it
+    CDiskBlockPos posFifo(FILE_QUEUE + 1, 0);
+    std::string strFifo = GetBlockPosFilename(posFifo, "blk").string();
+    BOOST_REQUIRE(mkfifo(strFifo.c_str(), 0600) == 0);
+    const unsigned int nStallSize = 1 << 20;
+    BOOST_CHECK(writer.WriteBlock(posFifo, CDataStream(std::vector<char>(nStallSize, 1), SER_DISK, CLIENT_VERSION)));
+
+    // Writers wait once the queue is full
+    const unsigned int nRecordSize = MAX_BLOCK_WRITE_QUEUE / 4;
+    boost::thread threadWrite(boost::bind(&WriteRecords, &writer, FILE_QUEUE, 6, nRecordSize));
+    MilliSleep(500);
+    BOOST_CHECK_EQUAL(writer.GetQueuedBytes(), nStallSize + 3 * nRecordSize);
+
+    int fd = open(strFifo.c_str(), O_RDONLY);
+    BOOST_REQUIRE(fd >= 0);
+    std::vector<char> vch(nStallSize);
+    size_t nRead = 0;
+    while (nRead < nStallSize) {
+        ssize_t n = read(fd, &vch[nRead], nStallSize - nRead);
+        BOOST_REQUIRE(n > 0);
+        nRead += n;
+    }
+    close(fd);
+    threadWrite.join();
+    BOOST_CHECK(writer.Flush());
+    BOOST_CHECK_EQUAL(writer.GetQueuedBytes(), 0U);
+    BOOST_CHECK_EQUAL(ReadFile(CDiskBlockPos(FILE_QUEUE, 0), "blk").size(), 6 * nRecordSize);
+
+    thread.interrupt();
+    thread.join();
+    RemoveFiles(FILE_QUEUE);
+    RemoveFiles(FILE_QUEUE + 1);
+    RemoveFiles(FILE_QUEUE + 2);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
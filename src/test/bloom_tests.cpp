@@ -8,6 +8,8 @@
 #include "clientversion.h"
 #include "key.h"
 #include "merkleblock.h"
+#include "protocol.h"
+#include "random.h"
 #include "serialize.h"
 #include "streams.h"
 #include "uint256.h"
@@ -459,4 +461,50 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
     BOOST_CHECK(!filter.contains(COutPoint(uint256("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    // Last 100 entries are always remembered, at a 1% false positive rate
+    CRollingBloomFilter rb1(100, 0.01);
+
+    std::vector<uint256> vData;
+    for (int i = 0; i < 100; i++)
+        vData.push_back(GetRandHash());
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(rb1.insert(vData[i]));
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(rb1.contains(vData[i]));
+    BOOST_CHECK(!rb1.insert(vData[0]));
+
+    // Past 150 inserts the first ones are forgotten
+    for (int i = 0; i < 300; i++)
+        rb1.insert(GetRandHash());
+    int nHits = 0;
+    for (int i = 0; i < 100; i++)
+        nHits += rb1.contains(vData[i]);
+    BOOST_CHECK(nHits < 10);
+
+    // False positives stay around the requested rate
+    int nFalsePositives = 0;
+    for (int i = 0; i < 10000; i++)
+        nFalsePositives += rb1.contains(GetRandHash());
+    BOOST_CHECK(nFalsePositives < 300);
+
+    // Inventory of different types with the same hash is told apart
+    CRollingBloomFilter rb2(1000, 0.000001);
+    uint256 hash = GetRandHash();
+    rb2.insert(CInv(MSG_TX, hash));
+    BOOST_CHECK(rb2.contains(CInv(MSG_TX, hash)));
+    BOOST_CHECK(!rb2.contains(CInv(MSG_TXLOCK_REQUEST, hash)));
+    BOOST_CHECK(!rb2.contains(hash));
+
+    std::vector<unsigned char> vKey = ParseHex("00000000000000000000ffff0a000001208d");
+    BOOST_CHECK(rb2.insert(vKey));
+    BOOST_CHECK(rb2.contains(vKey));
+    vKey.back() ^= 1;
+    BOOST_CHECK(!rb2.contains(vKey));
+
+    rb2.reset();
+    BOOST_CHECK(!rb2.contains(CInv(MSG_TX, hash)));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
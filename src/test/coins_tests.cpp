@@ -58,6 +58,24 @@ public:
 
     bool GetStats(CCoinsStats& stats) const { return false; }
 };
+
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView* base) : CCoinsViewCache(base) {}
+
+    void SelfTest() const
+    {
+        // Manually recompute the dynamic usage of the whole data, and compare it.
+        size_t ret = memusage::DynamicUsage(cacheCoins);
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+            ret += it->second.coins.DynamicMemoryUsage();
+        }
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+        // Every cached entry lives in the node pool.
+        BOOST_CHECK_EQUAL(cachePool.GetChunksInUse(), cacheCoins.size());
+    }
+};
 }
 
 BOOST_AUTO_TEST_SUITE(coins_tests)
@@ -89,8 +107,8 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
-    std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
-    stack.push_back(new CCoinsViewCache(&base)); // Start with one cache.
+    std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCacheTest(&base)); // Start with one cache.
 
     // Use a limited set of random transaction ids, so we do test overwriting entries.
     std::vector<uint256> txids;
@@ -115,6 +133,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 coins.nVersion = insecure_rand();
                 coins.vout.resize(1);
                 coins.vout[0].nValue = insecure_rand();
+                coins.vout[0].scriptPubKey.assign(insecure_rand() & 0x3F, 0);
                 *entry = coins;
             } else {
                 coins.Clear();
@@ -135,6 +154,9 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                     missed_an_entry = true;
                 }
             }
+            BOOST_FOREACH (const CCoinsViewCacheTest* test, stack) {
+                test->SelfTest();
+            }
         }
 
         if (insecure_rand() % 100 == 0) {
@@ -151,7 +173,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 } else {
                     removed_all_caches = true;
                 }
-                stack.push_back(new CCoinsViewCache(tip));
+                stack.push_back(new CCoinsViewCacheTest(tip));
                 if (stack.size() == 4) {
                     reached_4_caches = true;
                 }
@@ -175,4 +197,42 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+// Prefetched coins must never replace an entry the cache already has, and
+// must not be written back to the base view as if they were modified.
+BOOST_AUTO_TEST_CASE(coins_cache_warm_test)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest parent(&base);
+    CCoinsViewCacheTest cache(&parent);
+    uint256 txidCached = GetRandHash();
+    uint256 txidWarm = GetRandHash();
+
+    CCoins coinsCached;
+    coinsCached.vout.resize(1);
+    coinsCached.vout[0].nValue = 1;
+    *cache.ModifyCoins(txidCached) = coinsCached;
+
+    CCoins coinsStale;
+    coinsStale.vout.resize(1);
+    coinsStale.vout[0].nValue = 2;
+    BOOST_CHECK(!cache.WarmCoins(txidCached, coinsStale));
+    BOOST_CHECK_EQUAL(cache.AccessCoins(txidCached)->vout[0].nValue, 1);
+
+    CCoins coinsPruned;
+    BOOST_CHECK(!cache.WarmCoins(txidWarm, coinsPruned));
+    BOOST_CHECK(cache.AccessCoins(txidWarm) == NULL);
+
+    CCoins coinsWarm;
+    coinsWarm.vout.resize(1);
+    coinsWarm.vout[0].nValue = 3;
+    coinsWarm.vout[0].scriptPubKey.assign(insecure_rand() & 0x3F, 0);
+    BOOST_CHECK(cache.WarmCoins(txidWarm, coinsWarm));
+    BOOST_CHECK_EQUAL(cache.AccessCoins(txidWarm)->vout[0].nValue, 3);
+    cache.SelfTest();
+
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(parent.AccessCoins(txidCached) != NULL);
+    BOOST_CHECK(parent.AccessCoins(txidWarm) == NULL);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
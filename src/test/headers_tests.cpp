@@ -0,0 +1,180 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "net.h"
+#include "pow.h"
+#include "txdb.h"
+
+#include <boost/test/unit_test.hpp>
+
+// Tests these internal-to-main.cpp members:
+extern bool ProcessHeaders(CNode* pfrom, const std::vector<CBlockHeader>& headers);
+extern std::map<uint256, NodeId> mapHeadersOnlySource;
+
+/** Headers extending the active tip with the difficulty it expects; nNonce tells branches apart */
+static void MakeHeaders(unsigned int nCount, std::vector<CBlockHeader>& vHeaders, uint32_t nNonce = 0)
+{
+    // Index entries only to compute the difficulty from
+    std::vector<CBlockIndex> vIndex(nCount);
+    const CBlockIndex* pindexPrev = chainActive.Tip();
+    uint256 hashPrev = pindexPrev->GetBlockHash();
+    vHeaders.clear();
+    for (unsigned int i = 0; i < nCount; i++) {
+        CBlockHeader header;
+        header.hashPrevBlock = hashPrev;
+        header.nTime = pindexPrev->nTime + 60;
+        header.nBits = GetNextWorkRequired(pindexPrev, &header);
+        header.nNonce = nNonce + i;
+        vHeaders.push_back(header);
+
+        CBlockIndex& index = vIndex[i];
+        index.nTime = header.nTime;
+        index.nBits = header.nBits;
+        index.pprev = const_cast<CBlockIndex*>(pindexPrev);
+        index.nHeight = pindexPrev->nHeight + 1;
+        pindexPrev = &index;
+        hashPrev = header.GetHash();
+    }
+}
+
+/** Take the index entries of vHeaders out of mapBlockIndex and the block tree again */
+static void EraseHeaders(const std::vector<CBlockHeader>& vHeaders)
+{
+    FlushStateToDisk();
+    LOCK(cs_main);
+    std::vector<uint256> vHash;
+    for (std::vector<CBlockHeader>::const_reverse_iterator it = vHeaders.rbegin(); it != vHeaders.rend(); ++it) {
+        BlockMap::iterator mi = mapBlockIndex.find(it->GetHash());
+        if (mi == mapBlockIndex.end())
+            continue;
+        CBlockIndex* pindex = mi->second;
+        vHash.push_back(mi->first);
+        mapHeadersOnlySource.erase(mi->first);
+        mapBlockIndex.erase(mi);
+        delete pindex;
+    }
+    BOOST_CHECK(pblocktree->EraseBlockIndex(vHash));
+}
+
+static int CountHeadersOnly(NodeId nodeid)
+{
+    int nCount = 0;
+    for (std::map<uint256, NodeId>::const_iterator it = mapHeadersOnlySource.begin(); it != mapHeadersOnlySource.end(); ++it)
+        nCount += it->second == nodeid;
+    return nCount;
+}
+
+static bool HaveHeader(const CBlockHeader& header)
+{
+    LOCK(cs_main);
+    return mapBlockIndex.count(header.GetHash()) != 0;
+}
+
+static int GetMisbehavior(NodeId nodeid)
+{
+    CNodeStateStats stats;
+    BOOST_CHECK(GetNodeStateStats(nodeid, stats));
+    return stats.nMisbehavior;
+}
+
+BOOST_AUTO_TEST_SUITE(headers_tests)
+
+BOOST_AUTO_TEST_CASE(headers_only_per_peer)
+{
+    CBlockIndex* pindexBestHeaderOrig = pindexBestHeader;
+    std::vector<CBlockHeader> vHeaders;
+    MakeHeaders(MAX_HEADERS_ONLY_PER_PEER + 10, vHeaders);
+    std::vector<CBlockHeader> vFirst(vHeaders.begin(), vHeaders.begin() + MAX_HEADERS_RESULTS);
+    std::vector<CBlockHeader> vSecond(vHeaders.begin() + MAX_HEADERS_RESULTS, vHeaders.begin() + MAX_HEADERS_ONLY_PER_PEER);
+    std::vector<CBlockHeader> vRest(vHeaders.begin() + MAX_HEADERS_ONLY_PER_PEER, vHeaders.end());
+
+    CAddress addr1(CService("10.0.0.1", Params().GetDefaultPort()));
+    CAddress addr2(CService("10.0.0.2", Params().GetDefaultPort()));
+    NodeId id1;
+    {
+        CNode node1(INVALID_SOCKET, addr1, "", true);
+        CNode node2(INVALID_SOCKET, addr2, "", true);
+        node1.nVersion = node2.nVersion = 1;
+        id1 = node1.GetId();
+
+        BOOST_CHECK(ProcessHeaders(&node1, vFirst));
+        BOOST_CHECK(ProcessHeaders(&node1, vSecond));
+        BOOST_CHECK(HaveHeader(vSecond.back()));
+        BOOST_CHECK_EQUAL(CountHeadersOnly(node1.GetId()), MAX_HEADERS_ONLY_PER_PEER);
+        {
+            LOCK(cs_main);
+            BOOST_CHECK(pindexBestHeader->GetBlockHash() == vSecond.back().GetHash());
+        }
+
+        // Beyond the limit a peer's headers are ignored without penalty
+        BOOST_CHECK(ProcessHeaders(&node1, vRest));
+        BOOST_CHECK(!HaveHeader(vRest.front()));
+        BOOST_CHECK_EQUAL(GetMisbehavior(node1.GetId()), 0);
+
+        // Other peers may still extend the chain, and headers that are known already don't count
+        BOOST_CHECK(ProcessHeaders(&node2, vFirst));
+        BOOST_CHECK(ProcessHeaders(&node2, vRest));
+        BOOST_CHECK(HaveHeader(vRest.back()));
+        BOOST_CHECK_EQUAL(CountHeadersOnly(node2.GetId()), (int)vRest.size());
+    }
+    // Disconnecting releases what a peer was charged for; the best header chain stays
+    BOOST_CHECK_EQUAL(CountHeadersOnly(id1), 0);
+    BOOST_CHECK(HaveHeader(vFirst.front()));
+
+    // A peer that reconnects with a new branch each time doesn't grow the index
+    size_t nIndexSize = mapBlockIndex.size();
+    for (uint32_t nBranch = 1; nBranch <= 3; nBranch++) {
+        std::vector<CBlockHeader> vBranch;
+        MakeHeaders(MAX_HEADERS_RESULTS, vBranch, nBranch * MAX_HEADERS_ONLY_PER_PEER);
+        {
+            CNode node3(INVALID_SOCKET, CAddress(CService("10.0.0.4", Params().GetDefaultPort())), "", true);
+            node3.nVersion = 1;
+            BOOST_CHECK(ProcessHeaders(&node3, vBranch));
+            BOOST_CHECK(HaveHeader(vBranch.back()));
+            BOOST_CHECK_EQUAL(mapBlockIndex.size(), nIndexSize + MAX_HEADERS_RESULTS);
+        }
+        BOOST_CHECK(!HaveHeader(vBranch.front()));
+        BOOST_CHECK_EQUAL(mapBlockIndex.size(), nIndexSize);
+    }
+
+    EraseHeaders(vHeaders);
+    LOCK(cs_main);
+    pindexBestHeader = pindexBestHeaderOrig;
+}
+
+BOOST_AUTO_TEST_CASE(headers_invalid)
+{
+    CBlockIndex* pindexBestHeaderOrig = pindexBestHeader;
+    std::vector<CBlockHeader> vHeaders;
+    MakeHeaders(3, vHeaders);
+
+    CAddress addr(CService("10.0.0.3", Params().GetDefaultPort()));
+    CNode node(INVALID_SOCKET, addr, "", true);
+    node.nVersion = 1;
+
+    // A sequence with a gap
+    std::vector<CBlockHeader> vGap;
+    vGap.push_back(vHeaders[0]);
+    vGap.push_back(vHeaders[2]);
+    BOOST_CHECK(!ProcessHeaders(&node, vGap));
+    BOOST_CHECK_EQUAL(GetMisbehavior(node.GetId()), 20);
+    BOOST_CHECK(!HaveHeader(vHeaders[2]));
+
+    // A header claiming the wrong difficulty
+    std::vector<CBlockHeader> vBadBits(1, vHeaders[1]);
+    vBadBits[0].nBits = 0x1b0404cb;
+    BOOST_CHECK(!ProcessHeaders(&node, vBadBits));
+    BOOST_CHECK(!HaveHeader(vBadBits[0]));
+    BOOST_CHECK_EQUAL(GetMisbehavior(node.GetId()), 120);
+
+    // An empty message is fine
+    BOOST_CHECK(ProcessHeaders(&node, std::vector<CBlockHeader>()));
+
+    EraseHeaders(vHeaders);
+    LOCK(cs_main);
+    pindexBestHeader = pindexBestHeaderOrig;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
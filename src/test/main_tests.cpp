@@ -48,4 +48,31 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     BOOST_CHECK(nSum == 4109975100000000ULL);
 }
 
+BOOST_AUTO_TEST_CASE(message_lock_classes)
+{
+    // Masternode messages run in parallel with block and transaction handling
+    BOOST_CHECK_EQUAL(GetMessageLockClasses("mnb"), MSG_LOCK_MASTERNODE);
+    BOOST_CHECK_EQUAL(GetMessageLockClasses("mnw"), MSG_LOCK_MASTERNODE);
+    BOOST_CHECK_EQUAL(GetMessageLockClasses("mvote"), MSG_LOCK_MASTERNODE);
+    BOOST_CHECK_EQUAL(GetMessageLockClasses("block"), MSG_LOCK_CHAIN);
+    BOOST_CHECK_EQUAL(GetMessageLockClasses("tx"), MSG_LOCK_CHAIN);
+    BOOST_CHECK_EQUAL(GetMessageLockClasses("spork"), MSG_LOCK_CHAIN);
+    // inv and getdata look up masternode items
+    BOOST_CHECK_EQUAL(GetMessageLockClasses("inv"), MSG_LOCK_CHAIN | MSG_LOCK_MASTERNODE);
+    BOOST_CHECK_EQUAL(GetMessageLockClasses("getdata"), MSG_LOCK_CHAIN | MSG_LOCK_MASTERNODE);
+    // Unknown commands are treated conservatively
+    BOOST_CHECK_EQUAL(GetMessageLockClasses("foo"), MSG_LOCK_CHAIN);
+}
+
+BOOST_AUTO_TEST_CASE(message_queue_stats_commands)
+{
+    // The queue statistics count the same commands as the message counters
+    std::map<std::string, CMessageQueueStats> mapStats;
+    GetMessageQueueStats(mapStats);
+    BOOST_CHECK_EQUAL(mapStats.size(), (size_t)NUM_MESSAGE_STATS_SLOTS);
+    for (int i = 0; i < NUM_MESSAGE_STATS_SLOTS; i++)
+        BOOST_CHECK(mapStats.count(GetMessageStatsCommand(i)));
+    BOOST_CHECK(mapStats.count("dsr") && mapStats.count("merkleblock"));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,9 +3,14 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "script/standard.h"
+#include "swifttx.h"
 #include "txmempool.h"
 #include "util.h"
 
+#include <stdio.h>
+
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
 #include <list>
 
@@ -99,4 +104,290 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorDescendantTest)
+{
+    // Chain of parent -> child -> grandchild with rising fees
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++)
+    {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        if (i > 0)
+            tx[i].vin[0].prevout.hash = tx[i - 1].GetHash();
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 33000LL - 1000 * i;
+    }
+    CAmount nFee[3] = {1000, 2000, 10000};
+    uint64_t nSize = ::GetSerializeSize(CTransaction(tx[0]), SER_NETWORK, PROTOCOL_VERSION);
+
+    CTxMemPool testPool(CFeeRate(0));
+    std::list<CTransaction> removed;
+
+    // Add the child before the parent, as when a block is disconnected
+    testPool.addUnchecked(tx[1].GetHash(), CTxMemPoolEntry(tx[1], nFee[1], 0, 0.0, 1));
+    testPool.addUnchecked(tx[2].GetHash(), CTxMemPoolEntry(tx[2], nFee[2], 0, 0.0, 1));
+    testPool.addUnchecked(tx[0].GetHash(), CTxMemPoolEntry(tx[0], nFee[0], 0, 0.0, 1));
+
+    const CTxMemPoolEntry& parent = testPool.mapTx[tx[0].GetHash()];
+    BOOST_CHECK_EQUAL(parent.GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(parent.GetSizeWithDescendants(), 3 * nSize);
+    BOOST_CHECK_EQUAL(parent.GetModFeesWithDescendants(), nFee[0] + nFee[1] + nFee[2]);
+    BOOST_CHECK_EQUAL(parent.GetCountWithAncestors(), 1);
+
+    const CTxMemPoolEntry& grandchild = testPool.mapTx[tx[2].GetHash()];
+    BOOST_CHECK_EQUAL(grandchild.GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(grandchild.GetSizeWithAncestors(), 3 * nSize);
+    BOOST_CHECK_EQUAL(grandchild.GetModFeesWithAncestors(), nFee[0] + nFee[1] + nFee[2]);
+    BOOST_CHECK_EQUAL(grandchild.GetCountWithDescendants(), 1);
+
+    // The grandchild pays for its ancestors, so its package is the best one
+    BOOST_CHECK(*testPool.setTxByAncestorScore.begin() == testPool.mapTx.find(tx[2].GetHash()));
+
+    // Prioritising the child changes the totals of the whole chain
+    testPool.PrioritiseTransaction(tx[1].GetHash(), tx[1].GetHash().ToString(), 0, 500);
+    BOOST_CHECK_EQUAL(parent.GetModFeesWithDescendants(), nFee[0] + nFee[1] + nFee[2] + 500);
+    BOOST_CHECK_EQUAL(grandchild.GetModFeesWithAncestors(), nFee[0] + nFee[1] + nFee[2] + 500);
+
+    // The parent is mined: its descendants lose it as an ancestor
+    testPool.remove(tx[0], removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    removed.clear();
+    const CTxMemPoolEntry& child = testPool.mapTx[tx[1].GetHash()];
+    BOOST_CHECK_EQUAL(child.GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(child.GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(grandchild.GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(grandchild.GetModFeesWithAncestors(), nFee[1] + nFee[2] + 500);
+
+    // Removing the grandchild leaves the child alone
+    testPool.remove(tx[2], removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(child.GetCountWithDescendants(), 1);
+    BOOST_CHECK_EQUAL(child.GetSizeWithDescendants(), nSize);
+    BOOST_CHECK_EQUAL(testPool.setTxByAncestorScore.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    // tx1 and tx2 are independent, tx3 spends tx2 and pays for it
+    CMutableTransaction tx1, tx2, tx3;
+    tx1.vin.resize(1);
+    tx1.vin[0].scriptSig = CScript() << OP_1;
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    tx2 = tx1;
+    tx2.vin[0].scriptSig = CScript() << OP_2;
+    tx3 = tx1;
+    tx3.vin[0].prevout = COutPoint(tx2.GetHash(), 0);
+    CTransaction t1(tx1), t2(tx2), t3(tx3);
+    unsigned int nSize = ::GetSerializeSize(t1, SER_NETWORK, PROTOCOL_VERSION);
+
+    pool.addUnchecked(t1.GetHash(), CTxMemPoolEntry(t1, 10000, 100, 0.0, 1));
+    pool.addUnchecked(t2.GetHash(), CTxMemPoolEntry(t2, 5000, 200, 0.0, 1));
+    pool.addUnchecked(t3.GetHash(), CTxMemPoolEntry(t3, 20000, 300, 0.0, 1));
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(0));
+
+    // tx2 is worth the fee rate of its package with tx3, so tx1 goes first
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(!pool.exists(t1.GetHash()));
+    BOOST_CHECK(pool.exists(t2.GetHash()));
+    BOOST_CHECK(pool.exists(t3.GetHash()));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), CFeeRate(10000, nSize).GetFeePerK() + 1000);
+
+    // A SwiftTX lock request stays even though it pays the least
+    pool.addUnchecked(t1.GetHash(), CTxMemPoolEntry(t1, 1000, 100, 0.0, 1));
+    mapTxLockReq.insert(std::make_pair(t1.GetHash(), t1));
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(pool.exists(t1.GetHash()));
+    BOOST_CHECK(!pool.exists(t2.GetHash()));
+    BOOST_CHECK(!pool.exists(t3.GetHash()));
+    BOOST_CHECK_EQUAL(pool.Expire(1000), 0);
+
+    // After skipping it, the trim goes on to evict one package after another
+    CMutableTransaction tx4 = tx1;
+    tx4.vin[0].scriptSig = CScript() << OP_4;
+    CTransaction t4(tx4);
+    pool.addUnchecked(t2.GetHash(), CTxMemPoolEntry(t2, 5000, 200, 0.0, 1));
+    pool.addUnchecked(t3.GetHash(), CTxMemPoolEntry(t3, 1000, 300, 0.0, 1));
+    pool.addUnchecked(t4.GetHash(), CTxMemPoolEntry(t4, 4000, 400, 0.0, 1));
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 3U);
+    BOOST_CHECK(!pool.exists(t3.GetHash()));
+    pool.TrimToSize(0);
+    BOOST_CHECK_EQUAL(pool.size(), 1U);
+    BOOST_CHECK(pool.exists(t1.GetHash()));
+    mapTxLockReq.erase(t1.GetHash());
+
+    // Expiry takes the descendants of old transactions along
+    pool.addUnchecked(t2.GetHash(), CTxMemPoolEntry(t2, 5000, 200, 0.0, 1));
+    pool.addUnchecked(t3.GetHash(), CTxMemPoolEntry(t3, 20000, 300, 0.0, 1));
+    BOOST_CHECK_EQUAL(pool.Expire(250), 3);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+}
+
+// A zerocoin spend of vSerials; the proofs are left empty, which is all the serial index reads
+static CTransaction ZerocoinSpend(const std::vector<CBigNum>& vSerials, CAmount nValue)
+{
+    CMutableTransaction tx;
+    BOOST_FOREACH (const CBigNum& bnSerial, vSerials) {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << libzerocoin::ZQ_ONE << uint256() << (uint32_t)0 << CBigNum(1) << CBigNum(1) << bnSerial;
+        std::vector<unsigned char> data(ss.begin(), ss.end());
+        // Zeros deserialize as empty proofs; the fixed size keeps the transaction size independent of the serial
+        data.resize(2048, 0);
+
+        CTxIn txin;
+        txin.nSequence = 1;
+        txin.scriptSig = CScript() << OP_ZEROCOINSPEND << data.size();
+        txin.scriptSig.insert(txin.scriptSig.end(), data.begin(), data.end());
+        txin.prevout.SetNull();
+        tx.vin.push_back(txin);
+    }
+    tx.vout.push_back(CTxOut(nValue, CScript() << OP_TRUE));
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolZerocoinSerialTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    size_t nUsageEmpty = pool.DynamicMemoryUsage();
+    CBigNum bnSerial1(1), bnSerial2(2), bnSerial3(3);
+    CTransaction t1 = ZerocoinSpend(std::vector<CBigNum>(1, bnSerial1), COIN);
+    std::vector<CBigNum> vSerials;
+    vSerials.push_back(bnSerial2);
+    vSerials.push_back(bnSerial3);
+    CTransaction t2 = ZerocoinSpend(vSerials, COIN);
+    BOOST_CHECK(t1.IsZerocoinSpend() && t2.IsZerocoinSpend());
+
+    pool.addUnchecked(t1.GetHash(), CTxMemPoolEntry(t1, 0, 0, 0.0, 1));
+    pool.addUnchecked(t2.GetHash(), CTxMemPoolEntry(t2, 0, 0, 0.0, 1));
+    uint256 hashTx;
+    BOOST_CHECK(pool.LookupZerocoinSerial(bnSerial1, hashTx) && hashTx == t1.GetHash());
+    BOOST_CHECK(pool.LookupZerocoinSerial(bnSerial3, hashTx) && hashTx == t2.GetHash());
+    BOOST_CHECK(!pool.LookupZerocoinSerial(CBigNum(4), hashTx));
+
+    // A block spending serial 1 in another transaction takes t1 out of the pool and the index
+    CTransaction tBlock = ZerocoinSpend(std::vector<CBigNum>(1, bnSerial1), 2 * COIN);
+    std::list<CTransaction> removed;
+    pool.removeConflicts(tBlock, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK(!pool.exists(t1.GetHash()));
+    BOOST_CHECK(!pool.LookupZerocoinSerial(bnSerial1, hashTx));
+    BOOST_CHECK(pool.LookupZerocoinSerial(bnSerial2, hashTx));
+
+    pool.remove(t2, removed);
+    BOOST_CHECK(!pool.LookupZerocoinSerial(bnSerial2, hashTx));
+    BOOST_CHECK(!pool.LookupZerocoinSerial(bnSerial3, hashTx));
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), nUsageEmpty);
+
+    // Of two spends of a serial, the index keeps the first, and only its removal drops the serial
+    CTransaction t3 = ZerocoinSpend(std::vector<CBigNum>(1, bnSerial1), 3 * COIN);
+    pool.addUnchecked(t1.GetHash(), CTxMemPoolEntry(t1, 0, 0, 0.0, 1));
+    pool.addUnchecked(t3.GetHash(), CTxMemPoolEntry(t3, 0, 0, 0.0, 1));
+    BOOST_CHECK(pool.LookupZerocoinSerial(bnSerial1, hashTx) && hashTx == t1.GetHash());
+    pool.remove(t3, removed);
+    BOOST_CHECK(pool.LookupZerocoinSerial(bnSerial1, hashTx) && hashTx == t1.GetHash());
+    pool.remove(t1, removed);
+    BOOST_CHECK(!pool.LookupZerocoinSerial(bnSerial1, hashTx));
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), nUsageEmpty);
+
+    // The values of the serials count towards the pool's memory usage
+    CBigNum bnSerialLarge;
+    bnSerialLarge.SetHex(std::string(256, '7'));
+    CTransaction tSmall = ZerocoinSpend(std::vector<CBigNum>(1, CBigNum(5)), COIN);
+    CTransaction tLarge = ZerocoinSpend(std::vector<CBigNum>(1, bnSerialLarge), COIN);
+    BOOST_CHECK_EQUAL(::GetSerializeSize(tSmall, SER_NETWORK, PROTOCOL_VERSION), ::GetSerializeSize(tLarge, SER_NETWORK, PROTOCOL_VERSION));
+    CTxMemPool poolSmall(CFeeRate(0)), poolLarge(CFeeRate(0));
+    poolSmall.addUnchecked(tSmall.GetHash(), CTxMemPoolEntry(tSmall, 0, 0, 0.0, 1));
+    poolLarge.addUnchecked(tLarge.GetHash(), CTxMemPoolEntry(tLarge, 0, 0, 0.0, 1));
+    BOOST_CHECK(poolLarge.DynamicMemoryUsage() > poolSmall.DynamicMemoryUsage() + 128);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPersistTest)
+{
+    // A P2SH output of OP_TRUE in a cache over the test chain funds the transactions
+    CScript redeemScript = CScript() << OP_TRUE;
+    CScript scriptPubKey = GetScriptForDestination(CScriptID(redeemScript));
+    CScript scriptSig = CScript() << std::vector<unsigned char>(redeemScript.begin(), redeemScript.end());
+    CCoinsViewCache* pcoinsTipOrig = pcoinsTip;
+    CCoinsViewCache coins(pcoinsTipOrig);
+    pcoinsTip = &coins;
+    uint256 hashFunding = uint256(1);
+    {
+        CCoinsModifier modifier = coins.ModifyCoins(hashFunding);
+        modifier->fCoinBase = false;
+        modifier->nVersion = 1;
+        modifier->nHeight = 0;
+        modifier->vout.resize(1);
+        modifier->vout[0] = CTxOut(10 * COIN, scriptPubKey);
+    }
+
+    // tx2 spends tx1, tx3 is older than -mempoolexpiry and never looked at again
+    CMutableTransaction tx1, tx2, tx3;
+    tx1.vin.resize(1);
+    tx1.vin[0].prevout = COutPoint(hashFunding, 0);
+    tx1.vin[0].scriptSig = scriptSig;
+    tx1.vout.resize(1);
+    tx1.vout[0] = CTxOut(9 * COIN, scriptPubKey);
+    tx2 = tx1;
+    tx2.vin[0].prevout = COutPoint(tx1.GetHash(), 0);
+    tx2.vout[0].nValue = 8 * COIN;
+    tx3 = tx1;
+    tx3.vin[0].prevout = COutPoint(uint256(2), 0);
+    CTransaction t1(tx1), t2(tx2), t3(tx3);
+
+    int64_t nNow = GetTime();
+    int64_t nExpired = nNow - DEFAULT_MEMPOOL_EXPIRY * 60 * 60 - 1;
+    bool fMempoolLoadedOrig = fMempoolLoaded;
+    {
+        LOCK(cs_main);
+        fMempoolLoaded = true;
+        CValidationState state;
+        BOOST_CHECK(AcceptToMemoryPoolWithTime(mempool, state, t1, true, NULL, nNow - 10));
+        BOOST_CHECK(AcceptToMemoryPoolWithTime(mempool, state, t2, true, NULL, nNow - 20));
+    }
+    mempool.addUnchecked(t3.GetHash(), CTxMemPoolEntry(t3, 10000, nExpired, 0.0, 0));
+    mempool.PrioritiseTransaction(t2.GetHash(), t2.GetHash().ToString(), 100.0, 5000);
+    BOOST_CHECK_EQUAL(mempool.size(), 3U);
+    BOOST_CHECK(DumpMempool());
+
+    // Parents are written before children and both keep their time, the expired one is skipped
+    mempool.clear();
+    {
+        LOCK(mempool.cs);
+        mempool.mapDeltas.clear();
+    }
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 2U);
+    BOOST_CHECK(!mempool.exists(t3.GetHash()));
+    {
+        LOCK(mempool.cs);
+        BOOST_CHECK_EQUAL(mempool.mapTx.find(t1.GetHash())->second.GetTime(), nNow - 10);
+        BOOST_CHECK_EQUAL(mempool.mapTx.find(t2.GetHash())->second.GetTime(), nNow - 20);
+        BOOST_CHECK_EQUAL(mempool.mapDeltas.size(), 1U);
+        BOOST_CHECK_EQUAL(mempool.mapDeltas[t2.GetHash()].second, 5000);
+    }
+
+    // A file of another version is not loaded at all
+    mempool.clear();
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    FILE* file = fopen(path.string().c_str(), "rb+");
+    BOOST_CHECK(file != NULL);
+    fputc(2, file);
+    fclose(file);
+    BOOST_CHECK(!LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 0U);
+
+    boost::filesystem::remove(path);
+    {
+        LOCK(mempool.cs);
+        mempool.mapDeltas.clear();
+    }
+    fMempoolLoaded = fMempoolLoadedOrig;
+    pcoinsTip = pcoinsTipOrig;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,236 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "net.h"
+#include "uploadtarget.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#ifndef WIN32
+#include <sys/socket.h>
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+static bool Contains(const std::vector<CNode*>& vNodes, CNode* pnode)
+{
+    return std::find(vNodes.begin(), vNodes.end(), pnode) != vNodes.end();
+}
+
+// Queue a message with nSize payload bytes on pnode, and append the bytes it goes out as to strSent
+static void QueueTestMessage(CNode& node, size_t nSize, int nPriority, std::string& strSent)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    for (size_t i = 0; i < nSize; i++)
+        ss << (unsigned char)i;
+    CSendMessage msg(CMessageHeader("test", 0), CNetPayloadRef(new CNetPayload(ss)), nPriority);
+    node.vSendMsg.push_back(msg);
+    node.nSendSize += msg.size();
+    strSent.append(msg.pchHeader, CMessageHeader::HEADER_SIZE);
+    strSent.append(msg.payload->data().begin(), msg.payload->data().end());
+}
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(timer_wheel)
+{
+    CNode node1(INVALID_SOCKET, CAddress(), "", true);
+    CNode node2(INVALID_SOCKET, CAddress(), "", true);
+    CNode node3(INVALID_SOCKET, CAddress(), "", true);
+    int64_t nNow = 1500000000;
+    CTimerWheel wheel;
+    std::vector<CNode*> vDue;
+    wheel.Advance(nNow, vDue);
+    BOOST_CHECK(vDue.empty());
+
+    // Nodes come due in their second, not before
+    wheel.Schedule(&node1, nNow + 5);
+    wheel.Schedule(&node2, nNow + 10);
+    BOOST_CHECK_EQUAL(node1.nTimeoutCheck, nNow + 5);
+    wheel.Advance(nNow + 4, vDue);
+    BOOST_CHECK(vDue.empty());
+    wheel.Advance(nNow + 5, vDue);
+    BOOST_CHECK_EQUAL(vDue.size(), 1U);
+    BOOST_CHECK(Contains(vDue, &node1));
+    BOOST_CHECK_EQUAL(node1.nTimeoutCheck, 0);
+
+    // A removed node never comes due
+    vDue.clear();
+    wheel.Remove(&node2);
+    BOOST_CHECK_EQUAL(node2.nTimeoutCheck, 0);
+    wheel.Advance(nNow + 20, vDue);
+    BOOST_CHECK(vDue.empty());
+
+    // A time that passed already is the next second
+    wheel.Schedule(&node1, nNow);
+    BOOST_CHECK_EQUAL(node1.nTimeoutCheck, nNow + 21);
+
+    // A node due more than a turn ahead shares its slot with earlier turns, and waits for its own
+    wheel.Schedule(&node3, nNow + 20 + 300);
+    wheel.Advance(nNow + 21, vDue);
+    BOOST_CHECK_EQUAL(vDue.size(), 1U);
+    BOOST_CHECK(Contains(vDue, &node1));
+    vDue.clear();
+    wheel.Advance(nNow + 20 + 300 - 256, vDue);
+    BOOST_CHECK(vDue.empty());
+    wheel.Advance(nNow + 20 + 299, vDue);
+    BOOST_CHECK(vDue.empty());
+
+    // After a stall of more than a turn every node that is due comes out at once
+    wheel.Schedule(&node1, nNow + 330);
+    wheel.Schedule(&node2, nNow + 500);
+    wheel.Advance(nNow + 1000, vDue);
+    BOOST_CHECK_EQUAL(vDue.size(), 3U);
+    BOOST_CHECK(Contains(vDue, &node1) && Contains(vDue, &node2) && Contains(vDue, &node3));
+}
+
+BOOST_AUTO_TEST_CASE(send_queue_partial)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    LOCK(node.cs_vSend);
+    std::string strSent;
+    QueueTestMessage(node, 100, SEND_PRIORITY_NORMAL, strSent);
+    QueueTestMessage(node, 100, SEND_PRIORITY_HISTORICAL, strSent);
+    size_t nMessageSize = CMessageHeader::HEADER_SIZE + 100;
+    uint64_t vSent[SEND_PRIORITY_COUNT] = {};
+
+    // A send that ends inside a header
+    AdvanceSendQueue(&node, 10, vSent);
+    BOOST_CHECK_EQUAL(node.nSendOffset, 10U);
+    BOOST_CHECK_EQUAL(node.vSendMsg.size(), 2U);
+    BOOST_CHECK_EQUAL(node.nSendSize, 2 * nMessageSize);
+
+    // ... inside the payload
+    AdvanceSendQueue(&node, CMessageHeader::HEADER_SIZE - 10 + 50, vSent);
+    BOOST_CHECK_EQUAL(node.nSendOffset, CMessageHeader::HEADER_SIZE + 50);
+    BOOST_CHECK_EQUAL(node.vSendMsg.size(), 2U);
+
+    // ... and past the end of the message, inside the next header
+    AdvanceSendQueue(&node, 50 + 5, vSent);
+    BOOST_CHECK_EQUAL(node.nSendOffset, 5U);
+    BOOST_CHECK_EQUAL(node.vSendMsg.size(), 1U);
+    BOOST_CHECK_EQUAL(node.nSendSize, nMessageSize);
+    BOOST_CHECK_EQUAL(vSent[SEND_PRIORITY_NORMAL], nMessageSize);
+    BOOST_CHECK_EQUAL(vSent[SEND_PRIORITY_HISTORICAL], 5U);
+
+    AdvanceSendQueue(&node, nMessageSize - 5, vSent);
+    BOOST_CHECK(node.vSendMsg.empty());
+    BOOST_CHECK_EQUAL(node.nSendOffset, 0U);
+    BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+    BOOST_CHECK_EQUAL(vSent[SEND_PRIORITY_HISTORICAL], nMessageSize);
+}
+
+// Command of the message at position i of node's send queue
+static std::string QueuedCommand(const CNode& node, size_t i)
+{
+    const char* pchCommand = node.vSendMsg[i].pchHeader + MESSAGE_START_SIZE;
+    return std::string(pchCommand, strnlen(pchCommand, CMessageHeader::COMMAND_SIZE));
+}
+
+BOOST_AUTO_TEST_CASE(send_queue_priority)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    LOCK(node.cs_vSend);
+    std::string strSent;
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    CNetPayloadRef payload(new CNetPayload(ss));
+    uint64_t vSent[SEND_PRIORITY_COUNT] = {};
+    QueueTestMessage(node, 100, SEND_PRIORITY_HISTORICAL, strSent);
+    AdvanceSendQueue(&node, 10, vSent);
+    node.PushMessagePayload("block", payload, SEND_PRIORITY_HISTORICAL);
+    node.PushMessagePayload("block", payload, SEND_PRIORITY_HISTORICAL);
+
+    // An inv overtakes the historical blocks that haven't started, not the one that has
+    node.PushMessagePayload("inv", payload, SEND_PRIORITY_NORMAL);
+    BOOST_CHECK_EQUAL(node.vSendMsg.size(), 4U);
+    BOOST_CHECK_EQUAL(QueuedCommand(node, 0), "test");
+    BOOST_CHECK_EQUAL(QueuedCommand(node, 1), "inv");
+    BOOST_CHECK_EQUAL(node.vSendMsg[2].nPriority, SEND_PRIORITY_HISTORICAL);
+
+    // Messages that overtake keep their order among themselves, and historical blocks go last
+    node.PushMessagePayload("ix", payload, SEND_PRIORITY_MASTERNODE);
+    node.PushMessagePayload("block", payload, SEND_PRIORITY_HISTORICAL);
+    node.PushMessagePayload("headers", payload, SEND_PRIORITY_BLOCK_RELAY);
+    BOOST_CHECK_EQUAL(node.vSendMsg.size(), 7U);
+    BOOST_CHECK_EQUAL(QueuedCommand(node, 1), "inv");
+    BOOST_CHECK_EQUAL(QueuedCommand(node, 2), "ix");
+    BOOST_CHECK_EQUAL(QueuedCommand(node, 3), "headers");
+    for (size_t i = 4; i < node.vSendMsg.size(); i++)
+        BOOST_CHECK_EQUAL(node.vSendMsg[i].nPriority, SEND_PRIORITY_HISTORICAL);
+    BOOST_CHECK_EQUAL(node.nSendSize, 100 + 7 * CMessageHeader::HEADER_SIZE);
+
+    // With nothing of the first block sent yet, it is overtaken too
+    CNode node2(INVALID_SOCKET, CAddress(), "", true);
+    {
+        LOCK(node2.cs_vSend);
+        QueueTestMessage(node2, 100, SEND_PRIORITY_HISTORICAL, strSent);
+        node2.PushMessagePayload("inv", payload, SEND_PRIORITY_NORMAL);
+        BOOST_CHECK_EQUAL(QueuedCommand(node2, 0), "inv");
+        BOOST_CHECK_EQUAL(QueuedCommand(node2, 1), "test");
+    }
+}
+
+#ifndef WIN32
+// Everything that can be read from hSocket right now
+static std::string ReceiveAll(SOCKET hSocket)
+{
+    std::string str;
+    char pchBuf[4096];
+    ssize_t nBytes;
+    while ((nBytes = recv(hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT)) > 0)
+        str.append(pchBuf, nBytes);
+    return str;
+}
+
+BOOST_AUTO_TEST_CASE(send_data_scatter_gather)
+{
+    int vSockets[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, vSockets) == 0);
+    CNode node(vSockets[0], CAddress(), "", true);
+    LOCK(node.cs_vSend);
+    uint64_t vSent[SEND_PRIORITY_COUNT] = {};
+
+    // More messages than fit in one call's buffers, some without payload, resuming inside the first header
+    std::string strSent;
+    for (int i = 0; i < 50; i++)
+        QueueTestMessage(node, (i % 5) * 10, SEND_PRIORITY_NORMAL, strSent);
+    AdvanceSendQueue(&node, 7, vSent);
+    SocketSendData(&node);
+    BOOST_CHECK(node.vSendMsg.empty());
+    BOOST_CHECK_EQUAL(node.nSendOffset, 0U);
+    BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+    BOOST_CHECK(ReceiveAll(vSockets[1]) == strSent.substr(7));
+
+    // Resuming inside a payload
+    strSent.clear();
+    QueueTestMessage(node, 100, SEND_PRIORITY_NORMAL, strSent);
+    QueueTestMessage(node, 100, SEND_PRIORITY_NORMAL, strSent);
+    AdvanceSendQueue(&node, CMessageHeader::HEADER_SIZE + 30, vSent);
+    SocketSendData(&node);
+    BOOST_CHECK(node.vSendMsg.empty());
+    BOOST_CHECK(ReceiveAll(vSockets[1]) == strSent.substr(CMessageHeader::HEADER_SIZE + 30));
+
+    // Through a small socket buffer, the sends stop anywhere in the queue and pick up from there
+    int nBufferSize = 4096;
+    setsockopt(vSockets[0], SOL_SOCKET, SO_SNDBUF, &nBufferSize, sizeof(nBufferSize));
+    strSent.clear();
+    for (int i = 0; i < 100; i++)
+        QueueTestMessage(node, 1000 + i, SEND_PRIORITY_NORMAL, strSent);
+    std::string strReceived;
+    for (int i = 0; i < 10000 && !node.vSendMsg.empty(); i++) {
+        SocketSendData(&node);
+        if (!node.vSendMsg.empty())
+            BOOST_CHECK(node.nSendOffset < node.vSendMsg.front().size());
+        strReceived += ReceiveAll(vSockets[1]);
+    }
+    BOOST_CHECK(node.vSendMsg.empty());
+    BOOST_CHECK(strReceived == strSent);
+
+    close(vSockets[1]);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,56 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "netmsgstats.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(netmsgstats_tests)
+
+BOOST_AUTO_TEST_CASE(command_slots)
+{
+    int nSlot = GetMessageStatsSlot("mnb");
+    BOOST_CHECK_EQUAL(GetMessageStatsCommand(nSlot), "mnb");
+    BOOST_CHECK(GetMessageStatsSlot("block") != nSlot);
+
+    // Unknown commands share the last slot
+    BOOST_CHECK_EQUAL(GetMessageStatsSlot("nosuchcommand"), NUM_MESSAGE_STATS_SLOTS - 1);
+    BOOST_CHECK_EQUAL(GetMessageStatsSlot("*other*"), NUM_MESSAGE_STATS_SLOTS - 1);
+    BOOST_CHECK_EQUAL(GetMessageStatsCommand(NUM_MESSAGE_STATS_SLOTS - 1), "*other*");
+}
+
+BOOST_AUTO_TEST_CASE(peer_and_global_counters)
+{
+    CNetMessageCounters global;
+    CNetMessageCounters peer1(&global), peer2(&global);
+    int nSlot = GetMessageStatsSlot("block");
+
+    // A message sent in two parts counts once
+    peer1.RecordSent(nSlot, 1000, false);
+    peer1.RecordSent(nSlot, 500, true);
+    peer2.RecordSent(nSlot, 1500, true);
+    peer2.RecordRecv(nSlot, 200, 30);
+    peer2.RecordRecv(nSlot, 300, 70);
+
+    std::vector<CMessageStats> vStats;
+    peer1.GetStats(vStats);
+    BOOST_CHECK_EQUAL(vStats.size(), (size_t)NUM_MESSAGE_STATS_SLOTS);
+    BOOST_CHECK_EQUAL(vStats[nSlot].nSent, 1U);
+    BOOST_CHECK_EQUAL(vStats[nSlot].nSentBytes, 1500U);
+    BOOST_CHECK_EQUAL(vStats[nSlot].nRecv, 0U);
+
+    peer2.GetStats(vStats);
+    BOOST_CHECK_EQUAL(vStats[nSlot].nRecv, 2U);
+    BOOST_CHECK_EQUAL(vStats[nSlot].nRecvBytes, 500U);
+    BOOST_CHECK_EQUAL(vStats[nSlot].nHandlerTime, 100);
+
+    global.GetStats(vStats);
+    BOOST_CHECK_EQUAL(vStats[nSlot].nSent, 2U);
+    BOOST_CHECK_EQUAL(vStats[nSlot].nSentBytes, 3000U);
+    BOOST_CHECK_EQUAL(vStats[nSlot].nRecv, 2U);
+    BOOST_CHECK_EQUAL(vStats[nSlot].nHandlerTime, 100);
+    BOOST_CHECK_EQUAL(vStats[GetMessageStatsSlot("tx")].nSentBytes, 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,106 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "main.h"
+
+#include <boost/test/unit_test.hpp>
+
+static CBlockFileInfo MakeFileInfo(unsigned int nHeightFirst, unsigned int nHeightLast, unsigned int nSize, unsigned int nUndoSize)
+{
+    CBlockFileInfo info;
+    info.nBlocks = nHeightLast - nHeightFirst + 1;
+    info.nHeightFirst = nHeightFirst;
+    info.nHeightLast = nHeightLast;
+    info.nSize = nSize;
+    info.nUndoSize = nUndoSize;
+    return info;
+}
+
+BOOST_AUTO_TEST_SUITE(prune_tests)
+
+BOOST_AUTO_TEST_CASE(prune_height)
+{
+    int nKeep = std::max((int)MIN_BLOCKS_TO_KEEP, Params().MaxReorganizationDepth() + ACCUMULATOR_BLOCKS_TO_KEEP);
+    BOOST_CHECK_EQUAL(GetPruneHeight(0), -1);
+    BOOST_CHECK_EQUAL(GetPruneHeight(nKeep), -1);
+
+    // Until the zerocoin start block is buried, the blocks its checkpoint accumulates are kept
+    int nZerocoinKept = Params().Zerocoin_StartHeight() + nKeep;
+    BOOST_CHECK_EQUAL(GetPruneHeight(nZerocoinKept), std::min(nZerocoinKept - nKeep, Params().Zerocoin_AccumulatorStartHeight() - 1));
+    BOOST_CHECK_EQUAL(GetPruneHeight(nZerocoinKept + 1), nZerocoinKept + 1 - nKeep);
+    BOOST_CHECK_EQUAL(GetPruneHeight(nZerocoinKept + 1000), nZerocoinKept + 1000 - nKeep);
+}
+
+BOOST_AUTO_TEST_CASE(prune_select_files)
+{
+    const uint64_t nMiB = 1024 * 1024;
+    const uint64_t nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+    std::vector<CBlockFileInfo> vinfo;
+    vinfo.push_back(MakeFileInfo(0, 99, 100 * nMiB, 10 * nMiB));
+    vinfo.push_back(CBlockFileInfo()); // already pruned
+    vinfo.push_back(MakeFileInfo(100, 199, 100 * nMiB, 10 * nMiB));
+    vinfo.push_back(MakeFileInfo(200, 299, 100 * nMiB, 10 * nMiB));
+    vinfo.push_back(MakeFileInfo(300, 399, 100 * nMiB, 10 * nMiB));
+    uint64_t nUsage = 4 * 110 * nMiB;
+    int nLastBlockFile = 4;
+
+    // Nothing is selected while under the target, or before anything is buried deep enough
+    std::set<int> setFiles;
+    BOOST_CHECK_EQUAL(SelectFilesToPrune(vinfo, nLastBlockFile, nUsage, nUsage + nBuffer + 1, 1000, setFiles), nUsage);
+    BOOST_CHECK(setFiles.empty());
+    BOOST_CHECK_EQUAL(SelectFilesToPrune(vinfo, nLastBlockFile, nUsage, 0, -1, setFiles), nUsage);
+    BOOST_CHECK(setFiles.empty());
+
+    // Oldest files first, stopping once the usage plus the buffer is under the target
+    BOOST_CHECK_EQUAL(SelectFilesToPrune(vinfo, nLastBlockFile, nUsage, 3 * 110 * nMiB, 1000, setFiles), 2 * 110 * nMiB);
+    BOOST_CHECK_EQUAL(setFiles.size(), 2U);
+    BOOST_CHECK(setFiles.count(0) && setFiles.count(2));
+
+    // The file being written to is never pruned, even with a zero target
+    setFiles.clear();
+    BOOST_CHECK_EQUAL(SelectFilesToPrune(vinfo, nLastBlockFile, nUsage, 0, 1000, setFiles), 110 * nMiB);
+    BOOST_CHECK_EQUAL(setFiles.size(), 3U);
+    BOOST_CHECK(!setFiles.count(1) && !setFiles.count(4));
+
+    // Files with a block above the prune height are skipped, older ones still go
+    setFiles.clear();
+    BOOST_CHECK_EQUAL(SelectFilesToPrune(vinfo, nLastBlockFile, nUsage, 0, 250, setFiles), 2 * 110 * nMiB);
+    BOOST_CHECK_EQUAL(setFiles.size(), 2U);
+    BOOST_CHECK(setFiles.count(0) && setFiles.count(2));
+    setFiles.clear();
+    SelectFilesToPrune(vinfo, nLastBlockFile, nUsage, 0, 98, setFiles);
+    BOOST_CHECK(setFiles.empty());
+}
+
+BOOST_AUTO_TEST_CASE(prune_snapshot_history)
+{
+    const uint64_t nMiB = 1024 * 1024;
+    std::vector<CBlockFileInfo> vinfo;
+    vinfo.push_back(MakeFileInfo(0, 99, 100 * nMiB, 0));
+    vinfo.push_back(MakeFileInfo(100, 199, 100 * nMiB, 0));
+    vinfo.push_back(MakeFileInfo(200, 299, 100 * nMiB, 0));
+    vinfo.push_back(MakeFileInfo(300, 399, 100 * nMiB, 0));
+    vinfo.push_back(MakeFileInfo(400, 420, 10 * nMiB, 0));
+
+    // History below a snapshot is kept until the background validation connected it;
+    // blocks above the snapshot were connected normally and may go
+    int nSnapshotHeightOrig = nUTXOSnapshotHeight;
+    int nValidatedHeightOrig = nUTXOSnapshotValidatedHeight;
+    nUTXOSnapshotHeight = 250;
+    nUTXOSnapshotValidatedHeight = 150;
+    std::set<int> setFiles;
+    SelectFilesToPrune(vinfo, 4, 400 * nMiB, 0, 1000, setFiles);
+    BOOST_CHECK_EQUAL(setFiles.size(), 2U);
+    BOOST_CHECK(setFiles.count(0) && setFiles.count(3));
+
+    nUTXOSnapshotValidatedHeight = 299;
+    setFiles.clear();
+    SelectFilesToPrune(vinfo, 4, 400 * nMiB, 0, 1000, setFiles);
+    BOOST_CHECK_EQUAL(setFiles.size(), 4U);
+    nUTXOSnapshotHeight = nSnapshotHeightOrig;
+    nUTXOSnapshotValidatedHeight = nValidatedHeightOrig;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
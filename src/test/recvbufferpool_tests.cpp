@@ -0,0 +1,98 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "recvbufferpool.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(recvbufferpool_tests)
+
+BOOST_AUTO_TEST_CASE(reuse_by_size_class)
+{
+    CRecvBufferPool pool(1024 * 1024);
+
+    CSerializeData data;
+    size_t nCapacity = pool.Acquire(data, 100);
+    BOOST_CHECK(nCapacity >= 100);
+    BOOST_CHECK_EQUAL(pool.GetStats().nInUse, nCapacity);
+    BOOST_CHECK_EQUAL(pool.GetStats().nMisses, 1U);
+    const char* pbuffer = data.data();
+    data.resize(100, 'x');
+    pool.Release(data, nCapacity);
+    BOOST_CHECK(data.empty());
+    BOOST_CHECK_EQUAL(pool.GetStats().nInUse, 0U);
+    BOOST_CHECK_EQUAL(pool.GetStats().nIdle, nCapacity);
+
+    // The same buffer serves the next small message, emptied
+    CSerializeData data2;
+    BOOST_CHECK_EQUAL(pool.Acquire(data2, 50), nCapacity);
+    BOOST_CHECK(data2.empty());
+    BOOST_CHECK(data2.data() == pbuffer);
+    BOOST_CHECK_EQUAL(pool.GetStats().nHits, 1U);
+    BOOST_CHECK_EQUAL(pool.GetStats().nIdle, 0U);
+
+    // A larger message gets a larger class
+    CSerializeData data3;
+    size_t nCapacity3 = pool.Acquire(data3, 10000);
+    BOOST_CHECK(nCapacity3 >= 10000);
+    BOOST_CHECK_EQUAL(pool.GetStats().nMisses, 2U);
+
+    // Huge messages get at most the largest class up front
+    CSerializeData data4;
+    size_t nLarge = pool.Acquire(data4, 2 * 1024 * 1024);
+    BOOST_CHECK(nLarge >= MAX_POOLED_RECV_BUFFER && nLarge < 2 * MAX_POOLED_RECV_BUFFER);
+    data4.resize(4 * MAX_POOLED_RECV_BUFFER);
+    size_t nGrown = data4.capacity();
+    pool.Resized(nLarge, nGrown);
+    BOOST_CHECK_EQUAL(pool.GetStats().nInUse, nCapacity + nCapacity3 + nGrown);
+    // and are not kept once they grew far beyond it
+    pool.Release(data4, nGrown);
+    BOOST_CHECK_EQUAL(pool.GetStats().nInUse, nCapacity + nCapacity3);
+    BOOST_CHECK_EQUAL(pool.GetStats().nIdle, 0U);
+
+    pool.Release(data2, nCapacity);
+    pool.Release(data3, nCapacity3);
+    BOOST_CHECK_EQUAL(pool.GetStats().nInUse, 0U);
+    BOOST_CHECK_EQUAL(pool.GetStats().nIdle, nCapacity + nCapacity3);
+}
+
+BOOST_AUTO_TEST_CASE(idle_limit)
+{
+    CRecvBufferPool pool(MAX_POOLED_RECV_BUFFER);
+
+    CSerializeData data1, data2;
+    size_t nCapacity1 = pool.Acquire(data1, MAX_POOLED_RECV_BUFFER);
+    size_t nCapacity2 = pool.Acquire(data2, MAX_POOLED_RECV_BUFFER);
+    pool.Release(data1, nCapacity1);
+    pool.Release(data2, nCapacity2);
+    // Only one fits below the limit, the other one was freed
+    BOOST_CHECK_EQUAL(pool.GetStats().nIdle, nCapacity1);
+    BOOST_CHECK_EQUAL(pool.GetStats().nInUse, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(in_use_limit)
+{
+    CRecvBufferPool pool(MAX_POOLED_RECV_BUFFER, MAX_POOLED_RECV_BUFFER + 1024);
+
+    CSerializeData data1, data2, data3;
+    size_t nCapacity1 = pool.Acquire(data1, MAX_POOLED_RECV_BUFFER);
+    BOOST_CHECK(nCapacity1 >= MAX_POOLED_RECV_BUFFER);
+
+    // Over the limit a request is turned down and the buffer left alone
+    BOOST_CHECK_EQUAL(pool.Acquire(data2, 10000), 0U);
+    BOOST_CHECK(data2.empty() && data2.capacity() == 0);
+    BOOST_CHECK_EQUAL(pool.GetStats().nRefused, 1U);
+    BOOST_CHECK_EQUAL(pool.GetStats().nInUse, nCapacity1);
+
+    // ... while a small one still fits
+    size_t nCapacity3 = pool.Acquire(data3, 100);
+    BOOST_CHECK(nCapacity3 >= 100);
+
+    // Once buffers come back, requests are served again
+    pool.Release(data1, nCapacity1);
+    BOOST_CHECK(pool.Acquire(data2, 10000) >= 10000);
+    BOOST_CHECK_EQUAL(pool.GetStats().nRefused, 1U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
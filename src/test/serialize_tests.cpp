@@ -159,6 +159,40 @@ BOOST_AUTO_TEST_CASE(insert_delete)
     CSerializeData d;
     ss.GetAndClear(d);
     BOOST_CHECK_EQUAL(ss.size(), 0);
+    BOOST_CHECK_EQUAL(d.size(), 4);
+    BOOST_CHECK_EQUAL(d[3], (char)0xff);
+    // and appends to data that is not empty
+    ss << (char)5 << (char)6;
+    ss.GetAndClear(d);
+    BOOST_CHECK_EQUAL(ss.size(), 0);
+    BOOST_CHECK_EQUAL(d.size(), 6);
+    BOOST_CHECK_EQUAL(d[0], 0);
+    BOOST_CHECK_EQUAL(d[5], 6);
+}
+
+BOOST_AUTO_TEST_CASE(memory_reader)
+{
+    CDataStream ss(SER_DISK, 0);
+    std::vector<int> v(3, 7);
+    ss << (uint32_t)0x12345678 << v << (unsigned char)0xab;
+
+    CMemoryReader reader(&ss[0], &ss[0] + ss.size(), SER_DISK, 0);
+    uint32_t n;
+    reader >> n;
+    BOOST_CHECK_EQUAL(n, 0x12345678U);
+    std::vector<int> vRead;
+    reader >> vRead;
+    BOOST_CHECK(vRead == v);
+    BOOST_CHECK_EQUAL(reader.size(), 1U);
+
+    // Reading past the end throws and leaves the reader where it was
+    uint32_t nPastEnd;
+    BOOST_CHECK_THROW(reader >> nPastEnd, std::ios_base::failure);
+    BOOST_CHECK_THROW(reader.ignore(2), std::ios_base::failure);
+    unsigned char c;
+    reader >> c;
+    BOOST_CHECK_EQUAL(c, 0xab);
+    BOOST_CHECK(reader.empty());
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,82 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "servedblockcache.h"
+
+#include <boost/test/unit_test.hpp>
+
+static CNetPayloadRef MakeTestPayload(size_t nSize)
+{
+    return MakeNetPayload(std::vector<char>(nSize - 3, 'x'));
+}
+
+BOOST_AUTO_TEST_SUITE(servedblockcache_tests)
+
+BOOST_AUTO_TEST_CASE(shared_payloads)
+{
+    CServedBlockCache cache(10000);
+    uint256 hash = 1;
+
+    BOOST_CHECK(!cache.GetPayload(CServedBlockCache::ENTRY_BLOCK, hash));
+    CNetPayloadRef payload = MakeTestPayload(1000);
+    BOOST_CHECK_EQUAL(payload->size(), 1000U);
+    cache.PutPayload(CServedBlockCache::ENTRY_BLOCK, hash, payload);
+
+    // Every peer gets the same payload, without a copy
+    BOOST_CHECK(cache.GetPayload(CServedBlockCache::ENTRY_BLOCK, hash) == payload);
+    BOOST_CHECK(cache.GetPayload(CServedBlockCache::ENTRY_BLOCK, hash) == payload);
+    // The compact form of the block is a separate entry
+    BOOST_CHECK(!cache.GetPayload(CServedBlockCache::ENTRY_CMPCTBLOCK, hash));
+
+    CServedBlockCacheStats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nEntries, 1U);
+    BOOST_CHECK_EQUAL(stats.nBytes, 1000U);
+    BOOST_CHECK_EQUAL(stats.nBlockHits, 2U);
+    BOOST_CHECK_EQUAL(stats.nBlockMisses, 1U);
+    BOOST_CHECK_EQUAL(stats.nCompactMisses, 1U);
+
+    boost::shared_ptr<const CBlock> pblock(new CBlock());
+    BOOST_CHECK(!cache.GetBlock(hash));
+    cache.PutBlock(hash, pblock, 500);
+    BOOST_CHECK(cache.GetBlock(hash) == pblock);
+    stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nBytes, 1500U);
+    BOOST_CHECK_EQUAL(stats.nDecodedHits, 1U);
+    BOOST_CHECK_EQUAL(stats.nDecodedMisses, 1U);
+}
+
+BOOST_AUTO_TEST_CASE(evict_least_recently_used)
+{
+    CServedBlockCache cache(3000);
+    uint256 hash1 = 1, hash2 = 2, hash3 = 3;
+
+    cache.PutPayload(CServedBlockCache::ENTRY_BLOCK, hash1, MakeTestPayload(1000));
+    cache.PutPayload(CServedBlockCache::ENTRY_BLOCK, hash2, MakeTestPayload(1000));
+    cache.PutPayload(CServedBlockCache::ENTRY_BLOCK, hash3, MakeTestPayload(1000));
+    BOOST_CHECK(cache.GetPayload(CServedBlockCache::ENTRY_BLOCK, hash1));
+
+    // hash2 is now the least recently used
+    cache.PutPayload(CServedBlockCache::ENTRY_CMPCTBLOCK, hash1, MakeTestPayload(500));
+    BOOST_CHECK(!cache.GetPayload(CServedBlockCache::ENTRY_BLOCK, hash2));
+    BOOST_CHECK(cache.GetPayload(CServedBlockCache::ENTRY_BLOCK, hash1));
+    BOOST_CHECK(cache.GetPayload(CServedBlockCache::ENTRY_BLOCK, hash3));
+    BOOST_CHECK_EQUAL(cache.GetStats().nBytes, 2500U);
+
+    // Entries bigger than the cache are not kept
+    cache.PutPayload(CServedBlockCache::ENTRY_BLOCK, hash2, MakeTestPayload(4000));
+    BOOST_CHECK(!cache.GetPayload(CServedBlockCache::ENTRY_BLOCK, hash2));
+    BOOST_CHECK_EQUAL(cache.GetStats().nEntries, 3U);
+
+    // Shrinking the limit evicts down to it, and 0 disables the cache
+    cache.SetMaxBytes(1500);
+    BOOST_CHECK_EQUAL(cache.GetStats().nEntries, 1U);
+    BOOST_CHECK(cache.GetPayload(CServedBlockCache::ENTRY_BLOCK, hash3));
+    cache.SetMaxBytes(0);
+    BOOST_CHECK_EQUAL(cache.GetStats().nEntries, 0U);
+    BOOST_CHECK_EQUAL(cache.GetStats().nBytes, 0U);
+    cache.PutPayload(CServedBlockCache::ENTRY_BLOCK, hash1, MakeTestPayload(1000));
+    BOOST_CHECK(!cache.GetPayload(CServedBlockCache::ENTRY_BLOCK, hash1));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
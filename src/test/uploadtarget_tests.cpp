@@ -0,0 +1,70 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "uploadtarget.h"
+
+#include <boost/test/unit_test.hpp>
+
+static void RecordSent(CUploadTarget& target, int nPriority, uint64_t nBytes, int64_t nNow)
+{
+    uint64_t vSent[SEND_PRIORITY_COUNT] = {};
+    vSent[nPriority] = nBytes;
+    target.RecordSent(vSent, nNow);
+}
+
+BOOST_AUTO_TEST_SUITE(uploadtarget_tests)
+
+BOOST_AUTO_TEST_CASE(historical_serving_limit)
+{
+    CUploadTarget target;
+    int64_t nNow = 1500000000;
+
+    // Without a target nothing is limited
+    RecordSent(target, SEND_PRIORITY_HISTORICAL, 1000, nNow);
+    BOOST_CHECK(!target.IsLimited(SEND_PRIORITY_HISTORICAL, nNow));
+
+    target.SetTarget(10000);
+    RecordSent(target, SEND_PRIORITY_HISTORICAL, 5000, nNow);
+    BOOST_CHECK(!target.IsLimited(SEND_PRIORITY_HISTORICAL, nNow));
+
+    // Historical serving stops at its share of the target, other classes go on
+    RecordSent(target, SEND_PRIORITY_BLOCK_RELAY, 3000, nNow);
+    BOOST_CHECK(target.IsLimited(SEND_PRIORITY_HISTORICAL, nNow));
+    BOOST_CHECK(!target.IsLimited(SEND_PRIORITY_BLOCK_RELAY, nNow));
+    BOOST_CHECK(!target.IsLimited(SEND_PRIORITY_MASTERNODE, nNow));
+    RecordSent(target, SEND_PRIORITY_MASTERNODE, 4000, nNow);
+    BOOST_CHECK(!target.IsLimited(SEND_PRIORITY_MASTERNODE, nNow));
+
+    CUploadTargetStats stats = target.GetStats(nNow);
+    BOOST_CHECK_EQUAL(stats.nTarget, 10000U);
+    BOOST_CHECK_EQUAL(stats.vSent[SEND_PRIORITY_HISTORICAL], 6000U);
+    BOOST_CHECK_EQUAL(stats.vSent[SEND_PRIORITY_BLOCK_RELAY], 3000U);
+    BOOST_CHECK_EQUAL(stats.vSent[SEND_PRIORITY_MASTERNODE], 4000U);
+    BOOST_CHECK_EQUAL(stats.nSentTotal, 13000U);
+    BOOST_CHECK(stats.fTargetReached);
+    BOOST_CHECK(!stats.fServeHistorical);
+}
+
+BOOST_AUTO_TEST_CASE(rolling_window)
+{
+    CUploadTarget target;
+    target.SetTarget(10000, 1440);
+    int64_t nNow = 1500000000;
+
+    // Traffic leaves the window bucket by bucket
+    RecordSent(target, SEND_PRIORITY_HISTORICAL, 5000, nNow);
+    RecordSent(target, SEND_PRIORITY_HISTORICAL, 5000, nNow + 720);
+    BOOST_CHECK(target.IsLimited(SEND_PRIORITY_HISTORICAL, nNow + 720));
+    BOOST_CHECK(target.IsLimited(SEND_PRIORITY_HISTORICAL, nNow + 1430));
+    BOOST_CHECK(!target.IsLimited(SEND_PRIORITY_HISTORICAL, nNow + 1450));
+    BOOST_CHECK_EQUAL(target.GetStats(nNow + 1450).nSentTotal, 5000U);
+    BOOST_CHECK_EQUAL(target.GetStats(nNow + 2170).nSentTotal, 0U);
+
+    // Buckets are reused once they left the window
+    RecordSent(target, SEND_PRIORITY_NORMAL, 2000, nNow + 1440);
+    BOOST_CHECK_EQUAL(target.GetStats(nNow + 1440).nSentTotal, 7000U);
+    BOOST_CHECK_EQUAL(target.GetStats(nNow + 1440).vSent[SEND_PRIORITY_NORMAL], 2000U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,104 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+#include "utxosnapshot.h"
+
+#include <stdio.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(utxosnapshot_tests)
+
+BOOST_AUTO_TEST_CASE(snapshot_dump_verify_load)
+{
+    CZerocoinDB* zerocoinDBOrig = zerocoinDB;
+    if (zerocoinDB == NULL)
+        zerocoinDB = new CZerocoinDB(1 << 20, true);
+
+    boost::filesystem::path path = GetDataDir() / "utxosnapshot_test.dat";
+    CUTXOSnapshotHeader header;
+    CUTXOSnapshotStats stats;
+    std::string strError;
+    BOOST_CHECK_MESSAGE(DumpUTXOSnapshot(path, header, stats, strError), strError);
+    BOOST_CHECK(header.hashBlock == Params().HashGenesisBlock());
+    BOOST_CHECK_EQUAL(header.nHeight, 0);
+    BOOST_CHECK_EQUAL(stats.nBlockIndex, 1U);
+    BOOST_CHECK_EQUAL(stats.nBlocks, 0U);
+
+    // Only a snapshot whose height and hash are trusted verifies
+    MapUTXOSnapshots mapSnapshots;
+    CUTXOSnapshotHeader headerRead;
+    CUTXOSnapshotStats statsRead;
+    BOOST_CHECK(!VerifyUTXOSnapshot(path, mapSnapshots, headerRead, statsRead, strError));
+    mapSnapshots[0] = stats.hashContent;
+    BOOST_CHECK_MESSAGE(VerifyUTXOSnapshot(path, mapSnapshots, headerRead, statsRead, strError), strError);
+    BOOST_CHECK(statsRead.hashContent == stats.hashContent);
+    BOOST_CHECK_EQUAL(statsRead.nBytes, stats.nBytes);
+
+    MapUTXOSnapshots mapWrongHash;
+    mapWrongHash[0] = uint256(1);
+    BOOST_CHECK(!VerifyUTXOSnapshot(path, mapWrongHash, headerRead, statsRead, strError));
+    BOOST_CHECK(strError.find("does not match") != std::string::npos);
+
+    MapUTXOSnapshots mapWrongHeight;
+    mapWrongHeight[1] = stats.hashContent;
+    BOOST_CHECK(!VerifyUTXOSnapshot(path, mapWrongHeight, headerRead, statsRead, strError));
+
+    // Load into empty databases, then put the test chain back
+    CBlockTreeDB* pblocktreeOrig = pblocktree;
+    CCoinsViewDB* pcoinsdbviewOrig = pcoinsdbview;
+    CCoinsViewCache* pcoinsTipOrig = pcoinsTip;
+    CZerocoinDB* zerocoinDBTest = zerocoinDB;
+    pblocktree = new CBlockTreeDB(1 << 20, true);
+    pcoinsdbview = new CCoinsViewDB(1 << 20, true);
+    pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+    zerocoinDB = new CZerocoinDB(1 << 20, true);
+
+    BOOST_CHECK_MESSAGE(LoadUTXOSnapshot(path, mapSnapshots, statsRead, strError), strError);
+    BOOST_CHECK(pcoinsdbview->GetBestBlock() == Params().HashGenesisBlock());
+    int nHeight = -1;
+    uint256 hashCoins;
+    CCoinsStats coinsStats;
+    BOOST_CHECK(pblocktree->ReadUTXOSnapshot(nHeight, hashCoins));
+    BOOST_CHECK_EQUAL(nHeight, 0);
+    BOOST_CHECK(pcoinsdbview->GetStats(coinsStats));
+    BOOST_CHECK(hashCoins == coinsStats.hashSerialized);
+    bool fPruned = false;
+    BOOST_CHECK(pblocktree->ReadFlag("prunedblockfiles", fPruned) && fPruned);
+
+    // A snapshot is never loaded over an existing chain state
+    BOOST_CHECK(!LoadUTXOSnapshot(path, mapSnapshots, statsRead, strError));
+
+    delete pcoinsTip;
+    delete pcoinsdbview;
+    delete pblocktree;
+    delete zerocoinDB;
+    pblocktree = pblocktreeOrig;
+    pcoinsdbview = pcoinsdbviewOrig;
+    pcoinsTip = pcoinsTipOrig;
+    zerocoinDB = zerocoinDBTest;
+
+    // Any changed byte breaks the content hash
+    FILE* file = fopen(path.string().c_str(), "rb+");
+    BOOST_CHECK(file != NULL);
+    fseek(file, -40, SEEK_END);
+    int ch = fgetc(file);
+    fseek(file, -40, SEEK_END);
+    fputc(ch ^ 1, file);
+    fclose(file);
+    BOOST_CHECK(!VerifyUTXOSnapshot(path, mapSnapshots, headerRead, statsRead, strError));
+
+    boost::filesystem::remove(path);
+    if (zerocoinDBOrig == NULL) {
+        delete zerocoinDB;
+        zerocoinDB = NULL;
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
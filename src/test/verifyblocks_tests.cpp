@@ -0,0 +1,130 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockwriter.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "main.h"
+#include "txdb.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+// A file number far above the ones the test chain uses
+static const int FILE_VERIFY = 9200;
+
+/**
+ * Blocks with only a coinbase on top of the active tip, written to their own
+ * block file. They are made the active chain for the duration of a test, but
+ * are not added to mapBlockIndex.
+ */
+struct VerifyChainSetup {
+    CBlockIndex* pindexTipOrig;
+    bool fSkipProofOfWorkCheckOrig;
+    std::vector<uint256> vHashes;
+    std::vector<CBlockIndex*> vIndex;
+    CDiskBlockPos pos;
+
+    VerifyChainSetup() : pos(FILE_VERIFY, 0)
+    {
+        pindexTipOrig = chainActive.Tip();
+        fSkipProofOfWorkCheckOrig = Params().SkipProofOfWorkCheck();
+        ModifiableParams()->setSkipProofOfWorkCheck(true);
+        vHashes.reserve(100);
+    }
+
+    ~VerifyChainSetup()
+    {
+        LOCK(cs_main);
+        chainActive.SetTip(pindexTipOrig);
+        ModifiableParams()->setSkipProofOfWorkCheck(fSkipProofOfWorkCheckOrig);
+        for (unsigned int i = 0; i < vIndex.size(); i++)
+            delete vIndex[i];
+        blockDiskWriter.WaitForFile(FILE_VERIFY);
+        boost::filesystem::remove(GetBlockPosFilename(CDiskBlockPos(FILE_VERIFY, 0), "blk"));
+    }
+
+    CBlock MakeBlock(unsigned int nScriptSigSize = 2)
+    {
+        CBlockIndex* pindexPrev = vIndex.empty() ? pindexTipOrig : vIndex.back();
+        CMutableTransaction txCoinbase;
+        txCoinbase.vin.resize(1);
+        txCoinbase.vin[0].prevout.SetNull();
+        txCoinbase.vin[0].scriptSig = CScript() << std::vector<unsigned char>(nScriptSigSize - 1, vIndex.size() + 1);
+        txCoinbase.vout.resize(1);
+        txCoinbase.vout[0].nValue = 0;
+        txCoinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+
+        CBlock block;
+        block.nVersion = 1;
+        block.hashPrevBlock = pindexPrev->GetBlockHash();
+        block.nTime = pindexPrev->nTime + 60;
+        block.nBits = pindexPrev->nBits;
+        block.vtx.push_back(CTransaction(txCoinbase));
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        return block;
+    }
+
+    void AddBlock(CBlock& block)
+    {
+        CBlockIndex* pindexPrev = vIndex.empty() ? pindexTipOrig : vIndex.back();
+        BOOST_CHECK(WriteBlockToDisk(block, pos));
+        vHashes.push_back(block.GetHash());
+        CBlockIndex* pindex = new CBlockIndex(block);
+        pindex->phashBlock = &vHashes.back();
+        pindex->pprev = pindexPrev;
+        pindex->nHeight = pindexPrev->nHeight + 1;
+        pindex->nFile = pos.nFile;
+        pindex->nDataPos = pos.nPos;
+        pindex->nStatus = BLOCK_HAVE_DATA | BLOCK_VALID_SCRIPTS;
+        vIndex.push_back(pindex);
+        pos.nPos += ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+
+        LOCK(cs_main);
+        chainActive.SetTip(pindex);
+    }
+};
+
+BOOST_FIXTURE_TEST_SUITE(verifyblocks_tests, VerifyChainSetup)
+
+BOOST_AUTO_TEST_CASE(verifydb_workers)
+{
+    // Many more blocks than the workers keep in flight
+    for (int i = 0; i < 50; i++) {
+        CBlock block = MakeBlock();
+        AddBlock(block);
+    }
+    BOOST_CHECK(nScriptCheckThreads > 1);
+    BOOST_CHECK(CVerifyDB().VerifyDB(pcoinsdbview, 2, 0));
+    BOOST_CHECK(CVerifyDB().VerifyDB(pcoinsdbview, 2, 10));
+
+    // The workers run the context-free part of CheckBlock: a coinbase scriptSig must have 2 to 100 bytes
+    CBlock block = MakeBlock(1);
+    AddBlock(block);
+    for (int i = 0; i < 5; i++) {
+        block = MakeBlock();
+        AddBlock(block);
+    }
+    BOOST_CHECK(CVerifyDB().VerifyDB(pcoinsdbview, 0, 0));
+    BOOST_CHECK(!CVerifyDB().VerifyDB(pcoinsdbview, 1, 0));
+    BOOST_CHECK(!CVerifyDB().VerifyDB(pcoinsdbview, 1, 5));
+    BOOST_CHECK(CVerifyDB().VerifyDB(pcoinsdbview, 1, 4));
+}
+
+BOOST_AUTO_TEST_CASE(verifydb_bad_merkle_root)
+{
+    for (int i = 0; i < 10; i++) {
+        CBlock block = MakeBlock();
+        if (i == 3)
+            block.hashMerkleRoot = uint256(1);
+        AddBlock(block);
+    }
+    // The workers check the merkle root from level 1 on
+    BOOST_CHECK(CVerifyDB().VerifyDB(pcoinsdbview, 0, 0));
+    BOOST_CHECK(!CVerifyDB().VerifyDB(pcoinsdbview, 1, 0));
+    BOOST_CHECK(!CVerifyDB().VerifyDB(pcoinsdbview, 1, 6));
+    BOOST_CHECK(CVerifyDB().VerifyDB(pcoinsdbview, 1, 5));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -11,8 +11,11 @@
 #include "uint256.h"
 #include "accumulators.h"
 
+#include <deque>
 #include <stdint.h>
 
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -31,7 +34,7 @@ void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe)
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe, const std::string& strName) : db(GetDataDir() / strName, nCacheSize, fMemory, fWipe)
 {
 }
 
@@ -83,6 +86,22 @@ bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
 }
 
+bool CBlockTreeDB::WriteBlockIndex(const std::vector<CDiskBlockIndex>& vBlockIndex)
+{
+    CLevelDBBatch batch;
+    for (std::vector<CDiskBlockIndex>::const_iterator it = vBlockIndex.begin(); it != vBlockIndex.end(); it++)
+        batch.Write(make_pair('b', it->GetBlockHash()), *it);
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::EraseBlockIndex(const std::vector<uint256>& vHash)
+{
+    CLevelDBBatch batch;
+    for (std::vector<uint256>::const_iterator it = vHash.begin(); it != vHash.end(); it++)
+        batch.Erase(make_pair('b', *it));
+    return WriteBatch(batch);
+}
+
 bool CBlockTreeDB::WriteBlockFileInfo(int nFile, const CBlockFileInfo& info)
 {
     return Write(make_pair('f', nFile), info);
@@ -208,6 +227,127 @@ bool CBlockTreeDB::ReadInt(const std::string& name, int& nValue)
     return Read(std::make_pair('I', name), nValue);
 }
 
+bool CBlockTreeDB::WriteUTXOSnapshot(int nHeight, const uint256& hashCoins)
+{
+    return Write('U', std::make_pair(nHeight, hashCoins));
+}
+
+bool CBlockTreeDB::ReadUTXOSnapshot(int& nHeight, uint256& hashCoins)
+{
+    std::pair<int, uint256> snapshot;
+    if (!Read('U', snapshot))
+        return false;
+    nHeight = snapshot.first;
+    hashCoins = snapshot.second;
+    return true;
+}
+
+namespace
+{
+/** Number of block index records copied out of the database at a time */
+static const unsigned int BLOCK_INDEX_BATCH_SIZE = 1000;
+
+/** A run of serialized block index records, decoded and hashed by a CBlockIndexDecoder */
+struct CBlockIndexBatch {
+    std::vector<std::string> vValues;
+    std::vector<CDiskBlockIndex> vIndex;
+    std::vector<uint256> vHash;
+    std::string strError;
+    bool fDone;
+
+    CBlockIndexBatch() : fDone(false) {}
+};
+
+/**
+ * Worker threads that deserialize block index records and compute the block
+ * hashes (and proof-of-work checks) for them, which is most of the CPU time
+ * of loading the index. Linking the entries stays on the loading thread.
+ */
+class CBlockIndexDecoder
+{
+private:
+    boost::mutex cs;
+    boost::condition_variable cond;
+    std::deque<CBlockIndexBatch*> queue;
+    bool fStop;
+    boost::thread_group threads;
+
+    void Decode(CBlockIndexBatch& batch)
+    {
+        batch.vIndex.resize(batch.vValues.size());
+        batch.vHash.resize(batch.vValues.size());
+        for (unsigned int i = 0; i < batch.vValues.size(); i++) {
+            const std::string& strValue = batch.vValues[i];
+            CDiskBlockIndex& diskindex = batch.vIndex[i];
+            try {
+                CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+                ssValue >> diskindex;
+            } catch (std::exception& e) {
+                batch.strError = strprintf("Deserialize or I/O error - %s", e.what());
+                return;
+            }
+            batch.vHash[i] = diskindex.GetBlockHash();
+            if (diskindex.nHeight <= Params().LAST_POW_BLOCK() && !CheckProofOfWork(batch.vHash[i], diskindex.nBits)) {
+                batch.strError = strprintf("CheckProofOfWork failed: height=%d hash=%s", diskindex.nHeight, batch.vHash[i].ToString());
+                return;
+            }
+        }
+        std::vector<std::string>().swap(batch.vValues);
+    }
+
+    void Thread()
+    {
+        while (true) {
+            CBlockIndexBatch* batch;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (queue.empty() && !fStop)
+                    cond.wait(lock);
+                if (fStop)
+                    return;
+                batch = queue.front();
+                queue.pop_front();
+            }
+            Decode(*batch);
+            boost::unique_lock<boost::mutex> lock(cs);
+            batch->fDone = true;
+            cond.notify_all();
+        }
+    }
+
+public:
+    CBlockIndexDecoder(int nThreads) : fStop(false)
+    {
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CBlockIndexDecoder::Thread, this));
+    }
+
+    ~CBlockIndexDecoder()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            fStop = true;
+            cond.notify_all();
+        }
+        threads.join_all();
+    }
+
+    void Add(CBlockIndexBatch* batch)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        queue.push_back(batch);
+        cond.notify_all();
+    }
+
+    void Wait(CBlockIndexBatch* batch)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (!batch->fDone)
+            cond.wait(lock);
+    }
+};
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
     boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
@@ -216,74 +356,91 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     ssKeySet << make_pair('b', uint256(0));
     pcursor->Seek(ssKeySet.str());
 
+    // Records are copied out of the database in batches on this thread and
+    // decoded by the worker threads, while the entries of earlier batches are
+    // linked into mapBlockIndex here, in database order.
+    const unsigned int nThreads = std::max(1, nScriptCheckThreads);
+    std::deque<boost::shared_ptr<CBlockIndexBatch> > queueBatches;
+    CBlockIndexDecoder decoder(nThreads); // destroyed first, so no worker outlives a batch
+    bool fEnd = false;
+
     // Load mapBlockIndex
     uint256 nPreviousCheckpoint;
-    while (pcursor->Valid()) {
+    while (true) {
         boost::this_thread::interruption_point();
-        try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
-                pindexNew->nHeight = diskindex.nHeight;
-                pindexNew->nFile = diskindex.nFile;
-                pindexNew->nDataPos = diskindex.nDataPos;
-                pindexNew->nUndoPos = diskindex.nUndoPos;
-                pindexNew->nVersion = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime = diskindex.nTime;
-                pindexNew->nBits = diskindex.nBits;
-                pindexNew->nNonce = diskindex.nNonce;
-                pindexNew->nStatus = diskindex.nStatus;
-                pindexNew->nTx = diskindex.nTx;
-
-                //zerocoin
-                pindexNew->nAccumulatorCheckpoint = diskindex.nAccumulatorCheckpoint;
-                pindexNew->mapZerocoinSupply = diskindex.mapZerocoinSupply;
-                pindexNew->vMintDenominationsInBlock = diskindex.vMintDenominationsInBlock;
-
-                //Proof Of Stake
-                pindexNew->nMint = diskindex.nMint;
-                pindexNew->nMoneySupply = diskindex.nMoneySupply;
-                pindexNew->nFlags = diskindex.nFlags;
-                pindexNew->nStakeModifier = diskindex.nStakeModifier;
-                pindexNew->prevoutStake = diskindex.prevoutStake;
-                pindexNew->nStakeTime = diskindex.nStakeTime;
-                pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-
-                if (pindexNew->nHeight <= Params().LAST_POW_BLOCK()) {
-                    if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits))
-                        return error("LoadBlockIndex() : CheckProofOfWork failed: %s", pindexNew->ToString());
-                }
-                // ppcoin: build setStakeSeen
-                if (pindexNew->IsProofOfStake())
-                    setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
 
-                //populate accumulator checksum map in memory
-                if(pindexNew->nAccumulatorCheckpoint != 0 && pindexNew->nAccumulatorCheckpoint != nPreviousCheckpoint) {
-                    //Don't load any invalid checkpoints
-                    if (!InvalidCheckpointRange(pindexNew->nHeight))
-                        LoadAccumulatorValuesFromDB(pindexNew->nAccumulatorCheckpoint);
-
-                    nPreviousCheckpoint = pindexNew->nAccumulatorCheckpoint;
+        // Keep the decoders busy
+        while (!fEnd && queueBatches.size() < 2 * nThreads) {
+            boost::shared_ptr<CBlockIndexBatch> batch(new CBlockIndexBatch());
+            batch->vValues.reserve(BLOCK_INDEX_BATCH_SIZE);
+            while (batch->vValues.size() < BLOCK_INDEX_BATCH_SIZE) {
+                leveldb::Slice slKey;
+                if (pcursor->Valid())
+                    slKey = pcursor->key();
+                if (slKey.empty() || slKey[0] != 'b') {
+                    fEnd = true; // finished loading block index
+                    break;
                 }
-
+                leveldb::Slice slValue = pcursor->value();
+                batch->vValues.push_back(std::string(slValue.data(), slValue.size()));
                 pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
             }
-        } catch (std::exception& e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            if (batch->vValues.empty())
+                break;
+            queueBatches.push_back(batch);
+            decoder.Add(batch.get());
+        }
+        if (queueBatches.empty())
+            break;
+
+        boost::shared_ptr<CBlockIndexBatch> batch = queueBatches.front();
+        queueBatches.pop_front();
+        decoder.Wait(batch.get());
+        if (!batch->strError.empty())
+            return error("%s : %s", __func__, batch->strError);
+
+        for (unsigned int i = 0; i < batch->vIndex.size(); i++) {
+            const CDiskBlockIndex& diskindex = batch->vIndex[i];
+
+            // Construct block index object
+            CBlockIndex* pindexNew = InsertBlockIndex(batch->vHash[i]);
+            pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->nHeight = diskindex.nHeight;
+            pindexNew->nFile = diskindex.nFile;
+            pindexNew->nDataPos = diskindex.nDataPos;
+            pindexNew->nUndoPos = diskindex.nUndoPos;
+            pindexNew->nVersion = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime = diskindex.nTime;
+            pindexNew->nBits = diskindex.nBits;
+            pindexNew->nNonce = diskindex.nNonce;
+            pindexNew->nStatus = diskindex.nStatus;
+            pindexNew->nTx = diskindex.nTx;
+
+            //zerocoin
+            pindexNew->nAccumulatorCheckpoint = diskindex.nAccumulatorCheckpoint;
+            pindexNew->mapZerocoinSupply = diskindex.mapZerocoinSupply;
+            pindexNew->vMintDenominationsInBlock = diskindex.vMintDenominationsInBlock;
+
+            //Proof Of Stake
+            pindexNew->nMint = diskindex.nMint;
+            pindexNew->nMoneySupply = diskindex.nMoneySupply;
+            pindexNew->nFlags = diskindex.nFlags;
+            pindexNew->nStakeModifier = diskindex.nStakeModifier;
+            pindexNew->prevoutStake = diskindex.prevoutStake;
+
+            // ppcoin: build setStakeSeen
+            if (pindexNew->IsProofOfStake())
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->GetStakeTime()));
+
+            //populate accumulator checksum map in memory
+            if(pindexNew->nAccumulatorCheckpoint != 0 && pindexNew->nAccumulatorCheckpoint != nPreviousCheckpoint) {
+                //Don't load any invalid checkpoints
+                if (!InvalidCheckpointRange(pindexNew->nHeight))
+                    LoadAccumulatorValuesFromDB(pindexNew->nAccumulatorCheckpoint);
+
+                nPreviousCheckpoint = pindexNew->nAccumulatorCheckpoint;
+            }
         }
     }
 
@@ -34,13 +34,17 @@ protected:
     CLevelDBWrapper db;
 
 public:
-    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, const std::string& strName = "chainstate");
 
     bool GetCoins(const uint256& txid, CCoins& coins) const;
     bool HaveCoins(const uint256& txid) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     bool GetStats(CCoinsStats& stats) const;
+
+    //! Raw access for UTXO snapshots (see utxosnapshot.h)
+    leveldb::Iterator* NewIterator() { return db.NewIterator(); }
+    bool WriteBatch(CLevelDBBatch& batch) { return db.WriteBatch(batch); }
 };
 
 /** Access to the block database (blocks/index/) */
@@ -55,6 +59,8 @@ private:
 
 public:
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool WriteBlockIndex(const std::vector<CDiskBlockIndex>& vBlockIndex);
+    bool EraseBlockIndex(const std::vector<uint256>& vHash);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo& fileinfo);
     bool WriteBlockFileInfo(int nFile, const CBlockFileInfo& fileinfo);
     bool ReadLastBlockFile(int& nFile);
@@ -67,6 +73,9 @@ public:
     bool ReadFlag(const std::string& name, bool& fValue);
     bool WriteInt(const std::string& name, int nValue);
     bool ReadInt(const std::string& name, int& nValue);
+    //! Height of a loaded UTXO snapshot and the hash (see CCoinsViewDB::GetStats) of its coins
+    bool WriteUTXOSnapshot(int nHeight, const uint256& hashCoins);
+    bool ReadUTXOSnapshot(int& nHeight, uint256& hashCoins);
     bool LoadBlockIndexGuts();
 };
 
@@ -8,26 +8,65 @@
 #include "txmempool.h"
 
 #include "clientversion.h"
+#include "core_memusage.h"
 #include "main.h"
+#include "obfuscation.h"
 #include "streams.h"
+#include "swifttx.h"
 #include "util.h"
 #include "utilmoneystr.h"
 #include "version.h"
 
+#include <limits>
+#include <math.h>
+
 #include <boost/circular_buffer.hpp>
 
 using namespace std;
 
-CTxMemPoolEntry::CTxMemPoolEntry() : nFee(0), nTxSize(0), nModSize(0), nTime(0), dPriority(0.0)
+/**
+ * Heap usage of the value of a zerocoin serial: the words OpenSSL allocates
+ * for it, which the map nodes and vectors holding the CBigNum don't count.
+ */
+static size_t SerialDynamicUsage(const CBigNum& bnSerial)
+{
+    size_t nWords = (bnSerial.bitSize() + BN_BITS2 - 1) / BN_BITS2;
+    return memusage::MallocUsage(nWords * sizeof(BN_ULONG));
+}
+
+/**
+ * Heap usage of the mapSpendSerials vector of a zerocoin spend. The
+ * mapZerocoinSerials keys are counted separately, as a serial two spends
+ * share has only one.
+ */
+static size_t SerialsDynamicUsage(const std::vector<CBigNum>& vSerials)
+{
+    size_t nUsage = memusage::DynamicUsage(vSerials);
+    BOOST_FOREACH (const CBigNum& bnSerial, vSerials)
+        nUsage += SerialDynamicUsage(bnSerial);
+    return nUsage;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry() : nFee(0), nTxSize(0), nModSize(0), nUsageSize(0), nTime(0), dPriority(0.0), nFeeDelta(0),
+                                     nCountWithDescendants(1), nSizeWithDescendants(0), nModFeesWithDescendants(0),
+                                     nCountWithAncestors(1), nSizeWithAncestors(0), nModFeesWithAncestors(0)
 {
     nHeight = MEMPOOL_HEIGHT;
 }
 
-CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight) : tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight) : tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight), nFeeDelta(0)
 {
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
     nModSize = tx.CalculateModifiedSize(nTxSize);
+    nUsageSize = RecursiveDynamicUsage(tx);
+
+    nCountWithDescendants = 1;
+    nSizeWithDescendants = nTxSize;
+    nModFeesWithDescendants = nFee;
+    nCountWithAncestors = 1;
+    nSizeWithAncestors = nTxSize;
+    nModFeesWithAncestors = nFee;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -44,6 +83,31 @@ CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
     return dResult;
 }
 
+void CTxMemPoolEntry::UpdateFeeDelta(CAmount nNewFeeDelta)
+{
+    nModFeesWithDescendants += nNewFeeDelta - nFeeDelta;
+    nModFeesWithAncestors += nNewFeeDelta - nFeeDelta;
+    nFeeDelta = nNewFeeDelta;
+}
+
+void CTxMemPoolEntry::UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount)
+{
+    nSizeWithDescendants += modifySize;
+    assert(int64_t(nSizeWithDescendants) > 0);
+    nModFeesWithDescendants += modifyFee;
+    nCountWithDescendants += modifyCount;
+    assert(int64_t(nCountWithDescendants) > 0);
+}
+
+void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount)
+{
+    nSizeWithAncestors += modifySize;
+    assert(int64_t(nSizeWithAncestors) > 0);
+    nModFeesWithAncestors += modifyFee;
+    nCountWithAncestors += modifyCount;
+    assert(int64_t(nCountWithAncestors) > 0);
+}
+
 /**
  * Keep track of fee/priority for transactions confirmed within N blocks
  */
@@ -357,7 +421,12 @@ public:
 
 
 CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) : nTransactionsUpdated(0),
-                                                       minRelayFee(_minRelayFee)
+                                                       minRelayFee(_minRelayFee),
+                                                       totalTxSize(0),
+                                                       cachedInnerUsage(0),
+                                                       lastRollingFeeUpdate(GetTime()),
+                                                       blockSinceLastRollingFeeBump(false),
+                                                       rollingMinimumFeeRate(0)
 {
     // Sanity checks off by default for performance, because otherwise
     // accepting transactions becomes O(N^2) where N is the number
@@ -403,34 +472,387 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
 }
 
 
+bool CTxMemPool::CompareIteratorByAncestorScore::operator()(const txiter& a, const txiter& b) const
+{
+    // Compare feeA / sizeA > feeB / sizeB without dividing
+    double f1 = (double)a->second.GetModFeesWithAncestors() * b->second.GetSizeWithAncestors();
+    double f2 = (double)b->second.GetModFeesWithAncestors() * a->second.GetSizeWithAncestors();
+    if (f1 == f2)
+        return a->first < b->first;
+    return f1 > f2;
+}
+
+bool CTxMemPool::CompareIteratorByDescendantScore::operator()(const txiter& a, const txiter& b) const
+{
+    // A transaction is evicted together with its descendants, so it is only
+    // as cheap as the better of its own fee rate and that of the package
+    const CTxMemPoolEntry& ea = a->second;
+    const CTxMemPoolEntry& eb = b->second;
+    bool fUseADescendants = (double)ea.GetModFeesWithDescendants() * ea.GetTxSize() > (double)ea.GetModifiedFee() * ea.GetSizeWithDescendants();
+    bool fUseBDescendants = (double)eb.GetModFeesWithDescendants() * eb.GetTxSize() > (double)eb.GetModifiedFee() * eb.GetSizeWithDescendants();
+    double aFees = fUseADescendants ? ea.GetModFeesWithDescendants() : ea.GetModifiedFee();
+    double aSize = fUseADescendants ? ea.GetSizeWithDescendants() : ea.GetTxSize();
+    double bFees = fUseBDescendants ? eb.GetModFeesWithDescendants() : eb.GetModifiedFee();
+    double bSize = fUseBDescendants ? eb.GetSizeWithDescendants() : eb.GetTxSize();
+
+    // Compare feeA / sizeA < feeB / sizeB without dividing
+    double f1 = aFees * bSize;
+    double f2 = bFees * aSize;
+    if (f1 == f2)
+        return a->first < b->first;
+    return f1 < f2;
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolParents(txiter it) const
+{
+    std::map<txiter, TxLinks, CompareIteratorByHash>::const_iterator itLinks = mapLinks.find(it);
+    assert(itLinks != mapLinks.end());
+    return itLinks->second.parents;
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolChildren(txiter it) const
+{
+    std::map<txiter, TxLinks, CompareIteratorByHash>::const_iterator itLinks = mapLinks.find(it);
+    assert(itLinks != mapLinks.end());
+    return itLinks->second.children;
+}
+
+void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
+{
+    setEntries& parents = mapLinks[entry].parents;
+    if (add && parents.insert(parent).second)
+        cachedInnerUsage += memusage::IncrementalDynamicUsage(parents);
+    else if (!add && parents.erase(parent))
+        cachedInnerUsage -= memusage::IncrementalDynamicUsage(parents);
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+{
+    setEntries& children = mapLinks[entry].children;
+    if (add && children.insert(child).second)
+        cachedInnerUsage += memusage::IncrementalDynamicUsage(children);
+    else if (!add && children.erase(child))
+        cachedInnerUsage -= memusage::IncrementalDynamicUsage(children);
+}
+
+void CTxMemPool::UpdateAncestorState(txiter it, int64_t modifySize, CAmount modifyFee, int64_t modifyCount)
+{
+    setTxByAncestorScore.erase(it);
+    it->second.UpdateAncestorState(modifySize, modifyFee, modifyCount);
+    setTxByAncestorScore.insert(it);
+}
+
+void CTxMemPool::UpdateDescendantState(txiter it, int64_t modifySize, CAmount modifyFee, int64_t modifyCount)
+{
+    setTxByDescendantScore.erase(it);
+    it->second.UpdateDescendantState(modifySize, modifyFee, modifyCount);
+    setTxByDescendantScore.insert(it);
+}
+
+void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, const setEntries& setAncestors)
+{
+    int64_t updateCount = (add ? 1 : -1);
+    int64_t updateSize = updateCount * it->second.GetTxSize();
+    CAmount updateFee = updateCount * it->second.GetModifiedFee();
+    BOOST_FOREACH (txiter ancestorIt, setAncestors)
+        UpdateDescendantState(ancestorIt, updateSize, updateFee, updateCount);
+}
+
+bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string& errString, bool fSearchForParents)
+{
+    setEntries parentHashes;
+    const CTransaction& tx = entry.GetTx();
+
+    if (fSearchForParents) {
+        // Get parents of this transaction that are in the mempool
+        if (!tx.IsZerocoinSpend()) {
+            for (unsigned int i = 0; i < tx.vin.size(); i++) {
+                txiter piter = mapTx.find(tx.vin[i].prevout.hash);
+                if (piter != mapTx.end()) {
+                    parentHashes.insert(piter);
+                    if (parentHashes.size() + 1 > limitAncestorCount) {
+                        errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
+                        return false;
+                    }
+                }
+            }
+        }
+    } else {
+        // If we're not searching for parents, we require this to be an entry in the mempool already
+        txiter it = mapTx.find(tx.GetHash());
+        assert(it != mapTx.end());
+        parentHashes = GetMemPoolParents(it);
+    }
+
+    size_t totalSizeWithAncestors = entry.GetTxSize();
+
+    while (!parentHashes.empty()) {
+        txiter stageit = *parentHashes.begin();
+
+        setAncestors.insert(stageit);
+        parentHashes.erase(stageit);
+        totalSizeWithAncestors += stageit->second.GetTxSize();
+
+        if (stageit->second.GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
+            errString = strprintf("exceeds descendant size limit for tx %s [limit: %u]", stageit->first.ToString(), limitDescendantSize);
+            return false;
+        } else if (stageit->second.GetCountWithDescendants() + 1 > limitDescendantCount) {
+            errString = strprintf("too many descendants for tx %s [limit: %u]", stageit->first.ToString(), limitDescendantCount);
+            return false;
+        } else if (totalSizeWithAncestors > limitAncestorSize) {
+            errString = strprintf("exceeds ancestor size limit [limit: %u]", limitAncestorSize);
+            return false;
+        }
+
+        BOOST_FOREACH (txiter phash, GetMemPoolParents(stageit)) {
+            // If this is a new ancestor, add it.
+            if (setAncestors.count(phash) == 0)
+                parentHashes.insert(phash);
+            if (parentHashes.size() + setAncestors.size() + 1 > limitAncestorCount) {
+                errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+void CTxMemPool::CalculateDescendants(txiter entryit, setEntries& setDescendants)
+{
+    setEntries stage;
+    if (setDescendants.count(entryit) == 0)
+        stage.insert(entryit);
+    // Traverse down the children of entry, only adding children that are not
+    // accounted for in setDescendants already (because those children have either
+    // already been walked, or will be walked in this iteration).
+    while (!stage.empty()) {
+        txiter it = *stage.begin();
+        setDescendants.insert(it);
+        stage.erase(it);
+
+        BOOST_FOREACH (txiter childiter, GetMemPoolChildren(it)) {
+            if (!setDescendants.count(childiter))
+                stage.insert(childiter);
+        }
+    }
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry)
+{
+    LOCK(cs);
+    setEntries setAncestors;
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+    CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy);
+    return addUnchecked(hash, entry, setAncestors);
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry, const setEntries& setAncestors)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
-    {
-        mapTx[hash] = entry;
-        const CTransaction& tx = mapTx[hash].GetTx();
-        if(!tx.IsZerocoinSpend()) {
-            for (unsigned int i = 0; i < tx.vin.size(); i++)
-                mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+    std::pair<txiter, bool> ret = mapTx.insert(std::make_pair(hash, entry));
+    if (!ret.second)
+        return true;
+    txiter newit = ret.first;
+    mapLinks.insert(std::make_pair(newit, TxLinks()));
+
+    // Update transaction for any feeDelta created by PrioritiseTransaction
+    std::map<uint256, std::pair<double, CAmount> >::const_iterator pos = mapDeltas.find(hash);
+    if (pos != mapDeltas.end() && pos->second.second)
+        newit->second.UpdateFeeDelta(pos->second.second);
+
+    const CTransaction& tx = newit->second.GetTx();
+    if (!tx.IsZerocoinSpend()) {
+        for (unsigned int i = 0; i < tx.vin.size(); i++) {
+            mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+            txiter parent = mapTx.find(tx.vin[i].prevout.hash);
+            if (parent != mapTx.end()) {
+                UpdateParent(newit, parent, true);
+                UpdateChild(parent, newit, true);
+            }
         }
-        nTransactionsUpdated++;
-        totalTxSize += entry.GetTxSize();
+    } else {
+        std::vector<CBigNum>& vSerials = mapSpendSerials[newit];
+        vSerials = GetZerocoinSpendSerials(tx);
+        // A serial already in the index keeps pointing at the spend that put it there
+        BOOST_FOREACH (const CBigNum& bnSerial, vSerials) {
+            if (mapZerocoinSerials.insert(std::make_pair(bnSerial, hash)).second)
+                cachedInnerUsage += SerialDynamicUsage(bnSerial);
+        }
+        cachedInnerUsage += SerialsDynamicUsage(vSerials);
+    }
+
+    // A transaction put back after its block was disconnected may already
+    // have children in the pool
+    bool fHasChildren = false;
+    std::map<COutPoint, CInPoint>::iterator itNext = mapNextTx.lower_bound(COutPoint(hash, 0));
+    for (; itNext != mapNextTx.end() && itNext->first.hash == hash; itNext++) {
+        txiter child = mapTx.find(itNext->second.ptx->GetHash());
+        if (child == mapTx.end())
+            continue;
+        UpdateChild(newit, child, true);
+        UpdateParent(child, newit, true);
+        fHasChildren = true;
+    }
+
+    if (fHasChildren) {
+        UpdateForReaddedTransaction(newit);
+    } else {
+        UpdateAncestorsOf(true, newit, setAncestors);
+        int64_t updateCount = setAncestors.size();
+        int64_t updateSize = 0;
+        CAmount updateFee = 0;
+        BOOST_FOREACH (txiter ancestorIt, setAncestors) {
+            updateSize += ancestorIt->second.GetTxSize();
+            updateFee += ancestorIt->second.GetModifiedFee();
+        }
+        newit->second.UpdateAncestorState(updateSize, updateFee, updateCount);
+        setTxByAncestorScore.insert(newit);
     }
+    setTxByDescendantScore.insert(newit);
+    setTxByEntryTime.insert(newit);
+
+    nTransactionsUpdated++;
+    totalTxSize += entry.GetTxSize();
+    cachedInnerUsage += entry.DynamicMemoryUsage();
     return true;
 }
 
+void CTxMemPool::UpdateForReaddedTransaction(txiter it)
+{
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+
+    setEntries setAncestors;
+    CalculateMemPoolAncestors(it->second, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+    setEntries setDescendants;
+    CalculateDescendants(it, setDescendants);
+
+    // Every ancestor gains all of its descendants, every descendant all of its ancestors;
+    // some of them may be shared, so recount from scratch
+    setAncestors.insert(it);
+    BOOST_FOREACH (txiter ancestorIt, setAncestors) {
+        setEntries setAncestorDescendants;
+        CalculateDescendants(ancestorIt, setAncestorDescendants);
+        int64_t nSize = 0;
+        CAmount nFees = 0;
+        BOOST_FOREACH (txiter descIt, setAncestorDescendants) {
+            nSize += descIt->second.GetTxSize();
+            nFees += descIt->second.GetModifiedFee();
+        }
+        const CTxMemPoolEntry& entry = ancestorIt->second;
+        UpdateDescendantState(ancestorIt, nSize - entry.GetSizeWithDescendants(), nFees - entry.GetModFeesWithDescendants(), setAncestorDescendants.size() - entry.GetCountWithDescendants());
+    }
+    BOOST_FOREACH (txiter descIt, setDescendants) {
+        setEntries setDescendantAncestors;
+        CalculateMemPoolAncestors(descIt->second, setDescendantAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        setDescendantAncestors.insert(descIt);
+        int64_t nSize = 0;
+        CAmount nFees = 0;
+        BOOST_FOREACH (txiter ancIt, setDescendantAncestors) {
+            nSize += ancIt->second.GetTxSize();
+            nFees += ancIt->second.GetModifiedFee();
+        }
+        const CTxMemPoolEntry& entry = descIt->second;
+        int64_t modifySize = nSize - entry.GetSizeWithAncestors();
+        CAmount modifyFee = nFees - entry.GetModFeesWithAncestors();
+        int64_t modifyCount = setDescendantAncestors.size() - entry.GetCountWithAncestors();
+        if (descIt == it) {
+            // Not in the index yet
+            it->second.UpdateAncestorState(modifySize, modifyFee, modifyCount);
+            setTxByAncestorScore.insert(it);
+        } else {
+            UpdateAncestorState(descIt, modifySize, modifyFee, modifyCount);
+        }
+    }
+}
+
+void CTxMemPool::UpdateForRemoveFromMempool(const setEntries& entriesToRemove, bool updateDescendants)
+{
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    if (updateDescendants) {
+        // Descendants that stay in the pool lose the removed transactions from their ancestor totals
+        BOOST_FOREACH (txiter removeIt, entriesToRemove) {
+            setEntries setDescendants;
+            CalculateDescendants(removeIt, setDescendants);
+            setDescendants.erase(removeIt);
+            int64_t modifySize = -((int64_t)removeIt->second.GetTxSize());
+            CAmount modifyFee = -removeIt->second.GetModifiedFee();
+            BOOST_FOREACH (txiter dit, setDescendants) {
+                if (!entriesToRemove.count(dit))
+                    UpdateAncestorState(dit, modifySize, modifyFee, -1);
+            }
+        }
+    }
+    BOOST_FOREACH (txiter removeIt, entriesToRemove) {
+        setEntries setAncestors;
+        std::string dummy;
+        CalculateMemPoolAncestors(removeIt->second, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        UpdateAncestorsOf(false, removeIt, setAncestors);
+    }
+}
+
+void CTxMemPool::removeUnchecked(txiter it)
+{
+    const uint256 hash = it->first;
+    const CTransaction& tx = it->second.GetTx();
+    if (!tx.IsZerocoinSpend()) {
+        BOOST_FOREACH (const CTxIn& txin, tx.vin)
+            mapNextTx.erase(txin.prevout);
+    } else {
+        std::map<txiter, std::vector<CBigNum>, CompareIteratorByHash>::iterator itSerials = mapSpendSerials.find(it);
+        if (itSerials != mapSpendSerials.end()) {
+            BOOST_FOREACH (const CBigNum& bnSerial, itSerials->second) {
+                std::map<CBigNum, uint256>::iterator itSerial = mapZerocoinSerials.find(bnSerial);
+                if (itSerial != mapZerocoinSerials.end() && itSerial->second == it->first) {
+                    cachedInnerUsage -= SerialDynamicUsage(bnSerial);
+                    mapZerocoinSerials.erase(itSerial);
+                }
+            }
+            cachedInnerUsage -= SerialsDynamicUsage(itSerials->second);
+            mapSpendSerials.erase(itSerials);
+        }
+    }
+
+    const TxLinks& links = mapLinks[it];
+    BOOST_FOREACH (txiter parent, links.parents)
+        UpdateChild(parent, it, false);
+    BOOST_FOREACH (txiter child, links.children)
+        UpdateParent(child, it, false);
+    cachedInnerUsage -= memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
+    mapLinks.erase(it);
+
+    setTxByAncestorScore.erase(it);
+    setTxByDescendantScore.erase(it);
+    setTxByEntryTime.erase(it);
+    totalTxSize -= it->second.GetTxSize();
+    cachedInnerUsage -= it->second.DynamicMemoryUsage();
+    mapTx.erase(it);
+    nTransactionsUpdated++;
+}
+
+void CTxMemPool::RemoveStaged(const setEntries& stage, bool updateDescendants)
+{
+    AssertLockHeld(cs);
+    UpdateForRemoveFromMempool(stage, updateDescendants);
+    BOOST_FOREACH (txiter it, stage)
+        removeUnchecked(it);
+}
 
 void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& removed, bool fRecursive)
 {
     // Remove transaction from memory pool
     {
         LOCK(cs);
-        std::deque<uint256> txToRemove;
-        txToRemove.push_back(origTx.GetHash());
-        if (fRecursive && !mapTx.count(origTx.GetHash())) {
+        setEntries txToRemove;
+        txiter origit = mapTx.find(origTx.GetHash());
+        if (origit != mapTx.end()) {
+            txToRemove.insert(origit);
+        } else if (fRecursive) {
             // If recursively removing but origTx isn't in the mempool
             // be sure to remove any children that are in the pool. This can
             // happen during chain re-orgs if origTx isn't re-accepted into
@@ -439,31 +861,21 @@ void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& rem
                 std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
                 if (it == mapNextTx.end())
                     continue;
-                txToRemove.push_back(it->second.ptx->GetHash());
+                txiter nextit = mapTx.find(it->second.ptx->GetHash());
+                assert(nextit != mapTx.end());
+                txToRemove.insert(nextit);
             }
         }
-        while (!txToRemove.empty()) {
-            uint256 hash = txToRemove.front();
-            txToRemove.pop_front();
-            if (!mapTx.count(hash))
-                continue;
-            const CTransaction& tx = mapTx[hash].GetTx();
-            if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it == mapNextTx.end())
-                        continue;
-                    txToRemove.push_back(it->second.ptx->GetHash());
-                }
-            }
-            BOOST_FOREACH (const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-
-            removed.push_back(tx);
-            totalTxSize -= mapTx[hash].GetTxSize();
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
+        setEntries setAllRemoves;
+        if (fRecursive) {
+            BOOST_FOREACH (txiter it, txToRemove)
+                CalculateDescendants(it, setAllRemoves);
+        } else {
+            setAllRemoves.swap(txToRemove);
         }
+        BOOST_FOREACH (txiter it, setAllRemoves)
+            removed.push_back(it->second.GetTx());
+        RemoveStaged(setAllRemoves, !fRecursive);
     }
 }
 
@@ -506,6 +918,20 @@ void CTxMemPool::removeConflicts(const CTransaction& tx, std::list<CTransaction>
             }
         }
     }
+
+    // Remove the pool's spends of the zerocoin serials tx spends
+    if (tx.IsZerocoinSpend() && !mapZerocoinSerials.empty()) {
+        BOOST_FOREACH (const CBigNum& bnSerial, GetZerocoinSpendSerials(tx)) {
+            std::map<CBigNum, uint256>::iterator it = mapZerocoinSerials.find(bnSerial);
+            if (it == mapZerocoinSerials.end() || it->second == tx.GetHash())
+                continue;
+            txiter itConflict = mapTx.find(it->second);
+            if (itConflict != mapTx.end()) {
+                const CTransaction txConflict = itConflict->second.GetTx();
+                remove(txConflict, removed, true);
+            }
+        }
+    }
 }
 
 /**
@@ -527,15 +953,24 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
         removeConflicts(tx, conflicts);
         ClearPrioritisation(tx.GetHash());
     }
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = true;
 }
 
 
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    mapLinks.clear();
+    setTxByAncestorScore.clear();
+    setTxByDescendantScore.clear();
+    setTxByEntryTime.clear();
     mapTx.clear();
     mapNextTx.clear();
+    mapSpendSerials.clear();
+    mapZerocoinSerials.clear();
     totalTxSize = 0;
+    cachedInnerUsage = 0;
     ++nTransactionsUpdated;
 }
 
@@ -547,6 +982,7 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
     LogPrint("mempool", "Checking mempool with %u transactions and %u inputs\n", (unsigned int)mapTx.size(), (unsigned int)mapNextTx.size());
 
     uint64_t checkTotal = 0;
+    uint64_t innerUsage = 0;
 
     CCoinsViewCache mempoolDuplicate(const_cast<CCoinsViewCache*>(pcoins));
 
@@ -555,14 +991,22 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
     for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
         checkTotal += it->second.GetTxSize();
+        innerUsage += it->second.DynamicMemoryUsage();
         const CTransaction& tx = it->second.GetTx();
+        txiter itThis = const_cast<CTxMemPool*>(this)->mapTx.find(it->first);
+        const TxLinks& links = mapLinks.find(itThis)->second;
+        innerUsage += memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
+        if (tx.IsZerocoinSpend())
+            innerUsage += SerialsDynamicUsage(mapSpendSerials.find(itThis)->second);
         bool fDependsWait = false;
+        setEntries setParentCheck;
         BOOST_FOREACH (const CTxIn& txin, tx.vin) {
             // Check that every mempool transaction's inputs refer to available coins, or other mempool tx's.
             std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end()) {
                 const CTransaction& tx2 = it2->second.GetTx();
                 assert(tx2.vout.size() > txin.prevout.n && !tx2.vout[txin.prevout.n].IsNull());
+                setParentCheck.insert(const_cast<CTxMemPool*>(this)->mapTx.find(txin.prevout.hash));
                 fDependsWait = true;
             } else {
                 const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
@@ -575,6 +1019,36 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
             assert(it3->second.n == i);
             i++;
         }
+        assert(setParentCheck == links.parents);
+
+        // Check the cached ancestor and descendant totals against the links
+        uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+        std::string dummy;
+        setEntries setAncestors;
+        const_cast<CTxMemPool*>(this)->CalculateMemPoolAncestors(it->second, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        uint64_t nSizeCheck = it->second.GetTxSize();
+        CAmount nFeesCheck = it->second.GetModifiedFee();
+        BOOST_FOREACH (txiter ancestorIt, setAncestors) {
+            nSizeCheck += ancestorIt->second.GetTxSize();
+            nFeesCheck += ancestorIt->second.GetModifiedFee();
+        }
+        assert(it->second.GetCountWithAncestors() == setAncestors.size() + 1);
+        assert(it->second.GetSizeWithAncestors() == nSizeCheck);
+        assert(it->second.GetModFeesWithAncestors() == nFeesCheck);
+
+        setEntries setDescendants;
+        const_cast<CTxMemPool*>(this)->CalculateDescendants(itThis, setDescendants);
+        nSizeCheck = 0;
+        nFeesCheck = 0;
+        BOOST_FOREACH (txiter descendantIt, setDescendants) {
+            nSizeCheck += descendantIt->second.GetTxSize();
+            nFeesCheck += descendantIt->second.GetModifiedFee();
+            if (descendantIt != itThis)
+                assert(!setAncestors.count(descendantIt));
+        }
+        assert(it->second.GetCountWithDescendants() == setDescendants.size());
+        assert(it->second.GetSizeWithDescendants() == nSizeCheck);
+        assert(it->second.GetModFeesWithDescendants() == nFeesCheck);
         if (fDependsWait)
             waitingOnDependants.push_back(&it->second);
         else {
@@ -610,7 +1084,17 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
         assert(it->first == it->second.ptx->vin[it->second.n].prevout);
     }
 
+    for (std::map<CBigNum, uint256>::const_iterator it = mapZerocoinSerials.begin(); it != mapZerocoinSerials.end(); it++) {
+        assert(mapTx.count(it->second));
+        innerUsage += SerialDynamicUsage(it->first);
+    }
+
+    assert(setTxByAncestorScore.size() == mapTx.size());
+    assert(setTxByDescendantScore.size() == mapTx.size());
+    assert(setTxByEntryTime.size() == mapTx.size());
+    assert(mapLinks.size() == mapTx.size());
     assert(totalTxSize == checkTotal);
+    assert(innerUsage == cachedInnerUsage);
 }
 
 void CTxMemPool::queryHashes(vector<uint256>& vtxid)
@@ -632,6 +1116,130 @@ bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
     return true;
 }
 
+bool CTxMemPool::LookupZerocoinSerial(const CBigNum& bnSerial, uint256& hashTx) const
+{
+    LOCK(cs);
+    std::map<CBigNum, uint256>::const_iterator it = mapZerocoinSerials.find(bnSerial);
+    if (it == mapZerocoinSerials.end())
+        return false;
+    hashTx = it->second;
+    return true;
+}
+
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return memusage::DynamicUsage(mapTx) + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(setTxByAncestorScore) +
+           memusage::DynamicUsage(setTxByDescendantScore) + memusage::DynamicUsage(setTxByEntryTime) +
+           memusage::DynamicUsage(mapSpendSerials) + memusage::DynamicUsage(mapZerocoinSerials) + cachedInnerUsage;
+}
+
+bool CTxMemPool::IsEvictionProtected(txiter it) const
+{
+    // Masternodes vouched for these; dropping them would break the lock or the mix
+    return mapTxLockReq.count(it->first) || mapTxLocks.count(it->first) || mapObfuscationBroadcastTxes.count(it->first);
+}
+
+bool CTxMemPool::HasEvictionProtected(const setEntries& stage) const
+{
+    BOOST_FOREACH (txiter it, stage) {
+        if (IsEvictionProtected(it))
+            return true;
+    }
+    return false;
+}
+
+CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const
+{
+    LOCK(cs);
+    if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0)
+        return CFeeRate(rollingMinimumFeeRate);
+
+    int64_t time = GetTime();
+    if (time > lastRollingFeeUpdate + 10) {
+        double halflife = ROLLING_FEE_HALFLIFE;
+        if (DynamicMemoryUsage() < sizelimit / 4)
+            halflife /= 4;
+        else if (DynamicMemoryUsage() < sizelimit / 2)
+            halflife /= 2;
+
+        rollingMinimumFeeRate = rollingMinimumFeeRate / pow(2.0, (time - lastRollingFeeUpdate) / halflife);
+        lastRollingFeeUpdate = time;
+
+        if (rollingMinimumFeeRate < minRelayFee.GetFeePerK() / 2) {
+            rollingMinimumFeeRate = 0;
+            return CFeeRate(0);
+        }
+    }
+    return std::max(CFeeRate(rollingMinimumFeeRate), minRelayFee);
+}
+
+void CTxMemPool::trackPackageRemoved(const CFeeRate& rate)
+{
+    AssertLockHeld(cs);
+    if (rate.GetFeePerK() > rollingMinimumFeeRate) {
+        rollingMinimumFeeRate = rate.GetFeePerK();
+        blockSinceLastRollingFeeBump = false;
+    }
+}
+
+void CTxMemPool::TrimToSize(size_t sizelimit)
+{
+    LOCK(cs);
+
+    unsigned int nTxnRemoved = 0;
+    CFeeRate maxFeeRateRemoved(0);
+    // Protected packages stay protected while others are evicted, so after each
+    // eviction the walk goes on behind the last one it skipped rather than
+    // checking them all again. An ancestor whose score drops below that point
+    // by losing descendants is left for the next trim.
+    bool fSkipped = false;
+    txiter itLastSkipped;
+    setEntriesByDescendantScore::iterator itWorst = setTxByDescendantScore.begin();
+    while (itWorst != setTxByDescendantScore.end() && DynamicMemoryUsage() > sizelimit) {
+        txiter it = *itWorst;
+        setEntries stage;
+        CalculateDescendants(it, stage);
+        if (HasEvictionProtected(stage)) {
+            fSkipped = true;
+            itLastSkipped = it;
+            ++itWorst;
+            continue;
+        }
+
+        // The new minimum is the fee rate of the evicted package plus the
+        // minimum relay fee, so a transaction paying the same as the one
+        // just evicted can't take its place before the next block
+        CFeeRate removed(it->second.GetModFeesWithDescendants(), it->second.GetSizeWithDescendants());
+        removed = CFeeRate(removed.GetFeePerK() + minRelayFee.GetFeePerK());
+        trackPackageRemoved(removed);
+        maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
+
+        nTxnRemoved += stage.size();
+        RemoveStaged(stage, false);
+        itWorst = fSkipped ? setTxByDescendantScore.upper_bound(itLastSkipped) : setTxByDescendantScore.begin();
+    }
+
+    if (maxFeeRateRemoved > CFeeRate(0))
+        LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %s\n", nTxnRemoved, maxFeeRateRemoved.ToString());
+}
+
+int CTxMemPool::Expire(int64_t time)
+{
+    LOCK(cs);
+    setEntries stage;
+    setEntriesByEntryTime::iterator it = setTxByEntryTime.begin();
+    while (it != setTxByEntryTime.end() && (*it)->second.GetTime() < time) {
+        setEntries setDescendants;
+        CalculateDescendants(*it, setDescendants);
+        if (!HasEvictionProtected(setDescendants))
+            stage.insert(setDescendants.begin(), setDescendants.end());
+        it++;
+    }
+    RemoveStaged(stage, false);
+    return stage.size();
+}
+
 CFeeRate CTxMemPool::estimateFee(int nBlocks) const
 {
     LOCK(cs);
@@ -681,6 +1289,29 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
         std::pair<double, CAmount>& deltas = mapDeltas[hash];
         deltas.first += dPriorityDelta;
         deltas.second += nFeeDelta;
+        // The block template ranks by the modified priority and fee
+        nTransactionsUpdated++;
+        txiter it = mapTx.find(hash);
+        if (it != mapTx.end() && nFeeDelta) {
+            // The modified fee counts towards the totals of all ancestors and descendants
+            setTxByAncestorScore.erase(it);
+            setTxByDescendantScore.erase(it);
+            it->second.UpdateFeeDelta(deltas.second);
+            setTxByAncestorScore.insert(it);
+            setTxByDescendantScore.insert(it);
+
+            uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+            std::string dummy;
+            setEntries setAncestors;
+            CalculateMemPoolAncestors(it->second, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            BOOST_FOREACH (txiter ancestorIt, setAncestors)
+                UpdateDescendantState(ancestorIt, 0, nFeeDelta, 0);
+            setEntries setDescendants;
+            CalculateDescendants(it, setDescendants);
+            setDescendants.erase(it);
+            BOOST_FOREACH (txiter descendantIt, setDescendants)
+                UpdateAncestorState(descendantIt, 0, nFeeDelta, 0);
+        }
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
 }
@@ -9,9 +9,11 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
 
 #include "amount.h"
 #include "coins.h"
+#include "libzerocoin/bignum.h"
 #include "primitives/transaction.h"
 #include "sync.h"
 
@@ -33,8 +35,27 @@ inline bool AllowFree(double dPriority)
 /** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+
 /**
  * CTxMemPool stores these:
+ *
+ * Besides the transaction itself, each entry caches the totals of its
+ * in-mempool ancestors and descendants (count, size and fees after
+ * PrioritiseTransaction, each including the transaction itself). The pool
+ * keeps them up to date as transactions come and go, so block assembly can
+ * rank a transaction together with the unconfirmed parents it needs.
  */
 class CTxMemPoolEntry
 {
@@ -43,9 +64,21 @@ private:
     CAmount nFee;         //! Cached to avoid expensive parent-transaction lookups
     size_t nTxSize;       //! ... and avoid recomputing tx size
     size_t nModSize;      //! ... and modified size for priority
+    size_t nUsageSize;    //! ... and total memory usage
     int64_t nTime;        //! Local time when entering the mempool
     double dPriority;     //! Priority when entering the mempool
     unsigned int nHeight; //! Chain height when entering the mempool
+    CAmount nFeeDelta;    //! Fee adjustment from PrioritiseTransaction
+
+    // Totals over this transaction and its in-mempool descendants
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    CAmount nModFeesWithDescendants;
+
+    // Totals over this transaction and its in-mempool ancestors
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight);
@@ -56,8 +89,22 @@ public:
     double GetPriority(unsigned int currentHeight) const;
     CAmount GetFee() const { return nFee; }
     size_t GetTxSize() const { return nTxSize; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+    CAmount GetModifiedFee() const { return nFee + nFeeDelta; }
+
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+
+    // Only called by CTxMemPool, which keeps its indexes consistent
+    void UpdateFeeDelta(CAmount nNewFeeDelta);
+    void UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    void UpdateAncestorState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
 };
 
 class CMinerPolicyEstimator;
@@ -95,6 +142,48 @@ public:
  */
 class CTxMemPool
 {
+public:
+    typedef std::map<uint256, CTxMemPoolEntry>::iterator txiter;
+
+    struct CompareIteratorByHash {
+        bool operator()(const txiter& a, const txiter& b) const
+        {
+            return a->first < b->first;
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
+    /** Orders entries by the fee rate of the transaction together with its in-mempool ancestors, highest first */
+    struct CompareIteratorByAncestorScore {
+        bool operator()(const txiter& a, const txiter& b) const;
+    };
+    typedef std::set<txiter, CompareIteratorByAncestorScore> setEntriesByAncestorScore;
+
+    /**
+     * Orders entries by the higher of the transaction's own fee rate and
+     * the fee rate of it together with its in-mempool descendants, lowest
+     * first. Evicting the first entry with its descendants removes the
+     * package that pays the least for the room it takes.
+     */
+    struct CompareIteratorByDescendantScore {
+        bool operator()(const txiter& a, const txiter& b) const;
+    };
+    typedef std::set<txiter, CompareIteratorByDescendantScore> setEntriesByDescendantScore;
+
+    /** Orders entries by the time they entered the pool, oldest first */
+    struct CompareIteratorByEntryTime {
+        bool operator()(const txiter& a, const txiter& b) const
+        {
+            if (a->second.GetTime() != b->second.GetTime())
+                return a->second.GetTime() < b->second.GetTime();
+            return a->first < b->first;
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByEntryTime> setEntriesByEntryTime;
+
+    /** Time for the rolling minimum fee to halve once a block was found after it was last raised */
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
 private:
     bool fSanityCheck; //! Normally false, true if -checkmempool or -regtest
     unsigned int nTransactionsUpdated;
@@ -102,12 +191,53 @@ private:
 
     CFeeRate minRelayFee; //! Passed to constructor to avoid dependency on main
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
+    uint64_t cachedInnerUsage; //! sum of dynamic memory usage of all the map elements (NOT the maps themselves)
+
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+    mutable double rollingMinimumFeeRate; //! minimum fee rate to get into the pool, decreases exponentially
+
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+    //! In-mempool parents and children of every entry
+    std::map<txiter, TxLinks, CompareIteratorByHash> mapLinks;
+    //! Zerocoin spend serials by transaction, and the transaction by serial
+    std::map<txiter, std::vector<CBigNum>, CompareIteratorByHash> mapSpendSerials;
+    std::map<CBigNum, uint256> mapZerocoinSerials;
+
+    void UpdateParent(txiter entry, txiter parent, bool add);
+    void UpdateChild(txiter entry, txiter child, bool add);
+    //! Change an entry's ancestor totals, keeping it at the right place in setTxByAncestorScore
+    void UpdateAncestorState(txiter it, int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    //! Change an entry's descendant totals, keeping it at the right place in setTxByDescendantScore
+    void UpdateDescendantState(txiter it, int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    //! Add or remove an entry from the descendant totals of its ancestors
+    void UpdateAncestorsOf(bool add, txiter it, const setEntries& setAncestors);
+    //! Recompute the totals of the ancestors and descendants of an entry whose children were already in the pool
+    void UpdateForReaddedTransaction(txiter it);
+    void UpdateForRemoveFromMempool(const setEntries& entriesToRemove, bool updateDescendants);
+    void removeUnchecked(txiter it);
+
+    //! Raise the rolling minimum fee to the fee rate of an evicted package
+    void trackPackageRemoved(const CFeeRate& rate);
+    //! SwiftTX-locked and obfuscation DSTX transactions are never evicted or expired
+    bool IsEvictionProtected(txiter it) const;
+    //! Whether it or one of its descendants is protected from eviction
+    bool HasEvictionProtected(const setEntries& stage) const;
 
 public:
     mutable CCriticalSection cs;
     std::map<uint256, CTxMemPoolEntry> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    //! All entries, best package first; used by block assembly
+    setEntriesByAncestorScore setTxByAncestorScore;
+    //! All entries, cheapest package first; used for eviction
+    setEntriesByDescendantScore setTxByDescendantScore;
+    //! All entries, oldest first; used for expiry
+    setEntriesByEntryTime setTxByEntryTime;
 
     CTxMemPool(const CFeeRate& _minRelayFee);
     ~CTxMemPool();
@@ -121,7 +251,10 @@ public:
     void check(const CCoinsViewCache* pcoins) const;
     void setSanityCheck(bool _fSanityCheck) { fSanityCheck = _fSanityCheck; }
 
+    /** Add a transaction whose ancestors were not calculated yet; for tests and other callers that skip the limits */
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry);
+    /** Add a transaction with its in-mempool ancestors as returned by CalculateMemPoolAncestors */
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry, const setEntries& setAncestors);
     void remove(const CTransaction& tx, std::list<CTransaction>& removed, bool fRecursive = false);
     void removeCoinbaseSpends(const CCoinsViewCache* pcoins, unsigned int nMemPoolHeight);
     void removeConflicts(const CTransaction& tx, std::list<CTransaction>& removed);
@@ -137,6 +270,38 @@ public:
     void ApplyDeltas(const uint256 hash, double& dPriorityDelta, CAmount& nFeeDelta);
     void ClearPrioritisation(const uint256 hash);
 
+    /** Remove a set of entries; updateDescendants is needed when descendants of them stay in the pool */
+    void RemoveStaged(const setEntries& stage, bool updateDescendants);
+
+    /**
+     * Collect the in-mempool ancestors of entry into setAncestors, failing
+     * with errString if the transaction or one of its ancestors would exceed
+     * the ancestor or descendant limits. With fSearchForParents the parents
+     * are looked up from the inputs, for an entry that is not in the pool
+     * yet; otherwise the pool's links are used.
+     */
+    bool CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string& errString, bool fSearchForParents = true);
+
+    /** Add it and all its in-mempool descendants to setDescendants */
+    void CalculateDescendants(txiter it, setEntries& setDescendants);
+
+    const setEntries& GetMemPoolParents(txiter it) const;
+    const setEntries& GetMemPoolChildren(txiter it) const;
+
+    /**
+     * The minimum fee rate to get into the pool, which may itself not be
+     * enough to get into a block. It is raised when packages are evicted
+     * and decays once blocks are found again, faster while the pool is
+     * well below sizelimit.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
+
+    /** Evict the lowest fee rate packages until the dynamic memory usage is at most sizelimit */
+    void TrimToSize(size_t sizelimit);
+
+    /** Remove transactions that entered the pool before time, and their descendants; returns the number removed */
+    int Expire(int64_t time);
+
     unsigned long size()
     {
         LOCK(cs);
@@ -156,6 +321,12 @@ public:
 
     bool lookup(uint256 hash, CTransaction& result) const;
 
+    /** Find the pool transaction that spends the zerocoin serial bnSerial */
+    bool LookupZerocoinSerial(const CBigNum& bnSerial, uint256& hashTx) const;
+
+    /** Estimate the memory usage of the mempool (in bytes) */
+    size_t DynamicMemoryUsage() const;
+
     /** Estimate fee rate needed to get into the next nBlocks */
     CFeeRate estimateFee(int nBlocks) const;
 
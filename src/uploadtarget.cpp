@@ -0,0 +1,97 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "uploadtarget.h"
+
+#include <string.h>
+
+CUploadTarget uploadTarget;
+
+CUploadTarget::CUploadTarget() : nTarget(0), nTimeframe(UPLOAD_TARGET_TIMEFRAME), nRefused(0), nDropped(0)
+{
+    memset(vBuckets, 0, sizeof(vBuckets));
+}
+
+int64_t CUploadTarget::BucketLength() const
+{
+    return nTimeframe / NUM_BUCKETS > 0 ? nTimeframe / NUM_BUCKETS : 1;
+}
+
+uint64_t CUploadTarget::SentInWindow(int64_t nNow, uint64_t* pvSent) const
+{
+    int64_t nLength = BucketLength();
+    int64_t nOldest = (nNow / nLength - NUM_BUCKETS + 1) * nLength;
+    uint64_t nTotal = 0;
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        if (vBuckets[i].nStart < nOldest)
+            continue;
+        for (int nPriority = 0; nPriority < SEND_PRIORITY_COUNT; nPriority++) {
+            nTotal += vBuckets[i].vSent[nPriority];
+            if (pvSent)
+                pvSent[nPriority] += vBuckets[i].vSent[nPriority];
+        }
+    }
+    return nTotal;
+}
+
+void CUploadTarget::SetTarget(uint64_t nTargetIn, int64_t nTimeframeIn)
+{
+    LOCK(cs);
+    nTarget = nTargetIn;
+    if (nTimeframeIn != nTimeframe) {
+        nTimeframe = nTimeframeIn;
+        memset(vBuckets, 0, sizeof(vBuckets));
+    }
+}
+
+void CUploadTarget::RecordSent(const uint64_t* vSentIn, int64_t nNow)
+{
+    LOCK(cs);
+    int64_t nLength = BucketLength();
+    int64_t nStart = nNow / nLength * nLength;
+    CBucket& bucket = vBuckets[(nNow / nLength) % NUM_BUCKETS];
+    if (bucket.nStart != nStart) {
+        memset(&bucket, 0, sizeof(bucket));
+        bucket.nStart = nStart;
+    }
+    for (int nPriority = 0; nPriority < SEND_PRIORITY_COUNT; nPriority++)
+        bucket.vSent[nPriority] += vSentIn[nPriority];
+}
+
+bool CUploadTarget::IsLimited(int nPriority, int64_t nNow) const
+{
+    if (nPriority != SEND_PRIORITY_HISTORICAL)
+        return false;
+    LOCK(cs);
+    if (nTarget == 0)
+        return false;
+    return SentInWindow(nNow, NULL) >= nTarget / 100 * HISTORICAL_UPLOAD_PERCENT;
+}
+
+void CUploadTarget::RecordRefused()
+{
+    LOCK(cs);
+    nRefused++;
+}
+
+void CUploadTarget::RecordDropped()
+{
+    LOCK(cs);
+    nDropped++;
+}
+
+CUploadTargetStats CUploadTarget::GetStats(int64_t nNow) const
+{
+    CUploadTargetStats stats;
+    memset(stats.vSent, 0, sizeof(stats.vSent));
+    LOCK(cs);
+    stats.nTarget = nTarget;
+    stats.nTimeframe = nTimeframe;
+    stats.nSentTotal = SentInWindow(nNow, stats.vSent);
+    stats.fTargetReached = nTarget > 0 && stats.nSentTotal >= nTarget;
+    stats.fServeHistorical = nTarget == 0 || stats.nSentTotal < nTarget / 100 * HISTORICAL_UPLOAD_PERCENT;
+    stats.nRefused = nRefused;
+    stats.nDropped = nDropped;
+    return stats;
+}
@@ -0,0 +1,104 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_UPLOADTARGET_H
+#define BITCOIN_UPLOADTARGET_H
+
+#include "sync.h"
+
+#include <stdint.h>
+
+/** Default for -maxuploadtarget, in megabytes per timeframe; 0 means no limit */
+static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
+/** Length of the window -maxuploadtarget applies to */
+static const int64_t UPLOAD_TARGET_TIMEFRAME = 24 * 60 * 60;
+/** Blocks older than this, relative to the tip, count as historical block serving */
+static const int64_t HISTORICAL_BLOCK_AGE = 7 * 24 * 60 * 60;
+/** Percentage of the target historical block serving may use; the rest is kept for the other classes */
+static const unsigned int HISTORICAL_UPLOAD_PERCENT = 80;
+
+/**
+ * Classes of outgoing messages for -maxuploadtarget, most important first.
+ * The class decides how the bytes are accounted and which messages stop
+ * first as the target nears. Messages of the other classes also overtake
+ * the historical blocks in a peer's send queue that haven't started going
+ * out, and the socket thread serves peers with such messages first; within
+ * those two groups the queue stays in order.
+ */
+enum SendPriority {
+    //! Blocks near the tip, headers and compact blocks
+    SEND_PRIORITY_BLOCK_RELAY,
+    //! Masternode, budget and SwiftTX messages
+    SEND_PRIORITY_MASTERNODE,
+    //! Transactions, inventory, addresses and the rest
+    SEND_PRIORITY_NORMAL,
+    //! Old blocks served to peers that are syncing
+    SEND_PRIORITY_HISTORICAL,
+
+    SEND_PRIORITY_COUNT
+};
+
+struct CUploadTargetStats {
+    uint64_t nTarget;
+    int64_t nTimeframe;
+    //! Bytes sent within the window, per class
+    uint64_t vSent[SEND_PRIORITY_COUNT];
+    uint64_t nSentTotal;
+    bool fTargetReached;
+    bool fServeHistorical;
+    //! Historical block requests refused, and peers dropped with historical blocks still queued, because of the target
+    uint64_t nRefused;
+    uint64_t nDropped;
+};
+
+/**
+ * Bytes sent over a rolling window, split into buckets so old traffic leaves
+ * the window gradually instead of all at once when a fixed cycle ends. Once
+ * the traffic within the window reaches HISTORICAL_UPLOAD_PERCENT of the
+ * target, historical block serving stops until enough traffic has aged out.
+ * The other classes are never held back: new blocks, masternode messages and
+ * transactions must keep flowing for the node to stay useful, so the target
+ * is only a hard limit for historical blocks.
+ */
+class CUploadTarget
+{
+private:
+    static const int NUM_BUCKETS = 144;
+
+    struct CBucket {
+        int64_t nStart;
+        uint64_t vSent[SEND_PRIORITY_COUNT];
+    };
+
+    mutable CCriticalSection cs;
+    uint64_t nTarget;
+    int64_t nTimeframe;
+    CBucket vBuckets[NUM_BUCKETS];
+    uint64_t nRefused;
+    uint64_t nDropped;
+
+    int64_t BucketLength() const;
+    uint64_t SentInWindow(int64_t nNow, uint64_t* pvSent) const;
+
+public:
+    CUploadTarget();
+
+    //! Set the target in bytes per nTimeframeIn seconds; 0 means no limit
+    void SetTarget(uint64_t nTargetIn, int64_t nTimeframeIn = UPLOAD_TARGET_TIMEFRAME);
+
+    //! Account for bytes sent; vSentIn holds SEND_PRIORITY_COUNT counts
+    void RecordSent(const uint64_t* vSentIn, int64_t nNow);
+
+    //! Whether messages of class nPriority should not be sent now
+    bool IsLimited(int nPriority, int64_t nNow) const;
+
+    void RecordRefused();
+    void RecordDropped();
+
+    CUploadTargetStats GetStats(int64_t nNow) const;
+};
+
+extern CUploadTarget uploadTarget;
+
+#endif // BITCOIN_UPLOADTARGET_H
@@ -0,0 +1,554 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "utxosnapshot.h"
+
+#include "chainparams.h"
+#include "hash.h"
+#include "main.h"
+#include "streams.h"
+#include "txdb.h"
+#include "ui_interface.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+namespace
+{
+/** Record types, written as a single char before each record */
+enum SnapshotRecordType {
+    SNAPSHOT_BLOCK = 'd',       //! nHeight, CBlock, CBlockUndo
+    SNAPSHOT_BLOCK_INDEX = 'i', //! CDiskBlockIndex without data positions
+    SNAPSHOT_COINS = 'c',       //! raw chainstate key and value
+    SNAPSHOT_ZEROCOIN = 'z',    //! raw zerocoin database key and value
+    SNAPSHOT_END = 'e',         //! record counts, followed by the (unhashed) content hash
+};
+
+//! The file is hashed in chunks of records that add up to at least this many bytes, and the databases are written a chunk at a time
+static const uint64_t SNAPSHOT_CHUNK_SIZE = 16 << 20;
+//! Directory, below the data directory, of the chain state the snapshot validation rebuilds
+static const char* const SNAPSHOT_VALIDATION_DIR = "chainstate_snapshot";
+//! LevelDB cache of that chain state
+static const size_t SNAPSHOT_VALIDATION_DB_CACHE = 8 << 20;
+//! Flush its coins cache once it uses this many bytes
+static const size_t SNAPSHOT_VALIDATION_CACHE = 64 << 20;
+
+/** Writes serialized objects to a file while hashing everything written */
+class CHashedFileWriter
+{
+private:
+    CAutoFile& file;
+    CHashWriter hasher;
+    uint64_t nBytes;
+
+public:
+    int nType;
+    int nVersion;
+
+    CHashedFileWriter(CAutoFile& fileIn) : file(fileIn), hasher(SER_GETHASH, 0), nBytes(0), nType(fileIn.GetType()), nVersion(fileIn.GetVersion()) {}
+
+    CHashedFileWriter& write(const char* pch, size_t nSize)
+    {
+        file.write(pch, nSize);
+        hasher.write(pch, nSize);
+        nBytes += nSize;
+        return (*this);
+    }
+
+    template <typename T>
+    CHashedFileWriter& operator<<(const T& obj)
+    {
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+
+    // invalidates the object
+    uint256 GetHash() { return hasher.GetHash(); }
+    uint64_t GetBytes() const { return nBytes; }
+};
+
+/** Reads serialized objects from a file while hashing everything read, in full and in chunks */
+class CHashedFileReader
+{
+private:
+    CAutoFile& file;
+    CHashWriter hasher;
+    CHashWriter chunkHasher;
+    uint64_t nBytes;
+    uint64_t nChunkBytes;
+
+public:
+    int nType;
+    int nVersion;
+
+    CHashedFileReader(CAutoFile& fileIn) : file(fileIn), hasher(SER_GETHASH, 0), chunkHasher(SER_GETHASH, 0), nBytes(0), nChunkBytes(0), nType(fileIn.GetType()), nVersion(fileIn.GetVersion()) {}
+
+    CHashedFileReader& read(char* pch, size_t nSize)
+    {
+        file.read(pch, nSize);
+        hasher.write(pch, nSize);
+        chunkHasher.write(pch, nSize);
+        nBytes += nSize;
+        nChunkBytes += nSize;
+        return (*this);
+    }
+
+    //! Hash of what was read since the last call, and start a new chunk
+    uint256 GetChunkHash()
+    {
+        uint256 hash = chunkHasher.GetHash();
+        chunkHasher = CHashWriter(SER_GETHASH, 0);
+        nChunkBytes = 0;
+        return hash;
+    }
+    uint64_t GetChunkBytes() const { return nChunkBytes; }
+
+    template <typename T>
+    CHashedFileReader& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+
+    // invalidates the object
+    uint256 GetHash() { return hasher.GetHash(); }
+    uint64_t GetBytes() const { return nBytes; }
+};
+
+/** Copy the records of a database whose keys start with chPrefix (all records if chPrefix is 0) */
+bool WriteRawRecords(CHashedFileWriter& writer, leveldb::Iterator* pcursor, char chType, char chPrefix, uint64_t& nCount)
+{
+    vector<char> vKey, vValue;
+    if (chPrefix)
+        pcursor->Seek(leveldb::Slice(&chPrefix, 1));
+    else
+        pcursor->SeekToFirst();
+    for (; pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        leveldb::Slice slKey = pcursor->key();
+        if (chPrefix && (slKey.size() == 0 || slKey[0] != chPrefix))
+            break;
+        leveldb::Slice slValue = pcursor->value();
+        vKey.assign(slKey.data(), slKey.data() + slKey.size());
+        vValue.assign(slValue.data(), slValue.data() + slValue.size());
+        writer << chType << vKey << vValue;
+        nCount++;
+    }
+    return pcursor->status().ok();
+}
+
+/**
+ * Read a snapshot file from start to end. With fApply unset only the content
+ * hash, the record counts and the hash of every chunk are computed; otherwise
+ * every record is written to the (empty) databases, each chunk once its hash
+ * matches the one vChunkHash has for it from the first pass.
+ */
+bool ReadUTXOSnapshot(const boost::filesystem::path& path, bool fApply, CUTXOSnapshotHeader& header, CUTXOSnapshotStats& stats, vector<uint256>& vChunkHash, string& strError)
+{
+    CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        strError = strprintf("Failed to open snapshot file %s", path.string());
+        return false;
+    }
+
+    CHashedFileReader reader(filein);
+    stats = CUTXOSnapshotStats();
+    if (!fApply)
+        vChunkHash.clear();
+    size_t nChunk = 0;
+
+    // positions of the stored tail blocks, filled in before their index entries arrive
+    map<uint256, pair<CDiskBlockPos, CDiskBlockPos> > mapBlockPos;
+    // what the current chunk has for the databases
+    vector<CDiskBlockIndex> vIndexBatch;
+    CLevelDBBatch coinsBatch, zerocoinBatch;
+    uint256 hashLastIndex = 0;
+
+    try {
+        reader >> header;
+        if (header.nMagic != CUTXOSnapshotHeader::SNAPSHOT_MAGIC || header.nSnapshotVersion != CUTXOSnapshotHeader::CURRENT_VERSION) {
+            strError = "Not a UTXO snapshot file, or unsupported snapshot version";
+            return false;
+        }
+        if (header.hashGenesisBlock != Params().HashGenesisBlock()) {
+            strError = "UTXO snapshot was made for a different network";
+            return false;
+        }
+
+        vector<char> vKey, vValue;
+        bool fEnd = false;
+        while (!fEnd) {
+            boost::this_thread::interruption_point();
+            char chType;
+            reader >> chType;
+
+            if (chType == SNAPSHOT_BLOCK) {
+                int nHeight;
+                CBlock block;
+                CBlockUndo blockundo;
+                reader >> nHeight >> block >> blockundo;
+                stats.nBlocks++;
+                if (!fApply)
+                    continue;
+                // Only a block index entry makes the block known, and that waits for its chunk to check out
+                CDiskBlockPos blockPos, undoPos;
+                if (!WriteSnapshotBlock(block, blockundo, nHeight, blockPos, undoPos)) {
+                    strError = strprintf("Failed to store block at height %d", nHeight);
+                    return false;
+                }
+                mapBlockPos[block.GetHash()] = make_pair(blockPos, undoPos);
+            } else if (chType == SNAPSHOT_BLOCK_INDEX) {
+                CDiskBlockIndex diskindex;
+                reader >> diskindex;
+                stats.nBlockIndex++;
+                if (!fApply)
+                    continue;
+                if (diskindex.hashPrev != hashLastIndex || diskindex.nHeight != (int)stats.nBlockIndex - 1) {
+                    strError = strprintf("Block index in snapshot is not a chain at height %d", diskindex.nHeight);
+                    return false;
+                }
+                hashLastIndex = diskindex.GetBlockHash();
+                map<uint256, pair<CDiskBlockPos, CDiskBlockPos> >::const_iterator it = mapBlockPos.find(hashLastIndex);
+                if (it != mapBlockPos.end()) {
+                    diskindex.nFile = it->second.first.nFile;
+                    diskindex.nDataPos = it->second.first.nPos;
+                    diskindex.nUndoPos = it->second.second.nPos;
+                    diskindex.nStatus |= BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO;
+                }
+                vIndexBatch.push_back(diskindex);
+            } else if (chType == SNAPSHOT_COINS || chType == SNAPSHOT_ZEROCOIN) {
+                reader >> vKey >> vValue;
+                if (chType == SNAPSHOT_COINS)
+                    stats.nCoins++;
+                else
+                    stats.nZerocoin++;
+                if (!fApply)
+                    continue;
+                if (vKey.empty()) {
+                    strError = "Empty database key in snapshot";
+                    return false;
+                }
+                leveldb::Slice slKey(&vKey[0], vKey.size());
+                leveldb::Slice slValue(vValue.empty() ? "" : &vValue[0], vValue.size());
+                if (chType == SNAPSHOT_COINS)
+                    coinsBatch.WriteRaw(slKey, slValue);
+                else
+                    zerocoinBatch.WriteRaw(slKey, slValue);
+            } else if (chType == SNAPSHOT_END) {
+                uint64_t nBlockIndex, nBlocks, nCoins, nZerocoin;
+                reader >> nBlockIndex >> nBlocks >> nCoins >> nZerocoin;
+                if (nBlockIndex != stats.nBlockIndex || nBlocks != stats.nBlocks || nCoins != stats.nCoins || nZerocoin != stats.nZerocoin) {
+                    strError = "Record counts in snapshot do not match its contents";
+                    return false;
+                }
+                fEnd = true;
+            } else {
+                strError = strprintf("Unknown record type %d in snapshot", chType);
+                return false;
+            }
+
+            if (!fEnd && reader.GetChunkBytes() < SNAPSHOT_CHUNK_SIZE)
+                continue;
+            uint256 hashChunk = reader.GetChunkHash();
+            if (!fApply) {
+                vChunkHash.push_back(hashChunk);
+                continue;
+            }
+            if (nChunk >= vChunkHash.size() || vChunkHash[nChunk++] != hashChunk) {
+                strError = "UTXO snapshot file changed while it was being loaded";
+                return false;
+            }
+            if (fEnd && hashLastIndex != header.hashBlock) {
+                strError = "Snapshot block index does not end at the snapshot block";
+                return false;
+            }
+            if ((!vIndexBatch.empty() && !pblocktree->WriteBlockIndex(vIndexBatch)) ||
+                !pcoinsdbview->WriteBatch(coinsBatch) || !zerocoinDB->WriteBatch(zerocoinBatch)) {
+                strError = "Failed to write snapshot to the databases";
+                return false;
+            }
+            vIndexBatch.clear();
+            coinsBatch.Clear();
+            zerocoinBatch.Clear();
+        }
+
+        stats.nBytes = reader.GetBytes();
+        stats.hashContent = reader.GetHash();
+        uint256 hashFile;
+        filein >> hashFile;
+        if (hashFile != stats.hashContent) {
+            strError = "Snapshot file is corrupted (content hash mismatch)";
+            return false;
+        }
+    } catch (const std::exception& e) {
+        strError = strprintf("Failed to read snapshot file: %s", e.what());
+        return false;
+    }
+
+    if (fApply && nChunk != vChunkHash.size()) {
+        strError = "UTXO snapshot file changed while it was being loaded";
+        return false;
+    }
+    return true;
+}
+
+/** Check the content hash of a snapshot against the trusted hash for its height */
+bool CheckTrustedSnapshot(const MapUTXOSnapshots& mapSnapshots, const CUTXOSnapshotHeader& header, const CUTXOSnapshotStats& stats, string& strError)
+{
+    MapUTXOSnapshots::const_iterator it = mapSnapshots.find(header.nHeight);
+    if (it == mapSnapshots.end()) {
+        strError = strprintf("No trusted UTXO snapshot is known at height %d", header.nHeight);
+        return false;
+    }
+    if (it->second != stats.hashContent) {
+        strError = strprintf("UTXO snapshot hash %s does not match the trusted hash %s at height %d",
+            stats.hashContent.ToString(), it->second.ToString(), header.nHeight);
+        return false;
+    }
+    return true;
+}
+}
+
+bool DumpUTXOSnapshot(const boost::filesystem::path& path, CUTXOSnapshotHeader& header, CUTXOSnapshotStats& stats, string& strError)
+{
+    boost::filesystem::path pathTmp(path.string() + ".new");
+    CAutoFile fileout(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull()) {
+        strError = strprintf("Failed to open %s for writing", pathTmp.string());
+        return false;
+    }
+
+    CHashedFileWriter writer(fileout);
+    stats = CUTXOSnapshotStats();
+    boost::scoped_ptr<leveldb::Iterator> pcoinsCursor;
+    boost::scoped_ptr<leveldb::Iterator> pzerocoinCursor;
+    bool fSuccess = false;
+
+    try {
+        {
+            // The iterators pin the database contents as of the flushed tip, so only
+            // the block index and the tail blocks have to be written under the lock.
+            LOCK(cs_main);
+            FlushStateToDisk();
+
+            CBlockIndex* pindexTip = chainActive.Tip();
+            if (pindexTip == NULL)
+                throw runtime_error("there is no chain to snapshot");
+
+            header.SetNull();
+            header.hashGenesisBlock = Params().HashGenesisBlock();
+            header.hashBlock = pindexTip->GetBlockHash();
+            header.nHeight = pindexTip->nHeight;
+            writer << header;
+
+            pcoinsCursor.reset(pcoinsdbview->NewIterator());
+            pzerocoinCursor.reset(zerocoinDB->NewIterator());
+
+            // Tail blocks, oldest first. The genesis block has no undo data and is never included.
+            CBlockIndex* pindexFirst = pindexTip->pprev ? pindexTip : NULL;
+            for (int i = 1; pindexFirst && i < SNAPSHOT_TAIL_BLOCKS && pindexFirst->pprev->pprev; i++)
+                pindexFirst = pindexFirst->pprev;
+            for (CBlockIndex* pindex = pindexFirst; pindex; pindex = chainActive.Next(pindex)) {
+                CBlock block;
+                CBlockUndo blockundo;
+                if (!ReadBlockFromDisk(block, pindex))
+                    throw runtime_error(strprintf("failed to read block %s", pindex->GetBlockHash().ToString()));
+                CDiskBlockPos pos = pindex->GetUndoPos();
+                if (pos.IsNull() || !blockundo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+                    throw runtime_error(strprintf("failed to read undo data for block %s", pindex->GetBlockHash().ToString()));
+                writer << (char)SNAPSHOT_BLOCK << pindex->nHeight << block << blockundo;
+                stats.nBlocks++;
+            }
+
+            // The block index of the active chain, with data positions stripped
+            for (CBlockIndex* pindex = chainActive.Genesis(); pindex; pindex = chainActive.Next(pindex)) {
+                CDiskBlockIndex diskindex(pindex);
+                diskindex.nStatus &= ~BLOCK_HAVE_MASK;
+                diskindex.nFile = 0;
+                diskindex.nDataPos = 0;
+                diskindex.nUndoPos = 0;
+                writer << (char)SNAPSHOT_BLOCK_INDEX << diskindex;
+                stats.nBlockIndex++;
+            }
+        }
+
+        if (!WriteRawRecords(writer, pcoinsCursor.get(), SNAPSHOT_COINS, 'c', stats.nCoins))
+            throw runtime_error("failed to iterate the coin database");
+        if (!WriteRawRecords(writer, pzerocoinCursor.get(), SNAPSHOT_ZEROCOIN, 0, stats.nZerocoin))
+            throw runtime_error("failed to iterate the zerocoin database");
+
+        writer << (char)SNAPSHOT_END << stats.nBlockIndex << stats.nBlocks << stats.nCoins << stats.nZerocoin;
+        stats.nBytes = writer.GetBytes();
+        stats.hashContent = writer.GetHash();
+        fileout << stats.hashContent;
+        FileCommit(fileout.Get());
+        fileout.fclose();
+        fSuccess = true;
+    } catch (const std::exception& e) {
+        strError = strprintf("Failed to write snapshot: %s", e.what());
+    }
+
+    if (fSuccess && !RenameOver(pathTmp, path)) {
+        strError = strprintf("Failed to rename %s to %s", pathTmp.string(), path.string());
+        fSuccess = false;
+    }
+    if (!fSuccess) {
+        fileout.fclose();
+        boost::filesystem::remove(pathTmp);
+        return false;
+    }
+
+    LogPrintf("Dumped UTXO snapshot at height %d (%u index entries, %u blocks, %u coins, %u zerocoin records, %u bytes) to %s\n",
+        header.nHeight, stats.nBlockIndex, stats.nBlocks, stats.nCoins, stats.nZerocoin, stats.nBytes, path.string());
+    return true;
+}
+
+bool VerifyUTXOSnapshot(const boost::filesystem::path& path, const MapUTXOSnapshots& mapSnapshots, CUTXOSnapshotHeader& header, CUTXOSnapshotStats& stats, string& strError)
+{
+    vector<uint256> vChunkHash;
+    return ReadUTXOSnapshot(path, false, header, stats, vChunkHash, strError) && CheckTrustedSnapshot(mapSnapshots, header, stats, strError);
+}
+
+bool LoadUTXOSnapshot(const boost::filesystem::path& path, const MapUTXOSnapshots& mapSnapshots, CUTXOSnapshotStats& stats, string& strError)
+{
+    if (pcoinsdbview->GetBestBlock() != uint256(0)) {
+        strError = "A UTXO snapshot can only be loaded into an empty data directory";
+        return false;
+    }
+
+    // First pass: hash the file and check it against the trusted hashes before touching any database
+    int64_t nStart = GetTimeMillis();
+    CUTXOSnapshotHeader header;
+    vector<uint256> vChunkHash;
+    if (!ReadUTXOSnapshot(path, false, header, stats, vChunkHash, strError) || !CheckTrustedSnapshot(mapSnapshots, header, stats, strError))
+        return false;
+    LogPrintf("UTXO snapshot at height %d verified (%s) in %dms\n", header.nHeight, stats.hashContent.ToString(), GetTimeMillis() - nStart);
+
+    // Second pass: populate the databases with the chunks that hash as in the first. Validation progress left from an earlier snapshot is for another chain.
+    boost::filesystem::remove_all(GetDataDir() / SNAPSHOT_VALIDATION_DIR);
+    nStart = GetTimeMillis();
+    CUTXOSnapshotHeader headerApply;
+    CUTXOSnapshotStats statsApply;
+    if (!ReadUTXOSnapshot(path, true, headerApply, statsApply, vChunkHash, strError))
+        return false;
+
+    // Only now make the chainstate point at the snapshot block; history below the tail
+    // blocks is not stored, and a transaction index cannot cover it. The hash of the coins
+    // is what the background validation of that history has to arrive at.
+    CCoinsMap mapCoins;
+    CCoinsStats coinsStats;
+    if (!pcoinsdbview->BatchWrite(mapCoins, header.hashBlock) ||
+        !pcoinsdbview->GetStats(coinsStats) ||
+        !pblocktree->WriteFlag("prunedblockfiles", true) ||
+        !pblocktree->WriteFlag("txindex", false) ||
+        !pblocktree->WriteUTXOSnapshot(header.nHeight, coinsStats.hashSerialized)) {
+        strError = "Failed to write to the databases";
+        return false;
+    }
+    FlushStateToDisk();
+
+    LogPrintf("Loaded UTXO snapshot at height %d (%u index entries, %u blocks, %u coins, %u zerocoin records) in %dms\n",
+        header.nHeight, stats.nBlockIndex, stats.nBlocks, stats.nCoins, stats.nZerocoin, GetTimeMillis() - nStart);
+    return true;
+}
+
+void ThreadValidateUTXOSnapshot()
+{
+    RenameThread("catocoin-snapshotval");
+
+    int nSnapshotHeight;
+    uint256 hashSnapshotCoins;
+    if (!pblocktree->ReadUTXOSnapshot(nSnapshotHeight, hashSnapshotCoins)) {
+        AbortNode("Failed to read the UTXO snapshot record from the block index database");
+        return;
+    }
+
+    boost::filesystem::path pathChainState = GetDataDir() / SNAPSHOT_VALIDATION_DIR;
+    {
+        CCoinsViewDB db(SNAPSHOT_VALIDATION_DB_CACHE, false, false, SNAPSHOT_VALIDATION_DIR);
+        CCoinsViewCache view(&db);
+        if (view.GetBestBlock() == uint256(0))
+            view.SetBestBlock(Params().HashGenesisBlock()); // the genesis coinbase is unspendable
+        LogPrintf("Validating the history below the UTXO snapshot at height %d\n", nSnapshotHeight);
+
+        // Progress is kept across restarts, as far as it was flushed
+        try {
+            while (true) {
+                boost::this_thread::interruption_point();
+
+                CBlockIndex* pindex = NULL;
+                CDiskBlockPos pos;
+                {
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(view.GetBestBlock());
+                    if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second)) {
+                        AbortNode("The UTXO snapshot validation state is not on the active chain");
+                        return;
+                    }
+                    nUTXOSnapshotValidatedHeight = mi->second->nHeight;
+                    if (nUTXOSnapshotValidatedHeight >= nSnapshotHeight)
+                        break;
+                    CBlockIndex* pindexNext = chainActive[nUTXOSnapshotValidatedHeight + 1];
+                    if (pindexNext->nStatus & BLOCK_HAVE_DATA) {
+                        pindex = pindexNext;
+                        pos = pindex->GetBlockPos();
+                    }
+                }
+                if (pindex == NULL) {
+                    // Still being downloaded
+                    MilliSleep(500);
+                    continue;
+                }
+
+                CBlock block;
+                if (!ReadBlockFromDisk(block, pos) || block.GetHash() != pindex->GetBlockHash()) {
+                    AbortNode(strprintf("Failed to read block %s below the UTXO snapshot", pindex->GetBlockHash().ToString()));
+                    return;
+                }
+                {
+                    LOCK(cs_main);
+                    CValidationState state;
+                    if (!ConnectSnapshotHistoryBlock(block, state, pindex, view)) {
+                        AbortNode(strprintf("Block %s at height %d below the UTXO snapshot is invalid: %s", pindex->GetBlockHash().ToString(), pindex->nHeight, state.GetRejectReason()),
+                            _("The chain the UTXO snapshot was made from is invalid. Start again with an empty data directory without -loadutxosnapshot."));
+                        return;
+                    }
+                }
+                if (view.DynamicMemoryUsage() > SNAPSHOT_VALIDATION_CACHE && !view.Flush()) {
+                    AbortNode("Failed to write the UTXO snapshot validation state");
+                    return;
+                }
+            }
+        } catch (const boost::thread_interrupted&) {
+            view.Flush();
+            throw;
+        }
+
+        CCoinsStats stats;
+        if (!view.Flush() || !db.GetStats(stats)) {
+            AbortNode("Failed to write the UTXO snapshot validation state");
+            return;
+        }
+        if (stats.hashSerialized != hashSnapshotCoins) {
+            AbortNode(strprintf("UTXO set hash %s at height %d does not match the snapshot's %s", stats.hashSerialized.ToString(), nSnapshotHeight, hashSnapshotCoins.ToString()),
+                _("The UTXO snapshot does not match the chain it claims to be from. Start again with an empty data directory without -loadutxosnapshot."));
+            return;
+        }
+    }
+
+    {
+        LOCK(cs_main);
+        if (!pblocktree->WriteFlag("utxosnapshotvalidated", true)) {
+            AbortNode("Failed to write to the block index database");
+            return;
+        }
+        nUTXOSnapshotHeight = -1;
+    }
+    boost::filesystem::remove_all(pathChainState);
+    LogPrintf("History below the UTXO snapshot at height %d is valid\n", nSnapshotHeight);
+}
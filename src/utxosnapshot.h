@@ -0,0 +1,105 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_UTXOSNAPSHOT_H
+#define BITCOIN_UTXOSNAPSHOT_H
+
+#include "chainparams.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <string>
+
+#include <boost/filesystem/path.hpp>
+
+/**
+ * A UTXO snapshot is a flat file holding everything a node needs to continue
+ * from a given block without replaying the chain: the block index of the
+ * active chain, the last SNAPSHOT_TAIL_BLOCKS blocks with their undo data
+ * (accumulator checkpoints are computed from blocks 10-20 deep, and shallow
+ * reorgs need undo data), the coin database and the zerocoin mint/spend
+ * database. The header and every record are covered by a double-SHA256
+ * content hash, stored at the end of the file, which a loading node compares
+ * against the hashes compiled into chainparams.cpp.
+ */
+
+/** Number of full blocks (with undo data) stored below the snapshot tip */
+static const int SNAPSHOT_TAIL_BLOCKS = 100;
+
+class CUTXOSnapshotHeader
+{
+public:
+    static const uint32_t SNAPSHOT_MAGIC = 0x6f787475; // "utxo"
+    static const uint32_t CURRENT_VERSION = 1;
+
+    uint32_t nMagic;
+    uint32_t nSnapshotVersion;
+    uint256 hashGenesisBlock;
+    uint256 hashBlock;
+    int32_t nHeight;
+
+    CUTXOSnapshotHeader()
+    {
+        SetNull();
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nMagic);
+        READWRITE(nSnapshotVersion);
+        READWRITE(hashGenesisBlock);
+        READWRITE(hashBlock);
+        READWRITE(nHeight);
+    }
+
+    void SetNull()
+    {
+        nMagic = SNAPSHOT_MAGIC;
+        nSnapshotVersion = CURRENT_VERSION;
+        hashGenesisBlock = 0;
+        hashBlock = 0;
+        nHeight = -1;
+    }
+};
+
+/** Record counts and content hash of a snapshot file */
+struct CUTXOSnapshotStats {
+    uint64_t nBlockIndex;
+    uint64_t nBlocks;
+    uint64_t nCoins;
+    uint64_t nZerocoin;
+    uint64_t nBytes;
+    uint256 hashContent;
+
+    CUTXOSnapshotStats() : nBlockIndex(0), nBlocks(0), nCoins(0), nZerocoin(0), nBytes(0), hashContent(0) {}
+};
+
+/** Write a snapshot of the current chain state to path. Takes cs_main only while the databases are pinned. */
+bool DumpUTXOSnapshot(const boost::filesystem::path& path, CUTXOSnapshotHeader& header, CUTXOSnapshotStats& stats, std::string& strError);
+
+/** Hash the snapshot at path and check it against the trusted hashes in mapSnapshots, without loading it */
+bool VerifyUTXOSnapshot(const boost::filesystem::path& path, const MapUTXOSnapshots& mapSnapshots, CUTXOSnapshotHeader& header, CUTXOSnapshotStats& stats, std::string& strError);
+
+/**
+ * Populate the empty block index, coin and zerocoin databases from the
+ * snapshot at path. The file is hashed in full and checked against
+ * mapSnapshots (normally Params().UTXOSnapshots()) before anything is
+ * written, and while it is read again to be written, each chunk has to
+ * hash the same as the first time before it goes to the databases. Must
+ * be called before LoadBlockIndex().
+ */
+bool LoadUTXOSnapshot(const boost::filesystem::path& path, const MapUTXOSnapshots& mapSnapshots, CUTXOSnapshotStats& stats, std::string& strError);
+
+/**
+ * Connect the blocks below the snapshot the node was started from to a separate
+ * chain state, from the genesis block up, as they are downloaded. The node
+ * shuts down if that history is invalid or ends in other coins than the
+ * snapshot has; once it matches, the snapshot is fully validated.
+ */
+void ThreadValidateUTXOSnapshot();
+
+#endif // BITCOIN_UTXOSNAPSHOT_H
@@ -0,0 +1,97 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "verifyblocks.h"
+
+#include "main.h"
+#include "util.h"
+
+#include <boost/bind.hpp>
+
+CVerifyBlockReader::CVerifyBlockReader(const std::vector<CBlockIndex*>& vpindexIn, int nCheckLevelIn, int nThreads) : vpindex(vpindexIn), nCheckLevel(nCheckLevelIn), nClaimed(0), nNext(0)
+{
+    if (nThreads < 1)
+        nThreads = 1;
+    nMaxInFlight = 4 * nThreads;
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&CVerifyBlockReader::ThreadVerify, this));
+}
+
+CVerifyBlockReader::~CVerifyBlockReader()
+{
+    threads.interrupt_all();
+    threads.join_all();
+    for (std::map<size_t, CVerifiedBlock*>::iterator it = mapResults.begin(); it != mapResults.end(); it++)
+        delete it->second;
+}
+
+static CVerifiedBlock::Status VerifyBlock(CVerifiedBlock& result, int nCheckLevel)
+{
+    const CBlockIndex* pindex = result.pindex;
+    // check level 0: read from disk
+    if (!ReadBlockFromDisk(result.block, pindex))
+        return CVerifiedBlock::VERIFY_READ_FAILED;
+    // check level 1: everything about the block that doesn't need the chain state
+    if (nCheckLevel >= 1) {
+        CValidationState state;
+        if (!CheckBlockContextFree(result.block, state) || !result.block.CheckBlockSignature())
+            return CVerifiedBlock::VERIFY_BAD_BLOCK;
+    }
+    // check level 2: verify undo validity
+    if (nCheckLevel >= 2 && pindex->pprev) {
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        if (!pos.IsNull()) {
+            if (!result.undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+                return CVerifiedBlock::VERIFY_BAD_UNDO;
+            result.fHaveUndo = true;
+        }
+    }
+    return CVerifiedBlock::VERIFY_OK;
+}
+
+void CVerifyBlockReader::ThreadVerify()
+{
+    RenameThread("catocoin-verify");
+    while (true) {
+        boost::this_thread::interruption_point();
+        size_t nPos;
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            while (nClaimed < vpindex.size() && nClaimed - nNext >= nMaxInFlight)
+                cond.wait(lock);
+            if (nClaimed == vpindex.size())
+                return;
+            nPos = nClaimed++;
+        }
+
+        CVerifiedBlock* result = new CVerifiedBlock();
+        result->pindex = vpindex[nPos];
+        result->status = VerifyBlock(*result, nCheckLevel);
+
+        boost::unique_lock<boost::mutex> lock(cs);
+        mapResults[nPos] = result;
+        cond.notify_all();
+    }
+}
+
+bool CVerifyBlockReader::Next(CVerifiedBlock& result)
+{
+    CVerifiedBlock* next;
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (nNext == vpindex.size())
+            return false;
+        std::map<size_t, CVerifiedBlock*>::iterator it;
+        while ((it = mapResults.find(nNext)) == mapResults.end())
+            cond.wait(lock);
+        next = it->second;
+        mapResults.erase(it);
+        nNext++;
+        cond.notify_all();
+    }
+
+    std::swap(result, *next);
+    delete next;
+    return true;
+}
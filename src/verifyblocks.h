@@ -0,0 +1,86 @@
+// Copyright (c) 2018 The Catocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_VERIFYBLOCKS_H
+#define BITCOIN_VERIFYBLOCKS_H
+
+#include "chain.h"
+#include "main.h"
+#include "primitives/block.h"
+
+#include <map>
+#include <stddef.h>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+/** A block of a CVerifyDB pass, read and checked by a worker */
+struct CVerifiedBlock {
+    enum Status {
+        VERIFY_OK,
+        VERIFY_READ_FAILED, //! check level 0: the block could not be read
+        VERIFY_BAD_BLOCK,   //! check level 1: the block fails the context-free checks or its signature
+        VERIFY_BAD_UNDO,    //! check level 2: the undo data could not be read or has a bad checksum
+    };
+
+    CBlockIndex* pindex;
+    CBlock block;
+    //! The undo data, if level 2 read it
+    CBlockUndo undo;
+    bool fHaveUndo;
+    Status status;
+
+    CVerifiedBlock() : pindex(NULL), fHaveUndo(false), status(VERIFY_OK) {}
+};
+
+/**
+ * Runs the context-free part of the per-block checks of CVerifyDB on worker
+ * threads, for many blocks at once: reading the block (level 0),
+ * CheckBlockContextFree and the block signature (level 1) and reading and
+ * checksumming the undo data (level 2). Next() hands the results back in the
+ * order of the list, so the caller can run the checks against the chain state
+ * and disconnect or reconnect them (levels 1, 3 and 4) while the workers
+ * already work on the following blocks.
+ *
+ * The caller holds cs_main for the whole pass while it waits in Next(), so
+ * the workers must not take cs_main or look at anything it guards other
+ * than the block index entries they were given; the rest of CheckBlock does
+ * both.
+ */
+class CVerifyBlockReader
+{
+private:
+    std::vector<CBlockIndex*> vpindex;
+    int nCheckLevel;
+    boost::mutex cs;
+    //! Signalled when a result is ready or the caller consumed one
+    boost::condition_variable cond;
+    //! Checked blocks that were not handed out yet, by position in vpindex
+    std::map<size_t, CVerifiedBlock*> mapResults;
+    //! Position of the next block a worker picks up
+    size_t nClaimed;
+    //! Position of the next block Next() returns
+    size_t nNext;
+    //! Maximum number of blocks being checked or waiting to be handed out
+    size_t nMaxInFlight;
+    boost::thread_group threads;
+
+    void ThreadVerify();
+
+public:
+    /** Check the blocks of vpindexIn up to nCheckLevelIn (at most 2) with nThreads workers */
+    CVerifyBlockReader(const std::vector<CBlockIndex*>& vpindexIn, int nCheckLevelIn, int nThreads);
+    ~CVerifyBlockReader();
+
+    /** Return the next checked block, or false when all were returned */
+    bool Next(CVerifiedBlock& result);
+
+private:
+    CVerifyBlockReader(const CVerifyBlockReader&);
+    CVerifyBlockReader& operator=(const CVerifyBlockReader&);
+};
+
+#endif // BITCOIN_VERIFYBLOCKS_H
@@ -12,7 +12,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 71003; //release
+static const int PROTOCOL_VERSION = 71005; //release
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -20,6 +20,12 @@ static const int INIT_PROTO_VERSION = 209;
 //! In this version, 'getheaders' was introduced.
 static const int GETHEADERS_VERSION = 70000;
 
+//! 'getheaders' is answered with 'headers' (not block inventory) starting with this version
+static const int HEADERS_FIRST_VERSION = 71004;
+
+//! short-id-based block download ('sendcmpct', 'cmpctblock', 'getblocktxn', 'blocktxn') starts with this version
+static const int SHORT_IDS_BLOCKS_VERSION = 71005;
+
 //! disconnect from peers older than this proto version
 static const int MIN_PEER_PROTO_VERSION_BEFORE_ENFORCEMENT = 71002;
 static const int MIN_PEER_PROTO_VERSION_AFTER_ENFORCEMENT = 71003;
@@ -3239,10 +3239,14 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std:
         // Track how many getdata requests our transaction gets
         mapRequestCount[wtxNew.GetHash()] = 0;
 
-        // Broadcast
+        // Broadcast; a lock request is registered first, so trimming a full pool can't evict it
+        if (strCommand == "ix")
+            mapTxLockReq.insert(make_pair(wtxNew.GetHash(), (CTransaction)wtxNew));
         if (!wtxNew.AcceptToMemoryPool(false)) {
             // This must not fail. The transaction has already been signed and recorded.
             LogPrintf("CommitTransaction() : Error: Transaction not valid\n");
+            if (strCommand == "ix")
+                mapTxLockReq.erase(wtxNew.GetHash());
             return false;
         }
         wtxNew.RelayWalletTransaction(strCommand);